@@ -31,6 +31,7 @@
 #include "DB.h"
 #include "util_base64.h"
 #include "POSCameraController.h"
+#include "POSAudioEncoder.h"
 
 
 //Temporary debugging
@@ -169,20 +170,51 @@ HAPError getUInt8UUIDValueDescription(uint8_t* value, char* bytes, size_t maxByt
 
 /* ---------------------------------------------------------------------------------------------*/
 
-supportedAudioConfigStruct supportedAudioConfigValue =
+// One Audio Codec Configuration TLV is written per entry, AAC-ELD first for controllers that don't do Opus
+supportedAudioConfigStruct supportedAudioConfigValues[] =
 {
-    .audioCodecConfig =
     {
-        .audioCodecType = 2,     // AAC-ELD
-        .audioCodecParams =
+        .audioCodecConfig =
         {
-            .audioChannels = 1,  // 1 channel
-            .bitRate = 0,        // Variable
-            .sampleRate = 1,      // 16kHz 8 not supported on MBP
-            .rtpTime = 30        // 30 ms per packet
-        }
+            .audioCodecType = POS_AUDIO_CODEC_AAC_ELD,
+            .audioCodecParams =
+            {
+                .audioChannels = 1,  // 1 channel
+                .bitRate = 0,        // Variable
+                .sampleRate = 1,      // 16kHz 8 not supported on MBP
+                .rtpTime = 30        // 30 ms per packet
+            }
+        },
+        .comfortNoiseSupport = true
     },
-    .comfortNoiseSupport = false
+    {
+        .audioCodecConfig =
+        {
+            .audioCodecType = POS_AUDIO_CODEC_OPUS,
+            .audioCodecParams =
+            {
+                .audioChannels = 1,  // 1 channel
+                .bitRate = 0,        // Variable
+                .sampleRate = 1,     // 16kHz
+                .rtpTime = 20        // 20 ms per packet, Opus can't do 30
+            }
+        },
+        .comfortNoiseSupport = true
+    },
+    {
+        .audioCodecConfig =
+        {
+            .audioCodecType = POS_AUDIO_CODEC_OPUS,
+            .audioCodecParams =
+            {
+                .audioChannels = 1,  // 1 channel
+                .bitRate = 0,        // Variable
+                .sampleRate = 2,     // 24kHz
+                .rtpTime = 20        // 20 ms per packet
+            }
+        },
+        .comfortNoiseSupport = true
+    }
 };
 
 HAP_STRUCT_TLV_SUPPORT(void, SupportedAudioConfigFormat)
@@ -288,21 +320,10 @@ const HAPStructTLVMember audioCodecConfigMember = { .valueOffset =
                                                     .isOptional = false,
                                                     .isFlat = false };
 
-const HAPUInt8TLVFormat comfortNoiseFormat = { .type = kHAPTLVFormatType_UInt8,
-                                               .constraints = { .minimumValue = 0, .maximumValue = 255 },
-                                               .callbacks = { .getDescription = NULL } };
-const HAPStructTLVMember comfortNoiseMember = { .valueOffset =
-                                                        HAP_OFFSETOF(supportedAudioConfigStruct, comfortNoiseSupport),
-                                                .isSetOffset = 0,
-                                                .tlvType = 2,
-                                                .debugDescription = "Comfort Noise Support",
-                                                .format = &comfortNoiseFormat,
-                                                .isOptional = false,
-                                                .isFlat = false };
-
-const SupportedAudioConfigFormat supportedAudioConfigFormat = {
+// Only the codec configuration, HandleSupportedAudioRead writes the single Comfort Noise Support after the list
+const SupportedAudioConfigFormat supportedAudioCodecFormat = {
     .type = kHAPTLVFormatType_Struct,
-    .members = (const HAPStructTLVMember* const[]) { &audioCodecConfigMember, &comfortNoiseMember, NULL },
+    .members = (const HAPStructTLVMember* const[]) { &audioCodecConfigMember, NULL },
     .callbacks = { .isValid = isValid }
 };
 
@@ -1064,8 +1085,25 @@ HAPError HandleSupportedAudioRead(
     HAPPrecondition(responseWriter);
 
     HAPLogInfo(&kHAPLog_Default, "%s", __func__);
+    HAPError err;
 
-    return HAPTLVWriterEncode(responseWriter, &supportedAudioConfigFormat, &supportedAudioConfigValue);
+    for (size_t i = 0; i < HAPArrayCount(supportedAudioConfigValues); i++) {
+        if (i != 0) {
+            err = HAPTLVWriterAppend(
+                    responseWriter, &(const HAPTLV) { .type = 0, .value = { .bytes = NULL, .numBytes = 0 } }); // Separator
+            if (err) {
+                return err;
+            }
+        }
+        err = HAPTLVWriterEncode(responseWriter, &supportedAudioCodecFormat, &supportedAudioConfigValues[i]);
+        if (err) {
+            return err;
+        }
+    }
+    return HAPTLVWriterAppend(
+            responseWriter,
+            &(const HAPTLV) { .type = 2, // Comfort Noise Support
+                              .value = { .bytes = &supportedAudioConfigValues[0].comfortNoiseSupport, .numBytes = 1 } });
 }
 
 HAP_RESULT_USE_CHECK
@@ -1204,6 +1242,14 @@ HAPError HandleSelectedRTPConfigWrite(
         myContext->session.videoParameters = selectedRtp.videoParameters;
         myContext->session.audioParameters = selectedRtp.audioParameters;
         if (selectedRtp.control.command == kHAPCharacteristicValue_RTPCommand_Start) {
+            uint16_t audioCodecType = selectedRtp.audioParameters.codecConfig.audioCodecType;
+            if (!POSAudioEncoderIsSupported(audioCodecType)) {
+                // the audio thread picks its encoder from this, AAC-ELD or Opus
+                HAPLogError(&kHAPLog_Default, "Selected audio codec %u isn't supported", audioCodecType);
+                return kHAPError_InvalidData;
+            }
+            HAPLogInfo(&kHAPLog_Default, "Selected audio codec: %s",
+                       audioCodecType == POS_AUDIO_CODEC_OPUS ? "Opus" : "AAC-ELD");
             if(accessoryConfiguration.state.rtp.active){
                 // Added with support for HKSV
                 HAPLogDebug(&kHAPLog_Default, "Starting stream");
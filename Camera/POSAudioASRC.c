@@ -0,0 +1,178 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "POSAudioASRC.h"
+
+#include "HAP.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSAudioASRC"};
+
+// Built once, the extra phase at the end is phase 0 of the next sample, for interpolating
+static int16_t asrcFilter[POS_AUDIO_ASRC_PHASES + 1][POS_AUDIO_ASRC_TAPS];
+static bool asrcFilterReady = false;
+
+// Output sample n comes from input samples position - TAPS / 2 + 1 to position + TAPS / 2
+#define POS_AUDIO_ASRC_HISTORY (POS_AUDIO_ASRC_TAPS / 2 - 1)
+
+static void POSAudioASRCBuildFilter(void)
+{
+  // Blackman windowed sinc with the cutoff a little under nyquist, speech has nothing up there
+  const double cutoff = 0.9;
+  for (int phase = 0; phase <= POS_AUDIO_ASRC_PHASES; phase++)
+  {
+    double taps[POS_AUDIO_ASRC_TAPS];
+    double sum = 0;
+    for (int k = 0; k < POS_AUDIO_ASRC_TAPS; k++)
+    {
+      // distance from the output sample to input tap k, in input samples
+      double t = (k - POS_AUDIO_ASRC_HISTORY) - (double)phase / POS_AUDIO_ASRC_PHASES;
+      double x = M_PI * cutoff * t;
+      double sinc = t == 0 ? 1 : sin(x) / x;
+      double w = (t + POS_AUDIO_ASRC_TAPS / 2.0) / POS_AUDIO_ASRC_TAPS; // 0 to 1 across the taps
+      double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+    // unity gain for every phase, so a constant stays constant whatever the fraction
+    for (int k = 0; k < POS_AUDIO_ASRC_TAPS; k++)
+      asrcFilter[phase][k] = (int16_t)lround(taps[k] / sum * (1 << POS_AUDIO_ASRC_COEF_BITS));
+  }
+  asrcFilterReady = true;
+}
+
+void POSAudioASRCFlush(POSAudioASRC *asrc)
+{
+  HAPPrecondition(asrc);
+
+  // a little silence in front, so the first sample has history to filter with
+  HAPRawBufferZero(asrc->samples, POS_AUDIO_ASRC_HISTORY * sizeof asrc->samples[0]);
+  asrc->numSamples = POS_AUDIO_ASRC_HISTORY;
+  asrc->position = (uint64_t)POS_AUDIO_ASRC_HISTORY << 32;
+  asrc->haveOccupancy = false;
+}
+
+void POSAudioASRCInit(POSAudioASRC *asrc)
+{
+  HAPPrecondition(asrc);
+
+  if (!asrcFilterReady)
+    POSAudioASRCBuildFilter();
+  HAPRawBufferZero(asrc, sizeof *asrc);
+  asrc->step = (uint64_t)1 << 32;
+  POSAudioASRCFlush(asrc);
+}
+
+size_t POSAudioASRCWrite(POSAudioASRC *asrc, const int16_t *samples, size_t numSamples)
+{
+  HAPPrecondition(asrc);
+  HAPPrecondition(samples);
+
+  // drop what no output sample will look at again
+  size_t numUsed = (size_t)(asrc->position >> 32) - POS_AUDIO_ASRC_HISTORY;
+  if (numUsed > 0)
+  {
+    memmove(asrc->samples, &asrc->samples[numUsed], (asrc->numSamples - numUsed) * sizeof asrc->samples[0]);
+    asrc->numSamples -= numUsed;
+    asrc->position -= (uint64_t)numUsed << 32;
+  }
+
+  size_t numFree = POS_AUDIO_ASRC_MAX_SAMPLES - asrc->numSamples;
+  if (numSamples > numFree)
+  {
+    HAPLogError(&logObject, "queue full, dropping %zu samples", numSamples - numFree);
+    numSamples = numFree;
+  }
+  HAPRawBufferCopyBytes(&asrc->samples[asrc->numSamples], samples, numSamples * sizeof samples[0]);
+  asrc->numSamples += numSamples;
+  return numSamples;
+}
+
+bool POSAudioASRCCanRead(const POSAudioASRC *asrc, size_t numSamples)
+{
+  HAPPrecondition(asrc);
+
+  if (numSamples == 0)
+    return true;
+  uint64_t last = asrc->position + (numSamples - 1) * asrc->step;
+  return (last >> 32) + POS_AUDIO_ASRC_TAPS / 2 < asrc->numSamples;
+}
+
+void POSAudioASRCRead(POSAudioASRC *asrc, int16_t *samples, size_t numSamples)
+{
+  HAPPrecondition(asrc);
+  HAPPrecondition(samples);
+  HAPPrecondition(POSAudioASRCCanRead(asrc, numSamples));
+
+  for (size_t i = 0; i < numSamples; i++)
+  {
+    const int16_t *x = &asrc->samples[(asrc->position >> 32) - POS_AUDIO_ASRC_HISTORY];
+    uint32_t fraction = (uint32_t)asrc->position;
+    uint32_t phase = fraction >> (32 - POS_AUDIO_ASRC_PHASES_LOG2);
+    int32_t between = (fraction >> (16 - POS_AUDIO_ASRC_PHASES_LOG2)) & 0xffff; // Q16 towards phase + 1
+
+    int32_t a = 0;
+    int32_t b = 0;
+    for (int k = 0; k < POS_AUDIO_ASRC_TAPS; k++)
+    {
+      a += x[k] * asrcFilter[phase][k];
+      b += x[k] * asrcFilter[phase + 1][k];
+    }
+    int32_t y = (int32_t)(((int64_t)a * (0x10000 - between) + (int64_t)b * between) >> (16 + POS_AUDIO_ASRC_COEF_BITS));
+    samples[i] = y > INT16_MAX ? INT16_MAX : y < INT16_MIN ? INT16_MIN : y;
+    asrc->position += asrc->step;
+  }
+}
+
+uint32_t POSAudioASRCQueuedUs(const POSAudioASRC *asrc, uint32_t sampleRate)
+{
+  HAPPrecondition(asrc);
+  HAPPrecondition(sampleRate);
+
+  uint64_t queued = ((uint64_t)asrc->numSamples << 32) - asrc->position;
+  return (uint32_t)((queued >> 16) * 1000000 / sampleRate >> 16);
+}
+
+void POSAudioASRCSteer(POSAudioASRC *asrc, uint32_t occupancyUs, uint32_t targetUs)
+{
+  HAPPrecondition(asrc);
+
+  if (!asrc->haveOccupancy)
+    asrc->occupancyUs = occupancyUs;
+  asrc->haveOccupancy = true;
+  asrc->occupancyUs += ((int64_t)occupancyUs - asrc->occupancyUs) >> POS_AUDIO_ASRC_SMOOTHING_SHIFT;
+
+  // fuller than the target plays faster
+  int64_t errorUs = asrc->occupancyUs - (int64_t)targetUs;
+  const int64_t maxIntegral = (int64_t)POS_AUDIO_ASRC_MAX_PPM << 24;
+  asrc->integralQ24 += errorUs * POS_AUDIO_ASRC_KI_Q24;
+  if (asrc->integralQ24 > maxIntegral)
+    asrc->integralQ24 = maxIntegral;
+  if (asrc->integralQ24 < -maxIntegral)
+    asrc->integralQ24 = -maxIntegral;
+
+  int64_t ppm = ((errorUs * POS_AUDIO_ASRC_KP_Q16) >> 16) + (asrc->integralQ24 >> 24);
+  if (ppm > POS_AUDIO_ASRC_MAX_PPM)
+    ppm = POS_AUDIO_ASRC_MAX_PPM;
+  if (ppm < -POS_AUDIO_ASRC_MAX_PPM)
+    ppm = -POS_AUDIO_ASRC_MAX_PPM;
+  asrc->ppm = (int32_t)ppm;
+  // 2^32 / 10^6 = 4294.967
+  asrc->step = ((uint64_t)1 << 32) + ppm * 4295;
+}
@@ -0,0 +1,116 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSAUDIOASRC_H
+#define POSAUDIOASRC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Polyphase filter: taps per phase and phases per input sample, a power of two
+#define POS_AUDIO_ASRC_TAPS 8
+#define POS_AUDIO_ASRC_PHASES_LOG2 6
+#define POS_AUDIO_ASRC_PHASES (1 << POS_AUDIO_ASRC_PHASES_LOG2)
+// Coefficients are Q14, each phase sums to 1 << 14
+#define POS_AUDIO_ASRC_COEF_BITS 14
+// Input samples waiting to be resampled
+#define POS_AUDIO_ASRC_MAX_SAMPLES 2048
+// The rate correction never goes past this, well past any crystal but still inaudible
+#define POS_AUDIO_ASRC_MAX_PPM 1000
+// PI gains on the occupancy error.  Kp is ppm per us in Q16, Ki ppm per us per step in Q24,
+// which damps the loop critically with a time constant of about 40 s at one step per 30 ms
+#define POS_AUDIO_ASRC_KP_Q16 3277
+#define POS_AUDIO_ASRC_KI_Q24 315
+// The occupancy is smoothed over 1 << 4 steps before it steers
+#define POS_AUDIO_ASRC_SMOOTHING_SHIFT 4
+
+/**
+ * Asynchronous sample rate converter between the return audio, which runs on
+ * the controller's clock, and the speaker, which runs on the AO clock.
+ *
+ * The two clocks are both nominally 16 kHz but a few hundred ppm apart, so over
+ * a long talk session the speaker ring slowly fills or drains.  The converter
+ * plays the input back a little faster or slower through a windowed sinc
+ * polyphase filter, linearly interpolated between phases.  A PI controller
+ * sets the rate from the smoothed ring occupancy so it stays on its target.
+ *
+ * Fixed point except for building the filter table.  Only used on the speaker thread.
+ */
+typedef struct
+{
+    int16_t samples[POS_AUDIO_ASRC_MAX_SAMPLES];
+    size_t numSamples;
+    uint64_t position;      // of the next output sample in samples[], Q32
+    uint64_t step;          // input samples per output sample, Q32
+    int32_t ppm;            // current correction, > 0 plays faster
+    bool haveOccupancy;
+    int64_t occupancyUs;    // smoothed
+    int64_t integralQ24;    // ppm in Q24
+} POSAudioASRC;
+
+/**
+ * Empties the converter and resets the rate to nominal.
+ */
+void POSAudioASRCInit(POSAudioASRC *asrc);
+
+/**
+ * Drops the queued input and the smoothed occupancy but keeps the rate, which is a
+ * property of the two clocks.  Used when the input stops, so the tail doesn't play
+ * at the start of the next talkspurt.
+ */
+void POSAudioASRCFlush(POSAudioASRC *asrc);
+
+/**
+ * Queues input samples.
+ *
+ * @return Samples queued, less than numSamples if the queue is full.
+ */
+size_t POSAudioASRCWrite(POSAudioASRC *asrc, const int16_t *samples, size_t numSamples);
+
+/**
+ * Returns true when there is enough input queued for numSamples output samples.
+ */
+bool POSAudioASRCCanRead(const POSAudioASRC *asrc, size_t numSamples);
+
+/**
+ * Produces numSamples output samples, only call it when POSAudioASRCCanRead says so.
+ */
+void POSAudioASRCRead(POSAudioASRC *asrc, int16_t *samples, size_t numSamples);
+
+/**
+ * Returns the queued input in us at sampleRate, what the converter adds to the buffered audio.
+ */
+uint32_t POSAudioASRCQueuedUs(const POSAudioASRC *asrc, uint32_t sampleRate);
+
+/**
+ * Runs one step of the PI controller, call it once per output frame.
+ *
+ * @param occupancyUs Audio buffered ahead of the speaker now.
+ * @param targetUs Where the occupancy should sit.
+ */
+void POSAudioASRCSteer(POSAudioASRC *asrc, uint32_t occupancyUs, uint32_t targetUs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
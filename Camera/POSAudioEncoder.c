@@ -0,0 +1,272 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Outgoing audio encoders for live streaming
+
+#include <byteswap.h>
+
+#include "POSAudioEncoder.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSAudioEncoder"};
+
+// RFC 3640 AU header section: 16 bits of header length, then a 13 bit size and 3 bit index per AU
+#define POS_AUDIO_AAC_AU_HEADERS_LENGTH_BYTES 2
+#define POS_AUDIO_AAC_AU_HEADER_BYTES 2
+
+static void POSAudioEncoderSetAACParam(POSAudioEncoder *encoder, AACENC_PARAM param, UINT value, const char *name)
+{
+  AACENC_ERROR aacErr = aacEncoder_SetParam(encoder->aac, param, value);
+  if (aacErr != AACENC_OK)
+  {
+    HAPLogError(&logObject, "aacEncoder_SetParam %s err", name);
+  }
+}
+
+static HAPError POSAudioEncoderOpenAAC(POSAudioEncoder *encoder, uint32_t rtpTimeMs, uint32_t maxBitRate)
+{
+  AACENC_ERROR aacErr = aacEncOpen(&encoder->aac, 0, 1);
+  if (aacErr != AACENC_OK)
+  {
+    HAPLogError(&logObject, "aacEncOpen err");
+    return kHAPError_Unknown;
+  }
+  // Audio Object Type 39 = AAC-ELD
+  POSAudioEncoderSetAACParam(encoder, AACENC_AOT, AOT_ER_AAC_ELD, "AACENC_AOT");
+  POSAudioEncoderSetAACParam(encoder, AACENC_SAMPLERATE, encoder->sampleRate, "AACENC_SAMPLERATE");
+  // only one center channel, and it is the first channel
+  POSAudioEncoderSetAACParam(encoder, AACENC_CHANNELMODE, MODE_1, "AACENC_CHANNELMODE");
+  POSAudioEncoderSetAACParam(encoder, AACENC_CHANNELORDER, 1, "AACENC_CHANNELORDER");
+  POSAudioEncoderSetAACParam(encoder, AACENC_BITRATEMODE, 4, "AACENC_BITRATEMODE"); // variable high bit rate per RFC3640
+  // ignored by the aac encoder in variable bitrate mode
+  if (maxBitRate != 0)
+    POSAudioEncoderSetAACParam(encoder, AACENC_BITRATE, maxBitRate, "AACENC_BITRATE");
+  POSAudioEncoderSetAACParam(encoder, AACENC_GRANULE_LENGTH, POS_AUDIO_AAC_FRAME_SAMPLES, "AACENC_GRANULE_LENGTH");
+  POSAudioEncoderSetAACParam(encoder, AACENC_TRANSMUX, TT_MP4_RAW, "AACENC_TRANSMUX");
+  POSAudioEncoderSetAACParam(encoder, AACENC_SIGNALING_MODE, 2, "AACENC_SIGNALING_MODE"); // explicit hierarchical signaling
+  // the afterburner takes more cpu and ram for better audio
+  POSAudioEncoderSetAACParam(encoder, AACENC_AFTERBURNER, 0, "AACENC_AFTERBURNER");
+
+  // finalize settings
+  aacErr = aacEncEncode(encoder->aac, NULL, NULL, NULL, NULL);
+  if (aacErr != AACENC_OK)
+  {
+    HAPLogError(&logObject, "aacEncEncode finalize settings err");
+    return kHAPError_Unknown;
+  }
+  encoder->frameSamples = POS_AUDIO_AAC_FRAME_SAMPLES;
+  // 60 ms asks for two granules a packet, which halves the packet rate and the SRTP work
+  encoder->aacAUsPerPacket = rtpTimeMs * encoder->sampleRate / 1000 / POS_AUDIO_AAC_FRAME_SAMPLES;
+  if (encoder->aacAUsPerPacket < 1)
+    encoder->aacAUsPerPacket = 1;
+  if (encoder->aacAUsPerPacket > POS_AUDIO_AAC_MAX_AUS_PER_PACKET)
+    encoder->aacAUsPerPacket = POS_AUDIO_AAC_MAX_AUS_PER_PACKET;
+  HAPLogInfo(&logObject, "AAC-ELD, %u access units per %u ms packet", encoder->aacAUsPerPacket, rtpTimeMs);
+  return kHAPError_None;
+}
+
+static HAPError POSAudioEncoderOpenOpus(POSAudioEncoder *encoder, uint32_t rtpTimeMs, uint32_t maxBitRate,
+                                        bool variableBitRate)
+{
+  int opusErr;
+
+  if ((rtpTimeMs != 20) && (rtpTimeMs != 40) && (rtpTimeMs != 60))
+  {
+    HAPLogInfo(&logObject, "Opus can't code %u ms frames, using %u ms", rtpTimeMs, POS_AUDIO_OPUS_DEFAULT_RTP_TIME);
+    rtpTimeMs = POS_AUDIO_OPUS_DEFAULT_RTP_TIME;
+  }
+  encoder->opus = opus_encoder_create(encoder->sampleRate, 1, OPUS_APPLICATION_VOIP, &opusErr);
+  if (opusErr != OPUS_OK)
+  {
+    HAPLogError(&logObject, "opus_encoder_create err: %s", opus_strerror(opusErr));
+    encoder->opus = NULL;
+    return kHAPError_Unknown;
+  }
+  opus_encoder_ctl(encoder->opus, OPUS_SET_BITRATE(maxBitRate != 0 ? (opus_int32)maxBitRate : OPUS_AUTO));
+  opus_encoder_ctl(encoder->opus, OPUS_SET_VBR(variableBitRate ? 1 : 0));
+  opus_encoder_ctl(encoder->opus, OPUS_SET_COMPLEXITY(POS_AUDIO_OPUS_COMPLEXITY));
+  opus_encoder_ctl(encoder->opus, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+  // LBRR copies of the previous frame let the controller's decoder fill a single loss
+  opus_encoder_ctl(encoder->opus, OPUS_SET_INBAND_FEC(1));
+  opus_encoder_ctl(encoder->opus, OPUS_SET_PACKET_LOSS_PERC(POS_AUDIO_OPUS_EXPECTED_LOSS));
+  // a quiet room costs a 1 byte packet every 400 ms instead of a full frame
+  opus_encoder_ctl(encoder->opus, OPUS_SET_DTX(1));
+  encoder->frameSamples = encoder->sampleRate * rtpTimeMs / 1000;
+  return kHAPError_None;
+}
+
+bool POSAudioEncoderIsSupported(uint16_t codecType)
+{
+  return (codecType == POS_AUDIO_CODEC_AAC_ELD) || (codecType == POS_AUDIO_CODEC_OPUS);
+}
+
+uint32_t POSAudioEncoderRTPClockRate(uint16_t codecType, uint32_t sampleRate)
+{
+  if (codecType == POS_AUDIO_CODEC_OPUS)
+    return POS_AUDIO_OPUS_RTP_CLOCK;
+  return sampleRate;
+}
+
+HAPError POSAudioEncoderOpen(POSAudioEncoder *encoder, uint16_t codecType, uint32_t sampleRate, uint32_t rtpTimeMs,
+                             uint32_t maxBitRate, bool variableBitRate)
+{
+  HAPPrecondition(encoder);
+
+  HAPRawBufferZero(encoder, sizeof *encoder);
+  encoder->codecType = codecType;
+  encoder->sampleRate = sampleRate;
+  switch (codecType)
+  {
+  case POS_AUDIO_CODEC_AAC_ELD:
+    return POSAudioEncoderOpenAAC(encoder, rtpTimeMs, maxBitRate);
+  case POS_AUDIO_CODEC_OPUS:
+    return POSAudioEncoderOpenOpus(encoder, rtpTimeMs, maxBitRate, variableBitRate);
+  default:
+    HAPLogError(&logObject, "unsupported audio codec type: %u", codecType);
+    return kHAPError_InvalidData;
+  }
+}
+
+static size_t POSAudioEncoderEncodeAAC(POSAudioEncoder *encoder, const int16_t *samples, size_t numSamples,
+                                       uint64_t sampleTime, uint8_t *bytes, size_t maxBytes, uint64_t *payloadTime)
+{
+  int iidentify = IN_AUDIO_DATA;
+  int oidentify = OUT_BITSTREAM_DATA;
+  void *inBuf = (void *)samples;
+  INT inBufSize = numSamples * sizeof(int16_t);
+  INT inElSize = sizeof(int16_t);
+  void *outBuf = encoder->aacPending + encoder->aacNumPendingBytes;
+  INT outBufSize = POS_AUDIO_AAC_MAX_AU_BYTES;
+  INT outElSize = 1;
+
+  AACENC_BufDesc ibuf = {0};
+  ibuf.numBufs = 1;
+  ibuf.bufs = &inBuf;
+  ibuf.bufferIdentifiers = &iidentify;
+  ibuf.bufSizes = &inBufSize;
+  ibuf.bufElSizes = &inElSize;
+
+  AACENC_BufDesc obuf = {0};
+  obuf.numBufs = 1;
+  obuf.bufs = &outBuf;
+  obuf.bufferIdentifiers = &oidentify;
+  obuf.bufSizes = &outBufSize;
+  obuf.bufElSizes = &outElSize;
+
+  AACENC_InArgs iargs = {0};
+  iargs.numInSamples = numSamples;
+  AACENC_OutArgs oargs = {0};
+
+  AACENC_ERROR aacErr = aacEncEncode(encoder->aac, &ibuf, &obuf, &iargs, &oargs);
+  if (aacErr != AACENC_OK)
+  {
+    HAPLogError(&logObject, "aacEncEncode err: %d", aacErr);
+    return 0;
+  }
+  if (oargs.numOutBytes <= 0)
+    return 0;
+
+  if (encoder->aacNumPendingAUs == 0)
+    encoder->aacPendingSampleTime = sampleTime;
+  encoder->aacPendingAUBytes[encoder->aacNumPendingAUs++] = oargs.numOutBytes;
+  encoder->aacNumPendingBytes += oargs.numOutBytes;
+  if (encoder->aacNumPendingAUs < encoder->aacAUsPerPacket)
+    return 0;
+
+  uint32_t numAUs = encoder->aacNumPendingAUs;
+  size_t headerBytes = POS_AUDIO_AAC_AU_HEADERS_LENGTH_BYTES + numAUs * POS_AUDIO_AAC_AU_HEADER_BYTES;
+  size_t numBytes = headerBytes + encoder->aacNumPendingBytes;
+  encoder->aacNumPendingAUs = 0;
+  encoder->aacNumPendingBytes = 0;
+  if (numBytes > maxBytes)
+  {
+    HAPLogError(&logObject, "%zu byte packet does not fit in %zu bytes", numBytes, maxBytes);
+    return 0;
+  }
+
+  // build the au header section.  RFC3640 s3.2.1 and s3.3.6
+  // the access units are consecutive, so every AU-Index(-delta) is 0
+  *(uint16_t *)(&bytes[0]) = __bswap_16(numAUs * POS_AUDIO_AAC_AU_HEADER_BYTES * 8);
+  for (uint32_t i = 0; i < numAUs; i++)
+  {
+    *(uint16_t *)(&bytes[POS_AUDIO_AAC_AU_HEADERS_LENGTH_BYTES + i * POS_AUDIO_AAC_AU_HEADER_BYTES]) =
+        __bswap_16(encoder->aacPendingAUBytes[i] << 3);
+  }
+  HAPRawBufferCopyBytes(&bytes[headerBytes], encoder->aacPending, numBytes - headerBytes);
+  *payloadTime = encoder->aacPendingSampleTime;
+  return numBytes;
+}
+
+static size_t POSAudioEncoderEncodeOpus(POSAudioEncoder *encoder, const int16_t *samples, size_t numSamples,
+                                        uint8_t *bytes, size_t maxBytes)
+{
+  opus_int32 numBytes = opus_encode(encoder->opus, samples, numSamples, bytes, maxBytes);
+  if (numBytes < 0)
+  {
+    HAPLogError(&logObject, "opus_encode err: %s", opus_strerror(numBytes));
+    return 0;
+  }
+  return numBytes;
+}
+
+size_t POSAudioEncoderEncode(POSAudioEncoder *encoder, const int16_t *samples, size_t numSamples,
+                             uint64_t sampleTime, uint8_t *bytes, size_t maxBytes, uint64_t *payloadTime)
+{
+  HAPPrecondition(encoder);
+  HAPPrecondition(samples);
+  HAPPrecondition(bytes);
+  HAPPrecondition(payloadTime);
+
+  if (numSamples != encoder->frameSamples)
+  {
+    HAPLogError(&logObject, "got %zu samples for a %u sample frame", numSamples, encoder->frameSamples);
+    return 0;
+  }
+  if (encoder->aac != NULL)
+    return POSAudioEncoderEncodeAAC(encoder, samples, numSamples, sampleTime, bytes, maxBytes, payloadTime);
+  if (encoder->opus != NULL)
+  {
+    *payloadTime = sampleTime;
+    return POSAudioEncoderEncodeOpus(encoder, samples, numSamples, bytes, maxBytes);
+  }
+  return 0;
+}
+
+void POSAudioEncoderFlush(POSAudioEncoder *encoder)
+{
+  HAPPrecondition(encoder);
+
+  encoder->aacNumPendingAUs = 0;
+  encoder->aacNumPendingBytes = 0;
+}
+
+void POSAudioEncoderClose(POSAudioEncoder *encoder)
+{
+  HAPPrecondition(encoder);
+
+  if (encoder->aac != NULL)
+  {
+    AACENC_ERROR aacErr = aacEncClose(&encoder->aac);
+    if (aacErr != AACENC_OK)
+    {
+      HAPLogError(&logObject, "aacEncClose err");
+    }
+  }
+  if (encoder->opus != NULL)
+    opus_encoder_destroy(encoder->opus);
+  encoder->aac = NULL;
+  encoder->opus = NULL;
+}
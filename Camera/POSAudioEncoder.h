@@ -0,0 +1,120 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSAUDIOENCODER_H
+#define POSAUDIOENCODER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HAP.h"
+
+#include "aacenc_lib.h"
+#include "opus.h"
+
+// HAP Audio Codec Type values
+#define POS_AUDIO_CODEC_AAC_ELD 2
+#define POS_AUDIO_CODEC_OPUS 3
+
+// RFC 7587 section 4.1, Opus RTP timestamps always count 48 kHz
+#define POS_AUDIO_OPUS_RTP_CLOCK 48000
+// Frame length used when the controller asks Opus for one it can't code, e.g. 30 ms
+#define POS_AUDIO_OPUS_DEFAULT_RTP_TIME 20
+// Opus encoder complexity, 0-10, the T31 has one core shared with everything else
+#define POS_AUDIO_OPUS_COMPLEXITY 3
+// Loss the Opus in-band FEC is tuned for, in percent
+#define POS_AUDIO_OPUS_EXPECTED_LOSS 10
+// AAC-ELD granule, 30 ms at 16 kHz
+#define POS_AUDIO_AAC_FRAME_SAMPLES 480
+// Most AAC-ELD access units packed into one RTP packet, 4 covers 120 ms
+#define POS_AUDIO_AAC_MAX_AUS_PER_PACKET 4
+// 6144 bits per channel is the AAC limit for one access unit
+#define POS_AUDIO_AAC_MAX_AU_BYTES 768
+
+/**
+ * The outgoing audio encoder, AAC-ELD (RFC 3640 hbr mode) or Opus (RFC 7587).
+ * Encoded payloads are ready for POSRTPStreamPushPayload.
+ */
+typedef struct
+{
+    uint16_t codecType;    // POS_AUDIO_CODEC_*
+    uint32_t sampleRate;   // Hz of the PCM handed to POSAudioEncoderEncode
+    uint32_t frameSamples; // PCM samples per encoded frame
+    HANDLE_AACENCODER aac;
+    OpusEncoder *opus;
+    // RFC 3640 multi-AU packing, access units wait here until a packet's worth is encoded
+    uint32_t aacAUsPerPacket;
+    uint32_t aacNumPendingAUs;
+    uint16_t aacPendingAUBytes[POS_AUDIO_AAC_MAX_AUS_PER_PACKET];
+    size_t aacNumPendingBytes;
+    uint64_t aacPendingSampleTime; // of the first pending access unit
+    uint8_t aacPending[POS_AUDIO_AAC_MAX_AUS_PER_PACKET * POS_AUDIO_AAC_MAX_AU_BYTES];
+} POSAudioEncoder;
+
+/**
+ * Returns whether the audio codec type selected by the controller can be encoded.
+ */
+bool POSAudioEncoderIsSupported(uint16_t codecType);
+
+/**
+ * Returns the RTP timestamp rate of the codec.
+ */
+uint32_t POSAudioEncoderRTPClockRate(uint16_t codecType, uint32_t sampleRate);
+
+/**
+ * Opens the encoder for mono 16 bit PCM.
+ *
+ * @param codecType POS_AUDIO_CODEC_*.
+ * @param sampleRate 16000 or 24000.
+ * @param rtpTimeMs Packet time asked for by the controller. AAC-ELD always codes
+ *                  480 sample frames and packs as many as fit into one packet,
+ *                  Opus uses 20, 40 or 60 ms frames.
+ * @param maxBitRate Bits per second, 0 to let the encoder pick.
+ * @param variableBitRate false asks Opus for a constant bitrate.
+ */
+HAPError POSAudioEncoderOpen(POSAudioEncoder *encoder, uint16_t codecType, uint32_t sampleRate, uint32_t rtpTimeMs,
+                             uint32_t maxBitRate, bool variableBitRate);
+
+/**
+ * Encodes one frame of encoder->frameSamples samples.
+ *
+ * @param sampleTime Capture time of the first sample.
+ * @param payloadTime Capture time of the first sample in the returned payload,
+ *                    which is older than sampleTime when access units were packed.
+ * @return Payload bytes written, 0 if there is no packet to send yet.
+ */
+size_t POSAudioEncoderEncode(POSAudioEncoder *encoder, const int16_t *samples, size_t numSamples,
+                             uint64_t sampleTime, uint8_t *bytes, size_t maxBytes, uint64_t *payloadTime);
+
+/**
+ * Drops access units waiting to be packed, so the next payload starts with the next frame.
+ * Silence suppression calls this when it stops sending in the middle of a packet.
+ */
+void POSAudioEncoderFlush(POSAudioEncoder *encoder);
+
+void POSAudioEncoderClose(POSAudioEncoder *encoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,226 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "POSAudioJitterBuffer.h"
+
+#include "HAP.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSAudioJitterBuffer"};
+
+void POSAudioJitterBufferInit(POSAudioJitterBuffer *jb, uint32_t clockRate, uint32_t leadMs)
+{
+  HAPPrecondition(jb);
+  HAPPrecondition(clockRate);
+
+  HAPRawBufferZero(jb, sizeof *jb);
+  jb->clockRate = clockRate;
+  jb->leadMs = leadMs;
+  jb->packetMs = 20; // until the first two packets tell otherwise
+}
+
+uint32_t POSAudioJitterBufferTargetDelayMs(const POSAudioJitterBuffer *jb)
+{
+  HAPPrecondition(jb);
+
+  uint32_t delayMs = jb->leadMs + POS_AUDIO_JB_JITTER_MULTIPLIER * jb->jitterUs / 1000;
+  return delayMs > POS_AUDIO_JB_MAX_DELAY_MS ? POS_AUDIO_JB_MAX_DELAY_MS : delayMs;
+}
+
+static POSAudioJitterBufferSlot *POSAudioJitterBufferFind(POSAudioJitterBuffer *jb, uint32_t index)
+{
+  POSAudioJitterBufferSlot *slot = &jb->slots[index & (POS_AUDIO_JB_NUM_SLOTS - 1)];
+  return slot->valid && slot->index == index ? slot : NULL;
+}
+
+// Oldest packet held, NULL if there are none
+static POSAudioJitterBufferSlot *POSAudioJitterBufferOldest(POSAudioJitterBuffer *jb)
+{
+  POSAudioJitterBufferSlot *oldest = NULL;
+  for (size_t i = 0; i < POS_AUDIO_JB_NUM_SLOTS; i++)
+  {
+    POSAudioJitterBufferSlot *slot = &jb->slots[i];
+    if (slot->valid && (oldest == NULL || (int32_t)(slot->index - oldest->index) < 0))
+      oldest = slot;
+  }
+  return oldest;
+}
+
+static void POSAudioJitterBufferUpdateJitter(POSAudioJitterBuffer *jb, uint32_t index, uint32_t rtpTimeStamp,
+                                             HAPTime arrivalTime)
+{
+  // only packets that move the stream forward, a reordered one would count its own delay twice
+  if (jb->haveArrival && (int32_t)(index - jb->lastArrivalIndex) <= 0)
+    return;
+  if (jb->haveArrival)
+  {
+    int64_t arrivalUs = (int64_t)(arrivalTime - jb->lastArrivalTime) / 1000;
+    int64_t mediaUs = (int64_t)(int32_t)(rtpTimeStamp - jb->lastArrivalTimeStamp) * 1000000 / jb->clockRate;
+    int64_t d = arrivalUs - mediaUs;
+    if (d < 0)
+      d = -d;
+    if (d < 1000000) // a stall or a restarted stream isn't jitter
+      jb->jitterUs += ((int32_t)d - (int32_t)jb->jitterUs) / 16;
+  }
+  jb->haveArrival = true;
+  jb->lastArrivalIndex = index;
+  jb->lastArrivalTimeStamp = rtpTimeStamp;
+  jb->lastArrivalTime = arrivalTime;
+}
+
+void POSAudioJitterBufferInsert(POSAudioJitterBuffer *jb, uint32_t index, uint32_t rtpTimeStamp,
+                                const uint8_t *bytes, size_t numBytes, HAPTime arrivalTime)
+{
+  HAPPrecondition(jb);
+  HAPPrecondition(bytes);
+
+  POSAudioJitterBufferUpdateJitter(jb, index, rtpTimeStamp, arrivalTime);
+
+  if (jb->playing && (int32_t)(index - jb->playIndex) < 0)
+  {
+    jb->numLate++;
+    return;
+  }
+  if (numBytes == 0 || numBytes > POS_AUDIO_JB_MAX_PACKET_BYTES)
+  {
+    HAPLogError(&logObject, "dropping %zu byte packet", numBytes);
+    return;
+  }
+  if (jb->playing && index - jb->playIndex >= POS_AUDIO_JB_NUM_SLOTS)
+  {
+    // far ahead of playout, the controller restarted or we lost a lot, start over from here
+    HAPLogInfo(&logObject, "packet %u is %u ahead of playout, rebuffering", index, index - jb->playIndex);
+    for (size_t i = 0; i < POS_AUDIO_JB_NUM_SLOTS; i++)
+      jb->slots[i].valid = false;
+    jb->playing = false;
+    jb->numRebuffers++;
+  }
+
+  POSAudioJitterBufferSlot *slot = &jb->slots[index & (POS_AUDIO_JB_NUM_SLOTS - 1)];
+  if (slot->valid && slot->index == index)
+  {
+    jb->numDuplicate++;
+    return;
+  }
+  if (!jb->playing && POSAudioJitterBufferOldest(jb) == NULL)
+    jb->bufferingSince = arrivalTime;
+  slot->valid = true;
+  slot->index = index;
+  slot->rtpTimeStamp = rtpTimeStamp;
+  slot->numBytes = numBytes;
+  HAPRawBufferCopyBytes(slot->bytes, bytes, numBytes);
+}
+
+// Audio held here, waiting for its turn
+static uint32_t POSAudioJitterBufferHeldMs(const POSAudioJitterBuffer *jb)
+{
+  uint32_t numHeld = 0;
+  for (size_t i = 0; i < POS_AUDIO_JB_NUM_SLOTS; i++)
+    numHeld += jb->slots[i].valid;
+  return numHeld * jb->packetMs;
+}
+
+// Hands out the packet at playIndex and moves past it
+static POSAudioJitterBufferAction POSAudioJitterBufferTake(POSAudioJitterBuffer *jb, POSAudioJitterBufferSlot *slot,
+                                                           POSAudioJitterBufferAction action, const uint8_t **bytes,
+                                                           size_t *numBytes)
+{
+  if (jb->concealedMs == 0 && jb->lastRTPTimeStamp != 0)
+  {
+    uint32_t packetMs = (slot->rtpTimeStamp - jb->lastRTPTimeStamp) * 1000 / jb->clockRate;
+    if (packetMs > 0 && packetMs <= 120)
+      jb->packetMs = packetMs;
+  }
+  jb->lastRTPTimeStamp = slot->rtpTimeStamp;
+  jb->concealedMs = 0;
+  jb->packetsSinceStretch++;
+  jb->playIndex++;
+  slot->valid = false; // the bytes stay put until the next insert
+  *bytes = slot->bytes;
+  *numBytes = slot->numBytes;
+  return action;
+}
+
+POSAudioJitterBufferAction POSAudioJitterBufferPop(POSAudioJitterBuffer *jb, uint32_t bufferedMs, HAPTime now,
+                                                   const uint8_t **bytes, size_t *numBytes)
+{
+  HAPPrecondition(jb);
+  HAPPrecondition(bytes);
+  HAPPrecondition(numBytes);
+
+  *bytes = NULL;
+  *numBytes = 0;
+  uint32_t targetMs = POSAudioJitterBufferTargetDelayMs(jb);
+
+  if (!jb->playing)
+  {
+    // fill up to the target delay before the first packet of a talkspurt plays
+    POSAudioJitterBufferSlot *oldest = POSAudioJitterBufferOldest(jb);
+    if (oldest == NULL || now - jb->bufferingSince < (HAPTime)targetMs * 1000000)
+      return kPOSAudioJitterBuffer_Wait;
+    jb->playing = true;
+    jb->playIndex = oldest->index;
+    jb->lastRTPTimeStamp = 0;
+    jb->concealedMs = 0;
+    HAPLogDebug(&logObject, "playing from packet %u, target delay %u ms", oldest->index, targetMs);
+  }
+
+  POSAudioJitterBufferSlot *slot = POSAudioJitterBufferFind(jb, jb->playIndex);
+  if (slot != NULL)
+  {
+    // count what is held here too, it all goes to the speaker in this round
+    uint32_t queuedMs = bufferedMs + POSAudioJitterBufferHeldMs(jb);
+    // a delay spike leaves more queued than the target once the late packets arrive together
+    if (queuedMs > targetMs + POS_AUDIO_JB_EXCESS_MS)
+    {
+      jb->numDropped++;
+      return POSAudioJitterBufferTake(jb, slot, kPOSAudioJitterBuffer_Drop, bytes, numBytes);
+    }
+    // the jitter grew since the talkspurt started, build the delay back up a little at a time
+    if (queuedMs < targetMs && jb->packetsSinceStretch >= POS_AUDIO_JB_STRETCH_INTERVAL)
+    {
+      jb->packetsSinceStretch = 0;
+      jb->numStretched++;
+      return kPOSAudioJitterBuffer_Stretch;
+    }
+    return POSAudioJitterBufferTake(jb, slot, kPOSAudioJitterBuffer_Play, bytes, numBytes);
+  }
+
+  // the packet is missing, keep waiting for it as long as the speaker has audio left
+  if (bufferedMs >= jb->leadMs)
+    return kPOSAudioJitterBuffer_Wait;
+  if (jb->concealedMs >= POS_AUDIO_JB_MAX_CONCEAL_MS)
+  {
+    // the controller stopped talking, or the network is gone; start over with the next packet
+    HAPLogDebug(&logObject, "concealed %u ms at packet %u, rebuffering", jb->concealedMs, jb->playIndex);
+    jb->playing = false;
+    jb->numRebuffers++;
+    jb->bufferingSince = now;
+    return kPOSAudioJitterBuffer_Wait;
+  }
+
+  POSAudioJitterBufferSlot *next = POSAudioJitterBufferFind(jb, jb->playIndex + 1);
+  if (next != NULL)
+  {
+    *bytes = next->bytes;
+    *numBytes = next->numBytes;
+  }
+  jb->concealedMs += jb->packetMs;
+  jb->lastRTPTimeStamp += jb->packetMs * jb->clockRate / 1000;
+  jb->numConcealed++;
+  jb->playIndex++;
+  return kPOSAudioJitterBuffer_Conceal;
+}
@@ -0,0 +1,141 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSAUDIOJITTERBUFFER_H
+#define POSAUDIOJITTERBUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "POSRTPController.h"
+
+// Packets held at once, a power of two.  16 covers about a second of 60 ms packets
+#define POS_AUDIO_JB_NUM_SLOTS 16
+#define POS_AUDIO_JB_MAX_PACKET_BYTES 1500
+// The target delay never grows past this, however bad the jitter gets
+#define POS_AUDIO_JB_MAX_DELAY_MS 400
+// Target delay is the lead plus this many times the smoothed jitter
+#define POS_AUDIO_JB_JITTER_MULTIPLIER 3
+// After this much audio was concealed in a row the stream is taken as stopped and rebuffers
+#define POS_AUDIO_JB_MAX_CONCEAL_MS 150
+// More buffered audio than the target delay plus this and packets get dropped to catch up
+#define POS_AUDIO_JB_EXCESS_MS 120
+// Less than the target delay and a concealed packet is played in front of every this many real ones
+#define POS_AUDIO_JB_STRETCH_INTERVAL 4
+
+typedef struct
+{
+    bool valid;
+    uint32_t index;        // extended sequence number
+    uint32_t rtpTimeStamp;
+    size_t numBytes;
+    uint8_t bytes[POS_AUDIO_JB_MAX_PACKET_BYTES];
+} POSAudioJitterBufferSlot;
+
+/**
+ * What the caller should do with the speaker next.
+ */
+typedef enum
+{
+    kPOSAudioJitterBuffer_Wait,    // nothing due yet
+    kPOSAudioJitterBuffer_Play,    // decode the packet and queue it for the speaker
+    kPOSAudioJitterBuffer_Drop,    // decode the packet to keep the decoder in step, but don't play it
+    kPOSAudioJitterBuffer_Conceal, // the packet is missing, run the decoder's concealment for one packet
+    kPOSAudioJitterBuffer_Stretch, // run the concealment for one packet to grow the delay, nothing is missing
+} POSAudioJitterBufferAction;
+
+/**
+ * Reorders the return audio from the controller by RTP sequence number and
+ * decides when a missing packet is given up on.
+ *
+ * The speaker ring is the playout buffer.  Packets are handed out in order as
+ * soon as they are there, and the ring fills to the target delay at the start of
+ * each talkspurt.  A gap is held open for a late or reordered packet until the
+ * ring is about to run dry, then it is concealed.  The target delay follows the
+ * RFC 3550 interarrival jitter.  When the jitter grows mid talkspurt the delay is
+ * stretched with concealed packets, and audio that piles up past it after a
+ * delay spike is dropped to bring the latency back down.
+ *
+ * Only used on the media reactor thread.
+ */
+typedef struct
+{
+    POSAudioJitterBufferSlot slots[POS_AUDIO_JB_NUM_SLOTS];
+    uint32_t clockRate;
+    uint32_t leadMs;           // least audio the speaker needs queued to last until the next Pop
+    bool playing;
+    uint32_t playIndex;        // next packet to hand out
+    uint32_t lastRTPTimeStamp; // of the packet before playIndex
+    uint32_t packetMs;         // duration of the last packet played, what a concealment covers
+    uint32_t concealedMs;      // in a row
+    uint32_t packetsSinceStretch;
+    HAPTime bufferingSince;    // arrival of the first packet while not playing
+    bool haveArrival;
+    uint32_t lastArrivalIndex;
+    uint32_t lastArrivalTimeStamp;
+    HAPTime lastArrivalTime;
+    uint32_t jitterUs;         // smoothed interarrival jitter, RFC 3550 s6.4.1
+    uint32_t numLate;
+    uint32_t numDuplicate;
+    uint32_t numConcealed;
+    uint32_t numStretched;
+    uint32_t numDropped;
+    uint32_t numRebuffers;
+} POSAudioJitterBuffer;
+
+/**
+ * @param clockRate RTP clock rate of the return audio.
+ * @param leadMs Audio the speaker must have queued to last until the caller's next
+ *               POSAudioJitterBufferPop, the target delay never goes below this.
+ */
+void POSAudioJitterBufferInit(POSAudioJitterBuffer *jb, uint32_t clockRate, uint32_t leadMs);
+
+/**
+ * Stores one decrypted payload.  Packets that are too late to play, duplicates
+ * and payloads larger than POS_AUDIO_JB_MAX_PACKET_BYTES are dropped.
+ *
+ * @param index Extended RTP sequence number.
+ */
+void POSAudioJitterBufferInsert(POSAudioJitterBuffer *jb, uint32_t index, uint32_t rtpTimeStamp,
+                                const uint8_t *bytes, size_t numBytes, HAPTime arrivalTime);
+
+/**
+ * Picks the next thing to do with the speaker, call it until it returns kPOSAudioJitterBuffer_Wait.
+ *
+ * @param bufferedMs Audio queued for the speaker right now.
+ * @param bytes For Play and Drop the packet, for Conceal the packet after the
+ *              missing one if it is already there (Opus carries FEC for the
+ *              previous packet in it), else NULL.  Valid until the next Insert.
+ */
+POSAudioJitterBufferAction POSAudioJitterBufferPop(POSAudioJitterBuffer *jb, uint32_t bufferedMs, HAPTime now,
+                                                   const uint8_t **bytes, size_t *numBytes);
+
+/**
+ * Returns the delay the speaker is filled to at the start of a talkspurt.
+ */
+uint32_t POSAudioJitterBufferTargetDelayMs(const POSAudioJitterBuffer *jb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
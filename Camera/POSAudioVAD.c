@@ -0,0 +1,103 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "POSAudioVAD.h"
+
+#include "HAP.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSAudioVAD"};
+
+void POSAudioVADInit(POSAudioVAD *vad, uint32_t frameMs)
+{
+  HAPPrecondition(vad);
+  HAPPrecondition(frameMs);
+
+  HAPRawBufferZero(vad, sizeof *vad);
+  vad->hangoverFrames = (POS_AUDIO_VAD_HANGOVER_MS + frameMs - 1) / frameMs;
+  vad->hangoverRemaining = vad->hangoverFrames;
+  vad->active = true;
+}
+
+bool POSAudioVADProcess(POSAudioVAD *vad, const int16_t *samples, size_t numSamples)
+{
+  HAPPrecondition(vad);
+  HAPPrecondition(samples);
+
+  if (numSamples == 0)
+    return vad->active;
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < numSamples; i++)
+    sum += (int32_t)samples[i] * samples[i];
+  uint32_t energy = sum / numSamples; // at most 2^30
+  vad->frameEnergy = energy;
+
+  // judge the frame against the floor from before it, so speech doesn't raise its own bar
+  bool speech = energy >= POS_AUDIO_VAD_MIN_SPEECH_ENERGY &&
+                energy > (uint64_t)vad->noiseEnergy << POS_AUDIO_VAD_THRESHOLD_SHIFT;
+
+  if (vad->noiseEnergy == 0) // the first frame sets the floor
+    vad->noiseEnergy = energy;
+  else if (energy < vad->noiseEnergy)
+    vad->noiseEnergy -= (vad->noiseEnergy - energy + (1 << POS_AUDIO_VAD_FALL_SHIFT) - 1) >> POS_AUDIO_VAD_FALL_SHIFT;
+  else if (!speech)
+    vad->noiseEnergy += ((energy - vad->noiseEnergy) >> POS_AUDIO_VAD_RISE_SHIFT) + 1;
+  else // creep up under speech, so a noise that stays loud stops counting as speech
+    vad->noiseEnergy += (vad->noiseEnergy >> POS_AUDIO_VAD_CREEP_SHIFT) + 1;
+  if (vad->noiseEnergy < POS_AUDIO_VAD_MIN_NOISE_ENERGY)
+    vad->noiseEnergy = POS_AUDIO_VAD_MIN_NOISE_ENERGY;
+
+  bool wasActive = vad->active;
+  if (speech)
+  {
+    vad->hangoverRemaining = vad->hangoverFrames;
+    vad->active = true;
+  }
+  else if (vad->hangoverRemaining > 0)
+    vad->hangoverRemaining--;
+  else
+    vad->active = false;
+
+  if (vad->active != wasActive)
+  {
+    HAPLogDebug(&logObject, "%s, frame energy %u, noise floor %u", vad->active ? "speech" : "silence", energy,
+                vad->noiseEnergy);
+  }
+  return vad->active;
+}
+
+// log2(x) in Q8, linear between powers of two
+static uint32_t POSAudioVADLog2Q8(uint32_t x)
+{
+  if (x == 0)
+    return 0;
+  uint32_t msb = 31 - __builtin_clz(x);
+  uint32_t frac = (x << (31 - msb)) >> 23 & 0xff; // the 8 bits below the leading one
+  return msb << 8 | frac;
+}
+
+uint8_t POSAudioVADNoiseLevel(const POSAudioVAD *vad)
+{
+  HAPPrecondition(vad);
+
+  // full scale is 2^30 mean square, -dBov = (30 - log2(energy)) * 10 * log10(2), 771 / 256 ~ 3.01
+  uint32_t log2Energy = POSAudioVADLog2Q8(vad->noiseEnergy);
+  if (log2Energy >= 30 << 8)
+    return 0;
+  uint32_t level = ((30 << 8) - log2Energy) * 771 >> 16;
+  return level > 127 ? 127 : level;
+}
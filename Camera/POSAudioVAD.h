@@ -0,0 +1,86 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSAUDIOVAD_H
+#define POSAUDIOVAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames within this many ms of the last speech are still sent, so word endings aren't clipped
+#define POS_AUDIO_VAD_HANGOVER_MS 300
+// Speech is at least this far above the noise floor, 4x the energy is 6 dB
+#define POS_AUDIO_VAD_THRESHOLD_SHIFT 2
+// Mean square energy of -60 dBov, anything quieter is never speech
+#define POS_AUDIO_VAD_MIN_SPEECH_ENERGY 1074
+// Mean square energy of -90 dBov, the noise floor never drops below this
+#define POS_AUDIO_VAD_MIN_NOISE_ENERGY 1
+// The floor follows quieter frames in 1 << 3 frames and louder non speech ones in 1 << 4
+#define POS_AUDIO_VAD_FALL_SHIFT 3
+#define POS_AUDIO_VAD_RISE_SHIFT 4
+// Under speech the floor rises 1/64 a frame, 6 dB in about 90 frames
+#define POS_AUDIO_VAD_CREEP_SHIFT 6
+
+/**
+ * Energy based voice activity detector for the microphone frames.
+ *
+ * Tracks the background noise floor as the mean square energy of the frames.
+ * The floor falls quickly to quieter frames and only creeps up under speech, so
+ * a fan turning on becomes the new floor over the following seconds.  A frame is speech when it is
+ * POS_AUDIO_VAD_THRESHOLD_SHIFT above the floor, and the detector stays active
+ * for POS_AUDIO_VAD_HANGOVER_MS after the last speech frame.
+ *
+ * Integer only, the T31 has no FPU to spare in the audio thread.
+ */
+typedef struct
+{
+    uint32_t hangoverFrames;    // frames kept active after the last speech frame
+    uint32_t hangoverRemaining;
+    uint32_t noiseEnergy;       // mean square, in int16 sample units, 0 until the first frame
+    uint32_t frameEnergy;       // of the last frame
+    bool active;
+} POSAudioVAD;
+
+/**
+ * Starts the detector in the active state with an unknown noise floor.
+ *
+ * @param frameMs Duration of the frames passed to POSAudioVADProcess.
+ */
+void POSAudioVADInit(POSAudioVAD *vad, uint32_t frameMs);
+
+/**
+ * Classifies one frame of samples.
+ *
+ * @return true while there is speech or the hangover runs, false for silence.
+ */
+bool POSAudioVADProcess(POSAudioVAD *vad, const int16_t *samples, size_t numSamples);
+
+/**
+ * Returns the noise floor as a RFC 3389 comfort noise level, in -dBov from 0 to 127.
+ */
+uint8_t POSAudioVADNoiseLevel(const POSAudioVAD *vad);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
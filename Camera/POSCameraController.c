@@ -22,6 +22,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h> // SIOCOUTQ
 #include <arpa/inet.h>
 
 #include "HAP.h"
@@ -38,6 +40,17 @@
 #include "POSCameraController.h"
 #include "POSRTPController.h"
 #include "POSSRTPCrypto.h"
+#include "POSUDPSender.h"
+#include "POSMediaReactor.h"
+#include "POSRTPFec.h"
+#include "POSRTPPacer.h"
+#include "POSRTPFanout.h"
+#include "POSRateController.h"
+#include "POSMediaClock.h"
+#include "POSAudioEncoder.h"
+#include "POSAudioVAD.h"
+#include "POSAudioJitterBuffer.h"
+#include "POSAudioASRC.h"
 
 #include <imp/imp_log.h>
 #include <imp/imp_common.h>
@@ -61,13 +74,10 @@ extern AccessoryConfiguration accessoryConfiguration;
 
 static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSCameraController"};
 
+// Monotonic, the wall clock only enters through POSMediaClockToNTPTime for sender reports
 static HAPTime ActualTime()
 {
-  struct timespec spec;
-  clock_gettime(CLOCK_REALTIME, &spec);
-  uint32_t sec = (uint32_t)spec.tv_sec;
-  uint32_t ns = (uint32_t)spec.tv_nsec;
-  return (HAPTime)sec * 1000000000 + ns;
+  return POSMediaClockNow();
 }
 
 int callback_param = 0;
@@ -183,163 +193,272 @@ void *sample_ivs_move_get_result_process(void *arg)
 static int frmrate_sp[3] = {0};
 static int statime_sp[3] = {0};
 static int bitrate_sp[3] = {0};
+static uint32_t sendcalls_sp[3] = {0};
+static uint32_t packets_sp[3] = {0};
+
+// packet pool for batched video egress, one slot per rtp packet
+static uint8_t video_packet_pool[POS_UDP_BATCH_MAX][4096];
+static size_t video_packet_lens[POS_UDP_BATCH_MAX];
+
+// sent video packets, kept for NACK retransmission
+static POSRTPPacketHistory video_packet_history;
+
+// XOR parity for the video stream.  No HAP controller negotiates an FEC payload
+// type, so this stays off unless the build sets one, see POSITRON_VIDEO_FEC_PAYLOAD_TYPE.
+#ifndef POS_VIDEO_FEC_PAYLOAD_TYPE
+#define POS_VIDEO_FEC_PAYLOAD_TYPE 0
+#endif
+static POSRTPFecEncoder video_fec;
+// the parity of the batch being sent, built and protected by POSRTPStreamPollPackets
+static POSRTPFecBatch video_fec_batch;
+
+// Each frame is sent over this share of the frame interval instead of in one burst, 0 sends as fast as the socket takes it
+#define POS_VIDEO_PACING_PERCENT 50
+// Sent back to back before the pacer starts waiting, about three full packets
+#define POS_VIDEO_PACING_BURST_BYTES 4500
+static POSRTPPacer video_pacer;
+
+// Each frame is packetized once into video_packet_pool by video_packetizer, then
+// encrypted and sent, with its FEC parity, to every viewer by video_fanout
+static POSRTPStreamRef video_packetizer;
+static POSRTPFanout video_fanout;
+
+// Encoder bitrate and frame rate follow the loss, RTT and queueing the controller reports
+#define POS_VIDEO_MIN_BITRATE 100000
+
+// The stream ends when the controller hasn't sent any RTCP for this long
+#define POS_STREAM_DROPOUT_SECONDS 30
+static POSRateController video_rate;
 
 typedef uint64_t HAPEpochTime;
 
-// todo, move this function to a file dedicated to the video stream
-static void *srtp_video_feedback(void *context)
+// packetize the pushed payload into the pool, then hand it to every viewer in as few calls as possible
+static void send_video_payload(POSRTPStreamRef *stream, int chnNum)
 {
-  AccessoryContext *myContext = context;
+  for (;;)
+  {
+    size_t num_packets = 0;
+    POSRTPStreamPollPackets(
+        stream,
+        video_packet_pool,
+        sizeof(video_packet_pool[0]),
+        POS_UDP_BATCH_MAX,
+        video_packet_lens,
+        &num_packets);
+    if (num_packets == 0)
+      break;
+    packets_sp[chnNum] += num_packets;
+    POSRTPFanoutSend(&video_fanout, stream, (uint8_t *)video_packet_pool, sizeof(video_packet_pool[0]),
+                     video_packet_lens, num_packets, ActualTime(), &sendcalls_sp[chnNum]);
+  }
+}
 
+// Resends packets the controller NACKed, as long as the retransmission budget allows
+static void srtp_video_resend_packets(AccessoryContext *myContext)
+{
   int sock = myContext->session.videoFeedbackThread.socket;
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
-
-  prctl(PR_SET_NAME, "pos_srtp_feedb");
-
   uint8_t packet[4096];
   size_t numPacketBytes = 0;
-  HAPEpochTime time;
   int ret;
-  int chnNum = myContext->session.videoThread.chn_num;
 
-  // WORKAROUND ( SELECT CAUSES RUNAWAY HAP )
-  // this is causing high cpu utilization in the HAP run loop... not sure why
-  //  while( ! myContext->session.videoFeedbackThread.threadStop ){
-  //    int ret;
-  //    //select can modify timeout to be the time not slept
-  //    struct timeval timeout;
-  //    timeout.tv_sec = 5;
-  //    timeout.tv_usec = 0; // 1 s
-  //    ret = select(sock+1, &fds, NULL, NULL, &timeout);
-  //    if (ret == -1 && errno == EINTR){
-  //      continue;
-  //    }
-  //    if (ret < 0){
-  //      HAPLogError(&logObject, "Select failed in srtp_video_feedback thread");
-  //      return NULL;
-  //    }
-  //    if (ret  > 0){
-
-  // work around with a nonblocking socket
-  //  ret = setnonblock(sock);
-  //  if (ret < 0) {
-  //    HAPLogError(&logObject, "srtp_video_feedback setnonblock(%d) failed", chnNum);
-  //  }
-
-  while (!myContext->session.videoFeedbackThread.threadStop)
-  {
-
-//    if (FD_ISSET(sock, &fds))
-//   {
-
-      size_t numReceivedBytes;
-      do
-      {
-        numReceivedBytes = recv(sock, packet, sizeof(packet), 0);
-      } while ((numReceivedBytes == -1) && (errno = EINTR));
-      time = ActualTime();
+  for (;;)
+  {
+    POSRTPStreamPollRetransmission(&myContext->session.rtpVideoStream, ActualTime(), packet, sizeof(packet), &numPacketBytes);
+    if (numPacketBytes == 0)
+      break;
+    ret = send(sock, packet, numPacketBytes, 0);
+    if (ret != numPacketBytes)
+    {
+      HAPLogError(&logObject, "Tried to resend %d bytes, but send only sent %d", numPacketBytes, ret);
+      break;
+    }
+    // resent right away, the video that follows waits for them instead
+    POSRTPPacerCharge(&video_pacer, numPacketBytes);
+  }
+}
 
-      if (numReceivedBytes > 0)
-      {
-        // HAPLogDebug(&logObject, "srtp_video_feedback thread got a packet.  Len: %d", numReceivedBytes);
-        // hexDump("srtcpPacket",&packet, numReceivedBytes, 16);
-        POSRTPStreamPushPacket(
-            &myContext->session.rtpVideoStream,
-            packet,
-            numReceivedBytes,
-            &numPacketBytes,
-            time);
-        if (numPacketBytes)
-        {
-          uint8_t newPacket[4096];
-          size_t numPayloadBytes = 0;
-          HAPTimeNS sampleTime;
-          POSRTPStreamPollPayload(
-              &myContext->session.rtpVideoStream,
-              newPacket,
-              sizeof(newPacket),
-              &numPayloadBytes,
-              &sampleTime);
-          // PushSpeakerData , packet1, numPayloadBytes, sampleTime
-        }
-      }
-    //}
-    //    }
+// todo, move this function to a file dedicated to the video stream
+// Runs on the media reactor thread for every packet the controller sends on the video socket
+static void srtp_video_feedback_packet(void *context, uint8_t *packet, size_t numReceivedBytes)
+{
+  AccessoryContext *myContext = context;
+  size_t numPacketBytes = 0;
 
-    time = ActualTime();
-    uint32_t bitRate = 0;
-    bool newKeyFrame = 0;
-    uint32_t dropoutTime;
+  if (myContext->session.videoFeedbackThread.threadStop)
+    return;
 
-    POSRTPStreamCheckFeedback(
+  // HAPLogDebug(&logObject, "srtp_video_feedback got a packet.  Len: %d", numReceivedBytes);
+  // hexDump("srtcpPacket",&packet, numReceivedBytes, 16);
+  POSRTPStreamPushPacket(
+      &myContext->session.rtpVideoStream,
+      packet,
+      numReceivedBytes,
+      &numPacketBytes,
+      ActualTime());
+  if (numPacketBytes)
+  {
+    uint8_t newPacket[4096];
+    size_t numPayloadBytes = 0;
+    HAPTimeNS sampleTime;
+    POSRTPStreamPollPayload(
         &myContext->session.rtpVideoStream,
-        time,
-        packet,
-        sizeof(packet),
-        &numPacketBytes,
-        &bitRate,
-        &newKeyFrame,
-        &dropoutTime);
-
-    // Send RTCP feedback, if any
-    if (numPacketBytes)
+        newPacket,
+        sizeof(newPacket),
+        &numPayloadBytes,
+        &sampleTime);
+  }
+  // answer a NACK now rather than on the next reactor tick
+  srtp_video_resend_packets(myContext);
+}
+
+typedef struct
+{
+  AccessoryContext *context;
+  uint8_t sessionId[UUIDLENGTH];
+} POSStreamDropout;
+
+static void HandleStreamDropoutCallback(
+    void *_Nullable context,
+    size_t contextSize)
+{
+  // run in the hap loop, where posStopStream can join the threads and remove the reactor handlers
+  HAPAssert(context);
+  HAPAssert(contextSize == sizeof(POSStreamDropout));
+  POSStreamDropout *dropout = context;
+  AccessoryContext *myContext = dropout->context;
+
+  // the controller may have ended or replaced the stream while this was queued
+  if (myContext->session.status != kHAPCharacteristicValue_StreamingStatus_InUse ||
+      !HAPRawBufferAreEqual(myContext->session.sessionId, dropout->sessionId, UUIDLENGTH))
+    return;
+
+  HAPLogInfo(&logObject, "Stopping the stream after the dropout");
+  posStopStream(myContext);
+}
+
+// Runs on the media reactor thread on every reactor tick, so RTCP reports and the
+// dropout check no longer depend on the controller sending us packets
+static void srtp_video_feedback_tick(void *context)
+{
+  AccessoryContext *myContext = context;
+
+  if (myContext->session.videoFeedbackThread.threadStop)
+    return;
+
+  int sock = myContext->session.videoFeedbackThread.socket;
+  int chnNum = myContext->session.videoThread.chn_num;
+  uint8_t packet[4096];
+  size_t numPacketBytes = 0;
+  uint32_t bitRate = 0;
+  bool newKeyFrame = 0;
+  uint32_t dropoutTime;
+  int ret;
+
+  POSRTPStreamCheckFeedback(
+      &myContext->session.rtpVideoStream,
+      ActualTime(),
+      packet,
+      sizeof(packet),
+      &numPacketBytes,
+      &bitRate,
+      &newKeyFrame,
+      &dropoutTime);
+
+  // Send RTCP feedback, if any
+  if (numPacketBytes)
+  {
+    ret = send(sock, packet, numPacketBytes, 0);
+    if (ret != numPacketBytes)
     {
-      ret = send(sock, packet, numPacketBytes, 0);
-      if (ret != numPacketBytes)
-      {
-        HAPLogError(&logObject, "Tried to send %d bytes, but send only sent %d", numPacketBytes, ret);
-        // printf("send error (%d): %s\n", errno, strerror(errno));
-      }
+      HAPLogError(&logObject, "Tried to send %d bytes, but send only sent %d", numPacketBytes, ret);
     }
-    if (bitRate)
+  }
+  // FEC overhead follows the loss the controller reports
+  POSRTPFecSetFractionLost(&video_fec, myContext->session.rtpVideoStream.remoteFractionLost);
+  // Whatever the retransmission budget held back when the NACK came in
+  srtp_video_resend_packets(myContext);
+  if (bitRate)
+  {
+    HAPLogInfo(&logObject, "RTCP requested new bitrate: %d", bitRate);
+    // a TMMBR is an upper bound for the rate controller, not a rate to jump to
+    POSRateControllerSetCap(&video_rate, bitRate);
+  }
+  POSRateFeedback rateFeedback;
+  int queuedBytes = 0;
+  rateFeedback.reportCount = myContext->session.rtpVideoStream.remoteReportCount;
+  rateFeedback.fractionLost = myContext->session.rtpVideoStream.remoteFractionLost;
+  rateFeedback.jitterMs = myContext->session.rtpVideoStream.remoteJitter / 90; // 90khz clock
+  rateFeedback.rttMs =
+      (uint32_t)(((uint64_t)myContext->session.rtpVideoStream.roundTripTimeCalculation * 1000) >> 16); // 16.16 seconds
+  if (ioctl(myContext->session.videoThread.socket, SIOCOUTQ, &queuedBytes) < 0)
+    queuedBytes = 0;
+  rateFeedback.queuedBytes = queuedBytes;
+  uint32_t targetBitRate, targetFrameRate;
+  if (POSRateControllerUpdate(&video_rate, &rateFeedback, (uint32_t)(ActualTime() / 1000000), &targetBitRate, &targetFrameRate))
+  {
+    HAPLogInfo(&logObject, "Rate controller: %u bps, %u fps (loss %u/256, rtt %u ms, queued %u bytes)", targetBitRate,
+               targetFrameRate, rateFeedback.fractionLost, rateFeedback.rttMs, rateFeedback.queuedBytes);
+    // the encoder takes kbps, as in IMP_Encoder_SetDefaultParam
+    ret = IMP_Encoder_SetChnBitRate(chnNum, targetBitRate / 1000, (targetBitRate / 1000) << 2);
+    if (ret < 0)
     {
-      HAPLogInfo(&logObject, "RTCP requested new bitrate: %d", bitRate);
-      ret = IMP_Encoder_SetChnBitRate(chnNum, bitRate, bitRate << 2);
-      if (ret < 0)
-      {
-        HAPLogError(&logObject, "IMP_Encoder_SetChnBitRate(%d, %d) failed", chnNum, bitRate);
-      }
+      HAPLogError(&logObject, "IMP_Encoder_SetChnBitRate(%d, %d) failed", chnNum, targetBitRate / 1000);
     }
-    if (newKeyFrame)
+    IMPEncoderFrmRate frameRate = {.frmRateNum = targetFrameRate, .frmRateDen = 1};
+    IMPEncoderFrmRate currentFrameRate;
+    if ((IMP_Encoder_GetChnFrmRate(chnNum, &currentFrameRate) == 0) &&
+        (currentFrameRate.frmRateNum != targetFrameRate * currentFrameRate.frmRateDen))
     {
-      HAPLogInfo(&logObject, "RTCP requested new keyframe");
-      ret = IMP_Encoder_RequestIDR(chnNum);
+      ret = IMP_Encoder_SetChnFrmRate(chnNum, &frameRate);
       if (ret < 0)
       {
-        HAPLogError(&logObject, "IMP_Encoder_RequestIDR(%d) failed", chnNum);
+        HAPLogError(&logObject, "IMP_Encoder_SetChnFrmRate(%d, %u) failed", chnNum, targetFrameRate);
       }
     }
-    // this will never be called since we're blocking on read instead of using select
-    if (dropoutTime > 300)
+  }
+  if (newKeyFrame)
+  {
+    HAPLogInfo(&logObject, "RTCP requested new keyframe");
+    ret = IMP_Encoder_RequestIDR(chnNum);
+    if (ret < 0)
     {
-      HAPLogError(&logObject, "Stream timeout, closing video stream");
-      // not sure what to do here.  call posStopStream? - can't that'll wait in this
-      // do this for now
+      HAPLogError(&logObject, "IMP_Encoder_RequestIDR(%d) failed", chnNum);
+    }
+  }
+  // the tick runs even when the controller has gone quiet, so the dropout is caught within a tick
+  if (dropoutTime > POS_STREAM_DROPOUT_SECONDS)
+  {
+    HAPLogError(&logObject, "Haven't receieved an RTCP frame in %d seconds, ending stream", dropoutTime);
+    // can't call posStopStream from the reactor, it removes our own handler and joins threads,
+    // so quiet this tick and hand the teardown to the hap loop
+    myContext->session.videoFeedbackThread.threadStop = 1;
 
-      // Stop the videoThread
+    POSStreamDropout dropout;
+    dropout.context = myContext;
+    HAPRawBufferCopyBytes(dropout.sessionId, myContext->session.sessionId, UUIDLENGTH);
+    HAPError err = HAPPlatformRunLoopScheduleCallback(HandleStreamDropoutCallback, &dropout, sizeof dropout);
+    if (err)
+    {
+      HAPLogError(&logObject, "Scheduling the stream teardown failed");
+      // at least stop sending, the next stop or start command cleans up the rest
       myContext->session.videoThread.threadStop = 1;
-      // Stop this thread
-      myContext->session.videoFeedbackThread.threadStop = 1;
-      //
+      myContext->session.audioThread.threadStop = 1;
+      myContext->session.audioFeedbackThread.threadStop = 1;
       accessoryConfiguration.state.streaming = kHAPCharacteristicValue_StreamingStatus_Available;
       myContext->session.status = kHAPCharacteristicValue_StreamingStatus_Available;
     }
   }
-  HAPLogError(&logObject, "Exiting video rtcp feedback thread.");
-  return NULL;
 }
 
 // todo, move this function to a file dedicated to the video stream
 static void *get_srtp_video_stream(void *context)
 {
   //  HAPLogError(&logObject, "In capture thread.");
-  int val, i, chnNum, ret, sock;
+  int val, i, chnNum, ret;
 
   AccessoryContext *myContext = context;
 
-  sock = myContext->session.videoThread.socket;
+  // the sockets belong to video_fanout's viewers
   chnNum = myContext->session.videoThread.chn_num;
 
   prctl(PR_SET_NAME, "pos_srtp_vid");
@@ -351,6 +470,8 @@ static void *get_srtp_video_stream(void *context)
     return ((void *)-1);
   }
 
+  POSRTPPacerInit(&video_pacer, POS_VIDEO_PACING_BURST_BYTES);
+
   while (!myContext->session.videoThread.threadStop)
   {
     // HAPLogError(&logObject, "In capture loop.");
@@ -382,6 +503,21 @@ static void *get_srtp_video_stream(void *context)
     int len = 0;
     int ret, i, nr_pack = ImpEncStream.packCount;
 
+    // pick the pacing rate from the size of the whole frame and the bitrate the controller last asked for,
+    // every viewer gets a copy over the same uplink
+    size_t frameBytes = 0;
+    uint32_t numViewers = POSRTPFanoutNumViewers(&video_fanout);
+    if (numViewers == 0)
+      numViewers = 1;
+    for (i = 0; i < nr_pack; i++)
+      frameBytes += ImpEncStream.pack[i].length;
+    POSRTPPacerStartFrame(&video_pacer, frameBytes * numViewers,
+                          myContext->session.videoParameters.codecConfig.videoAttributes.frameRate,
+                          myContext->session.rtpVideoStream.bitRate * numViewers, POS_VIDEO_PACING_PERCENT);
+
+    // keep the IMP timestamp and wall clock offsets current
+    POSMediaClockSample(&posMediaClock);
+
     //  HAPLogDebug(&logObject, "----------packCount=%d, ImpEncStream->seq=%u start----------", ImpEncStream.packCount, ImpEncStream.seq);
     for (i = 0; i < nr_pack; i++)
     {
@@ -397,57 +533,28 @@ static void *get_srtp_video_stream(void *context)
       if (pack->length && !myContext->session.videoThread.threadPause)
       {
         size_t numPayloadBytes = 0;
-        // TODO:  Should the sequence number be derived from the encoder instead of the ActualTime?
         POSRTPStreamPushPayload(
-            &myContext->session.rtpVideoStream,
+            &video_packetizer,
             (void *)(ImpEncStream.virAddr + pack->offset + 4), // 4 removes the nal start prefix
             pack->length - 4,
             &numPayloadBytes,
-            pack->timestamp * 1000, // us to ns conversion
+            POSMediaClockFromSensor(&posMediaClock, pack->timestamp),
             ActualTime());
 
         if (numPayloadBytes > 0)
         {
-          for (;;)
-          {
-            uint8_t packet_data[4096];
-            size_t packet_len = 0;
-            POSRTPStreamPollPacket(
-                &myContext->session.rtpVideoStream,
-                packet_data,
-                sizeof(packet_data),
-                &packet_len);
-            if (packet_len == 0)
-              break;
-            // printf("sending %d bytes\n", packet_len);
-            // printf("sending %d video bytes, index %d, fd %d\n", packet_len,*(uint16_t *)(&packet_data[2]), sock);
-            ret = send(sock, packet_data, packet_len, 0);
-            if (ret != packet_len)
-            {
-              HAPLogError(&logObject,"Tried to send %d bytes, but send only sent %d", packet_len, ret);
-              // printf("send error (%d): %s\n", errno, strerror(errno));
-            }
-          }
+          send_video_payload(&video_packetizer, chnNum);
         }
       }
     }
-
-    // WORKAROUND ( SELECT CAUSES RUNAWAY HAP )
-    if (ImpEncStream.seq % 128 == 0)
-    { //...periodically
-      uint64_t NTPTime = HAPTimeToNTPTime(ActualTime());
-      int dropoutTime = (uint32_t)(NTPTime >> 32) - (uint32_t)(myContext->session.rtpVideoStream.lastRecvNTPtime);
-      HAPLogInfo(&logObject, "Last RTCP frame was %d sec ago", dropoutTime);
-      if (dropoutTime > 30)
+    if (!myContext->session.videoThread.threadPause)
+    {
+      // small nalus of this frame (sei, small slices of a static scene) are held back for one STAP-A
+      size_t numPayloadBytes = 0;
+      POSRTPStreamEndAccessUnit(&video_packetizer, &numPayloadBytes);
+      if (numPayloadBytes > 0)
       {
-        HAPLogError(&logObject, "Haven't receieved an RTCP frame in 30 seconds, ending stream");
-        myContext->session.videoThread.threadStop = 1;
-        myContext->session.videoFeedbackThread.threadStop = 1;
-        myContext->session.audioThread.threadStop = 1;
-        myContext->session.audioFeedbackThread.threadStop = 1;
-
-        accessoryConfiguration.state.streaming = kHAPCharacteristicValue_StreamingStatus_Available;
-        myContext->session.status = kHAPCharacteristicValue_StreamingStatus_Available;
+        send_video_payload(&video_packetizer, chnNum);
       }
     }
 
@@ -473,10 +580,17 @@ static void *get_srtp_video_stream(void *context)
       double fps = (double)frmrate_sp[chnNum] / ((double)(now - statime_sp[chnNum]) / 1000);
       double kbr = (double)bitrate_sp[chnNum] * 8 / (double)(now - statime_sp[chnNum]);
 
-      HAPLogInfo(&logObject, "streamNum[%d]:FPS: %d,Bitrate: %d(kbps)", chnNum, (int)floor(fps), (int)floor(kbr));
+      HAPLogInfo(&logObject,
+                 "streamNum[%d]:FPS: %d,Bitrate: %d(kbps),Packets/frame: %d,Send calls/frame: %d,Pacer waits: %u",
+                 chnNum, (int)floor(fps), (int)floor(kbr),
+                 frmrate_sp[chnNum] ? (int)(packets_sp[chnNum] / frmrate_sp[chnNum]) : 0,
+                 frmrate_sp[chnNum] ? (int)(sendcalls_sp[chnNum] / frmrate_sp[chnNum]) : 0, video_pacer.waits);
+      video_pacer.waits = 0;
 
       frmrate_sp[chnNum] = 0;
       bitrate_sp[chnNum] = 0;
+      sendcalls_sp[chnNum] = 0;
+      packets_sp[chnNum] = 0;
       statime_sp[chnNum] = now;
     }
 
@@ -495,38 +609,79 @@ static void *get_srtp_video_stream(void *context)
   return ((void *)0);
 }
 
-ring_buffer_ao_t ring_buffer_ao;
-void * ring_buffer_index_storage[128];
-uint8_t ring_buffer_storage[1024*128];
-pthread_mutex_t spkQueueMutex;
-pthread_cond_t spkQueueCond;
+// Decoded return audio, one AAC-ELD frame per slot.  A slot holds the full
+// 1024 sample output buffer the decoder wants, the speaker plays 480 of them.
+#define SPK_FRAME_SAMPLES 1024
+#define SPK_NUM_FRAMES 64
+ring_buffer_ao_t ring_buffer_ao = { .event_fd = -1 };
+static INT_PCM ring_buffer_storage[SPK_NUM_FRAMES][SPK_FRAME_SAMPLES];
 
 
-// todo, move this function to a file dedicated to the audio stream
-static void *srtp_audio_feedback(void *context)
+// Hz of the sample rate in the HAP audio codec parameters
+static uint32_t audio_sample_rate(const audioCodecConfigStruct *codecConfig)
 {
-  AccessoryContext *myContext = context;
-  int sock = myContext->session.audioFeedbackThread.socket;
-//  fd_set fds;
-//  FD_ZERO(&fds);
-//  FD_SET(sock, &fds);
-
-  prctl(PR_SET_NAME, "pos_aud_feedb");
-
-  uint8_t packet[4096];
-  size_t numPacketBytes = 0;
-  HAPEpochTime time;
-  int ret;
+  switch (codecConfig->audioCodecParams.sampleRate)
+  {
+  case 0:
+    return 8000;
+  case 2:
+    return 24000;
+  default:
+    return 16000;
+  }
+}
 
+// Return audio decoder, opened when the stream starts and used only on the reactor thread
+static HANDLE_AACDECODER hAacDec = NULL;
+static char ancBuffer[1024];
+static OpusDecoder *opusDec = NULL;
+// The speaker plays 480 sample frames (30 ms at 16 kHz), Opus frames are 20-60 ms. Decoded
+// samples that don't fill a speaker frame yet wait here. 120 ms is the longest Opus packet.
+#define SPK_SAMPLE_RATE 16000
+#define SPK_PLAY_SAMPLES 480
+static INT_PCM opusPcm[SPK_SAMPLE_RATE * 120 / 1000 + SPK_PLAY_SAMPLES];
+static size_t opusPcmSamples = 0;
+// Reorders the return audio ahead of the decoders.  The speaker has to last until the next
+// reactor tick while a late packet is waited for, so that sets the least delay.
+#define SPK_JITTER_LEAD_MS (POS_MEDIA_REACTOR_TICK_MS + SPK_PLAY_SAMPLES * 1000 / SPK_SAMPLE_RATE)
+static POSAudioJitterBuffer returnAudioJitterBuffer;
+
+// Published by srtp_audio_playout for the speaker thread's rate control, atomics only.
+// All 32 bit, a 64 bit atomic is a libatomic call on MIPS32.
+static struct
+{
+    uint32_t lastWriteUs;   // ActualTime() in us when decoded audio last went into the speaker ring, wraps
+    uint32_t writePeriodUs; // audio written each time, one packet
+    uint32_t targetUs;      // jitter buffer target delay
+} spkPlayout;
+// The controller's audio clock and the AO clock drift apart, the speaker thread plays a little
+// faster or slower through this to keep the ring on the jitter buffer's target
+static POSAudioASRC speakerASRC;
 
+static void srtp_audio_decoder_close(void);
 
-  // setup aac decoding
+static void srtp_audio_decoder_open(uint16_t codecType, uint32_t clockRate)
+{
   AACENC_ERROR aacErr = AACENC_OK;
-  HANDLE_AACDECODER hAacDec;
+  srtp_audio_decoder_close(); // a reconfigure restarts the stream
+  POSAudioJitterBufferInit(&returnAudioJitterBuffer, clockRate, SPK_JITTER_LEAD_MS);
+  if (codecType == POS_AUDIO_CODEC_OPUS)
+  {
+    int opusErr;
+    opusDec = opus_decoder_create(SPK_SAMPLE_RATE, 1, &opusErr);
+    if (opusErr != OPUS_OK)
+    {
+      HAPLogError(&logObject, "opus_decoder_create error: %s", opus_strerror(opusErr));
+      opusDec = NULL;
+    }
+    opusPcmSamples = 0;
+    return;
+  }
   hAacDec = aacDecoder_Open(TT_MP4_RAW, 1);
   if (hAacDec == NULL)
   {
     HAPLogError(&logObject, "aacDecoder_Open error");
+    return;
   }
   
   // trial and error 
@@ -542,7 +697,6 @@ static void *srtp_audio_feedback(void *context)
     HAPLogError(&logObject, "aacDecoder_Open error");
   }
 
-  char ancBuffer[1024];
   aacErr = aacDecoder_AncDataInit(hAacDec, ancBuffer, sizeof(ancBuffer));
   if (aacErr != AACENC_OK)
   {
@@ -554,180 +708,290 @@ static void *srtp_audio_feedback(void *context)
   stream_info = aacDecoder_GetStreamInfo(hAacDec);
   if (stream_info == NULL) {
     HAPLogError(&logObject, "aacDecoder_GetStreamInfo failed!");
-	  //return NULL;
+	  return;
   }
   HAPLogDebug(&logObject, "> stream info: channel = %d\tsample_rate = %d\tframe_size = %d\taot = %d\tbitrate = %d",   \
           stream_info->channelConfig, stream_info->aacSampleRate,
           stream_info->aacSamplesPerFrame, stream_info->aot, stream_info->bitRate);
+}
 
+static void srtp_audio_decoder_close(void)
+{
+  POSAudioJitterBuffer *jb = &returnAudioJitterBuffer;
+  if (hAacDec != NULL || opusDec != NULL)
+  {
+    HAPLogInfo(&logObject, "return audio: %u late, %u duplicate, %u concealed, %u stretched, %u dropped, %u rebuffers, "
+                           "jitter %u us, target delay %u ms",
+               jb->numLate, jb->numDuplicate, jb->numConcealed, jb->numStretched, jb->numDropped, jb->numRebuffers,
+               jb->jitterUs, POSAudioJitterBufferTargetDelayMs(jb));
+  }
 
+  // dealocate aac decoder and transport layer structures
+  if (hAacDec != NULL)
+    aacDecoder_Close(hAacDec);
+  hAacDec = NULL;
+  if (opusDec != NULL)
+    opus_decoder_destroy(opusDec);
+  opusDec = NULL;
+}
 
-  // WORKAROUND ( SELECT CAUSES RUNAWAY HAP )
-  // this is causing high cpu utilization in the HAP run loop... not sure why
-  //  while( ! myContext->session.audioFeedbackThread.threadStop ){
-  //    int ret;
-  //    //select can modify timeout to be the time not slept
-  //    struct timeval timeout;
-  //    timeout.tv_sec = 5;
-  //    timeout.tv_usec = 0; // 1 s
-  //    ret = select(sock+1, &fds, NULL, NULL, &timeout);
-  //    if (ret == -1 && errno == EINTR){
-  //      continue;
-  //    }
-  //    if (ret < 0){
-  //      HAPLogError(&logObject, "Select failed in srtp_audio_feedback thread");
-  //      return NULL;
-  //    }
-  //    if (ret  > 0){
-
-  // work around with a nonblocking socket
-  //  ret = setnonblock(sock);
-  //  if (ret < 0) {
-  //    HAPLogError(&logObject, "srtp_audio_feedback setnonblock(%d) failed", chnNum);
-  //  }
+// Decodes one Opus packet and hands whole speaker frames to the speaker thread.  With concealSamples
+// set it makes up that many samples of a lost packet instead, from the FEC in payload, the packet
+// after the lost one, or with plain PLC when payload is NULL.  Unless play is set the samples are
+// only decoded to keep the decoder in step.
+static void srtp_audio_decode_opus(const uint8_t *payload, size_t numPayloadBytes, int concealSamples, bool play)
+{
+  int maxSamples = concealSamples ? concealSamples : (int)(HAPArrayCount(opusPcm) - opusPcmSamples);
+  int numSamples = opus_decode(opusDec, payload, numPayloadBytes, &opusPcm[opusPcmSamples], maxSamples,
+                               concealSamples && payload != NULL);
+  if (numSamples < 0)
+  {
+    HAPLogError(&logObject, "opus_decode err: %s", opus_strerror(numSamples));
+    return;
+  }
+  if (play)
+    opusPcmSamples += numSamples;
 
-  while (!myContext->session.audioFeedbackThread.threadStop)
+  size_t played = 0;
+  while (opusPcmSamples - played >= SPK_PLAY_SAMPLES)
   {
+    INT_PCM *timeData = ring_buffer_ao_write_slot(&ring_buffer_ao);
+    if (timeData == NULL)
+      HAPLogError(&logObject, "speaker ring full, dropping frame (%u overruns)", ring_buffer_ao.overruns);
+    else
+    {
+      HAPRawBufferCopyBytes(timeData, &opusPcm[played], SPK_PLAY_SAMPLES * sizeof(INT_PCM));
+      ring_buffer_ao_commit_write(&ring_buffer_ao);
+    }
+    played += SPK_PLAY_SAMPLES;
+  }
+  memmove(opusPcm, &opusPcm[played], (opusPcmSamples - played) * sizeof(INT_PCM));
+  opusPcmSamples -= played;
+}
 
-    //if (FD_ISSET(sock, &fds))
-    //{
+// Decodes every access unit of one RFC 3640 packet, controllers asking for 60 ms send two per packet.
+// Unless play is set the frames are only decoded to keep the decoder in step.
+static void srtp_audio_decode_aac(uint8_t *payload, size_t numPayloadBytes, bool play)
+{
+  AACENC_ERROR aacErr = AACENC_OK;
 
-      size_t numReceivedBytes;
-      do
-      {
-        numReceivedBytes = recv(sock, packet, sizeof(packet), 0);
-      } while ((numReceivedBytes == -1) && (errno = EINTR));
-      time = ActualTime();
+  //hexDump("rfc3640 header", payload, 16,16);
 
-      if (numReceivedBytes > 0)
-      {
-        HAPLogDebug(&logObject, "srtp_audio_feedback thread got a packet.  Len: %d", numReceivedBytes);
-        //hexDump("srtcpPacket", &packet, numReceivedBytes, 16);
-        numPacketBytes = 0;
-        POSRTPStreamPushPacket(
-            &myContext->session.rtpAudioStream,
-            packet,
-            numReceivedBytes,
-            &numPacketBytes,
-            time);
-        if (numPacketBytes)
-        {
-          uint8_t newPacket[4096];
-          size_t numPayloadBytes = 0;
-          HAPTimeNS sampleTime;
-          POSRTPStreamPollPayload(
-              &myContext->session.rtpAudioStream,
-              newPacket,
-              sizeof(newPacket),
-              &numPayloadBytes,
-              &sampleTime);
-          //hexDump("decrypted srtpPacket", &newPacket, numPayloadBytes, 16);
-          // PushSpeakerData , newPacket, numPayloadBytes, sampleTime
-
-          if(numPayloadBytes){
-            uint8_t *pNewPacket4 = &(newPacket[4]);
-
-            //hexDump("rfc3640 header", &newPacket, 16,16);
-
-            size_t decoderNumPayloadBytes = numPayloadBytes - 4;
-
-            uint16_t headerSize = __bswap_16 ( * (uint16_t * )(&(newPacket[2])) ) >> 3; // not sure why this needs swapped
-
-            //printf("Header Size: %d, Packet Size: %d\n", headerSize, decoderNumPayloadBytes);
-
-            size_t bytesNotUsed = decoderNumPayloadBytes;
-            aacErr = aacDecoder_Fill(hAacDec, &pNewPacket4, &decoderNumPayloadBytes, &bytesNotUsed);
-            if (aacErr != AACENC_OK)
-            {
-              HAPLogError(&logObject, "aacDecoder_Fill err");
-            }
-            if (bytesNotUsed)
-              HAPLogError(&logObject, "the decoder didn't use bytes from the controller: %d", bytesNotUsed);
-
-            INT_PCM timeData[1024];
-            aacErr = aacDecoder_DecodeFrame(hAacDec, (INT_PCM *) &timeData, 1024, 0);
-            if (aacErr != AACENC_OK)
-            {
-              HAPLogError(&logObject, "aacDecoder_DecodeFrame err: %d", aacErr);
-              //hexDump("BAD aacFrame",  pNewPacket4, decoderNumPayloadBytes, 16 );
-            }
-            else{
-              //hexDump("GOOD aacFrame",  pNewPacket4, decoderNumPayloadBytes, 16 );
-            }
-            // trying to catch some of the errors where the decoder bails on claimed ancillary data
-            #if 1 //is this doing anything?
-
-            uint8_t * ancPtr = NULL;
-            int ancSize = 0;
-            aacErr = aacDecoder_AncDataGet(hAacDec, 0, &ancPtr, &ancSize);
-            if (aacErr != AACENC_OK)
-            {
-              HAPLogError(&logObject, "aacDecoder_DecodeFrame err: %d", aacErr);
-            }
-
-            if(ancSize != 0){
-              HAPLogInfo(&logObject, "aacDecoder_AncDataGet got some data", aacErr);
-              //hexDump("ancData", ancPtr, ancSize, 16);
-            }
-
-            #endif
-
-            //send data to the ring buffer...
-
-            //Lock the queue mutex to make sure that adding data to the queue happens correctly
-            pthread_mutex_lock(&spkQueueMutex);
-
-            //Push new data to the queue
-            memcpy(&ring_buffer_storage[ring_buffer_ao.head_index*1024], &timeData, 1024);
-            ptr_ring_buffer_ao_queue(&ring_buffer_ao, &ring_buffer_storage[ring_buffer_ao.head_index*1024]);
-
-            //Signal the condition variable that new data is available in the queue
-            pthread_cond_signal(&spkQueueCond);
-
-            //Done, unlock the mutex
-            pthread_mutex_unlock(&spkQueueMutex);
-          }
-        }
-      }
-   //}
-    //    }
+  if (numPayloadBytes < 2)
+    return;
+  size_t headerBits = __bswap_16(*(uint16_t *)(&payload[0])); // au headers length, in bits
+  size_t numAUs = headerBits / 16;                             // 13 bit size + 3 bit index each
+  size_t auOffset = 2 + (headerBits + 7) / 8;
+  if (numAUs == 0 || auOffset > numPayloadBytes)
+  {
+    HAPLogError(&logObject, "bad rfc3640 header, %zu header bits in %zu bytes", headerBits, numPayloadBytes);
+    return;
+  }
 
-    time = ActualTime();
-    uint32_t bitRate = 0;
-    bool newKeyFrame = 0;
-    uint32_t dropoutTime;
+  for (size_t i = 0; i < numAUs; i++)
+  {
+    size_t auSize = __bswap_16(*(uint16_t *)(&payload[2 + i * 2])) >> 3;
+    if (auOffset + auSize > numPayloadBytes)
+    {
+      HAPLogError(&logObject, "access unit %zu of %zu overruns the packet", i, numAUs);
+      return;
+    }
 
-    //printf("Calling POSRTPStreamCheckFeedback in the audio feedback thread\n");
-    numPacketBytes = 0;
-    POSRTPStreamCheckFeedback(
-        &myContext->session.rtpAudioStream,
-        time,
-        packet,
-        sizeof(packet),
-        &numPacketBytes,
-        &bitRate,
-        &newKeyFrame,
-        &dropoutTime);
-    // Send RTCP feedback, if any
-    if (numPacketBytes)
+    uint8_t *auData = &payload[auOffset];
+    UINT decoderNumPayloadBytes = auSize;
+    UINT bytesNotUsed = decoderNumPayloadBytes;
+    aacErr = aacDecoder_Fill(hAacDec, &auData, &decoderNumPayloadBytes, &bytesNotUsed);
+    if (aacErr != AACENC_OK)
     {
-      //printf("Sending audio RTCP feedback %d bytes\n", numPacketBytes);
-      //hexDump("audio feedback srtp packet", packet, numPacketBytes, 16);
-      ret = send(sock, packet, numPacketBytes, 0);
-      ;
-      if (ret != numPacketBytes)
-      {
-        HAPLogError(&logObject, "Tried to send %d bytes, but send only sent %d", numPacketBytes, ret);
-        // printf("send error (%d): %s\n", errno, strerror(errno));
-      }
+      HAPLogError(&logObject, "aacDecoder_Fill err");
+    }
+    if (bytesNotUsed)
+      HAPLogError(&logObject, "the decoder didn't use bytes from the controller: %d", bytesNotUsed);
+    auOffset += auSize;
+
+    // decode straight into the speaker ring, if the speaker has fallen behind drop this frame
+    INT_PCM *timeData = play ? ring_buffer_ao_write_slot(&ring_buffer_ao) : NULL;
+    INT_PCM overrunData[SPK_FRAME_SAMPLES];
+    if (timeData == NULL)
+    {
+      if (play)
+        HAPLogError(&logObject, "speaker ring full, dropping frame (%u overruns)", ring_buffer_ao.overruns);
+      timeData = overrunData; // still decode to keep the decoder state in sync
     }
+    aacErr = aacDecoder_DecodeFrame(hAacDec, timeData, SPK_FRAME_SAMPLES, 0);
+    if (aacErr != AACENC_OK)
+    {
+      HAPLogError(&logObject, "aacDecoder_DecodeFrame err: %d", aacErr);
+      //hexDump("BAD aacFrame",  auData, auSize, 16 );
+    }
+    // trying to catch some of the errors where the decoder bails on claimed ancillary data
+    #if 1 //is this doing anything?
+
+    uint8_t * ancPtr = NULL;
+    int ancSize = 0;
+    AACENC_ERROR ancErr = aacDecoder_AncDataGet(hAacDec, 0, &ancPtr, &ancSize);
+    if (ancErr != AACENC_OK)
+    {
+      HAPLogError(&logObject, "aacDecoder_AncDataGet err: %d", ancErr);
+    }
+
+    if(ancSize != 0){
+      HAPLogInfo(&logObject, "aacDecoder_AncDataGet got some data");
+      //hexDump("ancData", ancPtr, ancSize, 16);
+    }
+
+    #endif
+
+    //hand the frame to the speaker thread, this wakes it if the ring was empty
+    if (aacErr == AACENC_OK && timeData != overrunData)
+      ring_buffer_ao_commit_write(&ring_buffer_ao);
   }
+}
 
-  // dealocate aac decoder and transport layer structures
-  aacDecoder_Close(hAacDec);
+// Lets the AAC-ELD decoder make up numFrames lost frames from its own history
+static void srtp_audio_conceal_aac(uint32_t numFrames)
+{
+  for (uint32_t i = 0; i < numFrames; i++)
+  {
+    INT_PCM *timeData = ring_buffer_ao_write_slot(&ring_buffer_ao);
+    if (timeData == NULL)
+    {
+      HAPLogError(&logObject, "speaker ring full, dropping frame (%u overruns)", ring_buffer_ao.overruns);
+      return;
+    }
+    AACENC_ERROR aacErr = aacDecoder_DecodeFrame(hAacDec, timeData, SPK_FRAME_SAMPLES, AACDEC_CONCEAL);
+    if (aacErr != AACENC_OK)
+    {
+      HAPLogError(&logObject, "aacDecoder_DecodeFrame conceal err: %d", aacErr);
+      return;
+    }
+    ring_buffer_ao_commit_write(&ring_buffer_ao);
+  }
+}
 
-  HAPLogError(&logObject, "Exiting audio rtcp feedback thread.");
-  //return NULL;
+// Moves return audio from the jitter buffer to the speaker ring, runs after every receive batch and tick
+static void srtp_audio_playout(void)
+{
+  POSAudioJitterBuffer *jb = &returnAudioJitterBuffer;
+  if (hAacDec == NULL && opusDec == NULL)
+    return;
+
+  for (;;)
+  {
+    uint32_t bufferedMs = (ring_buffer_ao_num_items(&ring_buffer_ao) * SPK_PLAY_SAMPLES + opusPcmSamples) * 1000 /
+                          SPK_SAMPLE_RATE;
+    const uint8_t *bytes = NULL;
+    size_t numBytes = 0;
+    POSAudioJitterBufferAction action = POSAudioJitterBufferPop(jb, bufferedMs, ActualTime(), &bytes, &numBytes);
+    if (action == kPOSAudioJitterBuffer_Wait)
+      return;
+
+    __atomic_store_n(&spkPlayout.lastWriteUs, (uint32_t)(ActualTime() / 1000), __ATOMIC_RELAXED);
+    __atomic_store_n(&spkPlayout.writePeriodUs, jb->packetMs * 1000, __ATOMIC_RELAXED);
+    __atomic_store_n(&spkPlayout.targetUs, POSAudioJitterBufferTargetDelayMs(jb) * 1000, __ATOMIC_RELAXED);
+
+    bool play = action == kPOSAudioJitterBuffer_Play;
+    if (action == kPOSAudioJitterBuffer_Play || action == kPOSAudioJitterBuffer_Drop)
+    {
+      if (opusDec != NULL)
+        srtp_audio_decode_opus(bytes, numBytes, 0, play);
+      else
+        srtp_audio_decode_aac((uint8_t *)bytes, numBytes, play);
+      continue;
+    }
+
+    // a lost packet, or the delay is being stretched; bytes is only set for a lost one
+    if (opusDec != NULL)
+      srtp_audio_decode_opus(bytes, numBytes, jb->packetMs * SPK_SAMPLE_RATE / 1000, true);
+    else
+      srtp_audio_conceal_aac((jb->packetMs * SPK_SAMPLE_RATE / 1000 + SPK_PLAY_SAMPLES / 2) / SPK_PLAY_SAMPLES);
+  }
+}
+
+// todo, move this function to a file dedicated to the audio stream
+// Runs on the media reactor thread for every packet the controller sends on the audio socket
+static void srtp_audio_feedback_packet(void *context, uint8_t *packet, size_t numReceivedBytes)
+{
+  AccessoryContext *myContext = context;
+  size_t numPacketBytes = 0;
+
+  if (myContext->session.audioFeedbackThread.threadStop)
+    return;
+
+  //HAPLogDebug(&logObject, "srtp_audio_feedback got a packet.  Len: %d", numReceivedBytes);
+  //hexDump("srtcpPacket", &packet, numReceivedBytes, 16);
+  POSRTPStreamPushPacket(
+      &myContext->session.rtpAudioStream,
+      packet,
+      numReceivedBytes,
+      &numPacketBytes,
+      ActualTime());
+  if (numPacketBytes == 0 || (hAacDec == NULL && opusDec == NULL))
+    return;
+
+  uint8_t newPacket[4096];
+  size_t numPayloadBytes = 0;
+  HAPTimeNS sampleTime;
+  POSRTPStreamPollPayload(
+      &myContext->session.rtpAudioStream,
+      newPacket,
+      sizeof(newPacket),
+      &numPayloadBytes,
+      &sampleTime);
+  //hexDump("decrypted srtpPacket", &newPacket, numPayloadBytes, 16);
+
+  // srtp_audio_feedback_tick plays it out once it is due, in sequence order
+  if (numPayloadBytes)
+  {
+    POSAudioJitterBufferInsert(
+        &returnAudioJitterBuffer,
+        myContext->session.rtpAudioStream.lastRecSqNrAndROC,
+        myContext->session.rtpAudioStream.lastRecTimeStamp,
+        newPacket,
+        numPayloadBytes,
+        ActualTime());
+  }
+  // the packets drive playout while they arrive, the reactor tick once they stop
+  srtp_audio_playout();
+}
+
+// Runs on the media reactor thread on every reactor tick
+static void srtp_audio_feedback_tick(void *context)
+{
+  AccessoryContext *myContext = context;
+
+  if (myContext->session.audioFeedbackThread.threadStop)
+    return;
+
+  srtp_audio_playout();
+
+  int sock = myContext->session.audioFeedbackThread.socket;
+  uint8_t packet[4096];
+  size_t numPacketBytes = 0;
+  uint32_t bitRate = 0;
+  bool newKeyFrame = 0;
+  uint32_t dropoutTime;
+  int ret;
+
+  POSRTPStreamCheckFeedback(
+      &myContext->session.rtpAudioStream,
+      ActualTime(),
+      packet,
+      sizeof(packet),
+      &numPacketBytes,
+      &bitRate,
+      &newKeyFrame,
+      &dropoutTime);
+  // Send RTCP feedback, if any
+  if (numPacketBytes)
+  {
+    //hexDump("audio feedback srtp packet", packet, numPacketBytes, 16);
+    ret = send(sock, packet, numPacketBytes, 0);
+    if (ret != numPacketBytes)
+    {
+      HAPLogError(&logObject, "Tried to send %d bytes, but send only sent %d", numPacketBytes, ret);
+    }
+  }
 }
 
 pthread_t speaker_pthread = (pthread_t) NULL;
@@ -746,7 +1010,7 @@ static void *speaker_thread(void *context)
   attr.bitwidth = AUDIO_BIT_WIDTH_16;
   attr.soundmode = AUDIO_SOUND_MODE_MONO;
   attr.frmNum = 30;
-  attr.numPerFrm = 480;
+  attr.numPerFrm = SPK_PLAY_SAMPLES;
   attr.chnCnt = 1;
   ret = IMP_AO_SetPubAttr(devID, &attr);
   if (ret != 0)
@@ -821,43 +1085,57 @@ static void *speaker_thread(void *context)
   HAPLogDebug(&logObject, "Audio Out GetGain    gain : %d", aogain);
   
 
+  POSAudioASRCInit(&speakerASRC);
+  INT_PCM playData[SPK_PLAY_SAMPLES];
+
   while (!myContext->session.audioFeedbackThread.threadStop)
   {
-    //get data from the ring buffer...
-
-    //Start by locking the queue mutex
-    pthread_mutex_lock(&spkQueueMutex);
-
-    //As long as the queue is empty,
-    while(ptr_ring_buffer_ao_is_empty(&ring_buffer_ao)) {
-        // - wait for the condition variable to be signalled
-        //Note: This call unlocks the mutex when called and
-        //relocks it before returning!
-        pthread_cond_wait(&spkQueueCond, &spkQueueMutex);
+    //get data from the ring buffer, waking up now and then to check threadStop
+    bool timedOut = false;
+    while (!POSAudioASRCCanRead(&speakerASRC, SPK_PLAY_SAMPLES))
+    {
+      const INT_PCM *timeData = ring_buffer_ao_read_slot(&ring_buffer_ao, 500);
+      if (timeData == NULL)
+      {
+        timedOut = true;
+        break;
+      }
+      POSAudioASRCWrite(&speakerASRC, timeData, SPK_PLAY_SAMPLES);
+      ring_buffer_ao_commit_read(&ring_buffer_ao);
+    }
+    if (timedOut)
+    {
+      // the controller stopped talking, don't hold its last few ms for the next time
+      POSAudioASRCFlush(&speakerASRC);
+      continue;
     }
 
-    //As we returned from the call, there must be new data in the queue - get it,
-
-    uint8_t timeData[960];
-    uint8_t * ptr_new_data;
-    ptr_ring_buffer_ao_dequeue(&ring_buffer_ao, (void **)&ptr_new_data);
-    memcpy(&timeData, ptr_new_data, 960); // this will be a pointer in ring_buffer_storage
-    
-    //Now unlock the mutex
-    pthread_mutex_unlock(&spkQueueMutex);
+    // The ring only changes a packet at a time, so right after a write it is a packet fuller than on
+    // average and right before the next one it is emptier.  Time since the last write evens that out.
+    uint32_t periodUs = __atomic_load_n(&spkPlayout.writePeriodUs, __ATOMIC_RELAXED);
+    uint32_t sinceWriteUs = (uint32_t)(ActualTime() / 1000) - __atomic_load_n(&spkPlayout.lastWriteUs, __ATOMIC_RELAXED);
+    if (sinceWriteUs > periodUs)
+      sinceWriteUs = periodUs;
+    int64_t occupancyUs = ring_buffer_ao_num_items(&ring_buffer_ao) * SPK_PLAY_SAMPLES * 1000 / SPK_SAMPLE_RATE * 1000 +
+                          POSAudioASRCQueuedUs(&speakerASRC, SPK_SAMPLE_RATE) + (int64_t)sinceWriteUs - periodUs / 2;
+    // a frame over the target, so the jitter buffer doesn't see the ring under it and stretch
+    uint32_t targetUs = __atomic_load_n(&spkPlayout.targetUs, __ATOMIC_RELAXED) +
+                        SPK_PLAY_SAMPLES * 1000 / SPK_SAMPLE_RATE * 1000;
+    POSAudioASRCSteer(&speakerASRC, occupancyUs > 0 ? occupancyUs : 0, targetUs);
+    POSAudioASRCRead(&speakerASRC, playData, SPK_PLAY_SAMPLES);
 
     /* Step 5: send frame data. */
     IMPAudioFrame frm;
-    frm.virAddr = (uint32_t *)timeData;
-    frm.len = 480*2;  //bytes?
+    frm.virAddr = (uint32_t *)playData;
+    frm.len = SPK_PLAY_SAMPLES * 2;  //bytes?
     ret = IMP_AO_SendFrame(devID, chnID, &frm, BLOCK);
     if (ret != 0)
     {
       HAPLogError(&logObject, "send Frame Data error");
       // return NULL;
     }
-
   }
+  HAPLogInfo(&logObject, "speaker clock correction %d ppm", speakerASRC.ppm);
   ret = IMP_AO_FlushChnBuf(devID, chnID);
   if (ret != 0)
   {
@@ -879,12 +1157,51 @@ static void *speaker_thread(void *context)
     HAPLogError(&logObject, "Audio device disable error");
     //return NULL;
   }
-
+  return ((void *)0);
 }
 
 
-#define POS_AUDIO_OUTPUT_SAMPLE_RATE 16000
-#define AAC_ENC_OUTPUT_MAX_SIZE 8192
+#define AUDIO_ENC_OUTPUT_MAX_SIZE 8192
+// During silence a RFC 3389 comfort noise packet goes out at least this often, or when the level moves
+#define AUDIO_CN_REFRESH_NS 1000000000ULL
+#define AUDIO_CN_LEVEL_CHANGE_DB 3
+
+// Packetizes one audio payload and sends it, payloadType and markerBit go into the RTP header
+static void send_audio_payload(AccessoryContext *myContext, int sock, uint8_t *bytes, size_t numBytes,
+                               uint8_t payloadType, bool markerBit, HAPTimeNS sampleTime)
+{
+  size_t numPayloadBytes = 0;
+  POSRTPStreamPushPayloadAs(
+      &myContext->session.rtpAudioStream,
+      bytes,
+      numBytes,
+      &numPayloadBytes,
+      payloadType,
+      markerBit,
+      sampleTime,
+      ActualTime());
+
+  while (numPayloadBytes > 0)
+  {
+    uint8_t packet_data[4096];
+    size_t packet_len = 0;
+    POSRTPStreamPollPacket(
+        &myContext->session.rtpAudioStream,
+        packet_data,
+        sizeof(packet_data),
+        &packet_len);
+    if (packet_len == 0)
+      break;
+    // printf("sending %d audio bytes, index %d, fd %d\n", packet_len,*(uint16_t *)(&packet_data[2]), sock);
+    //hexDump("send audio packet", packet_data, packet_len,16);
+    int ret = send(sock, packet_data, packet_len, 0);
+    if (ret != packet_len)
+    {
+      HAPLogError(&logObject, "Tried to send %d audio bytes, but send only sent %d", packet_len, ret);
+      // printf("send error (%d): %s\n", errno, strerror(errno));
+    }
+  }
+}
 
 // todo, move this function to a file dedicated to the audio stream
 static void *get_srtp_audio_stream(void *context)
@@ -900,96 +1217,22 @@ static void *get_srtp_audio_stream(void *context)
 
   // setup the ingenic audio stream;
 
-  // setup the aac codec
-  HAPAssert(myContext->session.audioParameters.codecConfig.audioCodecType == 2);
-
-  // not using comfort noise
-  // HAPAssert( myContext->session.audioParameters.comfortNoise == 0 );
-  // myContext->session.audioParameters.rtpParameters.comfortNoisePayload;
-
-  HANDLE_AACENCODER aacEncHandle = NULL;
-  AACENC_ERROR aacErr = AACENC_OK;
-  aacErr = aacEncOpen(&aacEncHandle, 0, 1);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncOpen err");
-  }
-  // Audio Object Type 39 = AAC-ELD
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_AOT, AOT_ER_AAC_ELD);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_AOT err");
-  }
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_SAMPLERATE, POS_AUDIO_OUTPUT_SAMPLE_RATE);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_SAMPLERATE err");
-  }
-  // only one center channel
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_CHANNELMODE, MODE_1);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_CHANNELMODE err");
-  }
-  // center channel is the first channel
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_CHANNELORDER, 1);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_CHANNELORDER err");
-  }
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_BITRATEMODE, 4); // variable high bit rate per RFC3640
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_BITRATEMODE err");
-  }
-
-  // pretty sure this is being ignored according to the aac docs because of variable bitrate above
-  int audioEncoderBitrate = myContext->session.audioParameters.codecConfig.audioCodecParams.bitRate << 10;
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_BITRATE, audioEncoderBitrate);
-  //  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_BITRATE, 128000);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_BITRATE err");
-  }
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_GRANULE_LENGTH, 480); 
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_GRANULE_LENGTH err");
-  }
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_TRANSMUX, TT_MP4_RAW); // TT_MP4_LOAS);//TT_MP4_LATM_MCP1);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_TRANSMUX err");
-  }
-  // signaling mode, no idea.  guess.
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_SIGNALING_MODE, 2); //Explicit hierarchical signaling
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_SIGNALING_MODE err");
-  }
-  // aafterburner mode.  doc says this takes more cpu and ram for better audio.
-  aacErr = aacEncoder_SetParam(aacEncHandle, AACENC_AFTERBURNER, 0);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncoder_SetParam AACENC_AFTERBURNER err");
-  }
-  // finalize settings
+  // silence suppression needs the controller to have picked comfort noise, else it takes the gaps as loss
+  bool comfortNoise = myContext->session.audioParameters.comfortNoise == 1;
+  uint8_t comfortNoisePayloadType = myContext->session.audioParameters.rtpParameters.comfortNoisePayload;
 
-  aacErr = aacEncEncode(aacEncHandle, NULL, NULL, NULL, NULL);
-  if (aacErr != AACENC_OK)
-  {
-    HAPLogError(&logObject, "aacEncEncode finalize settings err");
-  }
-
-//#define AI_BASIC_TEST_RECORD_FILE "ai_record.pcm"
-
-  AACENC_InfoStruct encInfo;
-  aacErr = aacEncInfo(aacEncHandle, &encInfo);
-  if (aacErr != AACENC_OK)
+  // setup the encoder picked in HandleSelectedRTPConfigWrite
+  audioCodecConfigStruct *codecConfig = &myContext->session.audioParameters.codecConfig;
+  POSAudioEncoder audioEncoder;
+  ret = POSAudioEncoderOpen(&audioEncoder, codecConfig->audioCodecType, audio_sample_rate(codecConfig),
+                            codecConfig->audioCodecParams.rtpTime,
+                            myContext->session.audioParameters.rtpParameters.rtpParameters.maximumBitrate * 1000,
+                            codecConfig->audioCodecParams.bitRate == 0);
+  if (ret != kHAPError_None)
   {
-    HAPLogError(&logObject, "aacEncInfo err");
+    HAPLogError(&logObject, "audio encoder open err");
+    return NULL;
   }
-  //hexDump("encInfo.confBuf", &encInfo.confBuf, 64, 16);
 
   int devID = 1;
   int chnID = 0;
@@ -1047,8 +1290,8 @@ static void *get_srtp_audio_stream(void *context)
   // Audio seems to work, so just ignore the error!
   // HAPAssert(myContext->session.audioParameters.codecConfig.audioCodecParams.rtpTime == 30);
 
-  // 16000 samples/sec * 0.030 seconds = 480 samples per frame
-  attr.numPerFrm = 480; /**<Number of sampling points per frame */
+  // one encoder frame per AI frame, 480 samples for AAC-ELD, 20-60 ms for Opus
+  attr.numPerFrm = audioEncoder.frameSamples; /**<Number of sampling points per frame */
 
   attr.chnCnt = 1; /**< Number of supported channels */
   ret = IMP_AI_SetPubAttr(devID, &attr);
@@ -1142,6 +1385,16 @@ static void *get_srtp_audio_stream(void *context)
   HAPLogDebug(&logObject, "Audio In GetPubAttr  numPerFrm : %d", attr.numPerFrm);
   HAPLogDebug(&logObject, "Audio In GetPubAttr     chnCnt : %d", attr.chnCnt);
 
+  POSAudioVAD vad;
+  POSAudioVADInit(&vad, audioEncoder.frameSamples * 1000 / audioEncoder.sampleRate);
+  bool silent = false;
+  bool talkspurt = true; // the next payload sent is the first after a silence, RFC 3551 s4.1 marks it
+  HAPTime lastComfortNoise = 0;
+  uint8_t lastComfortNoiseLevel = 0;
+  uint32_t numFrames = 0;
+  uint32_t numSilentFrames = 0;
+  HAPLogInfo(&logObject, "Comfort noise %s, payload type %u", comfortNoise ? "on" : "off", comfortNoisePayloadType);
+
   while (!myContext->session.audioThread.threadStop)
   {
     // HAPLogError(&logObject, "In capture audio loop.");
@@ -1172,81 +1425,41 @@ static void *get_srtp_audio_stream(void *context)
 
     if (frm.len && !myContext->session.audioThread.threadPause)
     {
-      int iidentify = IN_AUDIO_DATA;
-      int oidentify = OUT_BITSTREAM_DATA;
-
-      AACENC_BufDesc ibuf = {0};
-      ibuf.numBufs = 1;
-      ibuf.bufs = (void **)&frm.virAddr;
-      ibuf.bufferIdentifiers = &iidentify;
-      ibuf.bufSizes = &frm.len;
-      uint32_t ibufElSizes = 2; // 16bits
-      ibuf.bufElSizes = &ibufElSizes;
-
-      AACENC_InArgs iargs = {0};
-      iargs.numInSamples = frm.len >> 1;            // 2 bytes per sample
-      uint8_t aacData[AAC_ENC_OUTPUT_MAX_SIZE + 4]; // 4 for the au header
-      uint8_t *pAacData = (&aacData[4]);
-
-      AACENC_BufDesc obuf = {0};
-      obuf.numBufs = 1;
-      obuf.bufs = (void **)&pAacData;
-
-      obuf.bufferIdentifiers = &oidentify;
-      uint32_t outBufSize = AAC_ENC_OUTPUT_MAX_SIZE;
-      obuf.bufSizes = &outBufSize;
-      uint32_t obufElSizes = 1; // not sure about this
-      obuf.bufElSizes = &obufElSizes;
-
-      AACENC_OutArgs oargs = {0};
-      // compress the frame
-      aacErr = aacEncEncode(aacEncHandle, &ibuf, &obuf, &iargs, &oargs);
-      if (aacErr != AACENC_OK)
+      numFrames++;
+      if (comfortNoise && !POSAudioVADProcess(&vad, (const int16_t *)frm.virAddr, frm.len >> 1))
       {
-        HAPLogError(&logObject, "aacEncEncode err: %d", aacErr);
+        // skip the encoder and srtp, only refresh the controller's comfort noise now and then
+        numSilentFrames++;
+        uint8_t level = POSAudioVADNoiseLevel(&vad);
+        HAPTime now = ActualTime();
+        if (!silent || now - lastComfortNoise >= AUDIO_CN_REFRESH_NS ||
+            level >= lastComfortNoiseLevel + AUDIO_CN_LEVEL_CHANGE_DB ||
+            level + AUDIO_CN_LEVEL_CHANGE_DB <= lastComfortNoiseLevel)
+        {
+          // level only, no spectral information.  RFC 3389 s3
+          send_audio_payload(myContext, sock, &level, sizeof level, comfortNoisePayloadType, false,
+                             POSMediaClockFromSensor(&posMediaClock, frm.timeStamp));
+          lastComfortNoise = now;
+          lastComfortNoiseLevel = level;
+        }
+        POSAudioEncoderFlush(&audioEncoder);
+        silent = true;
+        talkspurt = true;
       }
-      // printf("made it back from aacEncEncode!! Bytes out: %d, %d, %d, %d\n", oargs.numOutBytes, oargs.numInSamples, oargs.numAncBytes, oargs.bitResState);
-      if (oargs.numOutBytes > 0)
+      else
       {
-        // build the au header.  RFC3640 s3.2.1 and s3.3.6
-        *(uint8_t *)(&aacData[0]) = 0;  // 16 bits au headers length
-        *(uint8_t *)(&aacData[1]) = 16; // 16 bits au headers length
-        *(uint16_t *)(&aacData[2]) = __bswap_16(oargs.numOutBytes << 3);
-
-        //        hexDump("audio packet pushed",&aacData, oargs.numOutBytes+4, 16);
-
-        size_t numPayloadBytes = 0;
-        // TODO:  Should the sequence number be derived from the encoder instead of the ActualTime?
-        POSRTPStreamPushPayload(
-            &myContext->session.rtpAudioStream,
-            (void *)(&aacData),
-            oargs.numOutBytes + 4, // + 4 for header // TODO, is this +4 correct?
-            &numPayloadBytes,
-            frm.timeStamp * 1000, // us to ns conversion (checked)
-            ActualTime());
-
-        if (numPayloadBytes > 0)
+        silent = false;
+        uint8_t audioData[AUDIO_ENC_OUTPUT_MAX_SIZE];
+        uint64_t audioTimeStamp = 0; // sensor time of the first packed frame
+        size_t numAudioBytes = POSAudioEncoderEncode(&audioEncoder, (const int16_t *)frm.virAddr, frm.len >> 1, // 2 bytes per sample
+                                                     frm.timeStamp, audioData, sizeof(audioData), &audioTimeStamp);
+        if (numAudioBytes > 0)
         {
-          for (;;)
-          {
-            uint8_t packet_data[4096];
-            size_t packet_len = 0;
-            POSRTPStreamPollPacket(
-                &myContext->session.rtpAudioStream,
-                packet_data,
-                sizeof(packet_data),
-                &packet_len);
-            if (packet_len == 0)
-              break;
-            // printf("sending %d audio bytes, index %d, fd %d\n", packet_len,*(uint16_t *)(&packet_data[2]), sock);
-            //hexDump("send audio packet", packet_data, packet_len,16);
-            ret = send(sock, packet_data, packet_len, 0);
-            if (ret != packet_len)
-            {
-              HAPLogError(&logObject, "Tried to send %d audio bytes, but send only sent %d", packet_len, ret);
-              // printf("send error (%d): %s\n", errno, strerror(errno));
-            }
-          }
+          //        hexDump("audio packet pushed",&audioData, numAudioBytes, 16);
+          send_audio_payload(myContext, sock, audioData, numAudioBytes, myContext->session.rtpAudioStream.streamType,
+                             comfortNoise && talkspurt,
+                             POSMediaClockFromSensor(&posMediaClock, audioTimeStamp));
+          talkspurt = false;
         }
       }
     }
@@ -1260,11 +1473,12 @@ static void *get_srtp_audio_stream(void *context)
     }
   }
 
-  aacErr = aacEncClose(&aacEncHandle);
-  if (aacErr != AACENC_OK)
+  if (comfortNoise && numFrames > 0)
   {
-    HAPLogError(&logObject, "aacEncClose err");
+    HAPLogInfo(&logObject, "Suppressed %u of %u audio frames as silence (%u%%)", numSilentFrames, numFrames,
+               numSilentFrames * 100 / numFrames);
   }
+  POSAudioEncoderClose(&audioEncoder);
 
   /* Step 9: disable the audio channel. */
   ret = IMP_AI_DisableChn(devID, chnID);
@@ -1298,6 +1512,7 @@ void StreamContextInitialize(AccessoryContext *context)
 
   myContext->session.videoThread.thread = (pthread_t) NULL;
   myContext->session.videoFeedbackThread.thread = (pthread_t) NULL;
+  POSRTPFanoutInit(&video_fanout, &video_pacer);
   myContext->session.status = kHAPCharacteristicValue_StreamingStatus_Available;
   accessoryConfiguration.state.streaming = kHAPCharacteristicValue_StreamingStatus_Available;
 }
@@ -1356,8 +1571,10 @@ void posStartStream(AccessoryContext *context)
   // 0-3.1, 1-3.2, 2-4 - not sure what to do with this... not passing to encoder
   myContext->session.videoParameters.codecConfig.videoCodecParams.level;
 
-  // 0 - h264, the onlyone supported in the docs, TODO experiment with 1 which might be H265 HEVC
-  myContext->session.videoParameters.codecConfig.videoCodecType;
+  // 0 - h264, the onlyone supported in the docs, 1 - h265 (rfc7798 packetization)
+  RTPType videoRtpType = RTPType_H264;
+  if (myContext->session.videoParameters.codecConfig.videoCodecType == 1)
+    videoRtpType = RTPType_H265;
 
   IMPEncoderChnAttr enc0_channel0_attr;
   // TODO: experiment with different encoder rc modes
@@ -1374,6 +1591,11 @@ void posStartStream(AccessoryContext *context)
     if (myContext->session.videoParameters.codecConfig.videoCodecParams.profileID == kHAPRTPProfileMain)
       encoderProfile = IMP_ENC_PROFILE_AVC_MAIN;
   }
+  // 1 - h265, never offered in the supported video configuration but handled if a controller selects it
+  if (myContext->session.videoParameters.codecConfig.videoCodecType == 1)
+  {
+    encoderProfile = IMP_ENC_PROFILE_HEVC_MAIN;
+  }
 
   ret = IMP_Encoder_UnRegisterChn(0 /* encChn */);
   if (ret < 0)
@@ -1437,9 +1659,12 @@ void posStartStream(AccessoryContext *context)
   
   // Could almost just pass .vRtpParameters into StreamStart
   POSRTPParameters videoRtpParameters;
-  videoRtpParameters.maxBitRate = myContext->session.videoParameters.vRtpParameters.maximumBitrate << 10;
+  videoRtpParameters.maxBitRate = myContext->session.videoParameters.vRtpParameters.maximumBitrate;
+  // both streams' RTCP shares come out of what the controller negotiated for video and audio together
+  videoRtpParameters.sessionBitRate = myContext->session.videoParameters.vRtpParameters.maximumBitrate +
+                                      myContext->session.audioParameters.rtpParameters.rtpParameters.maximumBitrate;
   videoRtpParameters.maximumMTU = myContext->session.videoParameters.vRtpParameters.maxMTU;
-  videoRtpParameters.RTCPInterval = myContext->session.videoParameters.vRtpParameters.minRTCPinterval;
+  videoRtpParameters.RTCPInterval = *(float *)&(myContext->session.videoParameters.vRtpParameters.minRTCPinterval);
   videoRtpParameters.ssrc = myContext->session.videoParameters.vRtpParameters.ssrc;
   videoRtpParameters.type = myContext->session.videoParameters.vRtpParameters.payloadType;
 
@@ -1487,13 +1712,32 @@ void posStartStream(AccessoryContext *context)
 
   POSRTPStreamStart(&myContext->session.rtpVideoStream,
                     &videoRtpParameters,
-                    RTPType_H264,
-                    90000, // rfc6184 90khz clock
+                    videoRtpType,
+                    90000, // rfc6184 / rfc7798 90khz clock
                     myContext->session.ssrcVideo,
                     ActualTime(),
                     (char *) &cnameString,
                     &videoInSrtpParameters,
                     &videoOutSrtpParameters);
+  // answer NACKs from the controller by resending instead of waiting for a PLI and a new IDR
+  POSRTPStreamSetHistory(&myContext->session.rtpVideoStream, &video_packet_history);
+  POSRateControllerInit(&video_rate, POS_VIDEO_MIN_BITRATE,
+                        myContext->session.videoParameters.vRtpParameters.maximumBitrate * 1000,
+                        myContext->session.videoParameters.codecConfig.videoAttributes.frameRate, (uint32_t)(ActualTime() / 1000000));
+  // the parity has its own SSRC, the sender reports list it under the video stream's CNAME
+  POSRTPFecInit(&video_fec, POS_VIDEO_FEC_PAYLOAD_TYPE, myContext->session.ssrcVideo + 1);
+  POSRTPStreamSetFec(&myContext->session.rtpVideoStream, &video_fec, &video_fec_batch, &videoOutSrtpParameters);
+  // the first viewer (re)starts the shared packetizer, later ones join its output
+  if (POSRTPFanoutNumViewers(&video_fanout) == 0)
+  {
+    POSRTPStreamStartPacketizer(&video_packetizer,
+                                &videoRtpParameters,
+                                videoRtpType,
+                                90000,
+                                myContext->session.rtpVideoStream.context_output_srtp.tag_size,
+                                ActualTime());
+  }
+  POSRTPFanoutAddViewer(&video_fanout, &myContext->session.rtpVideoStream, myContext->session.videoThread.socket);
 
   IMP_Encoder_FlushStream(0);
   if (ret < 0)
@@ -1524,13 +1768,15 @@ void posStartStream(AccessoryContext *context)
   myContext->session.videoFeedbackThread.threadPause = 0;
   myContext->session.videoFeedbackThread.threadStop = 0;
 
-
-  //todo: move these pthread handles to global variables...
-  HAPLogInfo(&logObject, "Starting srtp video feedback thread");
-  ret = pthread_create(&myContext->session.videoFeedbackThread.thread, NULL, srtp_video_feedback, (void *)context);
-  if (ret < 0)
+  // rtcp and incoming packets are handled on the shared media reactor thread
+  HAPLogInfo(&logObject, "Adding srtp video feedback to the media reactor");
+  const POSMediaReactorHandler videoFeedbackHandler = {
+      .handlePacket = srtp_video_feedback_packet,
+      .handleTick = srtp_video_feedback_tick,
+      .context = context};
+  if (POSMediaReactorAdd(myContext->session.videoFeedbackThread.socket, &videoFeedbackHandler) < 0)
   {
-    HAPLogError(&logObject, "Create ChnNum%d get_srtp_video_stream failed", (/*chn_num*/ 0));
+    HAPLogError(&logObject, "Adding video socket %d to the media reactor failed", myContext->session.videoFeedbackThread.socket);
   }
 
   POSSRTPParameters audioOutSrtpParameters;
@@ -1566,16 +1812,19 @@ void posStartStream(AccessoryContext *context)
   }
 
   POSRTPParameters audioRtpParameters;
-  audioRtpParameters.maxBitRate = myContext->session.audioParameters.rtpParameters.rtpParameters.maximumBitrate << 10;
+  audioRtpParameters.maxBitRate = myContext->session.audioParameters.rtpParameters.rtpParameters.maximumBitrate;
+  audioRtpParameters.sessionBitRate = myContext->session.videoParameters.vRtpParameters.maximumBitrate +
+                                      myContext->session.audioParameters.rtpParameters.rtpParameters.maximumBitrate;
   audioRtpParameters.maximumMTU = 0; // myContext->session.videoParameters.vRtpParameters.maxMTU; // uhhh, where is the audio mtu supposed to come from?
   audioRtpParameters.RTCPInterval = *(float *)&(myContext->session.audioParameters.rtpParameters.rtpParameters.minRTCPinterval);
   audioRtpParameters.ssrc = myContext->session.audioParameters.rtpParameters.rtpParameters.ssrc;
   audioRtpParameters.type = myContext->session.audioParameters.rtpParameters.rtpParameters.payloadType;
 
+  audioCodecConfigStruct *audioCodecConfig = &myContext->session.audioParameters.codecConfig;
   POSRTPStreamStart(&myContext->session.rtpAudioStream,
                     &audioRtpParameters,
                     RTPType_Simple,
-                    POS_AUDIO_OUTPUT_SAMPLE_RATE,
+                    POSAudioEncoderRTPClockRate(audioCodecConfig->audioCodecType, audio_sample_rate(audioCodecConfig)),
                     myContext->session.ssrcAudio,
                     ActualTime(),
                     (char *) &cnameString,
@@ -1599,17 +1848,21 @@ void posStartStream(AccessoryContext *context)
   myContext->session.audioFeedbackThread.threadStop = 0;
 
   //Init the ring buffer that the audio feedback thread and the speaker thread will use to communicate
-  //Initialize the mutex and the condition variable
-  pthread_mutex_init(&spkQueueMutex, NULL);
-  pthread_cond_init(&spkQueueCond, NULL);
-
-  //Initialize the speaker ring buffer
-  ptr_ring_buffer_ao_init(&ring_buffer_ao,&ring_buffer_index_storage, 128);
-  HAPLogInfo(&logObject, "Starting srtp audio feedback thread");
-  ret = pthread_create(&myContext->session.audioFeedbackThread.thread, NULL, srtp_audio_feedback, (void *)context);
-  if (ret < 0)
+  if (ring_buffer_ao_init(&ring_buffer_ao, ring_buffer_storage, sizeof(ring_buffer_storage[0]), SPK_NUM_FRAMES) != 0)
   {
-    HAPLogError(&logObject, "Create ChnNum%d get_srtp_audio_stream failed", (/*chn_num*/ 0));
+    HAPLogError(&logObject, "Speaker ring buffer eventfd failed: %s", strerror(errno));
+  }
+  srtp_audio_decoder_open(audioCodecConfig->audioCodecType,
+                          POSAudioEncoderRTPClockRate(audioCodecConfig->audioCodecType,
+                                                      audio_sample_rate(audioCodecConfig)));
+  HAPLogInfo(&logObject, "Adding srtp audio feedback to the media reactor");
+  const POSMediaReactorHandler audioFeedbackHandler = {
+      .handlePacket = srtp_audio_feedback_packet,
+      .handleTick = srtp_audio_feedback_tick,
+      .context = context};
+  if (POSMediaReactorAdd(myContext->session.audioFeedbackThread.socket, &audioFeedbackHandler) < 0)
+  {
+    HAPLogError(&logObject, "Adding audio socket %d to the media reactor failed", myContext->session.audioFeedbackThread.socket);
   }
   HAPLogInfo(&logObject, "Starting speaker thread");
   if (speaker_pthread == (pthread_t) NULL){
@@ -1659,56 +1912,38 @@ void posStopStream(AccessoryContext *context HAP_UNUSED)
     }
   }
 
-  ret = IMP_FrameSource_DisableChn(1);
-  if (ret < 0)
-  {
-    HAPLogError(&logObject, "IMP_FrameSource_DisableChn(%d) error: %d", 1, ret);
-    return;
-  }
+  // once these return the reactor won't call into this session again
+  HAPLogInfo(&logObject, "Removing srtp feedback from the media reactor");
   myContext->session.videoFeedbackThread.threadStop = 1;
   myContext->session.audioFeedbackThread.threadStop = 1;
-
-  // WORKAROUND ( SELECT CAUSES RUNAWAY HAP )
-  // HAPLogInfo(&logObject, "Joining srtp feedback thread ");
-  // if ( myContext->session.videoFeedbackThread.thread != NULL){
-  //  ret = pthread_join(myContext->session.videoFeedbackThread.thread, NULL);
-  //  if (ret < 0) {
-  //    HAPLogError(&logObject, "Join ChnNum%d srtp feedback thread failed", (/*chn_num*/ 0 ));
-  //  }
-  //}
-
-  // work around since select isn't working in the feeback thread
-  HAPLogInfo(&logObject, "Killing video srtp feedback thread ");
-  if (myContext->session.videoFeedbackThread.thread != (pthread_t) NULL)
-  {
-    ret = pthread_kill(myContext->session.videoFeedbackThread.thread, 0);
-    if (ret < 0)
-    {
-      HAPLogError(&logObject, "Killing ChnNum%d srtp video feedback thread failed", (/*chn_num*/ 0));
-    }
-  }
+  POSMediaReactorRemove(myContext->session.videoFeedbackThread.socket);
+  POSRTPFanoutRemoveViewer(&video_fanout, &myContext->session.rtpVideoStream);
 #ifndef MUTE_ALL_SOUND
-  // work around since select isn't working in the feeback thread
-  HAPLogInfo(&logObject, "Killing audio srtp feedback thread ");
-  if (myContext->session.audioFeedbackThread.thread != (pthread_t) NULL)
+  POSMediaReactorRemove(myContext->session.audioFeedbackThread.socket);
+  srtp_audio_decoder_close();
+
+  // the speaker thread sees audioFeedbackThread.threadStop within a ring read timeout,
+  // join it so the next posStartStream starts a fresh one
+  HAPLogInfo(&logObject, "Joining speaker thread ");
+  if (speaker_pthread != (pthread_t) NULL)
   {
-    ret = pthread_kill(myContext->session.audioFeedbackThread.thread, 0);
-    if (ret < 0)
+    ret = pthread_join(speaker_pthread, NULL);
+    if (ret != 0)
     {
-      HAPLogError(&logObject, "Killing ChnNum%d srtp audio feedback thread failed", (/*chn_num*/ 0));
+      HAPLogError(&logObject, "Join speaker thread failed");
     }
+    speaker_pthread = (pthread_t) NULL;
   }
+#endif
 
-  HAPLogInfo(&logObject, "Killing speaker thread ");
-  if (speaker_pthread != (pthread_t) NULL)
+  ret = IMP_FrameSource_DisableChn(1);
+  if (ret < 0)
   {
-    ret = pthread_kill(speaker_pthread, 0);
-    if (ret < 0)
-    {
-      HAPLogError(&logObject, "Killing speaker thread failed");
-    }
+    HAPLogError(&logObject, "IMP_FrameSource_DisableChn(%d) error: %d", 1, ret);
+    return;
   }
 
+#ifndef MUTE_ALL_SOUND
   // not closing the socket here so that a new stream start command can reuse the socket
   // write setup endpoint will close the socket
 
@@ -1785,6 +2020,11 @@ void posReconfigureStream(AccessoryContext *context HAP_UNUSED)
     if (myContext->session.videoParameters.codecConfig.videoCodecParams.profileID == kHAPRTPProfileMain)
       encoderProfile = IMP_ENC_PROFILE_AVC_MAIN;
   }
+  // 1 - h265, never offered in the supported video configuration but handled if a controller selects it
+  if (myContext->session.videoParameters.codecConfig.videoCodecType == 1)
+  {
+    encoderProfile = IMP_ENC_PROFILE_HEVC_MAIN;
+  }
 
   IMPEncoderChnAttr enc0_channel0_attr;
 
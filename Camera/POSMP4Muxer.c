@@ -65,6 +65,30 @@
 // Atom with 'FullAtomVersionFlags' field
 #define MP4_FULL_ATOM(x, flag)  MP4_ATOM(x); WR4(flag);
 
+/*
+*   Copy the start of an HEVC SPS without emulation prevention bytes, enough for
+*   sps_max_sub_layers_minus1, sps_temporal_id_nesting_flag and the general
+*   profile_tier_level (ITU-T H.265 7.3.2.2 and 7.3.3)
+*/
+#define HEVC_SPS_PTL_BYTES 15
+static int POSHevcSPSHeader(const POSMp4VideoTrack * vtrack, uint8_t * rbsp)
+{
+    int n = 0;
+    int zeros = 0;
+    for (uint32_t i = 0; i < vtrack->SPSNALUNumBytes && n < HEVC_SPS_PTL_BYTES; i++)
+    {
+        uint8_t b = vtrack->SPSNALU[i];
+        if (zeros >= 2 && b == 3)
+        {
+            zeros = 0;
+            continue;
+        }
+        zeros = (b == 0) ? zeros + 1 : 0;
+        rbsp[n++] = b;
+    }
+    return n == HEVC_SPS_PTL_BYTES;
+}
+
 int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4AudioTrack * atrack){
 
     // atoms nesting stack
@@ -193,11 +217,11 @@ int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                     WR4(0); // modification_time
                     if (track_media_kind == e_audio)
                     {
-                        WR4(32000); // timescale
+                        WR4(POS_MP4_AUDIO_TIMESCALE); // timescale
                     }
                     else
                     {
-                        WR4(1000); // timescale
+                        WR4(POS_MP4_VIDEO_TIMESCALE); // timescale
                     }
                     WR4(0); // duration
                     {
@@ -326,7 +350,7 @@ int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
 
                         if (track_media_kind == e_video)
                         {
-                            MP4_ATOM(BOX_avc1);
+                            MP4_ATOM(vtrack->hevc ? BOX_hvc1 : BOX_avc1);
                             // VisualSampleEntry  8.16.2
                             // extends SampleEntry
                             WR2(0); // reserved
@@ -345,10 +369,20 @@ int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                             WR4(0); // reserved
                             WR2(1); // frame_count
                             WR1(4);
-                            WR1('h');
-                            WR1('2');
-                            WR1('6');
-                            WR1('4'); 
+                            if (vtrack->hevc)
+                            {
+                                WR1('h');
+                                WR1('e');
+                                WR1('v');
+                                WR1('c');
+                            }
+                            else
+                            {
+                                WR1('h');
+                                WR1('2');
+                                WR1('6');
+                                WR1('4');
+                            }
                             for (int i = 0; i < 27; i++)
                             {
                                 WR1(0); //  compressorname
@@ -356,6 +390,45 @@ int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                             WR2(24); // depth
                             WR2(0xffff); // pre_defined
 
+                            if (vtrack->hevc)
+                            {
+                                uint8_t sps[HEVC_SPS_PTL_BYTES] = {0};
+                                POSHevcSPSHeader(vtrack, sps);
+                                // sps[0..1] nal header, sps[2] vps id, max sub layers, temporal id nesting
+                                // sps[3..14] general profile space, tier, profile, compatibility, constraints and level
+                                uint8_t *parameterSets[3] = {vtrack->VPSNALU, vtrack->SPSNALU, vtrack->PPSNALU};
+                                uint32_t parameterSetNumBytes[3] = {vtrack->VPSNALUNumBytes, vtrack->SPSNALUNumBytes, vtrack->PPSNALUNumBytes};
+
+                                MP4_ATOM(BOX_hvcC);
+                                // HEVCDecoderConfigurationRecord 8.3.3.1.2
+                                WR1(1); // configurationVersion
+                                for (int i = 3; i < HEVC_SPS_PTL_BYTES; i++)
+                                {
+                                    WR1(sps[i]); // general_profile_space ... general_level_idc
+                                }
+                                WR2(0xf000); // reserved + min_spatial_segmentation_idc
+                                WR1(0xfc); // reserved + parallelismType unknown
+                                WR1(0xfc | 1); // reserved + chroma_format_idc, the t31 encoder is 4:2:0
+                                WR1(0xf8); // reserved + bit_depth_luma_minus8
+                                WR1(0xf8); // reserved + bit_depth_chroma_minus8
+                                WR2(0); // avgFrameRate unspecified
+                                // constantFrameRate 0, numTemporalLayers, temporalIdNested, lengthSizeMinusOne 3
+                                WR1(((((sps[2] >> 1) & 0x07) + 1) << 3) | ((sps[2] & 0x01) << 2) | 3);
+                                WR1(3); // numOfArrays
+                                for (int j = 0; j < 3; j++)
+                                {
+                                    WR1(0x80 | ((parameterSets[j][0] >> 1) & 0x3f)); // array_completeness + NAL_unit_type
+                                    WR2(1); // numNalus
+                                    WR2(parameterSetNumBytes[j]);
+                                    for (int i = 0; i < (int)parameterSetNumBytes[j]; i++)
+                                    {
+                                        WR1(parameterSets[j][i]);
+                                    }
+                                }
+                                MP4_END_ATOM;
+                            }
+                            else
+                            {
                                 MP4_ATOM(BOX_avcC);
                                 // AVCDecoderConfigurationRecord 5.2.4.1.1
                                 WR1(1); // configurationVersion
@@ -378,6 +451,7 @@ int POSWriteMoov(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                                 }
 
                                 MP4_END_ATOM;
+                            }
                             MP4_END_ATOM;
                         }
                         MP4_END_ATOM;
@@ -494,9 +568,9 @@ int POSWriteMoof(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
             flags |= 0x100;         // sample-duration-present
             flags |= 0x200;         // sample-size-present
 
-            int nalType = *(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_trun_index ].loc) & 0x1f;
+            int keyFrame = ptr_ring_buffer_vi_is_keyframe(vtrack -> ring, vtrack -> ring_trun_index);
 
-            if( nalType == 5) // I-Frame
+            if( keyFrame ) // I-Frame
                 flags |= 0x004;         // set first-sample-flags-present
             else
                 flags &= 0xfffb;        // clear first-sample-flag-present
@@ -508,7 +582,7 @@ int POSWriteMoof(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                 *pvideo_data_offset_stack++ = write_ptr; write_ptr += 4;   // save ptr to data_offset
 
                 //hexDump("stack", pvideo_data_offset_stack_base, 4*24*2*4, 8);
-                if(nalType == 5) {WR4(33554432)}; // ?? 0x02000000 matching supereg
+                if(keyFrame) {WR4(33554432)}; // ?? 0x02000000 matching supereg
                 int trunSampleCount = 0;
                 do{
 
@@ -521,7 +595,7 @@ int POSWriteMoof(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
                     vtrack -> ring_trun_index = (vtrack -> ring_trun_index + 1) & RING_BUFFER_MASK(vtrack -> ring);
                     //printf("I-frame?: %d\n", (*(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_trun_index ].loc) & 0x1f) == 5);
                 }
-                while((*(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_trun_index ].loc) & 0x1f) != 5 && // I-Frame
+                while(!ptr_ring_buffer_vi_is_keyframe(vtrack -> ring, vtrack -> ring_trun_index) && // I-Frame
                     vtrack -> ring_trun_index != (vtrack -> ring ->head_index -1) & RING_BUFFER_MASK(vtrack -> ring)); // ran out of ring buffer.  this should not be possible
 
                     HAPAssert(vtrack -> ring_trun_index != (vtrack -> ring ->head_index -1) & RING_BUFFER_MASK(vtrack -> ring));
@@ -599,7 +673,7 @@ int POSWriteMoof(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
         trunAccumLen += vtrack -> ring -> buffer[ vtrack -> ring_trun_index ].len + 4; //add the avcc header len
         vtrack -> ring_trun_index = (vtrack -> ring_trun_index + 1) & RING_BUFFER_MASK(vtrack -> ring);
     }
-    while((*(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_trun_index ].loc) & 0x1f) != 5 && // I-Frame
+    while(!ptr_ring_buffer_vi_is_keyframe(vtrack -> ring, vtrack -> ring_trun_index) && // I-Frame
         vtrack -> ring_trun_index != (vtrack -> ring ->head_index -1) & RING_BUFFER_MASK(vtrack -> ring)); // ran out of ring buffer.  this should not be possible
 
     if(!atrack->mute){
@@ -636,7 +710,7 @@ int POSWriteMdat(char * buf, size_t maxSize, POSMp4VideoTrack * vtrack, POSMp4Au
     // A: If the vtrack mdat_index is still pointing at the last I-Frame, start a new box
     //printf("Start a new MDAT?: NAL type: %d, mdat_idx: %d, trun_idx: %d\n", (*(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_mdat_index ].loc) & 0x1f), vtrack -> ring_mdat_index, vtrack -> ring_trun_index);
     if( vtrack -> ring_mdat_index != vtrack -> ring_trun_index &&  
-        (*(uint8_t *)(vtrack -> ring -> buffer[ vtrack -> ring_mdat_index ].loc) & 0x1f) == 5){
+        ptr_ring_buffer_vi_is_keyframe(vtrack -> ring, vtrack -> ring_mdat_index)){
         //printf("start a new mdat box\n");
         HAPAssert(maxSize > 8);
         WR4(mdatLen);
@@ -29,6 +29,8 @@
 *       LC  = Low Complexity (AAC profile)
 *       SPS = Sequence Parameter Set (H.264 element)
 *       PPS = Picture Parameter Set (H.264 element)
+*       HEVC = High Efficiency Video Coding (AKA H.265)
+*       VPS = Video Parameter Set (H.265 element)
 *
 *   The MP4 file has several tracks. Each track contains a number of 'samples'
 *   (audio or video frames). Position and size of each sample in the track
@@ -41,6 +43,9 @@
 
 #include "POSRingBufferVideoIn.h"
 
+// Media timescales of the two tracks, sample durations are in these units
+#define POS_MP4_VIDEO_TIMESCALE 1000
+#define POS_MP4_AUDIO_TIMESCALE 32000
 
 typedef struct{
     ring_buffer_vi_t * ring;
@@ -50,6 +55,9 @@ typedef struct{
     uint32_t SPSNALUNumBytes;
     uint8_t PPSNALU[128];
     uint32_t PPSNALUNumBytes;
+    bool hevc; // hvc1 sample entry, the VPS is only used for HEVC
+    uint8_t VPSNALU[128];
+    uint32_t VPSNALUNumBytes;
     uint32_t ring_trun_index;
     uint32_t ring_mdat_index;
 } POSMp4VideoTrack;
@@ -100,7 +108,7 @@ enum
     e_audio,
     e_video,
     e_private
-} track_media_kind;
+};
 
 /************************************************************************/
 /*          Some values of MP4X_track_t::handler_type                   */
@@ -196,6 +204,10 @@ enum
     BOX_m4ds    = FOUR_CHAR_INT( 'm', '4', 'd', 's' ),
     BOX_seib    = FOUR_CHAR_INT( 's', 'e', 'i', 'b' ),
 
+    // ISO/IEC 14496-15 HEVC
+    BOX_hvc1    = FOUR_CHAR_INT( 'h', 'v', 'c', '1' ),
+    BOX_hvcC    = FOUR_CHAR_INT( 'h', 'v', 'c', 'C' ),
+
     //3GPP atoms
     BOX_samr    = FOUR_CHAR_INT( 's', 'a', 'm', 'r' ),//AMRSampleEntryAtomType
     BOX_sawb    = FOUR_CHAR_INT( 's', 'a', 'w', 'b' ),//WB_AMRSampleEntryAtomType
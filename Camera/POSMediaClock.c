@@ -0,0 +1,157 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Monotonic media clock with smoothed mappings to the wall clock and the IMP timestamps
+
+#include <time.h>
+
+#include <imp/imp_system.h>
+
+#include "HAP.h"
+
+#include "POSMediaClock.h"
+
+#define NS_PER_SECOND 1000000000LL
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSMediaClock"};
+
+POSMediaClock posMediaClock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static HAPTime POSMediaClockRead(clockid_t id)
+{
+  struct timespec spec;
+  clock_gettime(id, &spec);
+  return (HAPTime)spec.tv_sec * NS_PER_SECOND + spec.tv_nsec;
+}
+
+// Moves *offset towards sample, returns true if it had to jump
+static bool POSMediaClockTrack(int64_t *offset, bool *valid, int64_t sample)
+{
+  int64_t error = sample - *offset;
+
+  if (!*valid || (error > POS_MEDIA_CLOCK_STEP_NS) || (error < -POS_MEDIA_CLOCK_STEP_NS))
+  {
+    bool stepped = *valid;
+    *offset = sample;
+    *valid = true;
+    return stepped;
+  }
+  *offset = *offset + error / POS_MEDIA_CLOCK_SMOOTHING;
+  return false;
+}
+
+HAPTime POSMediaClockNow(void)
+{
+  return POSMediaClockRead(CLOCK_MONOTONIC);
+}
+
+void POSMediaClockObserve(POSMediaClock *clock, HAPTime monotonic, HAPTime realtime, int64_t sensorUs)
+{
+  HAPPrecondition(clock);
+
+  pthread_mutex_lock(&clock->mutex);
+  if (POSMediaClockTrack(&clock->realtimeOffset, &clock->realtimeValid, (int64_t)(realtime - monotonic)))
+  {
+    clock->realtimeSteps++;
+    HAPLogInfo(&logObject, "wall clock stepped, NTP offset now %lld ms", clock->realtimeOffset / 1000000);
+  }
+  if (sensorUs >= 0)
+  {
+    if (POSMediaClockTrack(&clock->sensorOffset, &clock->sensorValid, (int64_t)monotonic - sensorUs * 1000))
+    {
+      clock->sensorSteps++;
+      HAPLogInfo(&logObject, "IMP timestamp stepped, offset now %lld ms", clock->sensorOffset / 1000000);
+    }
+  }
+  pthread_mutex_unlock(&clock->mutex);
+}
+
+// Reads the three clocks, returns the IMP timestamp and sets *trusted if reading it
+// took short enough to pair it with the other two
+static int64_t POSMediaClockReadAll(HAPTime *monotonic, HAPTime *realtime, bool *trusted)
+{
+  // bracket the IMP read so a sample interrupted by the scheduler can be told apart
+  HAPTime before = POSMediaClockRead(CLOCK_MONOTONIC);
+  int64_t sensorUs = IMP_System_GetTimeStamp();
+  HAPTime after = POSMediaClockRead(CLOCK_MONOTONIC);
+
+  *monotonic = before + (after - before) / 2;
+  *realtime = POSMediaClockRead(CLOCK_REALTIME) - (after - before) / 2;
+  *trusted = after - before <= POS_MEDIA_CLOCK_MAX_SAMPLE_NS;
+  return sensorUs;
+}
+
+void POSMediaClockSample(POSMediaClock *clock)
+{
+  HAPPrecondition(clock);
+
+  HAPTime monotonic;
+  HAPTime realtime;
+  bool trusted;
+  int64_t sensorUs = POSMediaClockReadAll(&monotonic, &realtime, &trusted);
+  POSMediaClockObserve(clock, monotonic, realtime, trusted ? sensorUs : -1);
+}
+
+HAPTime POSMediaClockFromSensor(POSMediaClock *clock, int64_t sensorUs)
+{
+  HAPPrecondition(clock);
+
+  pthread_mutex_lock(&clock->mutex);
+  bool valid = clock->sensorValid;
+  int64_t offset = clock->sensorOffset;
+  pthread_mutex_unlock(&clock->mutex);
+  if (!valid)
+  {
+    // sample once, and if that reading was too slow to keep use it unsmoothed for this frame
+    HAPTime monotonic;
+    HAPTime realtime;
+    bool trusted;
+    int64_t nowUs = POSMediaClockReadAll(&monotonic, &realtime, &trusted);
+    POSMediaClockObserve(clock, monotonic, realtime, trusted ? nowUs : -1);
+    offset = (int64_t)monotonic - nowUs * 1000;
+    pthread_mutex_lock(&clock->mutex);
+    if (clock->sensorValid)
+      offset = clock->sensorOffset;
+    pthread_mutex_unlock(&clock->mutex);
+  }
+  return (HAPTime)(sensorUs * 1000 + offset);
+}
+
+NTPEpochTime POSMediaClockToNTPTime(POSMediaClock *clock, HAPTime monotonic)
+{
+  HAPPrecondition(clock);
+
+  pthread_mutex_lock(&clock->mutex);
+  bool valid = clock->realtimeValid;
+  int64_t offset = clock->realtimeOffset;
+  pthread_mutex_unlock(&clock->mutex);
+  if (!valid)
+  {
+    HAPTime now = POSMediaClockRead(CLOCK_MONOTONIC);
+    HAPTime realtime = POSMediaClockRead(CLOCK_REALTIME);
+    offset = (int64_t)(realtime - now);
+    // the wall clock alone, this needs no IMP timestamp
+    POSMediaClockObserve(clock, now, realtime, -1);
+  }
+  return HAPTimeToNTPTime((HAPTime)((int64_t)monotonic + offset));
+}
+
+uint64_t POSMediaClockToMediaTime(HAPTime monotonic, uint32_t timescale)
+{
+  // whole seconds and the remainder separately, monotonic * timescale overflows after a few days
+  return (monotonic / NS_PER_SECOND) * timescale + (monotonic % NS_PER_SECOND) * timescale / NS_PER_SECOND;
+}
@@ -0,0 +1,108 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSMEDIACLOCK_H
+#define POSMEDIACLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "POSRTPController.h"
+
+// Offset errors larger than this are taken as a step of the other clock instead of drift
+#define POS_MEDIA_CLOCK_STEP_NS 500000000LL
+// Each sample moves the smoothed offsets 1/POS_MEDIA_CLOCK_SMOOTHING of the way
+#define POS_MEDIA_CLOCK_SMOOTHING 16
+// Samples where reading the clocks took longer than this are thrown away
+#define POS_MEDIA_CLOCK_MAX_SAMPLE_NS 1000000
+
+/**
+ * Every media timestamp in the camera is kept in CLOCK_MONOTONIC ns (a HAPTime),
+ * which neither ntpd nor the controller setting the time can step.  The clock
+ * keeps smoothed offsets to the two other clocks media passes through:
+ *
+ * - CLOCK_REALTIME, only needed for the NTP side of sender reports.
+ * - The IMP system timestamp the encoder and audio input stamp frames with, which
+ *   runs off its own timer and drifts against CLOCK_MONOTONIC.
+ *
+ * RTP timestamps and fMP4 decode times are derived from the monotonic time, so a
+ * step of the wall clock only moves the NTP timestamps and never the media.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    bool realtimeValid;
+    bool sensorValid;
+    int64_t realtimeOffset; // CLOCK_REALTIME - CLOCK_MONOTONIC, ns
+    int64_t sensorOffset;   // CLOCK_MONOTONIC - IMP timestamp, ns
+    uint32_t realtimeSteps;
+    uint32_t sensorSteps;
+} POSMediaClock;
+
+// Shared by the streaming and recording threads
+extern POSMediaClock posMediaClock;
+
+/**
+ * Returns CLOCK_MONOTONIC in ns.
+ */
+HAPTime POSMediaClockNow(void);
+
+/**
+ * Feeds one set of readings of the three clocks into the offset estimates.
+ * The first reading, or one off by more than POS_MEDIA_CLOCK_STEP_NS, sets the
+ * offset outright, later ones are smoothed.
+ *
+ * @param monotonic CLOCK_MONOTONIC in ns, taken at the same time as the others.
+ * @param realtime CLOCK_REALTIME in ns.
+ * @param sensorUs IMP system timestamp in us, or -1 if IMP isn't running.
+ */
+void POSMediaClockObserve(POSMediaClock *clock, HAPTime monotonic, HAPTime realtime, int64_t sensorUs);
+
+/**
+ * Reads the system clocks and passes them to POSMediaClockObserve.  Call once a
+ * frame or so from any thread.
+ */
+void POSMediaClockSample(POSMediaClock *clock);
+
+/**
+ * Converts an IMP frame timestamp (us) to CLOCK_MONOTONIC ns.
+ */
+HAPTime POSMediaClockFromSensor(POSMediaClock *clock, int64_t sensorUs);
+
+/**
+ * Converts a CLOCK_MONOTONIC time to the wall clock NTP timestamp sent in
+ * sender reports.
+ */
+NTPEpochTime POSMediaClockToNTPTime(POSMediaClock *clock, HAPTime monotonic);
+
+/**
+ * Converts a CLOCK_MONOTONIC time to ticks of a media clock running at
+ * timescale Hz, e.g. an fMP4 baseMediaDecodeTime.  The ticks of two times are
+ * consistent, so durations taken as differences don't accumulate rounding.
+ */
+uint64_t POSMediaClockToMediaTime(HAPTime monotonic, uint32_t timescale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // recvmmsg
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "HAP.h"
+
+#include "POSMediaReactor.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSMediaReactor"};
+
+// One thread owns every session socket.  It replaces a blocking recv() thread per
+// socket, so RTCP is sent on a timer instead of only when a packet arrives.
+
+typedef struct {
+  int sock; // -1 if the slot is free
+  POSMediaReactorHandler handler;
+} POSMediaReactorSlot;
+
+static pthread_once_t reactorOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t reactorMutex = PTHREAD_MUTEX_INITIALIZER; // held while callbacks run
+static POSMediaReactorSlot reactorSlots[POS_MEDIA_REACTOR_MAX_SOCKETS];
+static int reactorNumSockets = 0;
+static int reactorEpoll = -1;
+static int reactorTimer = -1;
+static pthread_t reactorThread;
+
+// receive buffers, only touched by the reactor thread
+static uint8_t reactorPackets[POS_MEDIA_REACTOR_RECV_BATCH][POS_MEDIA_REACTOR_MAX_PACKET];
+static struct iovec reactorIovecs[POS_MEDIA_REACTOR_RECV_BATCH];
+static struct mmsghdr reactorMsgs[POS_MEDIA_REACTOR_RECV_BATCH];
+
+static POSMediaReactorSlot *POSMediaReactorFindSlot(int sock)
+{
+  for (int i = 0; i < POS_MEDIA_REACTOR_MAX_SOCKETS; i++)
+  {
+    if (reactorSlots[i].sock == sock)
+      return &reactorSlots[i];
+  }
+  return NULL;
+}
+
+static void POSMediaReactorArmTimer(int enable)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (enable)
+  {
+    its.it_interval.tv_sec = POS_MEDIA_REACTOR_TICK_MS / 1000;
+    its.it_interval.tv_nsec = (POS_MEDIA_REACTOR_TICK_MS % 1000) * 1000000;
+    its.it_value = its.it_interval;
+  }
+  if (timerfd_settime(reactorTimer, 0, &its, NULL) < 0)
+    HAPLogError(&logObject, "timerfd_settime failed: %s", strerror(errno));
+}
+
+// Drains a readable socket, returns once recvmmsg would block
+static void POSMediaReactorReceive(POSMediaReactorSlot *slot)
+{
+  for (;;)
+  {
+    for (int i = 0; i < POS_MEDIA_REACTOR_RECV_BATCH; i++)
+    {
+      reactorIovecs[i].iov_base = reactorPackets[i];
+      reactorIovecs[i].iov_len = sizeof(reactorPackets[i]);
+      memset(&reactorMsgs[i].msg_hdr, 0, sizeof(reactorMsgs[i].msg_hdr));
+      reactorMsgs[i].msg_hdr.msg_iov = &reactorIovecs[i];
+      reactorMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(slot->sock, reactorMsgs, POS_MEDIA_REACTOR_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        HAPLogError(&logObject, "recvmmsg(%d) failed: %s", slot->sock, strerror(errno));
+      return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      if (reactorMsgs[i].msg_len > 0)
+        slot->handler.handlePacket(slot->handler.context, reactorPackets[i], reactorMsgs[i].msg_len);
+    }
+    if (n < POS_MEDIA_REACTOR_RECV_BATCH)
+      return;
+  }
+}
+
+static void *POSMediaReactorRun(void *arg)
+{
+  struct epoll_event events[POS_MEDIA_REACTOR_MAX_SOCKETS + 1];
+  (void)arg;
+
+  prctl(PR_SET_NAME, "pos_reactor");
+
+  for (;;)
+  {
+    int n = epoll_wait(reactorEpoll, events, POS_MEDIA_REACTOR_MAX_SOCKETS + 1, -1);
+    if (n < 0)
+    {
+      if (errno != EINTR)
+        HAPLogError(&logObject, "epoll_wait failed: %s", strerror(errno));
+      continue;
+    }
+
+    pthread_mutex_lock(&reactorMutex);
+    for (int i = 0; i < n; i++)
+    {
+      if (events[i].data.fd == reactorTimer)
+      {
+        uint64_t expirations;
+        if (read(reactorTimer, &expirations, sizeof(expirations)) != sizeof(expirations))
+          continue;
+        for (int s = 0; s < POS_MEDIA_REACTOR_MAX_SOCKETS; s++)
+        {
+          if (reactorSlots[s].sock >= 0 && reactorSlots[s].handler.handleTick)
+            reactorSlots[s].handler.handleTick(reactorSlots[s].handler.context);
+        }
+        continue;
+      }
+      // the socket may have been removed after epoll_wait returned
+      POSMediaReactorSlot *slot = POSMediaReactorFindSlot(events[i].data.fd);
+      if (slot != NULL)
+        POSMediaReactorReceive(slot);
+    }
+    pthread_mutex_unlock(&reactorMutex);
+  }
+  return NULL;
+}
+
+static void POSMediaReactorStart(void)
+{
+  for (int i = 0; i < POS_MEDIA_REACTOR_MAX_SOCKETS; i++)
+    reactorSlots[i].sock = -1;
+
+  reactorEpoll = epoll_create1(EPOLL_CLOEXEC);
+  reactorTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (reactorEpoll < 0 || reactorTimer < 0)
+  {
+    HAPLogError(&logObject, "Can't create the reactor epoll/timerfd: %s", strerror(errno));
+    return;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = reactorTimer;
+  if (epoll_ctl(reactorEpoll, EPOLL_CTL_ADD, reactorTimer, &ev) < 0)
+  {
+    HAPLogError(&logObject, "epoll_ctl(timerfd) failed: %s", strerror(errno));
+    return;
+  }
+
+  if (pthread_create(&reactorThread, NULL, POSMediaReactorRun, NULL) != 0)
+  {
+    HAPLogError(&logObject, "Can't start the reactor thread");
+    close(reactorEpoll);
+    reactorEpoll = -1;
+  }
+}
+
+int POSMediaReactorAdd(int sock, const POSMediaReactorHandler *handler)
+{
+  HAPPrecondition(handler);
+  HAPPrecondition(handler->handlePacket);
+
+  pthread_once(&reactorOnce, POSMediaReactorStart);
+  if (reactorEpoll < 0 || sock < 0)
+    return -1;
+
+  pthread_mutex_lock(&reactorMutex);
+  POSMediaReactorSlot *slot = POSMediaReactorFindSlot(sock);
+  int isNew = slot == NULL;
+  if (isNew)
+    slot = POSMediaReactorFindSlot(-1);
+  if (slot == NULL)
+  {
+    pthread_mutex_unlock(&reactorMutex);
+    HAPLogError(&logObject, "No room to watch socket %d", sock);
+    return -1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  // a socket that was closed and reopened under the same number is already gone from epoll
+  int ret = epoll_ctl(reactorEpoll, EPOLL_CTL_ADD, sock, &ev);
+  if (ret < 0 && errno == EEXIST)
+    ret = epoll_ctl(reactorEpoll, EPOLL_CTL_MOD, sock, &ev);
+  if (ret < 0)
+  {
+    pthread_mutex_unlock(&reactorMutex);
+    HAPLogError(&logObject, "epoll_ctl(%d) failed: %s", sock, strerror(errno));
+    return -1;
+  }
+
+  slot->sock = sock;
+  slot->handler = *handler;
+  if (isNew && reactorNumSockets++ == 0)
+    POSMediaReactorArmTimer(1);
+  pthread_mutex_unlock(&reactorMutex);
+  return 0;
+}
+
+void POSMediaReactorRemove(int sock)
+{
+  if (reactorEpoll < 0 || sock < 0)
+    return;
+
+  // waits for any callback in progress to return
+  pthread_mutex_lock(&reactorMutex);
+  POSMediaReactorSlot *slot = POSMediaReactorFindSlot(sock);
+  if (slot != NULL)
+  {
+    epoll_ctl(reactorEpoll, EPOLL_CTL_DEL, sock, NULL);
+    slot->sock = -1;
+    memset(&slot->handler, 0, sizeof(slot->handler));
+    if (--reactorNumSockets == 0)
+      POSMediaReactorArmTimer(0);
+  }
+  pthread_mutex_unlock(&reactorMutex);
+}
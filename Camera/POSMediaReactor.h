@@ -0,0 +1,71 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSMEDIAREACTOR_H
+#define POSMEDIAREACTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sockets the reactor can watch at once, two per streaming session
+#define POS_MEDIA_REACTOR_MAX_SOCKETS 8
+
+// Most datagrams pulled off a socket with one recvmmsg call
+#define POS_MEDIA_REACTOR_RECV_BATCH 16
+
+// Largest datagram delivered to handlePacket, anything longer is truncated
+#define POS_MEDIA_REACTOR_MAX_PACKET 4096
+
+// Period of handleTick while at least one socket is registered
+#define POS_MEDIA_REACTOR_TICK_MS 100
+
+/**
+ * Callbacks for one session socket.  They run on the reactor thread and must not
+ * block or call POSMediaReactorRemove.
+ */
+typedef struct {
+  // Called for every datagram received on the socket.
+  void (*handlePacket)(void *context, uint8_t *packet, size_t numBytes);
+  // Called every POS_MEDIA_REACTOR_TICK_MS and only then, however busy the socket is,
+  // this is where RTCP reports are generated.
+  void (*handleTick)(void *context);
+  void *context;
+} POSMediaReactorHandler;
+
+/**
+ * Starts watching a UDP socket.  The reactor thread is started on first use.
+ * Registering a socket again replaces its handler.
+ *
+ * @return 0 on success, -1 if the socket can't be watched.
+ */
+int POSMediaReactorAdd(int sock, const POSMediaReactorHandler *handler);
+
+/**
+ * Stops watching a socket.  When this returns none of the socket's callbacks are
+ * running or will run again.  The socket itself is left open.
+ */
+void POSMediaReactorRemove(int sock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,251 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compound RTCP parser
+// https://datatracker.ietf.org/doc/html/rfc3550#section-6
+// https://datatracker.ietf.org/doc/html/rfc4585#section-6
+// https://datatracker.ietf.org/doc/html/rfc5104#section-4
+
+#include "POSRTCPParser.h"
+
+// Table entries that apply to every count/format value
+#define POS_RTCP_ANY_FMT 0xff
+
+static uint32_t POSRTCPRead32(const uint8_t *bytes)
+{
+  return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static uint16_t POSRTCPRead16(const uint8_t *bytes)
+{
+  return (uint16_t)(bytes[0] << 8 | bytes[1]);
+}
+
+static void POSRTCPParseReportBlocks(const uint8_t *blocks, size_t numBytes, uint8_t count, uint32_t senderSSRC,
+                                     const POSRTCPHandlers *handlers, void *context)
+{
+  if (!handlers->reportBlock)
+    return;
+  for (uint8_t idx = 0; idx < count && (size_t)(idx + 1) * 24 <= numBytes; idx++)
+  {
+    const uint8_t *block = blocks + idx * 24;
+    POSRTCPReportBlock reportBlock;
+    reportBlock.senderSSRC = senderSSRC;
+    reportBlock.sourceSSRC = POSRTCPRead32(block);
+    reportBlock.fractionLost = block[4];
+    // 24 bit signed
+    reportBlock.cumulativeLost = (int32_t)(POSRTCPRead32(block + 4) << 8) >> 8;
+    reportBlock.extendedHighestSeqNr = POSRTCPRead32(block + 8);
+    reportBlock.jitter = POSRTCPRead32(block + 12);
+    reportBlock.lastSR = POSRTCPRead32(block + 16);
+    reportBlock.delaySinceLastSR = POSRTCPRead32(block + 20);
+    handlers->reportBlock(context, &reportBlock);
+  }
+}
+
+static void POSRTCPParseSR(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                           void *context)
+{
+  POSRTCPSenderInfo senderInfo;
+  senderInfo.senderSSRC = POSRTCPRead32(packet + 4);
+  senderInfo.ntpMSW = POSRTCPRead32(packet + 8);
+  senderInfo.ntpLSW = POSRTCPRead32(packet + 12);
+  senderInfo.rtpTimestamp = POSRTCPRead32(packet + 16);
+  senderInfo.packetCount = POSRTCPRead32(packet + 20);
+  senderInfo.octetCount = POSRTCPRead32(packet + 24);
+  if (handlers->senderReport)
+    handlers->senderReport(context, &senderInfo);
+  POSRTCPParseReportBlocks(packet + 28, numBytes - 28, count, senderInfo.senderSSRC, handlers, context);
+}
+
+static void POSRTCPParseRR(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                           void *context)
+{
+  POSRTCPParseReportBlocks(packet + 8, numBytes - 8, count, POSRTCPRead32(packet + 4), handlers, context);
+}
+
+static void POSRTCPParseSDES(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                             void *context)
+{
+  size_t offset = 4;
+  if (!handlers->sdesItem)
+    return;
+  for (uint8_t chunk = 0; chunk < count && offset + 4 <= numBytes; chunk++)
+  {
+    uint32_t ssrc = POSRTCPRead32(packet + offset);
+    offset += 4;
+    // items until the null item, then padding to the next 32 bit boundary
+    while (offset < numBytes && packet[offset] != 0)
+    {
+      if (offset + 2 > numBytes || offset + 2 + packet[offset + 1] > numBytes)
+        return;
+      handlers->sdesItem(context, ssrc, packet[offset], packet + offset + 2, packet[offset + 1]);
+      offset += 2 + packet[offset + 1];
+    }
+    offset = (offset + 4) & ~(size_t)3;
+  }
+}
+
+static void POSRTCPParseBYE(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                            void *context)
+{
+  if (!handlers->bye)
+    return;
+  for (uint8_t idx = 0; idx < count && 4 + (size_t)(idx + 1) * 4 <= numBytes; idx++)
+    handlers->bye(context, POSRTCPRead32(packet + 4 + idx * 4));
+}
+
+static void POSRTCPParseNACK(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                             void *context)
+{
+  (void)count;
+  if (!handlers->nack)
+    return;
+  for (size_t offset = 12; offset + 4 <= numBytes; offset += 4)
+    handlers->nack(context, POSRTCPRead32(packet + 4), POSRTCPRead32(packet + 8), POSRTCPRead16(packet + offset),
+                   POSRTCPRead16(packet + offset + 2));
+}
+
+static void POSRTCPParseTMMBR(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                              void *context)
+{
+  (void)count;
+  if (!handlers->tmmbr)
+    return;
+  for (size_t offset = 12; offset + 8 <= numBytes; offset += 8)
+  {
+    uint32_t word = POSRTCPRead32(packet + offset + 4);
+    POSRTCPTmmbr tmmbr;
+    tmmbr.senderSSRC = POSRTCPRead32(packet + 4);
+    tmmbr.mediaSSRC = POSRTCPRead32(packet + offset);
+    tmmbr.exponent = (uint8_t)(word >> 26);
+    tmmbr.mantissa = (word >> 9) & 0x1ffff;
+    tmmbr.overhead = (uint16_t)(word & 0x1ff);
+    handlers->tmmbr(context, &tmmbr);
+  }
+}
+
+static void POSRTCPParsePLI(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                            void *context)
+{
+  (void)numBytes;
+  (void)count;
+  if (handlers->pli)
+    handlers->pli(context, POSRTCPRead32(packet + 4), POSRTCPRead32(packet + 8));
+}
+
+static void POSRTCPParseFIR(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                            void *context)
+{
+  (void)count;
+  if (!handlers->fir)
+    return;
+  for (size_t offset = 12; offset + 8 <= numBytes; offset += 8)
+    handlers->fir(context, POSRTCPRead32(packet + 4), POSRTCPRead32(packet + offset), packet[offset + 4]);
+}
+
+static void POSRTCPParseTSTR(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                             void *context)
+{
+  (void)count;
+  if (!handlers->tstr)
+    return;
+  for (size_t offset = 12; offset + 8 <= numBytes; offset += 8)
+    handlers->tstr(context, POSRTCPRead32(packet + 4), POSRTCPRead32(packet + offset), packet[offset + 4],
+                   packet[offset + 7] & 0x1f);
+}
+
+static void POSRTCPParseREMB(const uint8_t *packet, size_t numBytes, uint8_t count, const POSRTCPHandlers *handlers,
+                             void *context)
+{
+  (void)count;
+  // application layer feedback is only REMB when it carries the identifier
+  if (!handlers->remb || packet[12] != 'R' || packet[13] != 'E' || packet[14] != 'M' || packet[15] != 'B')
+    return;
+  uint8_t numSSRCs = packet[16];
+  uint64_t bitRate = (uint64_t)(POSRTCPRead32(packet + 16) & 0x3ffff) << (packet[17] >> 2);
+  for (uint8_t idx = 0; idx < numSSRCs && 20 + (size_t)(idx + 1) * 4 <= numBytes; idx++)
+    handlers->remb(context, POSRTCPRead32(packet + 4), POSRTCPRead32(packet + 20 + idx * 4), bitRate);
+}
+
+typedef void (*POSRTCPParseFunction)(const uint8_t *packet, size_t numBytes, uint8_t count,
+                                     const POSRTCPHandlers *handlers, void *context);
+
+static const struct
+{
+    uint8_t packetType;
+    uint8_t fmt;
+    uint8_t minBytes;
+    POSRTCPParseFunction parse;
+} kPOSRTCPParsers[] = {
+  { 200, POS_RTCP_ANY_FMT, 28, POSRTCPParseSR },
+  { 201, POS_RTCP_ANY_FMT, 8, POSRTCPParseRR },
+  { 202, POS_RTCP_ANY_FMT, 4, POSRTCPParseSDES },
+  { 203, POS_RTCP_ANY_FMT, 4, POSRTCPParseBYE },
+  { 205, 1, 12, POSRTCPParseNACK },
+  { 205, 3, 12, POSRTCPParseTMMBR },
+  { 206, 1, 12, POSRTCPParsePLI },
+  { 206, 4, 12, POSRTCPParseFIR },
+  { 206, 5, 12, POSRTCPParseTSTR },
+  { 206, 15, 20, POSRTCPParseREMB },
+};
+
+bool POSRTCPParse(const uint8_t *bytes, size_t numBytes, const POSRTCPHandlers *handlers, void *context)
+{
+  size_t offset = 0;
+
+  if (bytes == 0 || handlers == 0 || numBytes < 4)
+    return false;
+
+  // every packet must be version 2 and the lengths must cover the buffer exactly
+  while (offset + 4 <= numBytes)
+  {
+    if (bytes[offset] >> 6 != 2)
+      return false;
+    offset += (size_t)POSRTCPRead16(bytes + offset + 2) * 4 + 4;
+  }
+  if (offset != numBytes)
+    return false;
+
+  for (offset = 0; offset < numBytes;)
+  {
+    const uint8_t *packet = bytes + offset;
+    size_t packetBytes = (size_t)POSRTCPRead16(packet + 2) * 4 + 4;
+    size_t numPacketBytes = packetBytes;
+    uint8_t count = packet[0] & 0x1f;
+    offset += packetBytes;
+
+    if ((packet[0] & 0x20) != 0)
+    {
+      // padding, the last byte counts the padding bytes
+      if (packet[packetBytes - 1] > packetBytes - 4)
+        continue;
+      numPacketBytes = packetBytes - packet[packetBytes - 1];
+    }
+    for (size_t idx = 0; idx < sizeof kPOSRTCPParsers / sizeof kPOSRTCPParsers[0]; idx++)
+    {
+      if (kPOSRTCPParsers[idx].packetType != packet[1])
+        continue;
+      if (kPOSRTCPParsers[idx].fmt != POS_RTCP_ANY_FMT && kPOSRTCPParsers[idx].fmt != count)
+        continue;
+      if (numPacketBytes >= kPOSRTCPParsers[idx].minBytes)
+        kPOSRTCPParsers[idx].parse(packet, numPacketBytes, count, handlers, context);
+      break;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,104 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSRTCPPARSER_H
+#define POSRTCPPARSER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sender info of an SR, https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1
+typedef struct
+{
+    uint32_t senderSSRC;
+    uint32_t ntpMSW;
+    uint32_t ntpLSW;
+    uint32_t rtpTimestamp;
+    uint32_t packetCount;
+    uint32_t octetCount;
+} POSRTCPSenderInfo;
+
+// One report block of an SR or RR
+typedef struct
+{
+    uint32_t senderSSRC; // of the SR/RR carrying the block
+    uint32_t sourceSSRC; // the stream being reported on
+    uint8_t fractionLost;
+    int32_t cumulativeLost;
+    uint32_t extendedHighestSeqNr;
+    uint32_t jitter;
+    uint32_t lastSR;
+    uint32_t delaySinceLastSR;
+} POSRTCPReportBlock;
+
+// TMMBR FCI, https://datatracker.ietf.org/doc/html/rfc5104#section-4.2.1.1
+typedef struct
+{
+    uint32_t senderSSRC;
+    uint32_t mediaSSRC;
+    uint8_t exponent;
+    uint32_t mantissa;
+    uint16_t overhead;
+} POSRTCPTmmbr;
+
+/**
+ * Typed callbacks for the packets of a compound RTCP packet.  Any of them may be
+ * NULL.  Pointers passed to a callback are only valid during the call.
+ */
+typedef struct
+{
+    void (*senderReport)(void *context, const POSRTCPSenderInfo *senderInfo);
+    void (*reportBlock)(void *context, const POSRTCPReportBlock *reportBlock);
+    // one call per SDES item, https://datatracker.ietf.org/doc/html/rfc3550#section-6.5
+    void (*sdesItem)(void *context, uint32_t ssrc, uint8_t itemType, const uint8_t *item, uint8_t numItemBytes);
+    void (*bye)(void *context, uint32_t ssrc);
+    // one call per FCI entry, https://datatracker.ietf.org/doc/html/rfc4585#section-6.2.1
+    void (*nack)(void *context, uint32_t senderSSRC, uint32_t mediaSSRC, uint16_t pid, uint16_t blp);
+    void (*tmmbr)(void *context, const POSRTCPTmmbr *tmmbr);
+    // https://datatracker.ietf.org/doc/html/rfc4585#section-6.3.1
+    void (*pli)(void *context, uint32_t senderSSRC, uint32_t mediaSSRC);
+    // one call per FCI entry, https://datatracker.ietf.org/doc/html/rfc5104#section-4.3.1
+    void (*fir)(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr);
+    // https://datatracker.ietf.org/doc/html/rfc5104#section-4.3.2
+    void (*tstr)(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr, uint8_t index);
+    // one call per listed SSRC, https://datatracker.ietf.org/doc/html/draft-alvestrand-rmcat-remb-03
+    void (*remb)(void *context, uint32_t senderSSRC, uint32_t ssrc, uint64_t bitRate);
+} POSRTCPHandlers;
+
+/**
+ * Walks a decrypted compound RTCP packet and calls the matching handlers.
+ *
+ * The whole compound packet is checked first, every packet must have version 2
+ * and the lengths must add up to numBytes exactly, otherwise nothing is
+ * dispatched.  Packets that are too short for their type, and unknown types or
+ * feedback formats, are skipped.  Nothing is allocated and every read is bounds
+ * checked against numBytes.
+ *
+ * @return false if the compound packet was rejected.
+ */
+bool POSRTCPParse(const uint8_t *bytes, size_t numBytes, const POSRTCPHandlers *handlers, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
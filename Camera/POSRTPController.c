@@ -25,9 +25,17 @@
 #include <HAP+Internal.h>
 
 #include "POSRTPController.h"
+#include "POSRTCPParser.h"
+#include "POSMediaClock.h"
 
 static const HAPLogObject logObject = { .subsystem = kHAP_LogSubsystem, .category = "POSRTPController" };
 
+static uint32_t POSMakeRTPPacketWithHeader(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t numDataBytes,
+                                           uint8_t *packetBytes, size_t maxBytes, size_t *numPacketBytes,
+                                           const uint8_t *FUHeaderBytes, uint32_t numFUHeaderBytes, uint8_t cvoID,
+                                           uint8_t MarkerBit);
+static void POSRTPHistoryRecord(POSRTPPacketHistory *history, uint16_t seq, const uint8_t *bytes, size_t numBytes);
+
 uint64_t Upper64ofMul64(uint64_t a, uint64_t b)
 
 {
@@ -61,10 +69,41 @@ NTPEpochTime HAPTimeToNTPTime(HAPTime hapTime)
 };
 
 HAPError POSRTPStreamEnd(POSRTPStreamRef *stream){
+  srtp_freeContext(&stream->context_input_srtp, &stream->context_input_rtcp);
+  srtp_freeContext(&stream->context_output_srtp, &stream->context_output_rtcp);
+  srtp_freeContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp);
   memset(stream, 0, sizeof(POSRTPStreamRef));
     return kHAPError_None;
 }
 
+// Randomized RTCP report interval, RFC 3550 section 6.3.1 and appendix A.7.
+// A HAP session has two members and we are one of the senders, so the RTCP
+// bandwidth (5% of the negotiated session bandwidth) is shared evenly and
+// rtcpInterval is Tmin.  There is no timer reconsideration, so the interval
+// isn't divided by e - 3/2 either.
+static HAPTime POSRTPStreamRTCPInterval(POSRTPStreamRef *stream, bool initial)
+{
+  uint64_t intervalNs = (uint64_t)stream->rtcpInterval * 1000000;
+  uint64_t rtcpBytesPerSecond = (uint64_t)stream->sessionBitRate / 8 * 5 / 100;
+  uint16_t random;
+
+  if (initial)
+  {
+    intervalNs = intervalNs / 2;
+  }
+  if (rtcpBytesPerSecond != 0)
+  {
+    uint64_t bandwidthIntervalNs = 2 * (uint64_t)stream->avgRTCPSize * 1000000000 / rtcpBytesPerSecond;
+    if (intervalNs < bandwidthIntervalNs)
+    {
+      intervalNs = bandwidthIntervalNs;
+    }
+  }
+  // spread over [0.5, 1.5) of the interval
+  HAPPlatformRandomNumberFill(&random, sizeof random);
+  return intervalNs * (32768 + random) / 65536;
+}
+
 HAPError POSRTPStreamStart(POSRTPStreamRef *stream, POSRTPParameters *rtpParameters,
                            RTPType encodeType, uint32_t clockFrequency, uint32_t localSSRC,
                            HAPTime startTime, char *cnameString,
@@ -76,18 +115,22 @@ HAPError POSRTPStreamStart(POSRTPStreamRef *stream, POSRTPParameters *rtpParamet
   uint32_t keySize;
   uint8_t *salt;
 
+  // a stream started again without POSRTPStreamEnd still holds the key schedules of its last session
+  srtp_freeContext(&stream->context_input_srtp, &stream->context_input_rtcp);
+  srtp_freeContext(&stream->context_output_srtp, &stream->context_output_rtcp);
+  srtp_freeContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp);
   HAPRawBufferZero(stream, sizeof(POSRTPStreamRef));
   HAPPlatformRandomNumberFill(&stream->outTimeStampBase, 4);
   HAPPlatformRandomNumberFill(&stream->randomOutputSequenceNrBase, 2);
 
   stream->lastSentKeyFrame = startTime;
-  stream->streamStartTime = startTime;
   stream->lastRTCPReportHAPTime = startTime;
   stream->lastRecvNTPtime = HAPTimeToNTPTime(startTime) >> 32;
   stream->rtcpInterval = rtpParameters->RTCPInterval * 1000;
   
   stream->encodeType = encodeType;
   stream->streamType = rtpParameters->type;
+  stream->payloadTypeToSend = rtpParameters->type;
   stream->clockFreq = clockFrequency;
   uint64_t temp = Upper64ofMul64((uint64_t)clockFrequency << 32, 5441186219426131130);
   stream->nsToTimestampConvLSW = (uint32_t)(temp);
@@ -95,7 +138,10 @@ HAPError POSRTPStreamStart(POSRTPStreamRef *stream, POSRTPParameters *rtpParamet
   stream->outstreamSSRC = localSSRC;
   stream->instreamSSRC = rtpParameters->ssrc;
   stream->bitRate = rtpParameters->maxBitRate * 1000;
+  stream->sessionBitRate = (rtpParameters->sessionBitRate ? rtpParameters->sessionBitRate : rtpParameters->maxBitRate) * 1000;
   stream->requestNewBitrateAtCheck = rtpParameters->maxBitRate * 1000;
+  stream->avgRTCPSize = POS_RTCP_INITIAL_AVG_SIZE;
+  stream->nextRTCPReportHAPTime = startTime + POSRTPStreamRTCPInterval(stream, true);
   uint8_t idx = 0;
   for (; idx < 32 && cnameString[idx] != 0; idx++)
     stream->localCNAME[idx] = cnameString[idx];
@@ -177,6 +223,189 @@ HAPError POSRTPStreamStart(POSRTPStreamRef *stream, POSRTPParameters *rtpParamet
   return kHAPError_None;
 }
 
+HAPError POSRTPStreamStartPacketizer(POSRTPStreamRef *stream, POSRTPParameters *rtpParameters,
+                                     RTPType encodeType, uint32_t clockFrequency, uint32_t tagSize,
+                                     HAPTime startTime)
+{
+  HAPRawBufferZero(stream, sizeof(POSRTPStreamRef));
+  HAPPlatformRandomNumberFill(&stream->outTimeStampBase, 4);
+
+  stream->lastSentKeyFrame = startTime;
+  stream->encodeType = encodeType;
+  stream->streamType = rtpParameters->type;
+  stream->payloadTypeToSend = rtpParameters->type;
+  stream->clockFreq = clockFrequency;
+  uint64_t temp = Upper64ofMul64((uint64_t)clockFrequency << 32, 5441186219426131130);
+  stream->nsToTimestampConvLSW = (uint32_t)(temp);
+  stream->nsToTimestampConvMSW = clockFrequency * 4 + (int)(temp >> 32);
+
+  if (rtpParameters->maximumMTU == 0)
+    stream->maximumMTU = 0x10000;
+  else
+    stream->maximumMTU = rtpParameters->maximumMTU;
+
+  // no output key, POSMakeRTPPacket copies the payload, but leave room for the viewers' tags
+  stream->outStreamHeaderPlusTagSize = tagSize + 0xc;
+  return kHAPError_None;
+}
+
+// H.265 counterpart of the NAL handling in POSRTPStreamPushPayload
+// https://datatracker.ietf.org/doc/html/rfc7798
+static void POSRTPStreamPushPayloadH265(POSRTPStreamRef *stream, void *bytes, size_t numBytes, size_t *numPayloadBytes,
+                                        HAPTime actualTime)
+{
+  uint8_t *parameterSet;
+  uint32_t *parameterSetNumBytes;
+  uint8_t NALType = (*(uint8_t *)bytes >> 1) & 0x3f;
+
+  if ((NALType >= 16) && (NALType <= 23))
+  {
+    /* IRAP picture (BLA, IDR or CRA) */
+    __atomic_add_fetch(&stream->keyFramesPushed, 1, __ATOMIC_RELAXED);
+    if ((stream->VPSNALUNumBytes == 0) || (stream->SPSNALUNumBytes == 0) || (stream->PPSNALUNumBytes == 0))
+    {
+      // wait for the parameter sets
+      return;
+    }
+    // trigger a new VPS, SPS and PPS send
+    stream->nextPayloadStart = 0xffffffff;
+    return;
+  }
+  switch (NALType)
+  {
+  case 32: /* Video parameter set */
+    parameterSet = stream->VPSNALU;
+    parameterSetNumBytes = &stream->VPSNALUNumBytes;
+    break;
+  case 33: /* Sequence parameter set */
+    parameterSet = stream->SPSNALU;
+    parameterSetNumBytes = &stream->SPSNALUNumBytes;
+    break;
+  case 34: /* Picture parameter set */
+    parameterSet = stream->PPSNALU;
+    parameterSetNumBytes = &stream->PPSNALUNumBytes;
+    break;
+  default:
+    return;
+  }
+  if (0x7f < numBytes)
+  {
+    return;
+  }
+  HAPRawBufferCopyBytes(parameterSet, bytes, numBytes);
+  *parameterSetNumBytes = numBytes;
+  stream->payloadBytes = (void *)0x0;
+  *numPayloadBytes = 0;
+}
+
+// Hands the STAP-A being filled to the poll and starts filling the other buffer
+static void POSRTPStreamFlushAggregate(POSRTPStreamRef *stream, bool MarkerBit)
+{
+  if (stream->aggregateNumBytes == 0)
+    return;
+  if (stream->aggregateReady)
+    return; // the previous one hasn't been polled yet
+  stream->readyNumBytes = stream->aggregateNumBytes;
+  stream->readyNumNALUs = stream->aggregateNumNALUs;
+  stream->readyTimeStamp = stream->aggregateTimeStamp;
+  stream->aggregateReady = true;
+  stream->aggregateMarkerBit = MarkerBit;
+  stream->aggregateFill = stream->aggregateFill ^ 1;
+  stream->aggregateNumBytes = 0;
+  stream->aggregateNumNALUs = 0;
+}
+
+// Pack a small NALU into the pending STAP-A instead of sending it in a packet of its own
+// https://datatracker.ietf.org/doc/html/rfc6184#section-5.7.1
+static void POSRTPStreamPushAggregate(POSRTPStreamRef *stream, uint8_t *bytes, size_t numBytes,
+                                      size_t *numPayloadBytes)
+{
+  uint8_t NALType = bytes[0] & 0x1f;
+  uint32_t maxAggregateBytes = stream->maximumMTU - stream->outStreamHeaderPlusTagSize;
+  bool canAggregate = !stream->aggregateReady;
+  uint8_t *aggregateBytes;
+
+  if (POS_RTP_AGGREGATE_MAX_BYTES < maxAggregateBytes)
+    maxAggregateBytes = POS_RTP_AGGREGATE_MAX_BYTES;
+  // picture NALUs that carry a new cvo header extension go on their own
+  if ((stream->cvoID != 0) && (NALType < 7) && (stream->cvoInformation != stream->lastcvoInformationSent))
+    canAggregate = false;
+  // and so do NALUs that wouldn't fit in a STAP-A even on their own
+  if (maxAggregateBytes < 1 + 2 + numBytes)
+    canAggregate = false;
+  if (!canAggregate)
+  {
+    // send what was aggregated so far, then this NALU as a single NAL unit or FU-A
+    POSRTPStreamFlushAggregate(stream, false);
+    return;
+  }
+
+  *numPayloadBytes = 0;
+  if ((stream->aggregateNumBytes != 0) && ((stream->aggregateTimeStamp != stream->timeStampToSend) ||
+                                           (maxAggregateBytes < stream->aggregateNumBytes + 2 + numBytes)))
+  {
+    // send what was aggregated so far, this NALU starts the next STAP-A
+    POSRTPStreamFlushAggregate(stream, false);
+    *numPayloadBytes = stream->readyNumBytes;
+  }
+
+  aggregateBytes = stream->aggregateBytes[stream->aggregateFill];
+  if (stream->aggregateNumBytes == 0)
+  {
+    aggregateBytes[0] = 0x18; // STAP-A
+    stream->aggregateNumBytes = 1;
+    stream->aggregateTimeStamp = stream->timeStampToSend;
+  }
+  // F is the OR and NRI the maximum of the aggregated NALUs
+  aggregateBytes[0] = aggregateBytes[0] | (bytes[0] & 0x80);
+  if ((aggregateBytes[0] & 0x60) < (bytes[0] & 0x60))
+    aggregateBytes[0] = (aggregateBytes[0] & 0x9f) | (bytes[0] & 0x60);
+  aggregateBytes[stream->aggregateNumBytes] = (uint8_t)(numBytes >> 8);
+  aggregateBytes[stream->aggregateNumBytes + 1] = (uint8_t)numBytes;
+  HAPRawBufferCopyBytes(&aggregateBytes[stream->aggregateNumBytes + 2], bytes, numBytes);
+  stream->aggregateNumBytes = stream->aggregateNumBytes + 2 + numBytes;
+  stream->aggregateNumNALUs++;
+  stream->payloadBytes = (void *)0x0;
+}
+
+void POSRTPStreamEndAccessUnit(POSRTPStreamRef *stream, size_t *numPayloadBytes)
+{
+  if (numPayloadBytes == 0)
+    return;
+  *numPayloadBytes = 0;
+  if (stream == 0)
+    return;
+  if (stream->aggregateNumBytes == 0)
+    return;
+  POSRTPStreamFlushAggregate(stream, true);
+  if (stream->aggregateReady)
+    *numPayloadBytes = stream->readyNumBytes;
+}
+
+static void POSRTPStreamPollAggregate(POSRTPStreamRef *stream, void *bytes, size_t maxBytes, size_t *numPacketBytes)
+{
+  uint32_t timeStampToSend = stream->timeStampToSend;
+  uint8_t *payloadBytes = stream->aggregateBytes[stream->aggregateFill ^ 1];
+  uint32_t numAggregateBytes = stream->readyNumBytes;
+
+  if (stream->maximumMTU <= maxBytes)
+  {
+    maxBytes = stream->maximumMTU;
+  }
+  if (stream->readyNumNALUs == 1)
+  {
+    // nothing joined it, a single NAL unit packet saves the STAP-A header
+    payloadBytes = payloadBytes + 3;
+    numAggregateBytes = numAggregateBytes - 3;
+  }
+  // the aggregate belongs to an earlier push than the payload waiting behind it
+  stream->timeStampToSend = stream->readyTimeStamp;
+  POSMakeRTPPacketWithHeader(stream, payloadBytes, numAggregateBytes, bytes, maxBytes, numPacketBytes, 0, 0, 0,
+                             stream->aggregateMarkerBit);
+  stream->timeStampToSend = timeStampToSend;
+  stream->aggregateReady = false;
+}
+
 void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numBytes, size_t *numPayloadBytes,
                              HAPTimeNS sampleTime, HAPTime actualTime)
 
@@ -197,9 +426,16 @@ void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numByt
   *numPayloadBytes = numBytes;
   stream->payloadBytes = bytes;
   stream->numPayloadBytes = numBytes;
+  stream->payloadTypeToSend = stream->streamType;
+  stream->markerBitToSend = false;
   temp = Upper64ofMul64((uint64_t)sampleTime, (uint64_t)stream->nsToTimestampConvLSW + ((uint64_t)stream->nsToTimestampConvMSW << 32));
   stream->timeStampToSend = stream->outTimeStampBase + temp;
   stream->nextPayloadStart = 0;
+  if (stream->encodeType == RTPType_H265)
+  {
+    POSRTPStreamPushPayloadH265(stream, bytes, numBytes, numPayloadBytes, actualTime);
+    return;
+  }
   if (stream->encodeType != RTPType_H264)
     return;
   NALType = *(uint8_t *)bytes & 0x1f;
@@ -208,9 +444,8 @@ void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numByt
   if (NALType == 5)
   {
     /* Coded slice of an IDR picture */
-    stream->KeyFrameRequestedBitOne = stream->encodeType;
-    stream->lastSentKeyFrame = actualTime;
-    stream->KeyFrameRequestedBitOne = 0;
+    __atomic_add_fetch(&stream->keyFramesPushed, 1, __ATOMIC_RELAXED);
+    POSRTPStreamFlushAggregate(stream, false);
     if (stream->SPSNALUNumBytes == 0)
     {
       // wait for sequence parameter set
@@ -239,6 +474,7 @@ void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numByt
   {
     if (NALType != 8)
     {
+      POSRTPStreamPushAggregate(stream, bytes, numBytes, numPayloadBytes);
       return;
     }
     if (0x7f < numBytes)
@@ -254,6 +490,98 @@ void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numByt
   return;
 }
 
+void POSRTPStreamPushPayloadAs(POSRTPStreamRef *stream, void *bytes, size_t numBytes, size_t *numPayloadBytes,
+                               uint8_t payloadType, bool markerBit, HAPTimeNS sampleTime, HAPTime actualTime)
+{
+  if (stream == 0)
+    return;
+  if (numPayloadBytes == 0)
+    return;
+  *numPayloadBytes = 0;
+  if (stream->encodeType != RTPType_Simple)
+    return;
+
+  POSRTPStreamPushPayload(stream, bytes, numBytes, numPayloadBytes, sampleTime, actualTime);
+  stream->payloadTypeToSend = payloadType & 0x7f;
+  stream->markerBitToSend = markerBit;
+}
+
+// Aggregation packet with the VPS, SPS and PPS, or the next single NAL or fragment of the pushed payload
+// https://datatracker.ietf.org/doc/html/rfc7798#section-4.4
+static void POSRTPStreamPollPacketH265(POSRTPStreamRef *stream, void *bytes, size_t maxBytes, size_t *numPacketBytes)
+{
+  uint8_t *payloadBytes = stream->payloadBytes;
+  uint32_t maxBytesLessHeaderTag = maxBytes - stream->outStreamHeaderPlusTagSize;
+  uint8_t NALType = (payloadBytes[0] >> 1) & 0x3f;
+  uint8_t FUHeaderBytes[3];
+  uint32_t numFUHeaderBytes = 0;
+  uint32_t rtpPacketSize;
+  bool MarkerBit = false;
+
+  if (stream->nextPayloadStart == 0xffffffff)
+  {
+    // AP: payload header (type 48, layer and tid of the picture) then size-prefixed parameter sets
+    uint8_t *apBytes = (uint8_t *)bytes + 0xc;
+    uint8_t *parameterSets[3] = {stream->VPSNALU, stream->SPSNALU, stream->PPSNALU};
+    uint32_t parameterSetNumBytes[3] = {stream->VPSNALUNumBytes, stream->SPSNALUNumBytes, stream->PPSNALUNumBytes};
+
+    apBytes[0] = (payloadBytes[0] & 0x81) | (48 << 1);
+    apBytes[1] = payloadBytes[1];
+    rtpPacketSize = 2;
+    for (int idx = 0; idx < 3; idx++)
+    {
+      apBytes[rtpPacketSize] = (uint8_t)(parameterSetNumBytes[idx] >> 8);
+      apBytes[rtpPacketSize + 1] = (uint8_t)parameterSetNumBytes[idx];
+      HAPRawBufferCopyBytes(apBytes + rtpPacketSize + 2, parameterSets[idx], parameterSetNumBytes[idx]);
+      rtpPacketSize = rtpPacketSize + 2 + parameterSetNumBytes[idx];
+    }
+    payloadBytes = apBytes;
+    stream->nextPayloadStart = 0;
+  }
+  else if (maxBytesLessHeaderTag < stream->numPayloadBytes)
+  {
+    // FU: payload header (type 49), then S/E and the original type, the NAL header itself isn't sent
+    // https://datatracker.ietf.org/doc/html/rfc7798#section-4.4.3
+    uint32_t maxFragmentBytes = maxBytesLessHeaderTag - 3;
+    FUHeaderBytes[0] = (payloadBytes[0] & 0x81) | (49 << 1);
+    FUHeaderBytes[1] = payloadBytes[1];
+    FUHeaderBytes[2] = NALType;
+    numFUHeaderBytes = 3;
+    if (stream->nextPayloadStart == 0)
+    {
+      // start of a fragmented series
+      stream->nextPayloadStart = 2;
+      FUHeaderBytes[2] = FUHeaderBytes[2] | 0x80;
+    }
+    uint32_t payloadSizeLeftToSend = stream->numPayloadBytes - stream->nextPayloadStart;
+    if (maxFragmentBytes < payloadSizeLeftToSend)
+    {
+      // start or middle of a fragment series
+      rtpPacketSize = maxFragmentBytes;
+    }
+    else
+    {
+      // end of a fragmented NALU
+      rtpPacketSize = payloadSizeLeftToSend;
+      FUHeaderBytes[2] = FUHeaderBytes[2] | 0x40;
+      stream->payloadBytes = 0;
+      MarkerBit = NALType < 32; // VCL
+    }
+    payloadBytes = payloadBytes + stream->nextPayloadStart;
+    stream->nextPayloadStart = stream->nextPayloadStart + rtpPacketSize;
+  }
+  else
+  {
+    // A NALU without FU
+    rtpPacketSize = stream->numPayloadBytes;
+    MarkerBit = NALType < 32;
+    stream->payloadBytes = 0;
+  }
+
+  POSMakeRTPPacketWithHeader(stream, payloadBytes, rtpPacketSize, bytes, maxBytes, numPacketBytes, FUHeaderBytes,
+                             numFUHeaderBytes, 0, MarkerBit);
+}
+
 void POSRTPStreamPollPacket(POSRTPStreamRef *stream, void *bytes, size_t maxBytes, size_t *numPacketBytes)
 
 {
@@ -276,6 +604,11 @@ void POSRTPStreamPollPacket(POSRTPStreamRef *stream, void *bytes, size_t maxByte
   if (numPacketBytes == 0)
     return;
 
+  if (stream->aggregateReady)
+  {
+    POSRTPStreamPollAggregate(stream, bytes, maxBytes, numPacketBytes);
+    return;
+  }
   payloadBytes = stream->payloadBytes;
   if (payloadBytes == (uint8_t *)0x0)
   {
@@ -286,6 +619,11 @@ void POSRTPStreamPollPacket(POSRTPStreamRef *stream, void *bytes, size_t maxByte
   {
     maxBytes = stream->maximumMTU;
   }
+  if (stream->encodeType == RTPType_H265)
+  {
+    POSRTPStreamPollPacketH265(stream, bytes, maxBytes, numPacketBytes);
+    return;
+  }
   if (stream->encodeType == RTPType_H264)
   {
 
@@ -387,7 +725,7 @@ void POSRTPStreamPollPacket(POSRTPStreamRef *stream, void *bytes, size_t maxByte
       return;
     rtpPacketSize = stream->numPayloadBytes;
     stream->payloadBytes = 0;
-    MarkerBit = false;
+    MarkerBit = stream->markerBitToSend;
     cvoID = 0;
     FUHeader = 0;
   }
@@ -397,15 +735,309 @@ void POSRTPStreamPollPacket(POSRTPStreamRef *stream, void *bytes, size_t maxByte
   return;
 }
 
-uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t numDataBytes, uint8_t *packetBytes,
-                          size_t maxBytes, size_t *numPacketBytes, uint16_t FUHeader, uint8_t cvoID,
-                          uint8_t MarkerBit)
+// Feeds a plaintext packet of the batch to the FEC encoder, and protects and queues the
+// parity packets it completes to go out after it
+static void POSRTPStreamAddFecPacket(POSRTPStreamRef *stream, const uint8_t *packetBytes, size_t numPacketBytes,
+                                     size_t batchIdx)
+{
+  POSRTPFecBatch *batch = stream->fecBatch;
+  srtp_ctx *srtpContext = &stream->context_output_fec_srtp;
+  size_t numParity = POSRTPFecAddPacket(stream->fec, packetBytes, numPacketBytes);
+
+  for (size_t n = 0; n < numParity; n++)
+  {
+    const uint8_t *parityBytes = stream->fec->parityPackets + n * POS_RTP_FEC_PARITY_STRIDE;
+    size_t numParityBytes = stream->fec->parityLens[n];
+    uint16_t seq = (uint16_t)(parityBytes[2] << 8 | parityBytes[3]);
+
+    if (seq < stream->fecLastSeq)
+      stream->fecRolloverCount++;
+    stream->fecLastSeq = seq;
+    if (batch->numPackets == POS_RTP_FEC_BATCH_PARITY)
+    {
+      batch->numDropped++;
+      continue;
+    }
+    uint8_t *bytes = batch->packets[batch->numPackets];
+    HAPRawBufferCopyBytes(bytes, parityBytes, numParityBytes);
+    if (srtpContext->key_size != 0)
+    {
+      // the 12 byte RTP header stays in the clear, the FEC headers and parity are payload
+      uint32_t index = stream->fecRolloverCount << 16 | seq;
+      srtp_encrypt(srtpContext, bytes + 12, bytes + 12, 0, numParityBytes - 12, index);
+      srtp_authenticate(srtpContext, bytes + numParityBytes, bytes, numParityBytes, stream->fecRolloverCount);
+      numParityBytes += srtpContext->tag_size;
+    }
+    batch->lens[batch->numPackets] = numParityBytes;
+    batch->after[batch->numPackets] = batchIdx;
+    batch->numPackets++;
+  }
+}
+
+// Encrypts and authenticates the packets POSMakeRTPPacketWithHeader or
+// POSRTPStreamProtectPackets left in the clear, packet n of the run is at pool + (first + n) * packetStride
+static void POSRTPStreamEncryptPackets(POSRTPStreamRef *stream, uint8_t *pool, size_t packetStride,
+                                       const size_t *packetLens, size_t first, srtp_encrypt_job *jobs,
+                                       size_t numJobs)
+{
+  uint32_t tagSize = (stream->context_output_srtp).tag_size;
+  size_t idx;
+
+  if (stream->fec != 0)
+  {
+    // parity is over the plaintext, so put the payload in place and encrypt it there
+    for (idx = 0; idx < numJobs; idx++)
+    {
+      uint8_t *payloadBytes = jobs[idx].packet + jobs[idx].num_header_bytes;
+      HAPRawBufferCopyBytes(payloadBytes, jobs[idx].data_bytes, jobs[idx].num_data_bytes);
+      jobs[idx].data_bytes = payloadBytes;
+      POSRTPStreamAddFecPacket(stream, pool + (first + idx) * packetStride, packetLens[first + idx] - tagSize,
+                               first + idx);
+    }
+  }
+  srtp_encrypt_many(&stream->context_output_srtp, jobs, numJobs);
+  for (idx = 0; idx < numJobs; idx++)
+  {
+    uint8_t *packetBytes = pool + (first + idx) * packetStride;
+    size_t numAuthBytes = packetLens[first + idx] - tagSize;
+
+    srtp_authenticate(&stream->context_output_srtp, packetBytes + numAuthBytes, packetBytes, numAuthBytes,
+                      jobs[idx].index >> 16);
+    if (stream->history != 0)
+      POSRTPHistoryRecord(stream->history, (uint16_t)jobs[idx].index, packetBytes, packetLens[first + idx]);
+  }
+}
+
+void POSRTPStreamPollPackets(POSRTPStreamRef *stream, void *pool, size_t packetStride, size_t maxPackets,
+                             size_t *packetLens, size_t *numPackets)
+
+{
+  // Poll as many packets of the pushed payload as fit in the pool so the caller
+  // can hand the whole batch to the socket in one call.
+  // Packet n is written at pool + n * packetStride, its length at packetLens[n].
+  // The packets are built first and then encrypted in runs with srtp_encrypt_many,
+  // the payload they point into stays put until the next push.
+  srtp_encrypt_job jobs[POS_RTP_SRTP_BATCH_MAX];
+  size_t numJobs = 0;
+  size_t idx;
+  bool encrypt;
+
+  if (numPackets == 0)
+    return;
+  *numPackets = 0;
+  if (stream == 0)
+    return;
+  if (pool == 0)
+    return;
+  if (packetLens == 0)
+    return;
+
+  if (stream->fec != 0)
+    stream->fecBatch->numPackets = 0;
+  encrypt = (stream->context_output_srtp).key_size != 0;
+  for (idx = 0; idx < maxPackets; idx++)
+  {
+    if (encrypt)
+      stream->srtpJob = &jobs[numJobs];
+    POSRTPStreamPollPacket(stream, (uint8_t *)pool + idx * packetStride, packetStride, &packetLens[idx]);
+    stream->srtpJob = 0;
+    if (packetLens[idx] == 0)
+      break;
+    *numPackets = idx + 1;
+    if (!encrypt && (stream->fec != 0))
+      POSRTPStreamAddFecPacket(stream, (uint8_t *)pool + idx * packetStride, packetLens[idx], idx);
+    if (encrypt && (++numJobs == POS_RTP_SRTP_BATCH_MAX))
+    {
+      POSRTPStreamEncryptPackets(stream, pool, packetStride, packetLens, idx + 1 - numJobs, jobs, numJobs);
+      numJobs = 0;
+    }
+  }
+  if (numJobs != 0)
+    POSRTPStreamEncryptPackets(stream, pool, packetStride, packetLens, *numPackets - numJobs, jobs, numJobs);
+  return;
+}
+
+static void POSRTPHistoryRecord(POSRTPPacketHistory *history, uint16_t seq, const uint8_t *bytes, size_t numBytes)
+{
+  POSRTPHistorySlot *slot = &history->slots[seq & (POS_RTP_HISTORY_PACKETS - 1)];
+
+  // readers skip a slot while it is marked empty, or if seq changed while they copied it
+  __atomic_store_n(&slot->seq, POS_RTP_HISTORY_EMPTY, __ATOMIC_RELEASE);
+  if (numBytes > sizeof(slot->bytes))
+    return;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  HAPRawBufferCopyBytes(slot->bytes, bytes, numBytes);
+  slot->numBytes = numBytes;
+  __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+}
+
+// Called by the send thread after each packet, see POSRTPSenderStats
+static void POSRTPStreamPublishSenderStats(POSRTPStreamRef *stream, uint32_t rtpTimeStamp)
+{
+  POSRTPSenderStats *stats = &stream->senderStats;
+  uint32_t seq = stats->seq;
+
+  __atomic_store_n(&stats->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&stats->packetCount, stream->outSequenceNr, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->octetCount, stream->totalOutPacketBytesWritten, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->rtpTimeStamp, rtpTimeStamp, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void POSRTPStreamGetSenderStats(const POSRTPStreamRef *stream, POSRTPSenderStats *stats)
+{
+  const POSRTPSenderStats *published = &stream->senderStats;
+  uint32_t seq;
+
+  do
+  {
+    seq = __atomic_load_n(&published->seq, __ATOMIC_ACQUIRE);
+    stats->packetCount = __atomic_load_n(&published->packetCount, __ATOMIC_RELAXED);
+    stats->octetCount = __atomic_load_n(&published->octetCount, __ATOMIC_RELAXED);
+    stats->rtpTimeStamp = __atomic_load_n(&published->rtpTimeStamp, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (((seq & 1) != 0) || (seq != __atomic_load_n(&published->seq, __ATOMIC_RELAXED)));
+  stats->seq = seq;
+}
+
+void POSRTPStreamSkipPackets(POSRTPStreamRef *stream, uint32_t numPackets)
+{
+  stream->outSequenceNr = stream->outSequenceNr + numPackets;
+  POSRTPStreamPublishSenderStats(stream, stream->senderStats.rtpTimeStamp);
+}
+
+// Whether a packet starts a key frame, counted the way POSRTPStreamPushPayload counts
+// them.  IDR and IRAP NALUs are never aggregated, so only single NALU packets and first
+// fragments can start one.
+static bool POSRTPPacketStartsKeyFrame(RTPType encodeType, const uint8_t *payloadBytes, size_t numPayloadBytes)
+{
+  uint8_t NALType;
+
+  if ((encodeType == RTPType_H264) && (numPayloadBytes > 1))
+  {
+    NALType = payloadBytes[0] & 0x1f;
+    if (NALType == 28)
+    {
+      // FU-A
+      if ((payloadBytes[1] & 0x80) == 0)
+        return false;
+      NALType = payloadBytes[1] & 0x1f;
+    }
+    return NALType == 5;
+  }
+  if ((encodeType == RTPType_H265) && (numPayloadBytes > 2))
+  {
+    NALType = (payloadBytes[0] >> 1) & 0x3f;
+    if (NALType == 49)
+    {
+      // FU
+      if ((payloadBytes[2] & 0x80) == 0)
+        return false;
+      NALType = payloadBytes[2] & 0x3f;
+    }
+    return (NALType >= 16) && (NALType <= 23);
+  }
+  return false;
+}
+
+void POSRTPStreamProtectPackets(POSRTPStreamRef *stream, const POSRTPStreamRef *packetizer, const void *plainPool,
+                                size_t plainStride, const size_t *plainLens, size_t numPackets, void *pool,
+                                size_t packetStride, size_t *packetLens)
+{
+  srtp_encrypt_job jobs[POS_RTP_SRTP_BATCH_MAX];
+  size_t numJobs = 0;
+  uint32_t tagSize;
+  size_t idx;
+
+  if (stream == 0)
+    return;
+  if (packetizer == 0)
+    return;
+  if ((plainPool == 0) || (plainLens == 0))
+    return;
+  if ((pool == 0) || (packetLens == 0))
+    return;
+
+  tagSize = (stream->context_output_srtp).tag_size;
+  if (stream->fec != 0)
+    stream->fecBatch->numPackets = 0;
+  for (idx = 0; idx < numPackets; idx++)
+  {
+    const uint8_t *plainBytes = (const uint8_t *)plainPool + idx * plainStride;
+    uint8_t *bytes = (uint8_t *)pool + idx * packetStride;
+    size_t numPlainBytes = plainLens[idx];
+    uint32_t headerBytes = 12;
+
+    // header extension (cvo) https://datatracker.ietf.org/doc/html/rfc3550#section-5.3.1
+    if ((numPlainBytes >= 16) && ((plainBytes[0] & 0x10) != 0))
+      headerBytes = headerBytes + 4 + ((uint32_t)plainBytes[14] * 0x100 + plainBytes[15]) * 4;
+    // the packetizer leaves room for the tag, so this should be impossible
+    HAPAssert(numPlainBytes >= headerBytes);
+    HAPAssert(packetStride >= numPlainBytes + tagSize);
+
+    uint32_t numDataBytes = numPlainBytes - headerBytes;
+    uint32_t index = stream->randomOutputSequenceNrBase + stream->outSequenceNr;
+    uint32_t timeStamp = ((uint32_t)plainBytes[4] << 24 | (uint32_t)plainBytes[5] << 16 |
+                          (uint32_t)plainBytes[6] << 8 | plainBytes[7]) -
+                         packetizer->outTimeStampBase + stream->outTimeStampBase;
+
+    HAPRawBufferCopyBytes(bytes, plainBytes, headerBytes);
+    bytes[2] = (uint8_t)(index >> 8);
+    bytes[3] = (uint8_t)index;
+    bytes[4] = (uint8_t)(timeStamp >> 24);
+    bytes[5] = (uint8_t)(timeStamp >> 16);
+    bytes[6] = (uint8_t)(timeStamp >> 8);
+    bytes[7] = (uint8_t)timeStamp;
+    bytes[8] = (uint8_t)(stream->outstreamSSRC >> 24);
+    bytes[9] = (uint8_t)(stream->outstreamSSRC >> 16);
+    bytes[10] = (uint8_t)(stream->outstreamSSRC >> 8);
+    bytes[11] = (uint8_t)stream->outstreamSSRC;
+
+    // the PLI holdoff of this viewer depends on its own key frame count
+    if (POSRTPPacketStartsKeyFrame(stream->encodeType, plainBytes + headerBytes, numDataBytes))
+      __atomic_add_fetch(&stream->keyFramesPushed, 1, __ATOMIC_RELAXED);
+    stream->outSequenceNr = stream->outSequenceNr + 1;
+    stream->totalOutPacketBytesWritten = stream->totalOutPacketBytesWritten + numDataBytes;
+    POSRTPStreamPublishSenderStats(stream, timeStamp);
+
+    if ((stream->context_output_srtp).key_size == 0)
+    {
+      HAPRawBufferCopyBytes(bytes + headerBytes, plainBytes + headerBytes, numDataBytes);
+      packetLens[idx] = numPlainBytes;
+      if (stream->fec != 0)
+        POSRTPStreamAddFecPacket(stream, bytes, numPlainBytes, idx);
+      if (stream->history != 0)
+        POSRTPHistoryRecord(stream->history, (uint16_t)index, bytes, numPlainBytes);
+      continue;
+    }
+    // encrypted in runs like POSRTPStreamPollPackets, straight from the packetizer's pool
+    jobs[numJobs].packet = bytes + headerBytes;
+    jobs[numJobs].data_bytes = plainBytes + headerBytes;
+    jobs[numJobs].num_header_bytes = 0;
+    jobs[numJobs].num_data_bytes = numDataBytes;
+    jobs[numJobs].index = index;
+    packetLens[idx] = numPlainBytes + tagSize;
+    if (++numJobs == POS_RTP_SRTP_BATCH_MAX)
+    {
+      POSRTPStreamEncryptPackets(stream, pool, packetStride, packetLens, idx + 1 - numJobs, jobs, numJobs);
+      numJobs = 0;
+    }
+  }
+  if (numJobs != 0)
+    POSRTPStreamEncryptPackets(stream, pool, packetStride, packetLens, numPackets - numJobs, jobs, numJobs);
+}
+
+// POSMakeRTPPacket with any number of FU header bytes, H.265 fragments carry three
+static uint32_t POSMakeRTPPacketWithHeader(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t numDataBytes,
+                                           uint8_t *packetBytes, size_t maxBytes, size_t *numPacketBytes,
+                                           const uint8_t *FUHeaderBytes, uint32_t numFUHeaderBytes, uint8_t cvoID,
+                                           uint8_t MarkerBit)
 
 {
   uint32_t tempBytesWritten;
   uint32_t packetStartOffset;
   uint8_t *packetStartByte;
-  uint32_t numFUHeaderBytes;
   uint32_t index;
 
   if (numPacketBytes == 0)
@@ -427,7 +1059,7 @@ uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t
   // RFC 1889 ver 2
   // https://datatracker.ietf.org/doc/html/rfc1889
   ((uint8_t *)packetBytes)[0] = (uint8_t)0x80;
-  ((uint8_t *)packetBytes)[1] = (uint8_t)stream->streamType + MarkerBit * -0x80;
+  ((uint8_t *)packetBytes)[1] = stream->payloadTypeToSend + MarkerBit * -0x80;
   ((uint8_t *)packetBytes)[2] = (uint8_t)(index >> 8);
   ((uint8_t *)packetBytes)[3] = (uint8_t)index;
   ((uint8_t *)packetBytes)[4] = (uint8_t)(stream->timeStampToSend >> 24);
@@ -468,16 +1100,10 @@ uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t
   packetStartByte = packetBytes + packetStartOffset;
 
   //*packetStartByte = 128;
-  if (FUHeader == 0)
+  if (numFUHeaderBytes != 0)
   {
-    numFUHeaderBytes = 0;
-  }
-  else
-  {
-    *(uint8_t *)(packetStartByte) = (uint8_t)(FUHeader >> 8);
-    *(uint8_t *)(packetStartByte + 1) = (uint8_t)FUHeader;
-    packetStartOffset = packetStartOffset + 2;
-    numFUHeaderBytes = 2;
+    HAPRawBufferCopyBytes(packetStartByte, FUHeaderBytes, numFUHeaderBytes);
+    packetStartOffset = packetStartOffset + numFUHeaderBytes;
   }
 
   //  this should be impossible with the correct calculation in Poll Packet
@@ -487,6 +1113,16 @@ uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t
   {
     HAPRawBufferCopyBytes(packetStartByte + numFUHeaderBytes, payloadBytes, numDataBytes);
   }
+  else if (stream->srtpJob != 0)
+  {
+    // POSRTPStreamPollPackets encrypts, authenticates and records the whole batch once it's built
+    stream->srtpJob->packet = packetStartByte;
+    stream->srtpJob->data_bytes = payloadBytes;
+    stream->srtpJob->num_header_bytes = numFUHeaderBytes;
+    stream->srtpJob->num_data_bytes = numDataBytes;
+    stream->srtpJob->index = index;
+    packetStartOffset = packetStartOffset + (stream->context_output_srtp).tag_size;
+  }
   else
   {
     // https://datatracker.ietf.org/doc/html/rfc3711
@@ -506,10 +1142,23 @@ uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t
   stream->outSequenceNr = stream->outSequenceNr + 1;
   tempBytesWritten = stream->totalOutPacketBytesWritten;
   stream->totalOutPacketBytesWritten = numDataBytes + tempBytesWritten + numFUHeaderBytes;
+  POSRTPStreamPublishSenderStats(stream, stream->timeStampToSend);
   *numPacketBytes = numDataBytes + packetStartOffset;
+  if ((stream->history != 0) && (stream->srtpJob == 0))
+    POSRTPHistoryRecord(stream->history, (uint16_t)index, packetBytes, *numPacketBytes);
   return (uint32_t)tempBytesWritten;
 }
 
+uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream, uint8_t *payloadBytes, size_t numDataBytes, uint8_t *packetBytes,
+                          size_t maxBytes, size_t *numPacketBytes, uint16_t FUHeader, uint8_t cvoID,
+                          uint8_t MarkerBit)
+
+{
+  uint8_t FUHeaderBytes[2] = {(uint8_t)(FUHeader >> 8), (uint8_t)FUHeader};
+  return POSMakeRTPPacketWithHeader(stream, payloadBytes, numDataBytes, packetBytes, maxBytes, numPacketBytes,
+                                    FUHeaderBytes, FUHeader == 0 ? 0 : 2, cvoID, MarkerBit);
+}
+
 //todo: replace with HAPReadLittleUInt32 and HAPWriteLittleUInt32
 uint32_t localEndian(uint32_t input)
 {
@@ -518,18 +1167,265 @@ uint32_t localEndian(uint32_t input)
 }
 
 
+// Same conversion POSRTPStreamPushPayload applies to sampleTime, both are CLOCK_MONOTONIC
+// (see POSMediaClock) so sender reports map onto the timestamps actually sent
 uint32_t TimeToTimestamp(POSRTPStreamRef *stream, uint64_t actualTime)
 {
   uint64_t TimeStampDelta;
-  uint64_t timeSinceStreamStart;
 
-  timeSinceStreamStart = actualTime - stream->streamStartTime;
-  TimeStampDelta = Upper64ofMul64((uint64_t)timeSinceStreamStart, ((uint64_t)stream->nsToTimestampConvLSW) +
+  TimeStampDelta = Upper64ofMul64((uint64_t)actualTime, ((uint64_t)stream->nsToTimestampConvLSW) +
                                                                           (((uint64_t)(stream->nsToTimestampConvMSW)) << 32));
 
   return stream->outTimeStampBase + TimeStampDelta;
 }
 
+typedef struct
+{
+  POSRTPStreamRef *stream;
+  HAPTime actualTime;
+  uint32_t NTPactualTimeMSW;
+  uint32_t NTPactualTimeLSW;
+  uint32_t LastRecvNtpTime65536thsOfSecond;
+} POSRTPStreamRTCPContext;
+
+// The send thread only counts the key frames it pushes, the request state and the
+// holdoff time belong to the rtcp thread, which takes a new count as a key frame sent now
+static void POSRTPStreamCheckKeyFramePushed(POSRTPStreamRef *stream, HAPTime actualTime)
+{
+  uint32_t keyFramesPushed = __atomic_load_n(&stream->keyFramesPushed, __ATOMIC_RELAXED);
+
+  if (keyFramesPushed != stream->keyFramesSeen)
+  {
+    stream->keyFramesSeen = keyFramesPushed;
+    stream->lastSentKeyFrame = actualTime;
+    stream->KeyFrameRequestedBitOne = 0;
+  }
+}
+
+// PLI and FIR both end up here, a new key frame is only asked of the encoder
+// once the last one has had two round trips (and at least
+// POS_RTP_KEYFRAME_HOLDOFF_MIN_MS) to reach the controller
+static void POSRTPStreamRequestKeyFrame(POSRTPStreamRTCPContext *ctx, const char *reason)
+{
+  POSRTPStreamRef *stream = ctx->stream;
+  const char *pLogString = "no new key frame";
+
+  POSRTPStreamCheckKeyFramePushed(stream, ctx->actualTime);
+  if (stream->KeyFrameRequestedBitOne != 0)
+  {
+    HAPLogInfo(&logObject, "%s: key frame already requested", reason);
+    return;
+  }
+  int64_t rtt = stream->roundTripTimeCalculation;
+  // 2 * rtt (uints: middle32) in ns
+  uint64_t holdoff = ((rtt << 0x11 & 0xffffffff) * 1000000000 >> 0x20) + ((rtt << 0x11) >> 0x20) * 1000000000;
+  if (holdoff < (uint64_t)POS_RTP_KEYFRAME_HOLDOFF_MIN_MS * 1000000)
+    holdoff = (uint64_t)POS_RTP_KEYFRAME_HOLDOFF_MIN_MS * 1000000;
+  if (holdoff + stream->lastSentKeyFrame <= ctx->actualTime)
+  {
+    stream->KeyFrameRequestedBitOne = 2;
+    pLogString = "request new key frame";
+  }
+  uint64_t lastSentKeyFrameNTPTime = POSMediaClockToNTPTime(&posMediaClock, stream->lastSentKeyFrame);
+  HAPLogInfo(&logObject, "%s: %s, time=%lu.%03lu, key-time=%lu.%03lu, rtt=%lu.%03lu", reason,
+             pLogString, ctx->NTPactualTimeMSW & 0xffff, ((uint64_t)(ctx->NTPactualTimeLSW) * 1000) >> 0x20,
+             (lastSentKeyFrameNTPTime >> 0x20) & 0xffff, ((lastSentKeyFrameNTPTime & 0xffffffff) * 1000 >> 0x20),
+             rtt >> 0x10, (rtt & 0xffff) * 1000 >> 0x10);
+}
+
+static void POSRTPStreamOnSenderReport(void *context, const POSRTCPSenderInfo *senderInfo)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if (senderInfo->senderSSRC != stream->instreamSSRC)
+    return;
+  stream->LastRecvNtpTime65536thsOfSecond = ctx->LastRecvNtpTime65536thsOfSecond;
+  stream->LastRecSenderReportNTPMSW = senderInfo->ntpMSW;
+  stream->LastRecSenderReportNTPLSW = senderInfo->ntpLSW;
+  stream->recRTCPTimestamp = senderInfo->rtpTimestamp;
+}
+
+static void POSRTPStreamOnReportBlock(void *context, const POSRTCPReportBlock *reportBlock)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((reportBlock->senderSSRC != stream->instreamSSRC) || (reportBlock->sourceSSRC != stream->outstreamSSRC))
+    return;
+  stream->remoteFractionLost = reportBlock->fractionLost;
+  stream->remoteJitter = reportBlock->jitter;
+  stream->remoteReportCount++;
+  if ((reportBlock->lastSR != 0) && (reportBlock->delaySinceLastSR != 0))
+  {
+    // bottom of page 40: https://datatracker.ietf.org/doc/html/rfc3550#page-40
+    uint32_t rtt_calc = (ctx->LastRecvNtpTime65536thsOfSecond - reportBlock->lastSR) - reportBlock->delaySinceLastSR;
+    // This smoothed Tr algorithm might be better https://datatracker.ietf.org/doc/html/rfc8083#page-7
+    uint32_t rtt_decay = stream->roundTripTimeCalculation -
+                         (stream->roundTripTimeCalculation >> 4);
+    if (rtt_calc <= rtt_decay)
+    {
+      rtt_calc = rtt_decay;
+    }
+    stream->roundTripTimeCalculation = rtt_calc;
+  }
+}
+
+static void POSRTPStreamOnBye(void *context, uint32_t ssrc)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+
+  if (ssrc == ctx->stream->instreamSSRC)
+    HAPLogInfo(&logObject, "BYE received from %08x", ssrc);
+}
+
+// Generic NACK https://datatracker.ietf.org/doc/html/rfc4585#section-6.2.1
+// each FCI is a lost packet id and a bitmask of the 16 packets following it
+static void POSRTPStreamOnNack(void *context, uint32_t senderSSRC, uint32_t mediaSSRC, uint16_t pid, uint16_t blp)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((senderSSRC != stream->instreamSSRC) || (mediaSSRC != stream->outstreamSSRC) || (stream->history == 0))
+    return;
+  for (uint32_t bit = 0; bit < 17; bit++)
+  {
+    if ((bit != 0) && ((blp >> (bit - 1) & 1) == 0))
+      continue;
+    if (stream->nackQueueHead - stream->nackQueueTail >= POS_RTP_NACK_QUEUE)
+    {
+      // fell too far behind, the controller will fall back to a PLI
+      stream->rtxPacketsMissed = stream->rtxPacketsMissed + 1;
+      continue;
+    }
+    stream->nackQueue[stream->nackQueueHead % POS_RTP_NACK_QUEUE] = (uint16_t)(pid + bit);
+    stream->nackQueueHead = stream->nackQueueHead + 1;
+  }
+}
+
+//TMMBR https://datatracker.ietf.org/doc/html/rfc5104#section-4.2.1
+static void POSRTPStreamOnTmmbr(void *context, const POSRTCPTmmbr *tmmbr)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((tmmbr->senderSSRC != stream->instreamSSRC) || (tmmbr->mediaSSRC != stream->outstreamSSRC))
+    return;
+  uint32_t maxPacketSize = stream->maximumMTU - stream->outStreamHeaderPlusTagSize;
+  uint32_t MxTBRmantessa = tmmbr->mantissa;
+  //TODO: this could be better coded, but is accurate
+  //   MxTBR = mantissa * 2^exp
+  uint32_t MxTBRoverhead = tmmbr->overhead;
+  uint32_t MxTBRexponent = tmmbr->exponent;
+  uint32_t recvCmdWord = MxTBRexponent << 0x1a | MxTBRmantessa << 9 | MxTBRoverhead;
+  uint32_t idx = 0;
+  if (maxPacketSize == 0)
+  {
+    return; //trap(7);
+  }
+  if (0xffffffffU >> (MxTBRexponent) < MxTBRmantessa)
+  {
+  label:
+    // MxTBRoverhead is the TMMBR measured overhead value
+    recvCmdWord = (MxTBRoverhead * 25000000) / maxPacketSize + 25000000;
+    while (0x1ffff < recvCmdWord)
+    {
+      recvCmdWord = recvCmdWord >> 1;
+      idx = idx + 1;
+    }
+    MxTBRmantessa = 25000000;
+    recvCmdWord = idx << 0x1a | recvCmdWord << 9 | MxTBRoverhead;
+  }
+  else
+  {
+    idx = MxTBRmantessa << (MxTBRexponent);
+    MxTBRmantessa = idx - (MxTBRoverhead * idx) / maxPacketSize;
+    if (25000000 < MxTBRmantessa)
+      goto label;
+  }
+  stream->lastReceivedTMMBRPayload = recvCmdWord;
+  stream->requestNewBitrateAtCheck = MxTBRmantessa;
+  if (MxTBRmantessa != stream->bitRate)
+  {
+    HAPLogInfo(&logObject, "new bitrate requested: %d -> %d", stream->bitRate, stream->requestNewBitrateAtCheck);
+  }
+}
+
+// Packet Loss Indication https://datatracker.ietf.org/doc/html/rfc4585#section-6.3.1
+static void POSRTPStreamOnPli(void *context, uint32_t senderSSRC, uint32_t mediaSSRC)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+
+  if ((senderSSRC != ctx->stream->instreamSSRC) || (mediaSSRC != ctx->stream->outstreamSSRC))
+    return;
+  POSRTPStreamRequestKeyFrame(ctx, "PLI");
+}
+
+// https://datatracker.ietf.org/doc/html/rfc5104#section-4.3.1
+static void POSRTPStreamOnFir(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((senderSSRC != stream->instreamSSRC) || (ssrc != stream->outstreamSSRC))
+    return;
+  // a repeated FIR with the same sequence number is a retransmission of one already handled
+  if (seqNr == stream->lastRecFIRframeRequestSequenceNumber)
+    return;
+  stream->lastRecFIRframeRequestSequenceNumber = seqNr;
+  POSRTPStreamRequestKeyFrame(ctx, "FIR");
+}
+
+// https://datatracker.ietf.org/doc/html/rfc5104#section-4.3.2
+static void POSRTPStreamOnTstr(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr, uint8_t index)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((senderSSRC != stream->instreamSSRC) || (ssrc != stream->outstreamSSRC))
+    return;
+  if (seqNr == stream->lastRecTSTRCmdWord)
+    return;
+  stream->lastRecTSTRCmdWord = seqNr;
+  if ((stream->lastRecTSTRSeqNr == 0xffffffff) ||
+      (0 < (char)(seqNr - (char)(stream->lastRecTSTRSeqNr >> 0x18))))
+  {
+    stream->lastRecTSTRSeqNr = seqNr * 0x1000000 + 0x1f;
+  }
+  else
+    // Temporal Spatial Tradeoff Request (0-31)
+    HAPLogInfo(&logObject, "TSTR received: index=%d", index);
+}
+
+// Receiver Estimated Max Bitrate, handled like a TMMBR without the overhead
+static void POSRTPStreamOnRemb(void *context, uint32_t senderSSRC, uint32_t ssrc, uint64_t bitRate)
+{
+  POSRTPStreamRTCPContext *ctx = context;
+  POSRTPStreamRef *stream = ctx->stream;
+
+  if ((senderSSRC != stream->instreamSSRC) || (ssrc != stream->outstreamSSRC))
+    return;
+  if (bitRate > 25000000)
+    bitRate = 25000000;
+  stream->requestNewBitrateAtCheck = (uint32_t)bitRate;
+  if (bitRate != stream->bitRate)
+  {
+    HAPLogInfo(&logObject, "REMB: new bitrate requested: %d -> %d", stream->bitRate, stream->requestNewBitrateAtCheck);
+  }
+}
+
+static const POSRTCPHandlers kPOSRTPStreamRTCPHandlers = {
+  .senderReport = POSRTPStreamOnSenderReport,
+  .reportBlock = POSRTPStreamOnReportBlock,
+  .bye = POSRTPStreamOnBye,
+  .nack = POSRTPStreamOnNack,
+  .tmmbr = POSRTPStreamOnTmmbr,
+  .pli = POSRTPStreamOnPli,
+  .fir = POSRTPStreamOnFir,
+  .tstr = POSRTPStreamOnTstr,
+  .remb = POSRTPStreamOnRemb,
+};
+
 void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPacketBytes, size_t *numPayloadBytes,
                             HAPTime actualTime)
 
@@ -538,7 +1434,6 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
   uint32_t NTPactualTimeMSW;
   uint32_t NTPactualTimeLSW;
   int srtpVerifyResult;
-  char *pLogString;
 
   *numPayloadBytes = 0;
 
@@ -659,9 +1554,9 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
     stream->lastRecPacketPayloadSize = numPacketBytes - 12;
     stream->lastRecEncPacketPtr = (uint8_t *)bytes + 12;
     stream->lastRecTimeStamp = localTimeStamp;
-    if (stream->instreamExtendedHighestSeqNrRec < *(uint32_t *)&stream->lastRecSqNrAndROC)
+    if (stream->instreamExtendedHighestSeqNrRec < stream->lastRecSqNrAndROC)
     {
-      stream->instreamExtendedHighestSeqNrRec = *(uint32_t *)&stream->lastRecSqNrAndROC;
+      stream->instreamExtendedHighestSeqNrRec = stream->lastRecSqNrAndROC;
     }
     stream->instreamSequenceNr = stream->instreamSequenceNr + 1;
     uint32_t timestampFromTime = TimeToTimestamp(stream, actualTime);
@@ -714,7 +1609,7 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
 
       // replay protection as defined in https://datatracker.ietf.org/doc/html/rfc2401#page-1-58
       uint32_t index = recIndex & 0x7fffffff; // most significant bit indicates whether the payload is encrypted
-      uint32_t recIndexDelta = index - *(int *)&stream->lastRecIndex;
+      uint32_t recIndexDelta = index - stream->lastRecIndex;
       uint32_t newBitmap = 0;
       if ((int)recIndexDelta < 1)
       {
@@ -723,8 +1618,8 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
           HAPLogInfo(&logObject,"(int)recIndexDelta < -31");
           return;
         }
-        newBitmap = 1 << (-recIndexDelta & 0x1f); // packet location in the bitmap
-        if ((newBitmap & *(uint32_t *)&stream->SRTCPReplayBitmap) != 0)
+        newBitmap = 1u << (-recIndexDelta & 0x1f); // packet location in the bitmap
+        if ((newBitmap & stream->SRTCPReplayBitmap) != 0)
         {
           HAPLogError(&logObject,"Replayed SRTCP input packet");
           return;
@@ -735,14 +1630,14 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
       {
         if ((int)recIndexDelta < 32)
         {
-          newBitmap = *(int *)&stream->SRTCPReplayBitmap << (recIndexDelta & 0x1f) | 1; // move the bitmap
+          newBitmap = stream->SRTCPReplayBitmap << (recIndexDelta & 0x1f) | 1; // move the bitmap
         }
         else
         {
           newBitmap = 1; // jumped far ahead, create a fresh bitmap
         }
-        *(uint32_t *)&stream->SRTCPReplayBitmap = newBitmap;
-        *(uint32_t *)&stream->lastRecIndex = index;
+        stream->SRTCPReplayBitmap = newBitmap;
+        stream->lastRecIndex = index;
       }
       if (recIndex >> 0x1f != 0)
       {
@@ -754,269 +1649,24 @@ void POSRTPStreamPushPacket(POSRTPStreamRef *stream, void *bytes, size_t numPack
     }
 
     // HAPLogBufferDebugInternal(&kHAPRTPController_PacketLog,bytes,numPacketBytes,"(%p) <",stream);
-    uint8_t *rtcpPacketPointer = (uint8_t *)bytes;
-    while (rtcpPacketPointer + 4 <= (uint8_t *)bytes + numPacketBytes)
-    {
-      // Walk through RTP packets in received buffer and
-      // check RTP header Version for consistency
-      if (*rtcpPacketPointer >> 6 != 2)
-      {
-        HAPLogInfo(&logObject,"*rtcpPacketPointer >> 6 != 2): returning");
-        return;
-      }
-      rtcpPacketPointer =
-          rtcpPacketPointer +
-          (uint8_t)rtcpPacketPointer[2] * 0x400 + (uint8_t)rtcpPacketPointer[3] * 4 + 4;
-    }
-    if ((uint8_t *)bytes + numPacketBytes != rtcpPacketPointer)
-    {
-      //HAPLogInfo(&logObject,"(uint8_t *)bytes + numPacketBytes = %p\n", (uint8_t *)bytes + numPacketBytes);
-      //HAPLogInfo(&logObject,"rtcpPacketPointer = %p\n", rtcpPacketPointer);
-      //HAPLogInfo(&logObject,"((uint8_t *)bytes + numPacketBytes != rtcpPacketPointer), returning");
-      return;
-    }
-
-    HAPNTPTimeOutput = HAPTimeToNTPTime(actualTime);
+    // same wall clock mapping as the sender reports, the RTT is taken against their NTP time
+    HAPNTPTimeOutput = POSMediaClockToNTPTime(&posMediaClock, actualTime);
     NTPactualTimeMSW = (uint32_t)((uint64_t)HAPNTPTimeOutput >> 0x20);
     NTPactualTimeLSW = HAPNTPTimeOutput & 0xffffffff;
-    stream->lastRecvNTPtime = NTPactualTimeMSW;
 
-    uint32_t LastRecvNtpTime65536thsOfSecond = NTPactualTimeLSW >> 0x10 | NTPactualTimeMSW << 0x10;
-    while (bytes < (void *) rtcpPacketPointer)
+    POSRTPStreamRTCPContext rtcpContext = {
+      .stream = stream,
+      .actualTime = actualTime,
+      .NTPactualTimeMSW = NTPactualTimeMSW,
+      .NTPactualTimeLSW = NTPactualTimeLSW,
+      .LastRecvNtpTime65536thsOfSecond = NTPactualTimeLSW >> 0x10 | NTPactualTimeMSW << 0x10,
+    };
+    if (!POSRTCPParse(bytes, numPacketBytes, &kPOSRTPStreamRTCPHandlers, &rtcpContext))
     {
-      // Walk through RTCP packets
-      // https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1
-      uint32_t *RTCPReportBlockStart;
-      uint8_t rtcpPacketType = ((uint8_t *)bytes)[1];
-      uint32_t rtcpPacketSize = (uint32_t)((uint8_t *)bytes)[2] * 0x400 + (uint32_t)((uint8_t *)bytes)[3] * 4 + 4;
-      uint32_t rtcpReportCount = (uint32_t) * (uint8_t *)bytes & 0x1f;
-      if (rtcpPacketType < 200)
-      {
-        // Ignore Packet Types < 200
-        HAPLogInfo(&logObject,"Ignore Packet Types < 200");
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      if (rtcpPacketType < 202)
-      {
-        // Accept
-        // Sender Report (type 200)
-        // Receiver Report (type 201)
-        if ((rtcpPacketSize > 7) && localEndian(*(uint32_t *)((uint8_t *)bytes + 4)) == stream->instreamSSRC)
-        {
-          if (rtcpPacketType == 200)
-          {
-            // Sender Report
-            if (rtcpPacketSize == rtcpReportCount * 0x18 + 0x1c)
-            {
-              uint32_t recRTPTimestamp = *(uint32_t *)(bytes + 16);
-              stream->LastRecvNtpTime65536thsOfSecond = LastRecvNtpTime65536thsOfSecond;
-              stream->LastRecSenderReportNTPMSW = localEndian(*(uint32_t *)(bytes + 8));
-              stream->LastRecSenderReportNTPLSW = localEndian(*(uint32_t *)(bytes + 12));
-              RTCPReportBlockStart = (uint32_t *)((uint8_t *)bytes + 28);
-              stream->recRTCPTimestamp = localEndian(recRTPTimestamp);
-            }
-            else
-            {
-              // reject: next rtcp report
-              HAPLogInfo(&logObject,"reject: next rtcp report ");
-              bytes = (uint8_t *)bytes + rtcpPacketSize;
-              continue;
-            }
-          }
-          else
-          {
-            if (rtcpPacketSize == rtcpReportCount * 0x18 + 8)
-            {
-              // Receiver Report
-              RTCPReportBlockStart = (uint32_t *)((uint8_t *)bytes + 8);
-            }
-            else
-            {
-              // reject: next rtcp report
-              bytes = (uint8_t *)bytes + rtcpPacketSize;
-              continue;
-            }
-          }
-          while (rtcpReportCount != 0)
-          {
-            if (localEndian(*RTCPReportBlockStart) == stream->outstreamSSRC)
-            {
-              uint32_t localLastSenderReport = localEndian(*(uint32_t *)((uint8_t *)RTCPReportBlockStart + 16));           // last Sender Report
-              uint32_t localDelaySinceLastSenderReport = localEndian(*(uint32_t *)((uint8_t *)RTCPReportBlockStart + 20)); // delay since last sender report
-              if ((localLastSenderReport != 0) && (localDelaySinceLastSenderReport != 0))
-              {
-                // bottom of page 40: https://datatracker.ietf.org/doc/html/rfc3550#page-40
-                uint32_t rtt_calc = (LastRecvNtpTime65536thsOfSecond - localLastSenderReport) - localDelaySinceLastSenderReport;
-                // This smoothed Tr algorithm might be better https://datatracker.ietf.org/doc/html/rfc8083#page-7
-                uint32_t rtt_decay = stream->roundTripTimeCalculation -
-                                     (stream->roundTripTimeCalculation >> 4);
-                if (rtt_calc <= rtt_decay)
-                {
-                  rtt_calc = rtt_decay;
-                }
-                stream->roundTripTimeCalculation = rtt_calc;
-              }
-            }
-            RTCPReportBlockStart = RTCPReportBlockStart + 6;
-            rtcpReportCount = rtcpReportCount - 1 & 0xff;
-          }
-        }
-        // done: next rtcp report
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      // RTCP Packet Number >206
-      if ((((uint8_t)rtcpPacketType > 206) || (rtcpPacketSize < 12)) || (localEndian(*(uint32_t *)((uint8_t *)bytes + 4)) != stream->instreamSSRC))
-      {
-        // next rtcp report
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      // packet type 206 (PSFB) processing https://datatracker.ietf.org/doc/html/rfc5104
-      uint32_t psfb_fmt = rtcpReportCount;
-      if (rtcpPacketType != 205)
-      {
-        if (psfb_fmt == 1)
-        {
-          // Packet Loss Indication https://datatracker.ietf.org/doc/html/rfc4585#section-6.3.1
-          if ((rtcpPacketSize == 12) &&
-              (localEndian(*(uint32_t *)((uint8_t *)bytes + 8)) == stream->outstreamSSRC))
-          {
-            HAPLogInfo(&logObject,"processing a PLI packet");
-            if (*(int *)&stream->KeyFrameRequestedBitOne == 0)
-            {
-              int64_t rtt = stream->roundTripTimeCalculation;
-              pLogString = "no new key frame";
-              // if (2 * rtt (uints: middle32) + lastsentkeyframe (uints: ns since hap epoch))<= actualTime (uints: ns since hap epoch)
-              if (((rtt << 0x11 & 0xffffffff) * 1000000000 >> 0x20) +
-                      ((rtt << 0x11) >> 0x20) * 1000000000 +
-                      (int64_t)(stream->lastSentKeyFrame) <=
-                  actualTime)
-              {
-                stream->KeyFrameRequestedBitOne = 2;
-                pLogString = "request new key frame";
-              }
-              uint64_t lastSentKeyFrameNTPTime = HAPTimeToNTPTime(stream->lastSentKeyFrame);
-              // Packet Loss Indication
-              HAPLogInfo(&logObject,"PLI: %s, time=%lu.%03lu, key-time=%lu.%03lu, rtt=%lu.%03lu",
-                     pLogString, NTPactualTimeMSW & 0xffff, ((uint64_t)(NTPactualTimeLSW) * 1000) >> 0x20,
-                     (lastSentKeyFrameNTPTime >> 0x20) & 0xffff, ((lastSentKeyFrameNTPTime & 0xffffffff) * 1000 >> 0x20),
-                     rtt >> 0x10, (rtt & 0xffff) * 1000 >> 0x10);
-            }
-            else
-            {
-              HAPLogInfo(&logObject,"PLI: key frame already requested");
-            }
-            bytes = (uint8_t *)bytes + rtcpPacketSize;
-            continue;
-          }
-        }
-        else
-        {
-          if (psfb_fmt == 4)
-          {
-            // https://datatracker.ietf.org/doc/html/rfc5104#section-4.2.2
-            if (((rtcpPacketSize == 20) && (localEndian(*(uint32_t *)((uint8_t *)bytes + 12)) == stream->outstreamSSRC)) &&
-                ((uint8_t)((uint8_t *)bytes)[0x10] != stream->lastRecFIRframeRequestSequenceNumber))
-            {
-              stream->lastRecFIRframeRequestSequenceNumber = (uint8_t)((uint8_t *)bytes)[0x10];
-              if (*(int *)&stream->KeyFrameRequestedBitOne == 0)
-              {
-                *(uint32_t *)&stream->KeyFrameRequestedBitOne = 2;
-                HAPLogInfo(&logObject, "FIR: request new key frame");
-              }
-              else
-              {
-                HAPLogInfo(&logObject, "FIR: key frame already requested");
-              }
-              bytes = (uint8_t *)bytes + rtcpPacketSize;
-              continue;
-            }
-          }
-          else
-          {
-            if (((psfb_fmt == 5) && (rtcpPacketSize == 20)) && (localEndian(*(uint32_t *)((uint8_t *)bytes + 12)) == stream->outstreamSSRC))
-            {
-              // https://datatracker.ietf.org/doc/html/rfc5104#section-4.3.2
-              uint8_t TSTRcmdWordLoc = ((uint8_t *)bytes)[0x10];
-              uint16_t TSTRcmdWord = (uint16_t)TSTRcmdWordLoc;
-              if (TSTRcmdWord != stream->lastRecTSTRCmdWord)
-              {
-                stream->lastRecTSTRCmdWord = TSTRcmdWord;
-                if ((stream->lastRecTSTRSeqNr == 0xffffffff) ||
-                    (0 < (char)(TSTRcmdWordLoc - (char)(stream->lastRecTSTRSeqNr >> 0x18))))
-                {
-                  stream->lastRecTSTRSeqNr = TSTRcmdWord * 0x1000000 + 0x1f;
-                }
-                else
-
-                  // Temporal Spatial Tradeoff Request (0-31)
-                  // HAPLogInfoInternal(&logObject,"TSTR received: index=%d",
-                  //                   (uint)((uint8_t *)bytes)[0x13] & 0x1f);
-                  HAPLogInfo(&logObject,"TSTR received: index=%d",
-                         (uint8_t)((uint8_t *)bytes)[0x13] & 0x1f);
-                bytes = (uint8_t *)bytes + rtcpPacketSize;
-                continue;
-              }
-            }
-          }
-        }
-        // next rtcp report
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      // 205 RTPFB Processing https://datatracker.ietf.org/doc/html/rfc4585#section-6.1
-      if (((psfb_fmt != 3) || (rtcpPacketSize != 20)) || (localEndian(*(uint32_t *)((uint8_t *)bytes + 12)) != stream->outstreamSSRC))
-      {
-
-        HAPLogInfo(&logObject,"psfb_fmt %d, rtcpPacketSize %d, ssrc %d", psfb_fmt, rtcpPacketSize, (localEndian(*(uint32_t *)((uint8_t *)bytes + 12))));
-        // next rtcp report
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      //TMMBR https://datatracker.ietf.org/doc/html/rfc5104#section-4.2.1
-      uint32_t recvCmdWord = localEndian(*(uint32_t *)((uint8_t *)bytes + 0x10));
-      uint32_t maxPacketSize = stream->maximumMTU - stream->outStreamHeaderPlusTagSize;
-      uint32_t MxTBRmantessa = recvCmdWord * 0x40 >> 0xf;
-      //TODO: this could be better coded, but is accurate
-      // (recvCmdWord >> 0x1a & 1f) is the value of the MxTBR exponent
-                //   MxTBR = mantissa * 2^exp 
-      uint32_t MxTBRoverhead = recvCmdWord & 0x1ff;
-      uint32_t MxTBRexponent = recvCmdWord >> 0x1a & 0x1f;
-      uint32_t idx = 0;
-      if (0xffffffffU >> (MxTBRexponent) < MxTBRmantessa) {
-      label:
-        // MxTBRoverhead is the TMMBR measured overhead value
-        if (maxPacketSize == 0) {
-          return; //trap(7);
-        }
-        recvCmdWord = (MxTBRoverhead * 25000000) / maxPacketSize + 25000000;
-        while (0x1ffff < recvCmdWord) {
-          recvCmdWord = recvCmdWord >> 1;
-          idx = idx + 1;
-        }
-        MxTBRmantessa = 25000000;
-        recvCmdWord = idx << 0x1a | recvCmdWord << 9 | MxTBRoverhead;
-      }
-      else {
-        idx = MxTBRmantessa << (MxTBRexponent);
-        if (maxPacketSize == 0) {
-          return; //trap(7);
-        }
-        MxTBRmantessa = idx - (MxTBRoverhead * idx) / maxPacketSize;
-        if (25000000 < MxTBRmantessa) goto label;
-      }
-      stream->lastReceivedTMMBRPayload = recvCmdWord;
-      stream->requestNewBitrateAtCheck = MxTBRmantessa;
-      if (MxTBRmantessa == stream->bitRate){
-        // next rtcp report
-        bytes = (uint8_t *)bytes + rtcpPacketSize;
-        continue;
-      }
-      HAPLogInfo(&logObject,"new bitrate requested: %d -> %d", stream->bitRate, stream->requestNewBitrateAtCheck);
-      bytes = (uint8_t *)bytes + rtcpPacketSize;
+      HAPLogInfo(&logObject, "malformed compound RTCP packet, ignored");
+      return;
     }
+    stream->lastRecvNTPtime = HAPTimeToNTPTime(actualTime) >> 32;
   }
   return;
 }
@@ -1115,7 +1765,8 @@ void POSRTPStreamCheckFeedback(POSRTPStreamRef *stream, HAPTime actualTime, void
   }
   if (newKeyFrame != 0)
   {
-    if (*(int *)&stream->KeyFrameRequestedBitOne == 2)
+    POSRTPStreamCheckKeyFramePushed(stream, actualTime);
+    if (stream->KeyFrameRequestedBitOne == 2)
     {
       *newKeyFrame = 1;
       stream->KeyFrameRequestedBitOne = 1;
@@ -1129,32 +1780,36 @@ void POSRTPStreamCheckFeedback(POSRTPStreamRef *stream, HAPTime actualTime, void
     HAPLogError(&logObject,"not enough space, bailing.");
     return; // enough space to fit any size packet and avoid checking throughout
   }
-  uint64_t NTPTime = HAPTimeToNTPTime(actualTime);
+  // wall clock for the sender report, the dropout time is measured on the monotonic clock
+  uint64_t NTPTime = POSMediaClockToNTPTime(&posMediaClock, actualTime);
 
   if (dropoutTime != 0)
   {
     // printf("NTPTime %lu, lastRecvNTPtime %lu\n",NTPTime>>32,(stream->lastRecvNTPtime));
-    *dropoutTime = (uint32_t)(NTPTime >> 32) - (uint32_t)(stream->lastRecvNTPtime);
+    *dropoutTime = (uint32_t)(HAPTimeToNTPTime(actualTime) >> 32) - (uint32_t)(stream->lastRecvNTPtime);
   }
 
   if (stream->lastReceivedTMMBRPayload == 0xffffffff)
   {
-    if (actualTime < stream->lastRTCPReportHAPTime + (uint64_t)stream->rtcpInterval * 1000000)
-    { // ms to ns conv
-      HAPLogDebug(&logObject,"not time to send a report yet, rtcpInterval: %u\n", (uint64_t)stream->rtcpInterval * 1000000);
+    if (actualTime < stream->nextRTCPReportHAPTime)
+    {
       return;
     }
   }
 
   stream->lastRTCPReportHAPTime = actualTime;
+  stream->nextRTCPReportHAPTime = actualTime + POSRTPStreamRTCPInterval(stream, false);
 
   uint32_t deltaSinceLastRecvReport = stream->instreamSequenceNr - stream->lastRecvReportRTPIndex;
   stream->lastRecvReportRTPIndex = stream->instreamSequenceNr;
 
   // https://datatracker.ietf.org/doc/html/rfc3550#appendix-A.3
   uint32_t lastInstreamExpectedPackets = stream->instreamExpectedPackets;
-  uint32_t localOutSeqNr = stream->outSequenceNr;
-  uint32_t instreamExpectedPackets = stream->instreamExtendedHighestSeqNrRec - *(int *)&stream->firstRecSqNr + 1;
+  // the send thread may be mid packet, take the counters from the published snapshot
+  POSRTPSenderStats senderStats;
+  POSRTPStreamGetSenderStats(stream, &senderStats);
+  uint32_t localOutSeqNr = senderStats.packetCount;
+  uint32_t instreamExpectedPackets = stream->instreamExtendedHighestSeqNrRec - stream->firstRecSqNr + 1;
   stream->instreamExpectedPackets = instreamExpectedPackets;
 
   uint32_t localOutSeqNrOfTwoPreviousSenderReport = stream->outSeqNrOfTwoPreviousSenderReport; // yes
@@ -1187,7 +1842,7 @@ void POSRTPStreamCheckFeedback(POSRTPStreamRef *stream, HAPTime actualTime, void
     *(uint32_t *)(ptrNextReport + 4) = localEndian((uint32_t)NTPTime);
     *(uint32_t *)(ptrNextReport + 8) = localEndian(TimeToTimestamp(stream, actualTime));
     *(uint32_t *)(ptrNextReport + 12) = localEndian(localOutSeqNr);
-    *(uint32_t *)(ptrNextReport + 16) = localEndian(stream->totalOutPacketBytesWritten);
+    *(uint32_t *)(ptrNextReport + 16) = localEndian(senderStats.octetCount);
 
     ptrNextReport = ptrNextReport + 20;
   }
@@ -1248,22 +1903,28 @@ void POSRTPStreamCheckFeedback(POSRTPStreamRef *stream, HAPTime actualTime, void
   {
     //HAPLogDebug(&logObject,"Starting SDES Report");
 
-    uint32_t cnameReportLength = stream->localCNAMElength + 10 >> 2;
-    *(uint8_t *)(ptrNextReport + 0) = 0x81; // V2, one source count
+    // the FEC stream gets a chunk with the same CNAME, which ties its SSRC to this source
+    uint32_t numChunks = stream->fec != 0 ? 2 : 1;
+    uint32_t cnameReportLength = numChunks * (stream->localCNAMElength + 10 >> 2);
+    *(uint8_t *)(ptrNextReport + 0) = (uint8_t)(0x80 | numChunks); // V2, source count
     *(uint8_t *)(ptrNextReport + 1) = 202;  // SDES
     *(uint8_t *)(ptrNextReport + 2) = (uint8_t)((cnameReportLength << 0x10) >> 0x18);
     *(uint8_t *)(ptrNextReport + 3) = (uint8_t)cnameReportLength;
-    *(uint32_t *)(ptrNextReport + 4) = localEndian(stream->outstreamSSRC);
-    *(uint8_t *)(ptrNextReport + 8) = 1; // CNAME
-    *(uint8_t *)(ptrNextReport + 9) = (uint8_t)stream->localCNAMElength;
-    HAPRawBufferCopyBytes(ptrNextReport + 10, stream->localCNAME, (uint8_t)stream->localCNAMElength);
-    ptrNextReport = ptrNextReport + 10 + (uint8_t)stream->localCNAMElength;
-    do
+    ptrNextReport = ptrNextReport + 4;
+    for (uint32_t chunk = 0; chunk < numChunks; chunk++)
     {
-      uint8_t *stringTerm = ptrNextReport;
-      ptrNextReport = stringTerm + 1;
-      *stringTerm = 0;
-    } while (((uint32_t)ptrNextReport & 3) != 0); // relies on word being 4 byte aligned
+      *(uint32_t *)(ptrNextReport + 0) = localEndian(chunk == 0 ? stream->outstreamSSRC : stream->fec->ssrc);
+      *(uint8_t *)(ptrNextReport + 4) = 1; // CNAME
+      *(uint8_t *)(ptrNextReport + 5) = (uint8_t)stream->localCNAMElength;
+      HAPRawBufferCopyBytes(ptrNextReport + 6, stream->localCNAME, (uint8_t)stream->localCNAMElength);
+      ptrNextReport = ptrNextReport + 6 + (uint8_t)stream->localCNAMElength;
+      do
+      {
+        uint8_t *stringTerm = ptrNextReport;
+        ptrNextReport = stringTerm + 1;
+        *stringTerm = 0;
+      } while (((uint32_t)ptrNextReport & 3) != 0); // relies on word being 4 byte aligned
+    }
 
     if (stream->lastReceivedTMMBRPayload != 0xffffffff)
     {
@@ -1325,6 +1986,149 @@ void POSRTPStreamCheckFeedback(POSRTPStreamRef *stream, HAPTime actualTime, void
   }
   *numBytes = ptrNextReport - (uint8_t *)bytes;
 //  HAPLogError(&logObject,"POSRTPStreamCheckFeedback exiting with numBytes: %d\n", *numBytes);
+  // RFC 3550 A.7 running average, 1/16 weight for the newest report
+  stream->avgRTCPSize = (uint32_t)((int32_t)stream->avgRTCPSize +
+                                   ((int32_t)(*numBytes + POS_RTCP_IP_UDP_HEADER_SIZE) - (int32_t)stream->avgRTCPSize) / 16);
   
   return;
 }
+
+void POSRTPStreamSetFec(POSRTPStreamRef *stream, POSRTPFecEncoder *fec, POSRTPFecBatch *batch,
+                        POSSRTPParameters *srtpOutParameters)
+{
+  if (stream == 0)
+    return;
+  srtp_freeContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp);
+  stream->fec = 0;
+  stream->fecBatch = 0;
+  if ((fec == 0) || (batch == 0) || (fec->payloadType == 0))
+    return;
+
+  // the same master key as the media, the SSRC in the IV keeps the keystreams apart
+  if (srtpOutParameters->cryptoType == CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80)
+    srtp_setupContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp,
+                      (const char *)srtpOutParameters->Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                      (const char *)srtpOutParameters->Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10, fec->ssrc);
+  else if (srtpOutParameters->cryptoType == CRYPTOTYPE_AES_256_CM_HMAC_SHA1_80)
+    srtp_setupContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp,
+                      (const char *)srtpOutParameters->Key_Union.AES_256_CM_HMAC_SHA1_80.key, 32,
+                      (const char *)srtpOutParameters->Key_Union.AES_256_CM_HMAC_SHA1_80.salt, 10, fec->ssrc);
+  if ((stream->context_output_fec_srtp).key_size != (stream->context_output_srtp).key_size)
+  {
+    HAPLogError(&logObject, "POSRTPStreamSetFec with other output crypto than the stream, FEC stays off");
+    srtp_freeContext(&stream->context_output_fec_srtp, &stream->context_output_fec_rtcp);
+    return;
+  }
+  batch->numPackets = 0;
+  batch->numDropped = 0;
+  stream->fecLastSeq = fec->seq;
+  stream->fecRolloverCount = 0;
+  stream->fecBatch = batch;
+  stream->fec = fec;
+}
+
+void POSRTPStreamSetHistory(POSRTPStreamRef *stream, POSRTPPacketHistory *history)
+{
+  if (stream == 0)
+    return;
+  if (history != 0)
+  {
+    for (uint32_t idx = 0; idx < POS_RTP_HISTORY_PACKETS; idx++)
+    {
+      history->slots[idx].seq = POS_RTP_HISTORY_EMPTY;
+      history->slots[idx].numBytes = 0;
+      history->slots[idx].lastResentSeq = POS_RTP_HISTORY_EMPTY;
+      history->slots[idx].lastResentTime = 0;
+    }
+  }
+  stream->nackQueueHead = 0;
+  stream->nackQueueTail = 0;
+  stream->rtxBudgetBytes = 0;
+  stream->rtxLastRefillTime = 0;
+  __atomic_store_n(&stream->history, history, __ATOMIC_RELEASE);
+}
+
+void POSRTPStreamPollRetransmission(POSRTPStreamRef *stream, HAPTime actualTime, void *bytes, size_t maxBytes,
+                                    size_t *numPacketBytes)
+{
+  if (numPacketBytes == 0)
+    return;
+  *numPacketBytes = 0;
+  if (stream == 0)
+    return;
+  if (bytes == 0)
+    return;
+  if (stream->history == 0)
+    return;
+  if (stream->nackQueueHead == stream->nackQueueTail)
+    return;
+
+  // refill the retransmission budget, it holds at most 100ms worth so a burst of
+  // NACKs after a long quiet period can't flood the link
+  uint64_t bytesPerSecond = (uint64_t)stream->bitRate / 8 * POS_RTP_RTX_MAX_PERCENT / 100;
+  int64_t maxBudget = bytesPerSecond / 10;
+  if (maxBudget < 2 * POS_RTP_HISTORY_MAX_PACKET)
+    maxBudget = 2 * POS_RTP_HISTORY_MAX_PACKET;
+  if (stream->rtxLastRefillTime == 0)
+  {
+    stream->rtxBudgetBytes = maxBudget;
+  }
+  else
+  {
+    int64_t budget = stream->rtxBudgetBytes + (int64_t)(bytesPerSecond * (actualTime - stream->rtxLastRefillTime) / 1000000000);
+    stream->rtxBudgetBytes = budget > maxBudget ? maxBudget : budget;
+  }
+  stream->rtxLastRefillTime = actualTime;
+
+  // don't resend a packet again until the first resend has had a round trip to arrive
+  int64_t rtt = stream->roundTripTimeCalculation; // 16.16 seconds
+  uint64_t resendHoldoff = ((uint64_t)rtt * 1000000000) >> 16;
+  if (resendHoldoff < 10000000)
+    resendHoldoff = 10000000;
+
+  while (stream->nackQueueHead != stream->nackQueueTail)
+  {
+    uint16_t seq = stream->nackQueue[stream->nackQueueTail % POS_RTP_NACK_QUEUE];
+    POSRTPHistorySlot *slot = &stream->history->slots[seq & (POS_RTP_HISTORY_PACKETS - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+    {
+      // too old, or never fit in the history
+      stream->nackQueueTail = stream->nackQueueTail + 1;
+      stream->rtxPacketsMissed = stream->rtxPacketsMissed + 1;
+      continue;
+    }
+    if ((slot->lastResentSeq == seq) && (actualTime < slot->lastResentTime + resendHoldoff))
+    {
+      stream->nackQueueTail = stream->nackQueueTail + 1;
+      continue;
+    }
+    uint32_t slotNumBytes = slot->numBytes;
+    if (slotNumBytes > maxBytes)
+    {
+      stream->nackQueueTail = stream->nackQueueTail + 1;
+      stream->rtxPacketsMissed = stream->rtxPacketsMissed + 1;
+      continue;
+    }
+    if ((int32_t)slotNumBytes > stream->rtxBudgetBytes)
+    {
+      // leave it queued until the budget refills
+      return;
+    }
+    HAPRawBufferCopyBytes(bytes, slot->bytes, slotNumBytes);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    stream->nackQueueTail = stream->nackQueueTail + 1;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+    {
+      // the sender reused the slot while we copied it
+      stream->rtxPacketsMissed = stream->rtxPacketsMissed + 1;
+      continue;
+    }
+    slot->lastResentSeq = seq;
+    slot->lastResentTime = actualTime;
+    stream->rtxBudgetBytes = stream->rtxBudgetBytes - slotNumBytes;
+    stream->rtxPacketsSent = stream->rtxPacketsSent + 1;
+    *numPacketBytes = slotNumBytes;
+    return;
+  }
+}
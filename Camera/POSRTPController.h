@@ -24,17 +24,88 @@ extern "C" {
 #endif
 
 #include "HAP.h"
+#include "POSRTPFec.h"
 #include "POSSRTPCrypto.h"
 
 typedef uint64_t HAPTime;
 
 HAP_ENUM_BEGIN(uint8_t, RTPType){
     RTPType_Simple,
-    RTPType_H264
+    RTPType_H264,
+    RTPType_H265
 } HAP_ENUM_END(uint8_t, RTPType);
 
+// Sent packets kept for NACK retransmission, must be a power of two
+#define POS_RTP_HISTORY_PACKETS 256
+// Packets larger than this aren't kept, the video MTU HAP negotiates is well under it
+#define POS_RTP_HISTORY_MAX_PACKET 1500
+// Sequence numbers requested by NACKs and not yet resent
+#define POS_RTP_NACK_QUEUE 64
+// Retransmissions may use at most this share of the stream bitrate
+#define POS_RTP_RTX_MAX_PERCENT 20
+
+#define POS_RTP_HISTORY_EMPTY 0xffffffff
+// PLI and FIR don't ask for key frames closer together than this, or two RTTs if that is longer
+#define POS_RTP_KEYFRAME_HOLDOFF_MIN_MS 200
+
+// Assumed size of the first RTCP report on the wire, before avgRTCPSize has been measured
+#define POS_RTCP_INITIAL_AVG_SIZE 100
+// IPv4 and UDP headers, counted in avgRTCPSize
+#define POS_RTCP_IP_UDP_HEADER_SIZE 28
+
+// Small NALUs of one access unit are packed into a STAP-A of at most this size
+#define POS_RTP_AGGREGATE_MAX_BYTES 1500
+// POSRTPStreamPollPackets encrypts the packets it polls in runs of up to this many
+#define POS_RTP_SRTP_BATCH_MAX 16
+
+typedef struct
+{
+    uint32_t seq; // rtp sequence number, POS_RTP_HISTORY_EMPTY while being written
+    uint32_t numBytes;
+    uint32_t lastResentSeq;
+    HAPTime lastResentTime;
+    uint8_t bytes[POS_RTP_HISTORY_MAX_PACKET];
+} POSRTPHistorySlot;
+
+// Written by the thread polling packets, read by the thread handling rtcp.
+// Slots are reused by sequence number, a reader copies a slot and then checks
+// that its seq didn't change underneath it.
+typedef struct
+{
+    POSRTPHistorySlot slots[POS_RTP_HISTORY_PACKETS];
+} POSRTPPacketHistory;
+
+// Packet counters for sender reports. The send thread bumps seq to odd, updates the
+// counters and bumps it back to even, the rtcp thread retries its copy until it reads
+// the same even seq on both sides.
 typedef struct
 {
+    uint32_t seq;
+    uint32_t packetCount;  // rtp packets sent
+    uint32_t octetCount;   // payload bytes sent
+    uint32_t rtpTimeStamp; // of the newest packet sent
+} POSRTPSenderStats;
+
+// Parity packets one POSRTPStreamPollPackets batch can carry, more are dropped
+#define POS_RTP_FEC_BATCH_PARITY 64
+
+// The FEC parity of the last POSRTPStreamPollPackets batch, SRTP protected and in send order.
+// Parity packet n goes out right after packet after[n] of the batch.
+typedef struct
+{
+    uint8_t packets[POS_RTP_FEC_BATCH_PARITY][POS_RTP_FEC_PARITY_STRIDE];
+    size_t lens[POS_RTP_FEC_BATCH_PARITY];
+    size_t after[POS_RTP_FEC_BATCH_PARITY];
+    size_t numPackets;
+    uint32_t numDropped;
+} POSRTPFecBatch;
+
+// T31 data cache line, keeps the halves below from sharing lines between threads
+#define POS_RTP_CACHE_LINE_BYTES 32
+
+typedef struct
+{
+    // configuration, written by POSRTPStreamStart and only read afterwards
     uint32_t streamType;
     uint32_t clockFreq;
     uint32_t nsToTimestampConvLSW;
@@ -44,29 +115,50 @@ typedef struct
     uint32_t maximumMTU;
     uint32_t outStreamHeaderPlusTagSize;
     uint32_t rtcpInterval;
+    uint32_t sessionBitRate; // bps, unlike bitRate not moved by TMMBR or REMB
     char localCNAME[32];
     uint32_t localCNAMElength;
     RTPType encodeType;
-    uint32_t padding1;
-    void *payloadBytes; 
+    uint32_t randomOutputSequenceNrBase; 
+    uint32_t outTimeStampBase; 
+    uint8_t cvoID;
+    POSRTPPacketHistory *history;
+    POSRTPFecEncoder *fec;
+    POSRTPFecBatch *fecBatch;
+
+    // sender half, written by the thread polling packets
+    void *payloadBytes __attribute__((aligned(POS_RTP_CACHE_LINE_BYTES)));
     uint32_t numPayloadBytes; 
     uint32_t timeStampToSend; 
     uint32_t nextPayloadStart; 
-    uint32_t randomOutputSequenceNrBase; 
-    uint32_t outTimeStampBase; 
-    HAPTime streamStartTime;  
     uint32_t outSequenceNr;
     uint32_t totalOutPacketBytesWritten;
+    uint8_t cvoInformation;
+    uint8_t lastcvoInformationSent;
+    uint32_t keyFramesPushed; // bumped atomically for each key frame, the receiver half picks it up
+    uint32_t aggregateNumBytes; // of the STAP-A being filled, aggregateBytes[aggregateFill]
+    uint32_t aggregateNumNALUs;
+    uint32_t aggregateTimeStamp;
+    uint8_t aggregateFill;
+    bool aggregateReady; // the other aggregateBytes is polled ahead of the pushed payload
+    bool aggregateMarkerBit;
+    uint32_t readyNumBytes;
+    uint32_t readyNumNALUs;
+    uint32_t readyTimeStamp;
+    uint8_t payloadTypeToSend; // streamType, or the one given to POSRTPStreamPushPayloadAs
+    bool markerBitToSend;      // RTPType_Simple only
+    srtp_encrypt_job *srtpJob; // set while POSRTPStreamPollPackets defers the encryption of a packet
+    uint16_t fecLastSeq;
+    uint32_t fecRolloverCount; // SRTP ROC of the parity stream
+    POSRTPSenderStats senderStats __attribute__((aligned(POS_RTP_CACHE_LINE_BYTES)));
+
+    // receiver half, written by the thread handling incoming rtp and rtcp
+    HAPTime lastRTCPReportHAPTime __attribute__((aligned(POS_RTP_CACHE_LINE_BYTES)));
+    HAPTime nextRTCPReportHAPTime; // randomized, see POSRTPStreamRTCPInterval
+    uint32_t avgRTCPSize;          // bytes on the wire, including IP and UDP headers
     uint32_t outSeqNrOfLastSenderReport;
     uint32_t outSeqNrOfTwoPreviousSenderReport;
     uint32_t outputRTCPcounter;
-    uint8_t cvoID;
-    uint8_t cvoInformation;
-    uint8_t lastcvoInformationSent;
-    uint16_t KeyFrameRequestedBitOne;
-    //HAPTime unused1;
-    HAPTime lastSentKeyFrame;
-    HAPTime lastRTCPReportHAPTime;
     uint8_t *lastRecEncPacketPtr;
     uint32_t lastRecPacketPayloadSize;
     uint32_t lastRecTimeStamp;
@@ -87,6 +179,9 @@ typedef struct
     uint32_t SRTCPReplayBitmap;
     uint32_t interarrivalJitterCalc; 
     uint32_t roundTripTimeCalculation;
+    uint8_t remoteFractionLost; // from the controller's last receiver report, out of 256
+    uint32_t remoteJitter; // from the controller's last receiver report, in timestamp units
+    uint32_t remoteReportCount; // report blocks about this stream received, the fields above only change when it does
     uint64_t lastRecvNTPtime;
     uint32_t lastRecFIRframeRequestSequenceNumber;
     uint32_t lastRecTSTRCmdWord;
@@ -94,14 +189,31 @@ typedef struct
     uint32_t requestNewBitrateAtCheck;
     uint32_t lastReceivedTMMBRPayload;
     uint32_t lastRecTSTRSeqNr;
-    uint8_t SPSNALU[128];
+    uint16_t nackQueue[POS_RTP_NACK_QUEUE];
+    uint32_t nackQueueHead;
+    uint32_t nackQueueTail;
+    int32_t rtxBudgetBytes;
+    HAPTime rtxLastRefillTime;
+    uint32_t rtxPacketsSent;
+    uint32_t rtxPacketsMissed;
+    uint16_t KeyFrameRequestedBitOne; // 2 requested, 1 passed on to the encoder, 0 once it has been pushed
+    uint32_t keyFramesSeen;           // keyFramesPushed when lastSentKeyFrame was last updated
+    HAPTime lastSentKeyFrame;
+
+    // large and rarely touched, kept out of the lines above
+    uint8_t SPSNALU[128] __attribute__((aligned(POS_RTP_CACHE_LINE_BYTES)));
     uint32_t SPSNALUNumBytes;
     uint8_t PPSNALU[128];
     uint32_t PPSNALUNumBytes;
+    uint8_t VPSNALU[128]; // H.265 only
+    uint32_t VPSNALUNumBytes;
+    uint8_t aggregateBytes[2][POS_RTP_AGGREGATE_MAX_BYTES]; // STAP-A header then [size, NALU] pairs
     srtp_ctx context_input_srtp;
     srtp_ctx context_output_srtp;
     srtp_ctx context_input_rtcp;
     srtp_ctx context_output_rtcp;
+    srtp_ctx context_output_fec_srtp; // keyed like context_output_srtp for the FEC SSRC
+    srtp_ctx context_output_fec_rtcp;
 } POSRTPStreamRef;
 
 
@@ -109,9 +221,10 @@ typedef struct
 typedef struct {
     uint8_t type;
     uint32_t ssrc;
-    uint16_t maxBitRate;
+    uint16_t maxBitRate; // kbps
     float RTCPInterval;
     uint16_t maximumMTU;
+    uint32_t sessionBitRate; // kbps negotiated for the whole session, its 5% is the RTCP bandwidth, 0 = maxBitRate
 } POSRTPParameters;
 
 
@@ -152,9 +265,22 @@ uint64_t Upper64ofMul64(uint64_t a, uint64_t b);
 void POSRTPStreamPushPayload(POSRTPStreamRef *stream, void *bytes, size_t numBytes, size_t *numPayloadBytes,
                              HAPTimeNS sampleTime, HAPTime actualTime);
 
+// Push a RTPType_Simple payload that goes out with its own payload type and marker bit, e.g. a
+// RFC 3389 comfort noise packet, or the first audio packet of a talkspurt with the marker set.
+void POSRTPStreamPushPayloadAs(POSRTPStreamRef *stream, void *bytes, size_t numBytes, size_t *numPayloadBytes,
+                               uint8_t payloadType, bool markerBit, HAPTimeNS sampleTime, HAPTime actualTime);
+
+// Flush the small NALUs held back for a STAP-A after the last NALU of an access unit was pushed.
+// numPayloadBytes is non zero when there is a packet to poll.
+void POSRTPStreamEndAccessUnit(POSRTPStreamRef *stream, size_t *numPayloadBytes);
+
 void POSRTPStreamPollPacket
                (POSRTPStreamRef *stream, void *bytes, size_t maxBytes, size_t *numPacketBytes);
 
+void POSRTPStreamPollPackets
+               (POSRTPStreamRef *stream, void *pool, size_t packetStride, size_t maxPackets,
+               size_t *packetLens, size_t *numPackets);
+
 uint32_t POSMakeRTPPacket(POSRTPStreamRef *stream,uint8_t *payloadBytes,size_t numDataBytes,uint8_t *packetBytes,
 
                   size_t maxBytes,size_t *numPacketBytes,uint16_t FUHeader,uint8_t cvoID,
@@ -171,6 +297,68 @@ void POSRTPStreamCheckFeedback
                (POSRTPStreamRef *stream,HAPTime actualTime,void *bytes,size_t maxBytes,
                size_t *numBytes,uint32_t *bitRate,bool *newKeyFrame,uint32_t *dropoutTime);
 
+/**
+ * Starts a stream that only packetizes.  Packets come out of POSRTPStreamPollPackets
+ * unencrypted, with room left for a tagSize byte SRTP tag, and are turned into a
+ * viewer's packets with POSRTPStreamProtectPackets.  This lets several viewers share
+ * one packetization of each frame, see POSRTPFanout.
+ */
+HAPError POSRTPStreamStartPacketizer(POSRTPStreamRef *stream, POSRTPParameters *rtpParameters,
+                                     RTPType encodeType, uint32_t clockFrequency, uint32_t tagSize,
+                                     HAPTime startTime);
+
+/**
+ * Turns a batch polled from a packetizer stream into this stream's packets.  Each
+ * packet gets this stream's sequence number, timestamp base and SSRC, and is then
+ * encrypted and authenticated with this stream's SRTP context.  Sender report
+ * counters, key frame tracking, the NACK history and the FEC batch are updated as if
+ * the batch had come from POSRTPStreamPollPackets.
+ * Plain packet n is at plainPool + n * plainStride, its protected copy is written at
+ * pool + n * packetStride.
+ */
+void POSRTPStreamProtectPackets
+               (POSRTPStreamRef *stream, const POSRTPStreamRef *packetizer, const void *plainPool,
+               size_t plainStride, const size_t *plainLens, size_t numPackets, void *pool,
+               size_t packetStride, size_t *packetLens);
+
+/**
+ * Accounts for packets that were given sequence numbers but never sent, e.g. to a
+ * stalled viewer, so sender reports still count them.  Send thread only.
+ */
+void POSRTPStreamSkipPackets(POSRTPStreamRef *stream, uint32_t numPackets);
+
+/**
+ * Keeps a copy of every packet sent on the stream so Generic NACKs from the
+ * controller can be answered.  Call after POSRTPStreamStart, history may be NULL
+ * to turn retransmission off.
+ */
+void POSRTPStreamSetHistory(POSRTPStreamRef *stream, POSRTPPacketHistory *history);
+
+/**
+ * Builds XOR parity (RFC 5109) over the packets POSRTPStreamPollPackets polls.  The
+ * parity is taken from the plaintext before it is encrypted, so a receiver rebuilds
+ * the plaintext packet, and goes out SRTP protected under fec->ssrc, which the sender
+ * reports list next to the media SSRC.  The parity of each batch is left in batch.
+ * Call after POSRTPStreamStart with the same output parameters, fec may be NULL to
+ * turn FEC off.
+ */
+void POSRTPStreamSetFec(POSRTPStreamRef *stream, POSRTPFecEncoder *fec, POSRTPFecBatch *batch,
+                        POSSRTPParameters *srtpOutParameters);
+
+/**
+ * Returns the next packet requested by a NACK, resent as is from the history.
+ * *numPacketBytes is 0 when nothing is pending or the retransmission budget is spent.
+ */
+void POSRTPStreamPollRetransmission
+               (POSRTPStreamRef *stream, HAPTime actualTime, void *bytes, size_t maxBytes,
+               size_t *numPacketBytes);
+
+/**
+ * Copies a consistent snapshot of the sender report counters.  Safe to call from
+ * any thread while the send thread is running.
+ */
+void POSRTPStreamGetSenderStats(const POSRTPStreamRef *stream, POSRTPSenderStats *stats);
+
 
 
 
@@ -0,0 +1,206 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "HAP.h"
+
+#include "POSRTPFanout.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSRTPFanout"};
+
+void POSRTPFanoutInit(POSRTPFanout *fanout, POSRTPPacer *pacer)
+{
+  HAPPrecondition(fanout);
+
+  pthread_mutex_init(&fanout->mutex, NULL);
+  memset(fanout->viewers, 0, sizeof(fanout->viewers));
+  fanout->numViewers = 0;
+  fanout->pacer = pacer;
+}
+
+HAPError POSRTPFanoutAddViewer(POSRTPFanout *fanout, POSRTPStreamRef *stream, int sock)
+{
+  HAPPrecondition(fanout);
+  HAPPrecondition(stream);
+
+  // a stalled viewer must not block the thread sending to everyone
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    HAPLogError(&logObject, "Can't make viewer socket %d nonblocking: %s", sock, strerror(errno));
+  }
+
+  pthread_mutex_lock(&fanout->mutex);
+  POSRTPViewer *slot = NULL;
+  for (size_t idx = 0; idx < POS_RTP_FANOUT_MAX_VIEWERS; idx++)
+  {
+    if (fanout->viewers[idx].stream == stream)
+    {
+      slot = &fanout->viewers[idx]; // restarted, reuse its slot
+      fanout->numViewers--;
+      break;
+    }
+    if (slot == NULL && fanout->viewers[idx].stream == NULL)
+      slot = &fanout->viewers[idx];
+  }
+  if (slot == NULL)
+  {
+    pthread_mutex_unlock(&fanout->mutex);
+    HAPLogError(&logObject, "No room for another viewer");
+    return kHAPError_OutOfResources;
+  }
+  memset(slot, 0, sizeof(*slot));
+  slot->stream = stream;
+  slot->sock = sock;
+  __atomic_store_n(&fanout->numViewers, fanout->numViewers + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fanout->mutex);
+
+  HAPLogInfo(&logObject, "Added viewer on socket %d, %d watching", sock, (int)fanout->numViewers);
+  return kHAPError_None;
+}
+
+void POSRTPFanoutRemoveViewer(POSRTPFanout *fanout, POSRTPStreamRef *stream)
+{
+  HAPPrecondition(fanout);
+
+  pthread_mutex_lock(&fanout->mutex);
+  for (size_t idx = 0; idx < POS_RTP_FANOUT_MAX_VIEWERS; idx++)
+  {
+    POSRTPViewer *viewer = &fanout->viewers[idx];
+    if (viewer->stream != stream)
+      continue;
+    HAPLogInfo(&logObject, "Removed viewer on socket %d: %u packets sent, %u dropped, %u stalls", viewer->sock,
+               viewer->packetsSent, viewer->packetsDropped, viewer->stalls);
+    memset(viewer, 0, sizeof(*viewer));
+    __atomic_store_n(&fanout->numViewers, fanout->numViewers - 1, __ATOMIC_RELAXED);
+    break;
+  }
+  pthread_mutex_unlock(&fanout->mutex);
+}
+
+size_t POSRTPFanoutNumViewers(POSRTPFanout *fanout)
+{
+  return __atomic_load_n(&fanout->numViewers, __ATOMIC_RELAXED);
+}
+
+// Sends numPackets packets as fast as the pacer lets them go, returns how many the socket took
+static size_t POSRTPFanoutSendRun(POSRTPFanout *fanout, int sock, const uint8_t *pool, size_t packetStride,
+                                  const size_t *packetLens, size_t numPackets, uint32_t *numSyscalls)
+{
+  size_t sent = 0;
+
+  while (sent < numPackets)
+  {
+    size_t numAdmitted = numPackets - sent;
+    if (fanout->pacer)
+      numAdmitted = POSRTPPacerAdmit(fanout->pacer, &packetLens[sent], numAdmitted);
+    int ret = POSUDPSendBatch(sock, pool + sent * packetStride, packetStride, &packetLens[sent], numAdmitted,
+                              numSyscalls);
+    if (ret > 0)
+      sent += ret;
+    if (ret < (int)numAdmitted)
+      break;
+  }
+  return sent;
+}
+
+static void POSRTPFanoutSendViewer(POSRTPFanout *fanout, POSRTPViewer *viewer, const POSRTPStreamRef *packetizer,
+                                   const uint8_t *pool, size_t packetStride, const size_t *packetLens,
+                                   size_t numPackets, HAPTime actualTime, uint32_t *numSyscalls)
+{
+  if (viewer->stalled)
+  {
+    if (actualTime < viewer->stalledSince + POS_RTP_FANOUT_STALL_NS)
+    {
+      // skip the encryption too, but use up the sequence numbers so the viewer sees the
+      // gap and asks for a NACK or a key frame
+      POSRTPStreamSkipPackets(viewer->stream, (uint32_t)numPackets);
+      viewer->packetsDropped += numPackets;
+      return;
+    }
+    viewer->stalled = false;
+  }
+
+  POSRTPStreamProtectPackets(viewer->stream, packetizer, pool, packetStride, packetLens, numPackets, fanout->pool,
+                             sizeof(fanout->pool[0]), fanout->packetLens);
+
+  // send in runs, with the parity of every FEC block the batch completes right after the
+  // packet that completed it
+  const POSRTPFecBatch *batch = viewer->stream->fec ? viewer->stream->fecBatch : NULL;
+  size_t numParity = batch ? batch->numPackets : 0;
+  size_t nextParity = 0;
+  size_t sent = 0;
+  size_t first = 0;
+  bool full = false;
+  while (first < numPackets && !full)
+  {
+    size_t end = numPackets;
+    if (nextParity < numParity)
+      end = batch->after[nextParity] + 1;
+    size_t ran = POSRTPFanoutSendRun(fanout, viewer->sock, fanout->pool[first], sizeof(fanout->pool[0]),
+                                     &fanout->packetLens[first], end - first, numSyscalls);
+    sent += ran;
+    full = ran < end - first;
+    first = end;
+
+    size_t numRunParity = 0;
+    while (nextParity + numRunParity < numParity && batch->after[nextParity + numRunParity] == end - 1)
+      numRunParity++;
+    if (!full && numRunParity)
+    {
+      ran = POSRTPFanoutSendRun(fanout, viewer->sock, batch->packets[nextParity], sizeof(batch->packets[0]),
+                                &batch->lens[nextParity], numRunParity, numSyscalls);
+      full = ran < numRunParity;
+    }
+    nextParity += numRunParity;
+  }
+
+  viewer->packetsSent += sent;
+  if (full)
+  {
+    viewer->packetsDropped += numPackets - sent;
+    viewer->stalled = true;
+    viewer->stalledSince = actualTime;
+    viewer->stalls++;
+    HAPLogInfo(&logObject, "Viewer on socket %d stalled, dropped %d packets", viewer->sock, (int)(numPackets - sent));
+  }
+}
+
+void POSRTPFanoutSend(POSRTPFanout *fanout, const POSRTPStreamRef *packetizer, const uint8_t *pool,
+                      size_t packetStride, const size_t *packetLens, size_t numPackets, HAPTime actualTime,
+                      uint32_t *numSyscalls)
+{
+  HAPPrecondition(fanout);
+  HAPPrecondition(packetizer);
+
+  if (numPackets > POS_UDP_BATCH_MAX)
+    numPackets = POS_UDP_BATCH_MAX;
+
+  pthread_mutex_lock(&fanout->mutex);
+  for (size_t idx = 0; idx < POS_RTP_FANOUT_MAX_VIEWERS; idx++)
+  {
+    if (fanout->viewers[idx].stream == NULL)
+      continue;
+    POSRTPFanoutSendViewer(fanout, &fanout->viewers[idx], packetizer, pool, packetStride, packetLens, numPackets,
+                           actualTime, numSyscalls);
+  }
+  pthread_mutex_unlock(&fanout->mutex);
+}
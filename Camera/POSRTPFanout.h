@@ -0,0 +1,109 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef POSRTPFANOUT_H
+#define POSRTPFANOUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+#include "POSRTPController.h"
+#include "POSRTPPacer.h"
+#include "POSUDPSender.h"
+
+// Live sessions that can watch the same encoder channel
+#define POS_RTP_FANOUT_MAX_VIEWERS 4
+// Largest protected packet, same stride as the packetizer's pool
+#define POS_RTP_FANOUT_PACKET_STRIDE 4096
+// A viewer whose socket stopped taking packets is skipped this long before it's tried again
+#define POS_RTP_FANOUT_STALL_NS 100000000ull
+
+typedef struct
+{
+    POSRTPStreamRef *stream; // SRTP context, SSRC, sequence numbers and FEC of this viewer, NULL if the slot is free
+    int sock;
+    bool stalled;
+    HAPTime stalledSince;
+    uint32_t packetsSent;
+    uint32_t packetsDropped;
+    uint32_t stalls;
+} POSRTPViewer;
+
+/**
+ * Sends the packets of one packetizer stream to every viewer.
+ *
+ * Each frame is packetized once.  Each viewer then gets its own copy, rewritten
+ * and encrypted with its own keys by POSRTPStreamProtectPackets, and sent on its
+ * own socket with its own FEC parity.  Viewer sockets are nonblocking, so a viewer
+ * whose link backs up loses packets (and recovers with NACK or PLI) instead of
+ * holding up the others.  Every viewer's packets go through the one pacer, they
+ * all leave over the same uplink.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex; // viewers are added and removed from the HAP thread
+    POSRTPPacer *pacer;    // may be NULL
+    POSRTPViewer viewers[POS_RTP_FANOUT_MAX_VIEWERS];
+    size_t numViewers;
+    uint8_t pool[POS_UDP_BATCH_MAX][POS_RTP_FANOUT_PACKET_STRIDE];
+    size_t packetLens[POS_UDP_BATCH_MAX];
+} POSRTPFanout;
+
+/**
+ * @param pacer Paces what is sent to all viewers together, may be NULL.
+ */
+void POSRTPFanoutInit(POSRTPFanout *fanout, POSRTPPacer *pacer);
+
+/**
+ * Adds a viewer.  The stream must already be started with POSRTPStreamStart, and
+ * its history and FEC set.  The socket is connected to the viewer and is made
+ * nonblocking.
+ *
+ * @return kHAPError_OutOfResources if every viewer slot is taken.
+ */
+HAPError POSRTPFanoutAddViewer(POSRTPFanout *fanout, POSRTPStreamRef *stream, int sock);
+
+/**
+ * Removes a viewer, no packets are sent to it once this returns.
+ */
+void POSRTPFanoutRemoveViewer(POSRTPFanout *fanout, POSRTPStreamRef *stream);
+
+size_t POSRTPFanoutNumViewers(POSRTPFanout *fanout);
+
+/**
+ * Protects and sends a batch of packets polled from the packetizer to every viewer.
+ * Packet n starts at pool + n * packetStride and is packetLens[n] bytes long.
+ */
+void POSRTPFanoutSend(
+        POSRTPFanout *fanout,
+        const POSRTPStreamRef *packetizer,
+        const uint8_t *pool,
+        size_t packetStride,
+        const size_t *packetLens,
+        size_t numPackets,
+        HAPTime actualTime,
+        uint32_t *numSyscalls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// XOR parity FEC for the outgoing video stream
+// https://datatracker.ietf.org/doc/html/rfc5109
+
+#include <string.h>
+
+#include "HAP.h"
+
+#include "POSRTPFec.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSRTPFec"};
+
+typedef POSRTPFecWord __attribute__((__may_alias__)) POSRTPFecAliasWord;
+
+// dst ^= src, a word at a time when both are word aligned, which packet payloads are
+static void POSRTPFecXor(uint8_t *dst, const uint8_t *src, size_t numBytes)
+{
+  if ((((uintptr_t)dst | (uintptr_t)src) & (sizeof(POSRTPFecWord) - 1)) == 0)
+  {
+    POSRTPFecAliasWord *d = (POSRTPFecAliasWord *)dst;
+    const POSRTPFecAliasWord *s = (const POSRTPFecAliasWord *)src;
+    size_t numWords = numBytes / sizeof(POSRTPFecWord);
+    for (; numWords >= 4; numWords -= 4, d += 4, s += 4)
+    {
+      d[0] ^= s[0];
+      d[1] ^= s[1];
+      d[2] ^= s[2];
+      d[3] ^= s[3];
+    }
+    for (; numWords; numWords--)
+      *d++ ^= *s++;
+    dst = (uint8_t *)d;
+    src = (const uint8_t *)s;
+    numBytes = numBytes & (sizeof(POSRTPFecWord) - 1);
+  }
+  while (numBytes--)
+    *dst++ ^= *src++;
+}
+
+static uint8_t *POSRTPFecParityPacket(POSRTPFecEncoder *fec, size_t idx)
+{
+  return fec->parityPackets + idx * POS_RTP_FEC_PARITY_STRIDE;
+}
+
+static void POSRTPFecAccumulate(POSRTPFecEncoder *fec, size_t idx, const uint8_t *packet, size_t numBytes, uint32_t position)
+{
+  POSRTPFecParity *parity = &fec->parity[idx];
+  uint8_t *payload = POSRTPFecParityPacket(fec, idx) + POS_RTP_FEC_HEADER_BYTES;
+  uint16_t payloadLen = (uint16_t)(numBytes - 12);
+
+  parity->byte0Recovery ^= packet[0];
+  parity->byte1Recovery ^= packet[1];
+  parity->tsRecovery ^= (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+  parity->lengthRecovery ^= payloadLen;
+  parity->mask |= (uint64_t)1 << (47 - position);
+  parity->numProtected++;
+
+  // bytes past the longest packet so far are implicitly zero, copy instead of xor so
+  // the parity buffers never need clearing
+  if (payloadLen <= parity->protectionLength)
+  {
+    POSRTPFecXor(payload, packet + 12, payloadLen);
+  }
+  else
+  {
+    POSRTPFecXor(payload, packet + 12, parity->protectionLength);
+    HAPRawBufferCopyBytes(payload + parity->protectionLength, packet + 12 + parity->protectionLength,
+                          payloadLen - parity->protectionLength);
+    parity->protectionLength = payloadLen;
+  }
+}
+
+// Writes the headers of every parity packet in the block, returns how many are ready
+static size_t POSRTPFecFinishBlock(POSRTPFecEncoder *fec)
+{
+  size_t numParity = fec->rows + (fec->rows > 1 ? fec->cols : 0);
+  size_t numReady = 0;
+
+  for (size_t idx = 0; idx < numParity; idx++)
+  {
+    POSRTPFecParity *parity = &fec->parity[idx];
+    if (parity->numProtected == 0)
+      continue; // short block, this row or column is empty
+    if (numReady != idx)
+    {
+      HAPRawBufferCopyBytes(POSRTPFecParityPacket(fec, numReady), POSRTPFecParityPacket(fec, idx),
+                            POS_RTP_FEC_HEADER_BYTES + parity->protectionLength);
+      fec->parity[numReady] = *parity;
+      parity = &fec->parity[numReady];
+    }
+    uint8_t *bytes = POSRTPFecParityPacket(fec, numReady);
+
+    // RTP header, FEC goes out as its own stream
+    bytes[0] = 0x80;
+    bytes[1] = fec->payloadType;
+    bytes[2] = (uint8_t)(fec->seq >> 8);
+    bytes[3] = (uint8_t)fec->seq;
+    bytes[4] = (uint8_t)(fec->lastTimestamp >> 24);
+    bytes[5] = (uint8_t)(fec->lastTimestamp >> 16);
+    bytes[6] = (uint8_t)(fec->lastTimestamp >> 8);
+    bytes[7] = (uint8_t)fec->lastTimestamp;
+    bytes[8] = (uint8_t)(fec->ssrc >> 24);
+    bytes[9] = (uint8_t)(fec->ssrc >> 16);
+    bytes[10] = (uint8_t)(fec->ssrc >> 8);
+    bytes[11] = (uint8_t)fec->ssrc;
+    fec->seq++;
+
+    // FEC header https://datatracker.ietf.org/doc/html/rfc5109#section-7.3
+    bytes[12] = 0x40 | (parity->byte0Recovery & 0x3f); // E = 0, L = 1 (48 bit mask)
+    bytes[13] = parity->byte1Recovery;
+    bytes[14] = (uint8_t)(fec->snBase >> 8);
+    bytes[15] = (uint8_t)fec->snBase;
+    bytes[16] = (uint8_t)(parity->tsRecovery >> 24);
+    bytes[17] = (uint8_t)(parity->tsRecovery >> 16);
+    bytes[18] = (uint8_t)(parity->tsRecovery >> 8);
+    bytes[19] = (uint8_t)parity->tsRecovery;
+    bytes[20] = (uint8_t)(parity->lengthRecovery >> 8);
+    bytes[21] = (uint8_t)parity->lengthRecovery;
+
+    // level 0 header https://datatracker.ietf.org/doc/html/rfc5109#section-7.4
+    bytes[22] = (uint8_t)(parity->protectionLength >> 8);
+    bytes[23] = (uint8_t)parity->protectionLength;
+    for (int b = 0; b < 6; b++)
+      bytes[24 + b] = (uint8_t)(parity->mask >> (40 - 8 * b));
+
+    fec->parityLens[numReady] = POS_RTP_FEC_HEADER_BYTES + parity->protectionLength;
+    numReady++;
+  }
+
+  fec->packetsProtected += fec->numInBlock;
+  fec->parityPacketsBuilt += numReady;
+  fec->numInBlock = 0;
+  return numReady;
+}
+
+void POSRTPFecInit(POSRTPFecEncoder *fec, uint8_t payloadType, uint32_t ssrc)
+{
+  HAPPrecondition(fec);
+
+  memset(fec, 0, sizeof(*fec));
+  fec->payloadType = payloadType & 0x7f;
+  fec->ssrc = ssrc;
+  HAPPlatformRandomNumberFill(&fec->seq, sizeof(fec->seq));
+  fec->parityPackets = (uint8_t *)fec->parityStorage + 2;
+}
+
+void POSRTPFecSetFractionLost(POSRTPFecEncoder *fec, uint8_t fractionLost)
+{
+  uint32_t shape;
+
+  // one row parity per cols packets covers scattered single losses, a 2-D block adds
+  // column parity for the bursts that show up once loss gets high
+  if (fractionLost < 3) // < 1%
+    shape = 0;
+  else if (fractionLost < 8) // < 3%, 10% overhead
+    shape = 1 << 8 | 10;
+  else if (fractionLost < 20) // < 8%, 20% overhead
+    shape = 1 << 8 | 5;
+  else if (fractionLost < 40) // < 16%, 50% overhead
+    shape = 4 << 8 | 4;
+  else // 67% overhead
+    shape = 3 << 8 | 3;
+
+  uint32_t previous = __atomic_exchange_n(&fec->requestedShape, shape, __ATOMIC_RELAXED);
+  if (previous != shape)
+    HAPLogInfo(&logObject, "fraction lost %d/256, fec block %dx%d", fractionLost, shape >> 8, shape & 0xff);
+}
+
+size_t POSRTPFecAddPacket(POSRTPFecEncoder *fec, const uint8_t *packet, size_t numBytes)
+{
+  if (fec->payloadType == 0)
+    return 0;
+  if (numBytes < 12)
+    return 0;
+
+  uint16_t seq = (uint16_t)(packet[2] << 8 | packet[3]);
+
+  if (fec->numInBlock == 0)
+  {
+    uint32_t shape = __atomic_load_n(&fec->requestedShape, __ATOMIC_RELAXED);
+    fec->rows = (uint8_t)(shape >> 8);
+    fec->cols = (uint8_t)shape;
+    if (fec->rows == 0 || fec->cols == 0)
+      return 0;
+    HAPAssert(fec->rows * fec->cols <= POS_RTP_FEC_MAX_BLOCK);
+    HAPAssert(fec->rows + (fec->rows > 1 ? fec->cols : 0) <= POS_RTP_FEC_MAX_PARITY);
+    memset(fec->parity, 0, sizeof(fec->parity));
+    fec->snBase = seq;
+  }
+
+  // the mask needs consecutive sequence numbers and the parity has to fit the buffers,
+  // close the block early and leave this packet unprotected otherwise
+  if ((numBytes - 12 > POS_RTP_FEC_MAX_PAYLOAD) || ((uint16_t)(seq - fec->snBase) != fec->numInBlock))
+    return fec->numInBlock ? POSRTPFecFinishBlock(fec) : 0;
+
+  uint32_t position = fec->numInBlock;
+  uint32_t row = position / fec->cols;
+  POSRTPFecAccumulate(fec, row, packet, numBytes, position);
+  if (fec->rows > 1)
+    POSRTPFecAccumulate(fec, fec->rows + position % fec->cols, packet, numBytes, position);
+  fec->lastTimestamp = (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+  fec->numInBlock++;
+
+  // a block never spans frames, the marker bit ends one
+  if ((fec->numInBlock == (uint32_t)fec->rows * fec->cols) || (packet[1] & 0x80))
+    return POSRTPFecFinishBlock(fec);
+  return 0;
+}
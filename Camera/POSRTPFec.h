@@ -0,0 +1,109 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSRTPFEC_H
+#define POSRTPFEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest block, the RFC 5109 long mask covers 48 packets
+#define POS_RTP_FEC_MAX_BLOCK 48
+// Row plus column parity packets for one block
+#define POS_RTP_FEC_MAX_PARITY 16
+// Source packets with more bytes after the rtp header than this aren't protected
+#define POS_RTP_FEC_MAX_PAYLOAD 1472
+// RTP header, FEC header and level 0 header with the long mask
+#define POS_RTP_FEC_HEADER_BYTES (12 + 10 + 8)
+// Distance between parity packets in parityPackets
+#define POS_RTP_FEC_PARITY_STRIDE 1536
+
+typedef uint32_t POSRTPFecWord;
+
+typedef struct
+{
+    uint8_t byte0Recovery;   // P, X, CC
+    uint8_t byte1Recovery;   // M, PT
+    uint32_t tsRecovery;
+    uint16_t lengthRecovery;
+    uint16_t protectionLength;
+    uint64_t mask;           // bit 47 is snBase
+    uint32_t numProtected;
+} POSRTPFecParity;
+
+/**
+ * XOR parity generator for an outgoing RTP stream, after RFC 5109 (ULPFEC).
+ *
+ * Packets are laid out row by row in a rows x cols block.  Every row gets a
+ * parity packet, and when there is more than one row every column gets one too,
+ * so any single loss in a row or column can be rebuilt.  A block ends when it is
+ * full or when a packet with the marker bit set ends the frame.
+ *
+ * Parity is computed over the plaintext RTP packets, before SRTP, and the parity
+ * packets are protected like any other (RFC 3711 section 10), so the receiver
+ * decrypts the parity and rebuilds the plaintext packet from it.
+ */
+typedef struct
+{
+    uint8_t payloadType;     // 0 turns FEC off
+    uint32_t ssrc;
+    uint16_t seq;
+    uint32_t requestedShape; // rows << 8 | cols, picked up at the next block
+    uint8_t rows;
+    uint8_t cols;
+    uint32_t numInBlock;
+    uint16_t snBase;
+    uint32_t lastTimestamp;
+    POSRTPFecParity parity[POS_RTP_FEC_MAX_PARITY];
+    // parity packets start 2 bytes in so their payload is word aligned, like a source payload at offset 12
+    POSRTPFecWord parityStorage[POS_RTP_FEC_MAX_PARITY][POS_RTP_FEC_PARITY_STRIDE / sizeof(POSRTPFecWord)];
+    uint8_t *parityPackets;
+    size_t parityLens[POS_RTP_FEC_MAX_PARITY];
+    uint32_t packetsProtected;
+    uint32_t parityPacketsBuilt;
+} POSRTPFecEncoder;
+
+/**
+ * Resets the encoder.  A payloadType of 0 leaves FEC off.
+ */
+void POSRTPFecInit(POSRTPFecEncoder *fec, uint8_t payloadType, uint32_t ssrc);
+
+/**
+ * Picks the block shape from the loss the controller reports in its receiver
+ * reports (RFC 3550 fraction lost, out of 256).  Takes effect at the next block,
+ * may be called from another thread than POSRTPFecAddPacket.
+ */
+void POSRTPFecSetFractionLost(POSRTPFecEncoder *fec, uint8_t fractionLost);
+
+/**
+ * Adds a plaintext packet to the current block.
+ *
+ * @return Number of parity packets that are ready, packet n starts at
+ *         fec->parityPackets + n * POS_RTP_FEC_PARITY_STRIDE and is
+ *         fec->parityLens[n] bytes long.  They stay valid until the next call.
+ */
+size_t POSRTPFecAddPacket(POSRTPFecEncoder *fec, const uint8_t *packet, size_t numBytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Send pacing for the outgoing video stream
+
+#include <errno.h>
+
+#include "HAP.h"
+
+#include "POSRTPPacer.h"
+
+#define NS_PER_SECOND 1000000000LL
+
+static int64_t POSRTPPacerElapsedNs(const struct timespec *from, const struct timespec *to)
+{
+  return (int64_t)(to->tv_sec - from->tv_sec) * NS_PER_SECOND + (to->tv_nsec - from->tv_nsec);
+}
+
+static void POSRTPPacerRefill(POSRTPPacer *pacer)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsedNs = POSRTPPacerElapsedNs(&pacer->lastRefill, &now);
+  pacer->lastRefill = now;
+  pacer->budgetBytes -= __atomic_exchange_n(&pacer->chargedBytes, 0, __ATOMIC_RELAXED);
+  if (pacer->bytesPerSecond == 0)
+  {
+    // not pacing, nothing is owed when it starts again
+    pacer->budgetBytes = pacer->burstBytes;
+    return;
+  }
+  if (elapsedNs <= 0)
+    return;
+  pacer->budgetBytes += elapsedNs * pacer->bytesPerSecond / NS_PER_SECOND;
+  if (pacer->budgetBytes > (int64_t)pacer->burstBytes)
+    pacer->budgetBytes = pacer->burstBytes;
+}
+
+void POSRTPPacerInit(POSRTPPacer *pacer, uint32_t burstBytes)
+{
+  HAPPrecondition(pacer);
+
+  HAPRawBufferZero(pacer, sizeof *pacer);
+  pacer->burstBytes = burstBytes;
+  pacer->budgetBytes = burstBytes;
+  clock_gettime(CLOCK_MONOTONIC, &pacer->lastRefill);
+}
+
+void POSRTPPacerStartFrame(POSRTPPacer *pacer, size_t frameBytes, uint32_t frameRate, uint32_t bitRate,
+                           uint32_t spreadPercent)
+{
+  HAPPrecondition(pacer);
+
+  // bring the budget up to date at the old rate before switching
+  POSRTPPacerRefill(pacer);
+  if (spreadPercent == 0)
+  {
+    pacer->bytesPerSecond = 0;
+    return;
+  }
+  uint64_t floorBytesPerSecond = (uint64_t)bitRate / 8 * 100 / spreadPercent;
+  uint64_t frameBytesPerSecond = (uint64_t)frameBytes * frameRate * 100 / spreadPercent;
+  uint64_t bytesPerSecond = frameBytesPerSecond > floorBytesPerSecond ? frameBytesPerSecond : floorBytesPerSecond;
+  pacer->bytesPerSecond = bytesPerSecond > UINT32_MAX ? UINT32_MAX : (uint32_t)bytesPerSecond;
+}
+
+size_t POSRTPPacerAdmit(POSRTPPacer *pacer, const size_t *packetLens, size_t numPackets)
+{
+  HAPPrecondition(pacer);
+  HAPPrecondition(packetLens);
+
+  if (numPackets == 0)
+    return 0;
+  if (pacer->bytesPerSecond == 0)
+    return numPackets;
+
+  POSRTPPacerRefill(pacer);
+  while (pacer->budgetBytes <= 0)
+  {
+    // sleep until the debt is paid off, on an absolute deadline so a late wakeup isn't added to the next wait
+    struct timespec deadline = pacer->lastRefill;
+    int64_t waitNs = (1 - pacer->budgetBytes) * NS_PER_SECOND / pacer->bytesPerSecond;
+    deadline.tv_sec += waitNs / NS_PER_SECOND;
+    deadline.tv_nsec += waitNs % NS_PER_SECOND;
+    if (deadline.tv_nsec >= NS_PER_SECOND)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= NS_PER_SECOND;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+      ;
+    pacer->waits++;
+    POSRTPPacerRefill(pacer);
+  }
+
+  // let packets go while there is budget, the last one may overdraw it
+  size_t numAdmitted = 0;
+  while ((numAdmitted < numPackets) && (pacer->budgetBytes > 0))
+  {
+    pacer->budgetBytes -= packetLens[numAdmitted];
+    numAdmitted++;
+  }
+  return numAdmitted;
+}
+
+void POSRTPPacerCharge(POSRTPPacer *pacer, size_t numBytes)
+{
+  HAPPrecondition(pacer);
+
+  __atomic_fetch_add(&pacer->chargedBytes, (uint32_t)numBytes, __ATOMIC_RELAXED);
+}
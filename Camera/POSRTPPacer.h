@@ -0,0 +1,82 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSRTPPACER_H
+#define POSRTPPACER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Token bucket that spreads the packets of a video frame out instead of handing
+ * them to the socket as fast as it takes them.  An IDR sent back to back
+ * overflows the queue of a Wi-Fi access point and the loss that follows asks
+ * for yet another IDR.
+ *
+ * The budget refills at the rate picked for the current frame and is capped at
+ * burstBytes, which is how much may leave back to back after an idle period.
+ * Everything else sent on the video socket, FEC parity and retransmissions, is
+ * taken out of the same budget.
+ */
+typedef struct
+{
+    uint32_t bytesPerSecond; // 0 turns pacing off
+    uint32_t burstBytes;
+    int64_t budgetBytes;
+    struct timespec lastRefill;
+    uint32_t waits;
+    uint32_t chargedBytes; // sent by other threads since the last refill, see POSRTPPacerCharge
+} POSRTPPacer;
+
+/**
+ * Resets the pacer, pacing stays off until the first POSRTPPacerStartFrame.
+ */
+void POSRTPPacerInit(POSRTPPacer *pacer, uint32_t burstBytes);
+
+/**
+ * Picks the rate for the next frame so its frameBytes go out in spreadPercent of
+ * the frame interval, but never slower than the stream bitRate (bits per second)
+ * spread the same way, so small frames aren't held back.  A spreadPercent of 0
+ * turns pacing off.
+ */
+void POSRTPPacerStartFrame(POSRTPPacer *pacer, size_t frameBytes, uint32_t frameRate, uint32_t bitRate,
+                           uint32_t spreadPercent);
+
+/**
+ * Waits until the first of packetLens may be sent.
+ *
+ * @return Number of packets, at least 1, that may be sent now.
+ */
+size_t POSRTPPacerAdmit(POSRTPPacer *pacer, const size_t *packetLens, size_t numPackets);
+
+/**
+ * Takes numBytes sent outside POSRTPPacerAdmit out of the budget, so the packets
+ * admitted next wait for them.  Doesn't wait itself, and may be called from
+ * another thread than the one admitting packets.
+ */
+void POSRTPPacerCharge(POSRTPPacer *pacer, size_t numBytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
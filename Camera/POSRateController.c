@@ -0,0 +1,129 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Adaptive bitrate for the outgoing video stream
+
+#include "POSRateController.h"
+
+static uint32_t POSRateClamp(const POSRateController *rc, uint64_t bitRate)
+{
+  uint32_t maxBitRate = rc->capBitRate < rc->maxBitRate ? rc->capBitRate : rc->maxBitRate;
+  if (bitRate > maxBitRate)
+    bitRate = maxBitRate;
+  if (bitRate < rc->minBitRate)
+    bitRate = rc->minBitRate;
+  return (uint32_t)bitRate;
+}
+
+void POSRateControllerInit(POSRateController *rc, uint32_t minBitRate, uint32_t maxBitRate, uint32_t maxFrameRate,
+                           uint32_t nowMs)
+{
+  rc->minBitRate = minBitRate < maxBitRate ? minBitRate : maxBitRate;
+  rc->maxBitRate = maxBitRate;
+  rc->capBitRate = maxBitRate;
+  rc->maxFrameRate = maxFrameRate;
+  rc->targetBitRate = maxBitRate;
+  rc->targetFrameRate = maxFrameRate;
+  rc->appliedBitRate = maxBitRate;
+  rc->appliedFrameRate = maxFrameRate;
+  rc->state = kPOSRateState_Hold;
+  rc->minRttMs = 0;
+  rc->lastReportCount = 0;
+  rc->lastReportMs = nowMs;
+  rc->lastDecreaseMs = nowMs;
+  rc->holdUntilMs = nowMs;
+}
+
+void POSRateControllerSetCap(POSRateController *rc, uint32_t capBitRate)
+{
+  rc->capBitRate = capBitRate ? capBitRate : rc->maxBitRate;
+  rc->targetBitRate = POSRateClamp(rc, rc->targetBitRate);
+}
+
+bool POSRateControllerUpdate(POSRateController *rc, const POSRateFeedback *feedback, uint32_t nowMs,
+                             uint32_t *bitRate, uint32_t *frameRate)
+{
+  // loss, jitter and RTT only say something new once per receiver report
+  bool newReport = feedback->reportCount != rc->lastReportCount;
+  uint32_t elapsedMs = nowMs - rc->lastReportMs;
+  if (newReport)
+  {
+    rc->lastReportCount = feedback->reportCount;
+    rc->lastReportMs = nowMs;
+    if (feedback->rttMs != 0 && (rc->minRttMs == 0 || feedback->rttMs < rc->minRttMs))
+      rc->minRttMs = feedback->rttMs;
+  }
+
+  // how long what is sitting in the socket takes to drain at the current rate
+  uint32_t queueMs = (uint32_t)((uint64_t)feedback->queuedBytes * 8 * 1000 / (rc->targetBitRate ? rc->targetBitRate : 1));
+  bool queueHigh = queueMs > POS_RATE_QUEUE_HIGH_MS;
+  bool rttRising = newReport && feedback->rttMs != 0 && feedback->rttMs > rc->minRttMs + POS_RATE_RTT_RISE_MS;
+  bool lossHigh = newReport && feedback->fractionLost > POS_RATE_LOSS_HIGH;
+
+  if (lossHigh || rttRising || queueHigh)
+  {
+    // a report describes the rate before it, the local queue only drains within a round trip
+    uint32_t reactMs = feedback->rttMs > 300 ? feedback->rttMs : 300;
+    if (lossHigh || rttRising || rc->state != kPOSRateState_Decrease || nowMs - rc->lastDecreaseMs >= reactMs)
+    {
+      uint64_t keepPer256 = 256 - 38; // delay only: 85%
+      uint64_t lossKeepPer256 = 256 - (uint64_t)(feedback->fractionLost / 2);
+      if (lossHigh && lossKeepPer256 < keepPer256)
+        keepPer256 = lossKeepPer256;
+      rc->targetBitRate = POSRateClamp(rc, (uint64_t)rc->targetBitRate * keepPer256 / 256);
+      rc->lastDecreaseMs = nowMs;
+      rc->holdUntilMs = nowMs + POS_RATE_HOLD_MS;
+    }
+    rc->state = kPOSRateState_Decrease;
+  }
+  else if (!newReport)
+  {
+    // nothing new from the receiver and the socket is draining, stay put
+  }
+  else if (feedback->fractionLost < POS_RATE_LOSS_LOW && feedback->jitterMs < POS_RATE_JITTER_HIGH_MS &&
+           (int32_t)(nowMs - rc->holdUntilMs) >= 0)
+  {
+    // probe upwards, proportional to the time the report covers
+    uint64_t step = (uint64_t)rc->targetBitRate * POS_RATE_PROBE_PERCENT * elapsedMs / (100 * 1000);
+    rc->targetBitRate = POSRateClamp(rc, (uint64_t)rc->targetBitRate + (step ? step : 1));
+    rc->state = kPOSRateState_Increase;
+  }
+  else
+  {
+    rc->state = kPOSRateState_Hold;
+  }
+
+  // halve the frame rate when bits are scarce, with a gap between the thresholds so it doesn't flap
+  if ((uint64_t)rc->targetBitRate * 100 < (uint64_t)rc->maxBitRate * POS_RATE_FPS_DOWN_PERCENT)
+    rc->targetFrameRate = rc->maxFrameRate > 1 ? rc->maxFrameRate / 2 : rc->maxFrameRate;
+  else if ((uint64_t)rc->targetBitRate * 100 > (uint64_t)rc->maxBitRate * POS_RATE_FPS_UP_PERCENT)
+    rc->targetFrameRate = rc->maxFrameRate;
+
+  uint32_t delta = rc->targetBitRate > rc->appliedBitRate ? rc->targetBitRate - rc->appliedBitRate
+                                                          : rc->appliedBitRate - rc->targetBitRate;
+  bool bitRateChanged = (uint64_t)delta * 100 >= (uint64_t)rc->appliedBitRate * POS_RATE_CHANGE_PERCENT ||
+                        (delta != 0 && (rc->targetBitRate == rc->minBitRate || rc->targetBitRate == rc->capBitRate ||
+                                        rc->targetBitRate == rc->maxBitRate));
+  if (!bitRateChanged && rc->targetFrameRate == rc->appliedFrameRate)
+    return false;
+
+  rc->appliedBitRate = rc->targetBitRate;
+  rc->appliedFrameRate = rc->targetFrameRate;
+  *bitRate = rc->appliedBitRate;
+  *frameRate = rc->appliedFrameRate;
+  return true;
+}
@@ -0,0 +1,124 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSRATECONTROLLER_H
+#define POSRATECONTROLLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Loss above this (out of 256) backs the bitrate off, about 10%
+#define POS_RATE_LOSS_HIGH 26
+// Loss below this (out of 256) lets the bitrate probe upwards, about 2%
+#define POS_RATE_LOSS_LOW 5
+// RTT above the lowest seen by this much means a queue is building on the path
+#define POS_RATE_RTT_RISE_MS 150
+// Interarrival jitter above this holds the bitrate where it is
+#define POS_RATE_JITTER_HIGH_MS 40
+// More than this much video waiting in the local socket means we are ahead of the link
+#define POS_RATE_QUEUE_HIGH_MS 100
+// No probing for this long after a back off
+#define POS_RATE_HOLD_MS 2000
+// Probing grows the bitrate by this much per second
+#define POS_RATE_PROBE_PERCENT 8
+// The encoder is only touched when the target moves this much
+#define POS_RATE_CHANGE_PERCENT 5
+// Below this share of the maximum bitrate the frame rate is halved, above the second it is restored
+#define POS_RATE_FPS_DOWN_PERCENT 30
+#define POS_RATE_FPS_UP_PERCENT 50
+
+/**
+ * What the receiver reports and what is queued locally, gathered on every feedback tick.
+ *
+ * The report fields stay the same between receiver reports, reportCount tells a new
+ * report from the one already acted on.
+ */
+typedef struct
+{
+    uint32_t reportCount; // receiver reports seen so far, POSRTPStreamRef.remoteReportCount
+    uint8_t fractionLost; // RFC 3550 fraction lost from the last receiver report, out of 256
+    uint32_t jitterMs;    // interarrival jitter from the last receiver report
+    uint32_t rttMs;       // 0 until the first report with an LSR/DLSR
+    uint32_t queuedBytes; // sent but still in the local socket, fresh on every tick
+} POSRateFeedback;
+
+typedef enum
+{
+    kPOSRateState_Hold,
+    kPOSRateState_Increase,
+    kPOSRateState_Decrease
+} POSRateState;
+
+/**
+ * Loss and delay based sender side rate controller for the video encoder.
+ *
+ * Backs off multiplicatively when a new receiver report shows heavy loss or an
+ * RTT above the lowest seen, once per report, or when the local socket queue
+ * grows, at most once per RTT.  After a back off it holds for POS_RATE_HOLD_MS
+ * and then probes upwards on each report with low loss, never above the
+ * negotiated maximum or the last TMMBR.
+ * Below POS_RATE_FPS_DOWN_PERCENT of the maximum the frame rate is halved so
+ * the remaining bits still make a usable picture.
+ *
+ * Time is passed in, so the controller has no clock or platform dependency.
+ */
+typedef struct
+{
+    uint32_t minBitRate; // bits per second
+    uint32_t maxBitRate;
+    uint32_t capBitRate; // last TMMBR, maxBitRate until one arrives
+    uint32_t maxFrameRate;
+    uint32_t targetBitRate;
+    uint32_t targetFrameRate;
+    uint32_t appliedBitRate;
+    uint32_t appliedFrameRate;
+    POSRateState state;
+    uint32_t minRttMs;
+    uint32_t lastReportCount;
+    uint32_t lastReportMs;
+    uint32_t lastDecreaseMs;
+    uint32_t holdUntilMs;
+} POSRateController;
+
+/**
+ * Starts at the negotiated maximum, the rate the encoder was configured with.
+ */
+void POSRateControllerInit(POSRateController *rc, uint32_t minBitRate, uint32_t maxBitRate, uint32_t maxFrameRate,
+                           uint32_t nowMs);
+
+/**
+ * Applies a TMMBR from the controller as an upper bound.
+ */
+void POSRateControllerSetCap(POSRateController *rc, uint32_t capBitRate);
+
+/**
+ * Runs the controller on the latest feedback, call it on every feedback tick.
+ *
+ * @return true if the encoder should be set to *bitRate and *frameRate.
+ */
+bool POSRateControllerUpdate(POSRateController *rc, const POSRateFeedback *feedback, uint32_t nowMs,
+                             uint32_t *bitRate, uint32_t *frameRate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
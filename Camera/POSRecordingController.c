@@ -38,6 +38,7 @@
 #include "POSDataStreamParser.h"
 #include "POSMP4Muxer.h"
 #include "POSRingBufferVideoIn.h"
+#include "POSMediaClock.h"
 
 
 #include <imp/imp_log.h>
@@ -62,11 +63,7 @@ static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category
 
 static HAPTime ActualTime()
 {
-  struct timespec spec;
-  clock_gettime(CLOCK_REALTIME, &spec);
-  uint32_t sec = (uint32_t)spec.tv_sec;
-  uint32_t ns = (uint32_t)spec.tv_nsec;
-  return (HAPTime)sec * 1000000000 + ns;
+  return POSMediaClockNow();
 }
 
 static int frmrate_sp[3] = { 0 };
@@ -102,6 +99,13 @@ int64_t media_init_us;
 // Store the memory here (on the stack) until the encoder can be rewritten (in the distant future)
 uint8_t rmem_raw_buffer[RMEM_BUFFER_SIZE];
 
+// NAL unit types of the parameter sets and key frames for the track's codec
+#define POS_NAL_TYPE(vtrack, nal) ((vtrack)->hevc ? ((*(uint8_t *)(nal) >> 1) & 0x3f) : (*(uint8_t *)(nal) & 0x1f))
+#define POS_NAL_IS_VPS(vtrack, type) ((vtrack)->hevc && (type) == 32)
+#define POS_NAL_IS_SPS(vtrack, type) ((type) == ((vtrack)->hevc ? 33 : 7))
+#define POS_NAL_IS_PPS(vtrack, type) ((type) == ((vtrack)->hevc ? 34 : 8))
+#define POS_NAL_IS_KEYFRAME(vtrack, type) ((vtrack)->hevc ? ((type) >= 16 && (type) <= 23) : (type) == 5)
+
 static void *get_hksv_video_record(void *context)
 {
   //  HAPLogError(&logObject, "In recording thread.");
@@ -135,6 +139,8 @@ static void *get_hksv_video_record(void *context)
 
   vtrack.baseMediaDecodeTime = 0;
   vtrack.sequenceNumber = 1;
+  vtrack.hevc = false; // HKSV only negotiates H.264, the hvc1 track is there for when the encoder runs HEVC
+  vtrack.VPSNALUNumBytes = 0;
   vtrack.ring = &vring;
   vtrack.ring_trun_index = vtrack.ring->tail_index;
   vtrack.ring_mdat_index = vtrack.ring->tail_index;
@@ -173,9 +179,16 @@ static void *get_hksv_video_record(void *context)
     for (i = 0; i < stream.packCount; i++) {
       HAPAssert(stream.streamSize - stream.pack[i].offset >= stream.pack[i].length); // shouldn't happen
       //printf("pack.len: %d, pack.timestamp: %lld \n", stream.pack[i].length, stream.pack[i].timestamp );
-      int NALType = *(uint8_t *)(stream.virAddr+stream.pack[i].offset +4) & 0x1f;
+      int NALType = POS_NAL_TYPE(&vtrack, stream.virAddr+stream.pack[i].offset +4);
       int numBytes = stream.pack[i].length - 4;
-      if (NALType == 7){
+      if (POS_NAL_IS_VPS(&vtrack, NALType)){
+        /* Video parameter set */
+        if (0x7f < numBytes) continue;
+        HAPRawBufferCopyBytes(&vtrack.VPSNALU, (void *)(stream.virAddr+stream.pack[i].offset +4), numBytes);
+        vtrack.VPSNALUNumBytes = numBytes;
+        continue; // don't put this in the ring buffer or count it in len
+      }
+      if (POS_NAL_IS_SPS(&vtrack, NALType)){
         /* Sequence parameter set */
         //printf("Got a SPS.\n");
         if (0x7f < numBytes) continue;
@@ -183,7 +196,7 @@ static void *get_hksv_video_record(void *context)
         vtrack.SPSNALUNumBytes = numBytes;
         continue; // don't put this in the ring buffer or count it in len
       }
-      if (NALType == 8){
+      if (POS_NAL_IS_PPS(&vtrack, NALType)){
         /* Picture parameter set */
         //printf("Got a PPS.\n");
         if (0x7f < numBytes) continue;
@@ -230,20 +243,32 @@ static void *get_hksv_video_record(void *context)
     ring_buffer_vi_element_t newElement;
     newElement.loc = rmem_buffer_v_head;
     newElement.len = len;
-    newElement.timestamp = stream.pack[0].timestamp;
+    POSMediaClockSample(&posMediaClock);
+    newElement.timestamp = POSMediaClockFromSensor(&posMediaClock, stream.pack[0].timestamp) / 1000; // monotonic us
+    newElement.dur = 0;
+    newElement.nal_type = 0;
+    newElement.flags = 0;
         
     // copy the packets from the stream to RMEM
     for (i = 0; i < stream.packCount; i++) {
-      int NALType = *(uint8_t *)(stream.virAddr+stream.pack[i].offset +4) & 0x1f;
+      int NALType = POS_NAL_TYPE(&vtrack, stream.virAddr+stream.pack[i].offset +4);
       int numBytes = stream.pack[i].length - 4;
-      if (NALType == 7){
+      if (POS_NAL_IS_VPS(&vtrack, NALType)){
+        /* Video parameter set */
+        continue; // don't put this in the ring buffer or count it in len
+      }
+      if (POS_NAL_IS_SPS(&vtrack, NALType)){
         /* Sequence parameter set */
         continue; // don't put this in the ring buffer or count it in len
       }
-      if (NALType == 8){
+      if (POS_NAL_IS_PPS(&vtrack, NALType)){
         /* Picture parameter set */
         continue; // don't put this in the ring buffer or count it in len
       }
+      if (rmem_buffer_v_head == newElement.loc)
+        newElement.nal_type = NALType;
+      if (POS_NAL_IS_KEYFRAME(&vtrack, NALType))
+        newElement.flags |= RING_BUFFER_VI_FLAG_KEYFRAME; // indexed by the ring so preroll lookups don't scan frames
       memcpy(rmem_buffer_v_head, (void *)(stream.virAddr+stream.pack[i].offset +4), stream.pack[i].length -4); // 4 removes the annex b nal start bytes
       rmem_buffer_v_head += stream.pack[i].length -4;
     }
@@ -273,9 +298,10 @@ static void *get_hksv_video_record(void *context)
 
     // now that we have this frame, update the duration of the last frame
     if(ptr_ring_buffer_vi_num_items((&vring)) >= 2){
+      // differences of whole media times, so the fragment decode times don't drift from the timestamps
       vring.buffer[((vring.head_index-1) & RING_BUFFER_MASK((&vring))) ].dur = 
-        vring.buffer[((vring.head_index-1) & RING_BUFFER_MASK((&vring))) ].timestamp / 1000 - 
-        vring.buffer[((vring.head_index-2) & RING_BUFFER_MASK((&vring))) ].timestamp / 1000;
+        POSMediaClockToMediaTime(vring.buffer[((vring.head_index-1) & RING_BUFFER_MASK((&vring))) ].timestamp * 1000, POS_MP4_VIDEO_TIMESCALE) - 
+        POSMediaClockToMediaTime(vring.buffer[((vring.head_index-2) & RING_BUFFER_MASK((&vring))) ].timestamp * 1000, POS_MP4_VIDEO_TIMESCALE);
         //printf("Updating duration: %d\n", vring.buffer[((vring.head_index-1) & RING_BUFFER_MASK((&vring))) ].dur);
     }
 
@@ -290,20 +316,12 @@ static void *get_hksv_video_record(void *context)
       //got the lock, else try the lock on the next frame
       posDataStreamStruct * datastream = posRecordingBuffer.datastreamCtx;
 
-      uint32_t iframeCountPOS = 0 ;
-      // count the fragments in the ring buffer
-      for( size_t tempIndex = vring.tail_index; tempIndex != ((vring.head_index -1) & RING_BUFFER_MASK((&vring)));
-          tempIndex = ((tempIndex + 1) & RING_BUFFER_MASK((&vring)))  ){
-
-        //printf("counting I-frame:%d\n", ((*(uint8_t *)(vring.buffer[tempIndex].loc)) & 0x1f));
-
-        if( ((*(uint8_t *)(vring.buffer[tempIndex].loc)) & 0x1f) == 5 && 
-             (vring.buffer[tempIndex].timestamp > (vring.buffer[vring.head_index].timestamp - 6000000)) ){
-          iframeCountPOS = iframeCountPOS + 1 ;
-          //printf("tempIndex: %d\n", tempIndex);
-          //hexDump("(*(uint8_t *)(vring.buffer[tempIndex].loc)", ((vring.buffer[tempIndex].loc)), 16 ,16);
-        }
-      }
+      // count the fragments in the ring buffer, the newest frame doesn't count
+      size_t newestIndex = (vring.head_index - 1) & RING_BUFFER_MASK((&vring));
+      uint64_t prerollStart = vring.buffer[newestIndex].timestamp > 6000000 ? vring.buffer[newestIndex].timestamp - 6000000 : 0; //us
+      uint32_t iframeCountPOS = ptr_ring_buffer_vi_count_keyframes(&vring, prerollStart);
+      if (iframeCountPOS && ptr_ring_buffer_vi_is_keyframe(&vring, newestIndex))
+        iframeCountPOS--;
       //printf("I-Frames in recording buffer: %d\n", iframeCountPOS);
 
       // special cases to avoid too many nested parens
@@ -357,16 +375,13 @@ static void *get_hksv_video_record(void *context)
           
           // we're hardcoded at 4 sec I frame interval, and 4 sec preroll buffer so start from the end
           // find the oldest I frame < 6 seconds old in the ring buffer to try put the first motion in the second frame
-          while ( (*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f) != 5  || 
-           (vring.buffer[vring.tail_index].timestamp < (vring.buffer[vring.head_index].timestamp - 6000000))){ //us
-            // dequeue the tail
-            ring_buffer_vi_element_t freeEle;
-            //printf("dequeing: %d, tail: %d, head: %d\n", (*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f), vring.tail_index, vring.head_index);
-            ptr_ring_buffer_vi_dequeue(&vring, &freeEle);
-          }
-          //hexDump("(*(uint8_t *)(vring.buffer[vring.tail_index].loc)", ((vring.buffer[vring.tail_index].loc)), 16 ,16);
-          HAPAssert((*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f) == 5); 
-          HAPAssert((vring.buffer[vring.tail_index].timestamp >= (vring.buffer[vring.head_index].timestamp - 6000000)));
+          size_t prerollIndex = vring.tail_index;
+          bool prerollFound = ptr_ring_buffer_vi_find_keyframe(&vring, prerollStart, &prerollIndex);
+          HAPAssert(prerollFound); // iframeCountPOS >= 2
+          // drop everything older than the preroll
+          ptr_ring_buffer_vi_drop_until(&vring, prerollIndex);
+          HAPAssert(ptr_ring_buffer_vi_is_keyframe(&vring, vring.tail_index)); 
+          HAPAssert(vring.buffer[vring.tail_index].timestamp >= prerollStart);
 
           vtrack.ring_trun_index = vring.tail_index;
           vtrack.ring_mdat_index = vring.tail_index;
@@ -392,7 +407,7 @@ static void *get_hksv_video_record(void *context)
             // the tail should have been left on an I frame
             //printf("tail_index: %d\n", vring.tail_index);
             //hexDump("(*(uint8_t *)(vring.buffer[vring.tail_index].loc)", ((vring.buffer[vring.tail_index].loc)), 16 ,16);
-            HAPAssert((*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f) == 5); 
+            HAPAssert(ptr_ring_buffer_vi_is_keyframe(&vring, vring.tail_index)); 
 
             // make a new fragment
             dataTypeStr = "mediaFragment";
@@ -476,12 +491,11 @@ static void *get_hksv_video_record(void *context)
 
           if(mdatDone){
             //printf("mdatDone!\n");
-            do{
-              // dequeue the tail
-              ring_buffer_vi_element_t freeEle;
-              //printf("mdatDone dequeing: %d\n", (*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f));
-              ptr_ring_buffer_vi_dequeue(&vring, &freeEle);
-            }while ( (*(uint8_t *)(vring.buffer[vring.tail_index].loc) & 0x1f) != 5 );
+            // drop the sent fragment, leaving the tail on the keyframe that starts the next one
+            size_t nextFragmentIndex = vring.tail_index;
+            bool nextFragmentFound = ptr_ring_buffer_vi_next_keyframe(&vring, vring.tail_index, &nextFragmentIndex);
+            HAPAssert(nextFragmentFound);
+            ptr_ring_buffer_vi_drop_until(&vring, nextFragmentIndex);
           }
 
           b->limit += mdatChunkBytes;
@@ -15,61 +15,87 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "POSRingBufferAudioOut.h"
 
 /**
  * @file
- * Implementation of ring buffer functions.
- * Credit: https://github.com/AndersKaloer/Ring-Buffer
+ * Implementation of the audio out ring buffer.
+ *
+ * head_index and tail_index are free running counters, the slot is the counter
+ * masked with buffer_mask.  Unlike the byte ring buffers the full capacity is
+ * usable since head - tail distinguishes full from empty.
  */
 
-void ptr_ring_buffer_ao_init(ring_buffer_ao_t *buffer, void *buf, size_t buf_size) {
-  RING_BUFFER_ASSERT(RING_BUFFER_IS_POWER_OF_TWO(buf_size) == 1);
-  buffer->buffer = buf;
-  buffer->buffer_mask = buf_size - 1;
-  buffer->tail_index = 0;
-  buffer->head_index = 0;
-}
+int ring_buffer_ao_init(ring_buffer_ao_t *buffer, void *storage, size_t frame_bytes, ring_buffer_size_t num_frames) {
+  RING_BUFFER_ASSERT(RING_BUFFER_IS_POWER_OF_TWO(num_frames) == 1);
+  buffer->storage = storage;
+  buffer->frame_bytes = frame_bytes;
+  buffer->buffer_mask = num_frames - 1;
+  buffer->overruns = 0;
+  __atomic_store_n(&buffer->head_index, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&buffer->tail_index, 0, __ATOMIC_SEQ_CST);
 
-void ptr_ring_buffer_ao_queue(ring_buffer_ao_t *buffer, void * data) {
-  /* Is buffer full? */
-  if(ptr_ring_buffer_ao_is_full(buffer)) {
-    /* Is going to overwrite the oldest byte */
-    /* Increase tail index */
-    buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK(buffer));
+  if (buffer->event_fd < 0) {
+    buffer->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (buffer->event_fd < 0)
+      return -1;
+  } else {
+    /* Drop any stale wakeup */
+    uint64_t count;
+    while (read(buffer->event_fd, &count, sizeof(count)) == sizeof(count))
+      ;
   }
-
-  /* Place data in buffer */
-  buffer->buffer[buffer->head_index] = data;
-  buffer->head_index = ((buffer->head_index + 1) & RING_BUFFER_MASK(buffer));
+  return 0;
 }
 
-uint8_t ptr_ring_buffer_ao_dequeue(ring_buffer_ao_t *buffer, void ** data) {
-  if(ptr_ring_buffer_ao_is_empty(buffer)) {
-    /* No items */
-    return 0;
+void *ring_buffer_ao_write_slot(ring_buffer_ao_t *buffer) {
+  ring_buffer_size_t head = buffer->head_index;
+  ring_buffer_size_t tail = __atomic_load_n(&buffer->tail_index, __ATOMIC_ACQUIRE);
+  if (head - tail > buffer->buffer_mask) {
+    /* Full, the consumer still owns every slot */
+    buffer->overruns++;
+    return NULL;
   }
-  
-  *data = buffer->buffer[buffer->tail_index];
-  buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK(buffer));
-  return 1;
+  return buffer->storage + (head & buffer->buffer_mask) * buffer->frame_bytes;
 }
 
-
-uint8_t ptr_ring_buffer_ao_peek(ring_buffer_ao_t *buffer, void ** data, ring_buffer_size_t index) {
-  if(index >= ptr_ring_buffer_ao_num_items(buffer)) {
-    /* No items at index */
-    return 0;
+void ring_buffer_ao_commit_write(ring_buffer_ao_t *buffer) {
+  ring_buffer_size_t head = buffer->head_index;
+  /* Publish the frame, then look at the tail.  Both are seq_cst so that either
+   * we see the consumer caught up with us, or the consumer sees the new head
+   * before it goes to sleep. */
+  __atomic_store_n(&buffer->head_index, head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&buffer->tail_index, __ATOMIC_SEQ_CST) == head) {
+    uint64_t one = 1;
+    ssize_t ret;
+    do {
+      ret = write(buffer->event_fd, &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
   }
-  
-  /* Add index to pointer */
-  ring_buffer_size_t data_index = ((buffer->tail_index + index) & RING_BUFFER_MASK(buffer));
-  *data = buffer->buffer[data_index];
-  return 1;
 }
 
-extern inline uint8_t ptr_ring_buffer_ao_is_empty(ring_buffer_ao_t *buffer);
-extern inline uint8_t ptr_ring_buffer_ao_is_full(ring_buffer_ao_t *buffer);
-extern inline ring_buffer_size_t ptr_ring_buffer_ao_num_items(ring_buffer_ao_t *buffer);
+const void *ring_buffer_ao_read_slot(ring_buffer_ao_t *buffer, int timeout_ms) {
+  ring_buffer_size_t tail = buffer->tail_index;
+  while (__atomic_load_n(&buffer->head_index, __ATOMIC_SEQ_CST) == tail) {
+    struct pollfd pfd = { .fd = buffer->event_fd, .events = POLLIN };
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret == 0)
+      return NULL;
+    if (ret < 0 && errno != EINTR)
+      return NULL;
+    if (ret > 0) {
+      uint64_t count;
+      (void) read(buffer->event_fd, &count, sizeof(count));
+    }
+  }
+  return buffer->storage + (tail & buffer->buffer_mask) * buffer->frame_bytes;
+}
 
+void ring_buffer_ao_commit_read(ring_buffer_ao_t *buffer) {
+  __atomic_store_n(&buffer->tail_index, buffer->tail_index + 1, __ATOMIC_SEQ_CST);
+}
@@ -15,14 +15,21 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-
 #include <inttypes.h>
 #include <stddef.h>
 #include <assert.h>
 /**
  * @file
- * Prototypes and structures for the ring buffer module.
- * Credit: https://github.com/AndersKaloer/Ring-Buffer
+ * Single producer / single consumer ring of fixed size PCM frames between the
+ * return audio decoder and the speaker thread.
+ *
+ * The producer decodes straight into the slot returned by
+ * ring_buffer_ao_write_slot and publishes it with ring_buffer_ao_commit_write,
+ * the consumer plays straight out of ring_buffer_ao_read_slot and hands the
+ * slot back with ring_buffer_ao_commit_read.  Head and tail are only ever
+ * written by one side each, so no lock is needed.  The consumer sleeps on an
+ * eventfd that the producer only signals when the ring goes from empty to
+ * non-empty.
  */
 
 #ifndef SPKRINGBUFFER_H
@@ -47,15 +54,7 @@ extern "C"
  * The type which is used to hold the size
  * and the indicies of the buffer.
  */
-typedef size_t ring_buffer_size_t;
-
-/**
- * Used as a modulo operator
- * as <tt> a % b = (a & (b − 1)) </tt>
- * where \c a is a positive index in the buffer and
- * \c b is the (power of two) size of the buffer.
- */
-#define RING_BUFFER_MASK(rb) (rb->buffer_mask)
+typedef uint32_t ring_buffer_size_t;
 
 /**
  * Simplifies the use of <tt>struct ring_buffer_ao_t</tt>.
@@ -64,80 +63,66 @@ typedef struct ring_buffer_ao_t ring_buffer_ao_t;
 
 /**
  * Structure which holds a ring buffer.
- * The buffer contains a buffer array
- * as well as metadata for the ring buffer.
  */
 struct ring_buffer_ao_t {
-  /** Buffer memory. */
-  void **buffer;
-  /** Buffer mask. */
+  /** Frame storage, num_frames * frame_bytes. */
+  uint8_t *storage;
+  /** Size of one frame slot in bytes. */
+  size_t frame_bytes;
+  /** Number of slots - 1. */
   ring_buffer_size_t buffer_mask;
-  /** Index of tail. */
-  ring_buffer_size_t tail_index;
-  /** Index of head. */
+  /** Next slot the producer writes, only written by the producer. */
   ring_buffer_size_t head_index;
+  /** Next slot the consumer reads, only written by the consumer. */
+  ring_buffer_size_t tail_index;
+  /** Frames the producer dropped because the ring was full. */
+  ring_buffer_size_t overruns;
+  /** Wakes the consumer on empty to non-empty transitions, -1 if not open. */
+  int event_fd;
 };
 
 /**
- * Initializes the ring buffer pointed to by <em>buffer</em>.
- * This function can also be used to empty/reset the buffer.
- * The resulting buffer can contain <em>buf_size-1</em> bytes.
+ * Initializes or resets the ring buffer.
+ * The eventfd is created the first time and reused afterwards, so a consumer
+ * that is already waiting keeps working.  buffer->event_fd must be -1 before
+ * the first call.
  * @param buffer The ring buffer to initialize.
- * @param buf The buffer allocated for the ringbuffer.
- * @param buf_size The size of the allocated ringbuffer.
+ * @param storage num_frames * frame_bytes bytes of frame storage.
+ * @param frame_bytes The size of one frame slot.
+ * @param num_frames The number of slots, a power of two.
+ * @return 0 on success, -1 if the eventfd can't be created.
  */
-void ptr_ring_buffer_ao_init(ring_buffer_ao_t *buffer, void *buf, size_t buf_size);
+int ring_buffer_ao_init(ring_buffer_ao_t *buffer, void *storage, size_t frame_bytes, ring_buffer_size_t num_frames);
 
 /**
- * Adds a byte to a ring buffer.
- * @param buffer The buffer in which the data should be placed.
- * @param data The byte to place.
+ * Returns the slot the producer should fill next.
+ * @return The slot, or NULL if the ring is full.  A full ring counts an overrun.
  */
-void ptr_ring_buffer_ao_queue(ring_buffer_ao_t *buffer,  void * data);
+void *ring_buffer_ao_write_slot(ring_buffer_ao_t *buffer);
 
 /**
- * Returns the oldest byte in a ring buffer.
- * @param buffer The buffer from which the data should be returned.
- * @param data A pointer to the location at which the data should be placed.
- * @return 1 if data was returned; 0 otherwise.
+ * Publishes the slot returned by ring_buffer_ao_write_slot to the consumer.
  */
-uint8_t ptr_ring_buffer_ao_dequeue(ring_buffer_ao_t *buffer, void ** data);
+void ring_buffer_ao_commit_write(ring_buffer_ao_t *buffer);
 
 /**
- * Peeks a ring buffer, i.e. returns an element without removing it.
- * @param buffer The buffer from which the data should be returned.
- * @param data A pointer to the location at which the data should be placed.
- * @param index The index to peek.
- * @return 1 if data was returned; 0 otherwise.
+ * Returns the oldest frame, waiting up to timeout_ms for one to arrive.
+ * @param timeout_ms How long to wait, -1 to wait forever.
+ * @return The frame, or NULL on timeout.  The frame stays valid until ring_buffer_ao_commit_read.
  */
-uint8_t ptr_ring_buffer_ao_peek(ring_buffer_ao_t *buffer, void ** data, ring_buffer_size_t index);
-
-
-/**
- * Returns whether a ring buffer is empty.
- * @param buffer The buffer for which it should be returned whether it is empty.
- * @return 1 if empty; 0 otherwise.
- */
-inline uint8_t ptr_ring_buffer_ao_is_empty(ring_buffer_ao_t *buffer) {
-  return (buffer->head_index == buffer->tail_index);
-}
+const void *ring_buffer_ao_read_slot(ring_buffer_ao_t *buffer, int timeout_ms);
 
 /**
- * Returns whether a ring buffer is full.
- * @param buffer The buffer for which it should be returned whether it is full.
- * @return 1 if full; 0 otherwise.
+ * Hands the frame returned by ring_buffer_ao_read_slot back to the producer.
  */
-inline uint8_t ptr_ring_buffer_ao_is_full(ring_buffer_ao_t *buffer) {
-  return ((buffer->head_index - buffer->tail_index) & RING_BUFFER_MASK(buffer)) == RING_BUFFER_MASK(buffer);
-}
+void ring_buffer_ao_commit_read(ring_buffer_ao_t *buffer);
 
 /**
- * Returns the number of items in a ring buffer.
- * @param buffer The buffer for which the number of items should be returned.
- * @return The number of items in the ring buffer.
+ * Returns the number of frames in the ring.  Only exact when called from the
+ * producer or consumer thread.
  */
-inline ring_buffer_size_t ptr_ring_buffer_ao_num_items(ring_buffer_ao_t *buffer) {
-  return ((buffer->head_index - buffer->tail_index) & RING_BUFFER_MASK(buffer));
+static inline ring_buffer_size_t ring_buffer_ao_num_items(ring_buffer_ao_t *buffer) {
+  return __atomic_load_n(&buffer->head_index, __ATOMIC_ACQUIRE) - __atomic_load_n(&buffer->tail_index, __ATOMIC_ACQUIRE);
 }
 
 #ifdef __cplusplus
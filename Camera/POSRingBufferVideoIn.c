@@ -25,12 +25,30 @@
  * Credit: https://github.com/AndersKaloer/Ring-Buffer
  */
 
+#define KEY_INDEX_MASK (RING_BUFFER_VI_MAX_KEYFRAMES - 1)
+
+/* Forgets the oldest keyframe if it is the element leaving the tail */
+static void key_index_remove_tail(ring_buffer_vi_t *buffer) {
+  if(buffer->key_tail != buffer->key_head &&
+     buffer->key_index[buffer->key_tail & KEY_INDEX_MASK] == buffer->tail_index) {
+    buffer->key_tail++;
+  }
+}
+
+/* Distance of a ring index from the tail, used to order ring indexes */
+static ring_buffer_vi_size_t ring_offset(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index) {
+  return (index - buffer->tail_index) & RING_BUFFER_MASK(buffer);
+}
+
 void ptr_ring_buffer_vi_init(ring_buffer_vi_t *buffer, ring_buffer_vi_element_t *buf, size_t buf_size) {
   RING_BUFFER_ASSERT(RING_BUFFER_IS_POWER_OF_TWO(buf_size) == 1);
+  RING_BUFFER_ASSERT(buf_size <= RING_BUFFER_VI_MAX_KEYFRAMES);
   buffer->buffer = buf;
   buffer->buffer_mask = buf_size - 1;
   buffer->tail_index = 0;
   buffer->head_index = 0;
+  buffer->key_tail = 0;
+  buffer->key_head = 0;
 }
 
 void ptr_ring_buffer_vi_queue(ring_buffer_vi_t *buffer, ring_buffer_vi_element_t * data) {
@@ -38,6 +56,7 @@ void ptr_ring_buffer_vi_queue(ring_buffer_vi_t *buffer, ring_buffer_vi_element_t
   if(ptr_ring_buffer_vi_is_full(buffer)) {
     /* Is going to overwrite the oldest byte */
     /* Increase tail index */
+    key_index_remove_tail(buffer);
     buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK(buffer));
   }
 
@@ -45,6 +64,10 @@ void ptr_ring_buffer_vi_queue(ring_buffer_vi_t *buffer, ring_buffer_vi_element_t
   //buffer->buffer[buffer->head_index] = data;
   //printf("ring inserting index: %d\n", buffer->head_index);
   memcpy(&buffer->buffer[buffer->head_index], data, sizeof(ring_buffer_vi_element_t));
+  if(data->flags & RING_BUFFER_VI_FLAG_KEYFRAME) {
+    buffer->key_index[buffer->key_head & KEY_INDEX_MASK] = buffer->head_index;
+    buffer->key_head++;
+  }
   buffer->head_index = ((buffer->head_index + 1) & RING_BUFFER_MASK(buffer));
 }
 
@@ -58,6 +81,7 @@ uint8_t ptr_ring_buffer_vi_dequeue(ring_buffer_vi_t *buffer, ring_buffer_vi_elem
   //*data = buffer->buffer[buffer->tail_index];
   //printf("ring dequeuing index: %d\n", buffer->tail_index);
   memcpy(data, &buffer->buffer[buffer->tail_index], sizeof(ring_buffer_vi_element_t));
+  key_index_remove_tail(buffer);
   buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK(buffer));
   return 1;
 }
@@ -79,6 +103,52 @@ uint8_t ptr_ring_buffer_vi_peek(ring_buffer_vi_t *buffer, ring_buffer_vi_element
   return 1;
 }
 
+uint8_t ptr_ring_buffer_vi_find_keyframe(ring_buffer_vi_t *buffer, uint64_t min_timestamp, ring_buffer_vi_size_t *index) {
+  for(ring_buffer_vi_size_t k = buffer->key_tail; k != buffer->key_head; k++) {
+    ring_buffer_vi_size_t i = buffer->key_index[k & KEY_INDEX_MASK];
+    if(buffer->buffer[i].timestamp >= min_timestamp) {
+      *index = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+ring_buffer_vi_size_t ptr_ring_buffer_vi_count_keyframes(ring_buffer_vi_t *buffer, uint64_t min_timestamp) {
+  ring_buffer_vi_size_t count = 0;
+  /* Keyframes are in timestamp order, walk back from the newest */
+  for(ring_buffer_vi_size_t k = buffer->key_head; k != buffer->key_tail; k--) {
+    ring_buffer_vi_size_t i = buffer->key_index[(k - 1) & KEY_INDEX_MASK];
+    if(buffer->buffer[i].timestamp <= min_timestamp)
+      break;
+    count++;
+  }
+  return count;
+}
+
+uint8_t ptr_ring_buffer_vi_next_keyframe(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index, ring_buffer_vi_size_t *next) {
+  ring_buffer_vi_size_t offset = ring_offset(buffer, index);
+  for(ring_buffer_vi_size_t k = buffer->key_tail; k != buffer->key_head; k++) {
+    ring_buffer_vi_size_t i = buffer->key_index[k & KEY_INDEX_MASK];
+    if(ring_offset(buffer, i) > offset) {
+      *next = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void ptr_ring_buffer_vi_drop_until(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index) {
+  ring_buffer_vi_size_t offset = ring_offset(buffer, index);
+  RING_BUFFER_ASSERT(offset <= ptr_ring_buffer_vi_num_items(buffer));
+  while(buffer->key_tail != buffer->key_head &&
+        ring_offset(buffer, buffer->key_index[buffer->key_tail & KEY_INDEX_MASK]) < offset) {
+    buffer->key_tail++;
+  }
+  buffer->tail_index = index & RING_BUFFER_MASK(buffer);
+}
+
+extern inline uint8_t ptr_ring_buffer_vi_is_keyframe(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index);
 extern inline uint8_t ptr_ring_buffer_vi_is_empty(ring_buffer_vi_t *buffer);
 extern inline uint8_t ptr_ring_buffer_vi_is_full(ring_buffer_vi_t *buffer);
 extern inline ring_buffer_vi_size_t ptr_ring_buffer_vi_num_items(ring_buffer_vi_t *buffer);
@@ -73,8 +73,19 @@ struct ring_buffer_vi_element_t {
   size_t len;
   uint64_t timestamp; //us
   uint32_t dur; //ms
+  uint8_t nal_type; // type of the first NALU in the frame
+  uint8_t flags; // RING_BUFFER_VI_FLAG_*
 };
 
+/** The frame contains an IDR slice. */
+#define RING_BUFFER_VI_FLAG_KEYFRAME 0x01
+
+/**
+ * Capacity of the keyframe index, must be a power of two and at least the
+ * size of the frame ring so every frame could be a keyframe.
+ */
+#define RING_BUFFER_VI_MAX_KEYFRAMES 256
+
 /**
  * Simplifies the use of <tt>struct ring_buffer_vi_t</tt>.
  */
@@ -94,6 +105,12 @@ struct ring_buffer_vi_t {
   ring_buffer_vi_size_t tail_index;
   /** Index of head. */
   ring_buffer_vi_size_t head_index;
+  /** Ring indexes of the keyframes in the buffer, oldest first. */
+  ring_buffer_vi_size_t key_index[RING_BUFFER_VI_MAX_KEYFRAMES];
+  /** Free running position of the oldest keyframe in key_index. */
+  ring_buffer_vi_size_t key_tail;
+  /** Free running position after the newest keyframe in key_index. */
+  ring_buffer_vi_size_t key_head;
 };
 
 /**
@@ -130,6 +147,40 @@ uint8_t ptr_ring_buffer_vi_dequeue(ring_buffer_vi_t *buffer, ring_buffer_vi_elem
  */
 uint8_t ptr_ring_buffer_vi_peek(ring_buffer_vi_t *buffer, ring_buffer_vi_element_t * data, ring_buffer_vi_size_t index);
 
+/**
+ * Finds the oldest keyframe whose timestamp is at least min_timestamp.
+ * @param buffer The buffer to search.
+ * @param min_timestamp The earliest acceptable timestamp in us.
+ * @param index Set to the ring index of the keyframe.
+ * @return 1 if a keyframe was found; 0 otherwise.
+ */
+uint8_t ptr_ring_buffer_vi_find_keyframe(ring_buffer_vi_t *buffer, uint64_t min_timestamp, ring_buffer_vi_size_t *index);
+
+/**
+ * Counts the keyframes newer than min_timestamp.
+ * Cost grows with the number of keyframes counted, not with the ring size.
+ * @param buffer The buffer to search.
+ * @param min_timestamp Keyframes at or before this timestamp (us) aren't counted.
+ * @return The number of keyframes.
+ */
+ring_buffer_vi_size_t ptr_ring_buffer_vi_count_keyframes(ring_buffer_vi_t *buffer, uint64_t min_timestamp);
+
+/**
+ * Finds the first keyframe after the ring index <em>index</em>.
+ * @param buffer The buffer to search.
+ * @param index A ring index between tail and head.
+ * @param next Set to the ring index of the keyframe.
+ * @return 1 if a keyframe was found; 0 otherwise.
+ */
+uint8_t ptr_ring_buffer_vi_next_keyframe(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index, ring_buffer_vi_size_t *next);
+
+/**
+ * Dequeues every element before the ring index <em>index</em>, which becomes the new tail.
+ * @param buffer The buffer to drop elements from.
+ * @param index A ring index between tail and head.
+ */
+void ptr_ring_buffer_vi_drop_until(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index);
+
 
 /**
  * Returns whether a ring buffer is empty.
@@ -158,6 +209,16 @@ inline ring_buffer_vi_size_t ptr_ring_buffer_vi_num_items(ring_buffer_vi_t *buff
   return ((buffer->head_index - buffer->tail_index) & RING_BUFFER_MASK(buffer));
 }
 
+/**
+ * Returns whether the element at a ring index is a keyframe.
+ * @param buffer The buffer holding the element.
+ * @param index The ring index (not the offset from the tail).
+ * @return 1 if it is a keyframe; 0 otherwise.
+ */
+inline uint8_t ptr_ring_buffer_vi_is_keyframe(ring_buffer_vi_t *buffer, ring_buffer_vi_size_t index) {
+  return (buffer->buffer[index].flags & RING_BUFFER_VI_FLAG_KEYFRAME) != 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
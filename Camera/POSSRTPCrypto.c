@@ -21,6 +21,8 @@
 #include "mbedtls/aes.h"
 #include "mbedtls/sha1.h"
 
+static void hmac_sha1_midstates(srtp_ctx *srtp_ctx);
+
 // debugging
 // #include <stdio.h>
 
@@ -46,6 +48,7 @@ void srtp_session_key(char *subKeyOut, uint32_t subKeySize, const char *masterKe
 
   memset(subKeyOut, 0, subKeySize);
   mbedtls_aes_crypt_ctr(&aes, subKeySize, &nc_off, iv, stream_block, subKeyOut, subKeyOut);
+  mbedtls_aes_free(&aes);
 
   return;
 }
@@ -56,6 +59,9 @@ void srtp_setupContext(srtp_ctx *srtp_ctxx, srtp_ctx *srtcp_ctx, const char *key
 {
   uint32_t bsssrc = __builtin_bswap32(ssrc);
   uint32_t *a;
+  // a stream restarted with new keys passes in the contexts of its last session,
+  // release their key schedules before they are overwritten
+  srtp_freeContext(srtp_ctxx, srtcp_ctx);
   if (srtp_ctxx != NULL)
   {
     srtp_ctxx->key_size = keySize;
@@ -67,6 +73,11 @@ void srtp_setupContext(srtp_ctx *srtp_ctxx, srtp_ctx *srtcp_ctx, const char *key
       srtp_session_key(srtp_ctxx->salt_key, 0xe, key, keySize, salt, 2);
       a = (uint32_t *)(srtp_ctxx->salt_key + 4);
       *a = *(a) ^ bsssrc;
+      // the key schedule only depends on the session key, so expand it once here
+      // rather than on every packet
+      mbedtls_aes_init(&srtp_ctxx->aes);
+      mbedtls_aes_setkey_enc(&srtp_ctxx->aes, srtp_ctxx->encr_key, 8 * keySize);
+      hmac_sha1_midstates(srtp_ctxx);
     }
   }
   if (srtcp_ctx != NULL)
@@ -80,11 +91,52 @@ void srtp_setupContext(srtp_ctx *srtp_ctxx, srtp_ctx *srtcp_ctx, const char *key
       srtp_session_key(srtcp_ctx->salt_key, 0xe, key, keySize, salt, 5);
       a = (uint32_t *)(srtcp_ctx->salt_key + 4);
       *a = *(a) ^ bsssrc;
+      mbedtls_aes_init(&srtcp_ctx->aes);
+      mbedtls_aes_setkey_enc(&srtcp_ctx->aes, srtcp_ctx->encr_key, 8 * keySize);
+      hmac_sha1_midstates(srtcp_ctx);
     }
   }
   return;
 }
 
+void srtp_freeContext(srtp_ctx *srtp_ctxx, srtp_ctx *srtcp_ctx)
+
+{
+  if (srtp_ctxx != NULL && srtp_ctxx->key_size != 0)
+  {
+    mbedtls_aes_free(&srtp_ctxx->aes);
+    mbedtls_sha1_free(&srtp_ctxx->hmac_inner);
+    mbedtls_sha1_free(&srtp_ctxx->hmac_outer);
+  }
+  if (srtcp_ctx != NULL && srtcp_ctx->key_size != 0)
+  {
+    mbedtls_aes_free(&srtcp_ctx->aes);
+    mbedtls_sha1_free(&srtcp_ctx->hmac_inner);
+    mbedtls_sha1_free(&srtcp_ctx->hmac_outer);
+  }
+  // wipe the keys too, and key_size 0 marks the context as free so freeing it again is harmless
+  if (srtp_ctxx != NULL)
+    memset(srtp_ctxx, 0, sizeof(*srtp_ctxx));
+  if (srtcp_ctx != NULL)
+    memset(srtcp_ctx, 0, sizeof(*srtcp_ctx));
+  return;
+}
+
+static void srtp_counter_iv(const srtp_ctx *srtp_ctx, uint8_t *iv, uint32_t index)
+
+{
+  // https://datatracker.ietf.org/doc/html/rfc3711#section-4.1.1
+  memcpy(iv, srtp_ctx->salt_key, 14);
+  iv[14] = 0;
+  iv[15] = 0;
+
+  iv[10] = (uint8_t)(index >> 24) ^ iv[10];
+  iv[11] = (uint8_t)(index >> 16) ^ iv[11];
+  iv[12] = (uint8_t)(index >> 8) ^ iv[12];
+  iv[13] = (uint8_t)index ^ iv[13];
+  return;
+}
+
 void srtp_encrypt(
     const srtp_ctx *srtp_ctx,
     uint8_t *packet,
@@ -97,18 +149,11 @@ void srtp_encrypt(
 //  printf("srtp_encrypt: num_header_bytes, %d, num_data_bytes %d, index: %lu\n", num_header_bytes, num_data_bytes, index);
 //  hexDump("srtp_ctx->encr_key",&srtp_ctx->encr_key, srtp_ctx->key_size, 16);
 //  hexDump("srtp_ctx->salt_key",&srtp_ctx->salt_key, 14, 16);
-  
-  memset(&iv, 0, 16);
-  memcpy(&iv, srtp_ctx->salt_key, 14);
 
-  iv[10] = (uint8_t)(index >> 24) ^ iv[10];
-  iv[11] = (uint8_t)(index >> 16) ^ iv[11];
-  iv[12] = (uint8_t)(index >> 8) ^ iv[12];
-  iv[13] = (uint8_t)index ^ iv[13];
+  srtp_counter_iv(srtp_ctx, iv, index);
 
-  mbedtls_aes_context aes;
-  mbedtls_aes_init(&aes);
-  mbedtls_aes_setkey_enc(&aes, srtp_ctx->encr_key, 8 * srtp_ctx->key_size);
+  // mbedtls only reads the key schedule, the const is dropped to match its prototype
+  mbedtls_aes_context *aes = (mbedtls_aes_context *)&srtp_ctx->aes;
 
   size_t nc_off = 0;
   uint8_t stream_block[16];
@@ -116,9 +161,39 @@ void srtp_encrypt(
 
   if (num_header_bytes != 0)
   {
-    mbedtls_aes_crypt_ctr(&aes, num_header_bytes, &nc_off, iv, stream_block, packet, packet);
+    mbedtls_aes_crypt_ctr(aes, num_header_bytes, &nc_off, iv, stream_block, packet, packet);
+  }
+  mbedtls_aes_crypt_ctr(aes, num_data_bytes, &nc_off, iv, stream_block, data_bytes, packet + num_header_bytes);
+  return;
+}
+
+void srtp_encrypt_many(
+    const srtp_ctx *srtp_ctx,
+    srtp_encrypt_job *jobs,
+    size_t num_jobs)
+{
+  // Encrypts all the packets of one frame against the same key schedule.
+  // Each packet still gets its own keystream (counter IV) derived from its index.
+  uint8_t iv[16];
+  uint8_t stream_block[16];
+  size_t nc_off;
+  size_t idx;
+  mbedtls_aes_context *aes = (mbedtls_aes_context *)&srtp_ctx->aes;
+
+  for (idx = 0; idx < num_jobs; idx++)
+  {
+    srtp_counter_iv(srtp_ctx, iv, jobs[idx].index);
+    nc_off = 0;
+    memset(stream_block, 0, 16);
+
+    if (jobs[idx].num_header_bytes != 0)
+    {
+      mbedtls_aes_crypt_ctr(aes, jobs[idx].num_header_bytes, &nc_off, iv, stream_block,
+                            jobs[idx].packet, jobs[idx].packet);
+    }
+    mbedtls_aes_crypt_ctr(aes, jobs[idx].num_data_bytes, &nc_off, iv, stream_block,
+                          jobs[idx].data_bytes, jobs[idx].packet + jobs[idx].num_header_bytes);
   }
-  mbedtls_aes_crypt_ctr(&aes, num_data_bytes, &nc_off, iv, stream_block, data_bytes, packet + num_header_bytes);
   return;
 }
 
@@ -128,23 +203,13 @@ void srtp_decrypt(srtp_ctx *srtp_ctx, uint8_t *data, uint8_t *packet_bytes,
 {
   uint8_t iv[16];
   // printf("srtp_decrypt: num_packet_bytes %d, index %lu\n", num_packet_bytes, index);
-  memset(&iv, 0, 16);
-  memcpy(&iv, srtp_ctx->salt_key, 14);
-
-  iv[10] = (uint8_t)(index >> 24) ^ iv[10];
-  iv[11] = (uint8_t)(index >> 16) ^ iv[11];
-  iv[12] = (uint8_t)(index >> 8) ^ iv[12];
-  iv[13] = (uint8_t)index ^ iv[13];
-
-  mbedtls_aes_context aes;
-  mbedtls_aes_init(&aes);
-  mbedtls_aes_setkey_enc(&aes, srtp_ctx->encr_key, 8 * srtp_ctx->key_size);
+  srtp_counter_iv(srtp_ctx, iv, index);
 
   size_t nc_off = 0;
   uint8_t stream_block[16];
   memset(stream_block, 0, 16);
 
-  mbedtls_aes_crypt_ctr(&aes, num_packet_bytes, &nc_off, iv, stream_block, packet_bytes, data);
+  mbedtls_aes_crypt_ctr(&srtp_ctx->aes, num_packet_bytes, &nc_off, iv, stream_block, packet_bytes, data);
   return;
 }
 
@@ -204,6 +269,65 @@ void hmac_sha1_aad(uint8_t *r, uint8_t *key, uint32_t key_len, uint8_t *in, uint
   return;
 }
 
+static void hmac_sha1_midstates(srtp_ctx *srtp_ctx)
+
+{
+  // The first block of both HMAC hashes only depends on the key, so hash it once per
+  // session and clone the resulting states for every packet.
+  // https://datatracker.ietf.org/doc/html/rfc2104#section-4
+  uint32_t idx;
+  uint8_t BByteString[0x40];
+
+  for (idx = 0; idx != 20; idx++)
+  {
+    *(uint8_t *)(BByteString + idx) = srtp_ctx->auth_key[idx] ^ 0x36;
+  }
+  for (; idx != 0x40; idx++)
+  {
+    *(uint8_t *)(BByteString + idx) = 0x36;
+  }
+  mbedtls_sha1_init(&srtp_ctx->hmac_inner);
+  mbedtls_sha1_starts(&srtp_ctx->hmac_inner);
+  mbedtls_sha1_update(&srtp_ctx->hmac_inner, BByteString, 0x40);
+
+  for (idx = 0; idx != 20; idx++)
+  {
+    *(uint8_t *)(BByteString + idx) = srtp_ctx->auth_key[idx] ^ 0x5c;
+  }
+  for (; idx != 0x40; idx++)
+  {
+    *(uint8_t *)(BByteString + idx) = 0x5c;
+  }
+  mbedtls_sha1_init(&srtp_ctx->hmac_outer);
+  mbedtls_sha1_starts(&srtp_ctx->hmac_outer);
+  mbedtls_sha1_update(&srtp_ctx->hmac_outer, BByteString, 0x40);
+
+  memset(BByteString, 0, 0x40);
+  return;
+}
+
+static void hmac_sha1_aad_midstate(const srtp_ctx *srtp_ctx, uint8_t *r, const uint8_t *in, uint32_t in_len,
+                                   const uint8_t *aad, uint32_t aad_len)
+
+{
+  mbedtls_sha1_context sha_ctx;
+
+  mbedtls_sha1_init(&sha_ctx);
+  mbedtls_sha1_clone(&sha_ctx, &srtp_ctx->hmac_inner);
+  mbedtls_sha1_update(&sha_ctx, in, in_len);
+  if (aad != 0)
+  {
+    mbedtls_sha1_update(&sha_ctx, aad, aad_len);
+  }
+  mbedtls_sha1_finish(&sha_ctx, r);
+
+  mbedtls_sha1_clone(&sha_ctx, &srtp_ctx->hmac_outer);
+  mbedtls_sha1_update(&sha_ctx, r, 0x14);
+  mbedtls_sha1_finish(&sha_ctx, r);
+  mbedtls_sha1_free(&sha_ctx);
+  return;
+}
+
 void srtp_authenticate(
     srtp_ctx *srtp_ctx,
     uint8_t *tag,
@@ -218,7 +342,7 @@ void srtp_authenticate(
 //  hexDump("srtp_ctx->auth_key",&srtp_ctx->auth_key, 20, 16);
 
   store_bigendian(&beIndex, index);
-  hmac_sha1_aad(result, srtp_ctx->auth_key, 20, bytes, num_bytes, (uint8_t *)&beIndex, 4);
+  hmac_sha1_aad_midstate(srtp_ctx, result, bytes, num_bytes, (uint8_t *)&beIndex, 4);
   memcpy(tag, result, srtp_ctx->tag_size);
   return;
 }
@@ -228,10 +352,16 @@ int srtp_verifyAuthentication(srtp_ctx *srtp_ctx, uint8_t *tag, uint8_t *bytes,
 {
   uint8_t result[20];
   uint32_t beIndex;
-  uint32_t output;
+  uint32_t idx;
+  uint8_t diff = 0;
   // printf("srtp_verifyAuthentication(srtp_ctx *srtp_ctx = %8x,uint8_t *tag = %8x,uint8_t *bytes = %8x,uint32_t num_bytes = %d,uint32_t index = %d)\n",srtp_ctx, tag, bytes, num_bytes, index);
   store_bigendian(&beIndex, index);
-  hmac_sha1_aad(result, srtp_ctx->auth_key, 20, bytes, num_bytes, (uint8_t *)&beIndex, 4);
-  output = 0 == memcmp(tag, result, srtp_ctx->tag_size);
-  return (output);
+  hmac_sha1_aad_midstate(srtp_ctx, result, bytes, num_bytes, (uint8_t *)&beIndex, 4);
+
+  // compare every byte of the tag so the time taken doesn't leak how many bytes matched
+  for (idx = 0; idx < srtp_ctx->tag_size && idx < 20; idx++)
+  {
+    diff |= tag[idx] ^ result[idx];
+  }
+  return (diff == 0);
 }
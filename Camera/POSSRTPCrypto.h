@@ -24,6 +24,8 @@ extern "C" {
 #endif
 #include <stddef.h>
 #include <stdint.h>
+#include "mbedtls/aes.h"
+#include "mbedtls/sha1.h"
 
 typedef struct {
     uint32_t key_size;
@@ -31,16 +33,34 @@ typedef struct {
     uint8_t encr_key[32];
     uint8_t auth_key[20];
     uint8_t salt_key[14];
+    // expanded AES key schedule for encr_key, built once in srtp_setupContext
+    mbedtls_aes_context aes;
+    // HMAC-SHA1 states after absorbing the ipad/opad blocks of auth_key
+    mbedtls_sha1_context hmac_inner;
+    mbedtls_sha1_context hmac_outer;
 } srtp_ctx;
 
+// One packet of a batch handed to srtp_encrypt_many, same meaning as the srtp_encrypt arguments
+typedef struct {
+    uint8_t *packet;
+    const uint8_t *data_bytes;
+    size_t num_header_bytes;
+    size_t num_data_bytes;
+    uint32_t index;
+} srtp_encrypt_job;
+
 void srtp_session_key
                (char * subKeyOut, uint32_t subKeySize, const char * masterKey, uint32_t masterKeySize,
                const char * salt, uint8_t keyIndex);
 
+// The contexts must be zeroed or set up before, a key they already hold is freed first
 void srtp_setupContext
                (srtp_ctx *srtp_ctxx,srtp_ctx *srtcp_ctx,const char *key,
                uint32_t keySize,const char *salt,uint32_t tagSize,uint32_t ssrc);
 
+// Releases the key schedules and zeroes the contexts, either may be NULL
+void srtp_freeContext(srtp_ctx *srtp_ctxx, srtp_ctx *srtcp_ctx);
+
 void srtp_encrypt(
     const srtp_ctx *srtp_ctx,
     uint8_t *packet,
@@ -49,6 +69,11 @@ void srtp_encrypt(
     size_t num_data_bytes,
     uint32_t index);
 
+void srtp_encrypt_many(
+    const srtp_ctx *srtp_ctx,
+    srtp_encrypt_job *jobs,
+    size_t num_jobs);
+
 void srtp_decrypt
                (srtp_ctx *srtp_ctx,uint8_t *data,uint8_t *packet_bytes,
                uint32_t num_packet_bytes,uint32_t index);
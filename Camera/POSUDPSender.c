@@ -0,0 +1,213 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sendmmsg
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "HAP.h"
+
+#include "POSUDPSender.h"
+
+static const HAPLogObject logObject = {.subsystem = kHAP_LogSubsystem, .category = "POSUDPSender"};
+
+// Cleared the first time the kernel refuses the feature, the T31 BSP kernel predates UDP_SEGMENT
+static volatile int useUDPSegment = 1;
+static volatile int useSendmmsg = 1;
+
+// UDP payload limit for a single GSO super-packet
+#define POS_UDP_GSO_MAX_BYTES 65000
+
+#ifdef UDP_SEGMENT
+static int POSUDPSendSegmented(int sock, const uint8_t *pool, size_t packetStride, const size_t *packetLens,
+                               size_t numPackets, uint32_t *numSyscalls)
+{
+  // https://lwn.net/Articles/752184/
+  // All segments are segmentSize bytes except possibly the last one.
+  struct iovec iov[POS_UDP_BATCH_MAX];
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  uint16_t segmentSize = (uint16_t)packetLens[0];
+  size_t total = 0;
+  size_t idx;
+
+  for (idx = 0; idx < numPackets; idx++)
+  {
+    iov[idx].iov_base = (void *)(pool + idx * packetStride);
+    iov[idx].iov_len = packetLens[idx];
+    total += packetLens[idx];
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = numPackets;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(uint16_t));
+
+  if (numSyscalls)
+    (*numSyscalls)++;
+  ssize_t ret = sendmsg(sock, &msg, 0);
+  if (ret < 0)
+  {
+    if (errno == EINVAL || errno == ENOPROTOOPT || errno == EIO || errno == EOPNOTSUPP)
+    {
+      HAPLogInfo(&logObject, "UDP_SEGMENT not usable (%s), using sendmmsg", strerror(errno));
+      useUDPSegment = 0;
+    }
+    return -1;
+  }
+  if ((size_t)ret != total)
+  {
+    HAPLogError(&logObject, "Tried to send %d bytes, but sendmsg only sent %d", (int)total, (int)ret);
+  }
+  return (int)numPackets;
+}
+#endif
+
+static int POSUDPSendMany(int sock, const uint8_t *pool, size_t packetStride, const size_t *packetLens,
+                          size_t numPackets, uint32_t *numSyscalls)
+{
+  struct mmsghdr msgs[POS_UDP_BATCH_MAX];
+  struct iovec iov[POS_UDP_BATCH_MAX];
+  size_t idx;
+  size_t sent = 0;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * numPackets);
+  for (idx = 0; idx < numPackets; idx++)
+  {
+    iov[idx].iov_base = (void *)(pool + idx * packetStride);
+    iov[idx].iov_len = packetLens[idx];
+    msgs[idx].msg_hdr.msg_iov = &iov[idx];
+    msgs[idx].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (sent < numPackets)
+  {
+    if (numSyscalls)
+      (*numSyscalls)++;
+    int ret = sendmmsg(sock, msgs + sent, numPackets - sent, 0);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return sent ? (int)sent : -1; // nonblocking socket with a full send buffer
+      if (errno == ENOSYS)
+      {
+        HAPLogInfo(&logObject, "sendmmsg not available, using send");
+        useSendmmsg = 0;
+      }
+      else
+      {
+        HAPLogError(&logObject, "sendmmsg failed: %s", strerror(errno));
+      }
+      return sent ? (int)sent : -1;
+    }
+    if (ret == 0)
+      break;
+    sent += ret;
+  }
+  return (int)sent;
+}
+
+int POSUDPSendBatch(int sock, const uint8_t *pool, size_t packetStride, const size_t *packetLens,
+                    size_t numPackets, uint32_t *numSyscalls)
+{
+  size_t start = 0;
+  size_t idx;
+
+  if (pool == NULL || packetLens == NULL)
+    return -1;
+
+  while (start < numPackets)
+  {
+    size_t count = numPackets - start;
+    int ret = -1;
+
+    if (count > POS_UDP_BATCH_MAX)
+      count = POS_UDP_BATCH_MAX;
+
+#ifdef UDP_SEGMENT
+    if (useUDPSegment && count > 1)
+    {
+      // take the longest run of equal sized packets (plus one shorter tail packet) that fits in a datagram
+      size_t segmentSize = packetLens[start];
+      size_t total = 0;
+      size_t run = 0;
+      while (run < count && packetLens[start + run] <= segmentSize &&
+             total + packetLens[start + run] <= POS_UDP_GSO_MAX_BYTES)
+      {
+        total += packetLens[start + run];
+        run++;
+        if (packetLens[start + run - 1] != segmentSize)
+          break;
+      }
+      if (run > 1)
+      {
+        ret = POSUDPSendSegmented(sock, pool + start * packetStride, packetStride, packetLens + start, run,
+                                  numSyscalls);
+        if (ret > 0)
+        {
+          start += ret;
+          continue;
+        }
+      }
+    }
+#endif
+    if (useSendmmsg)
+    {
+      ret = POSUDPSendMany(sock, pool + start * packetStride, packetStride, packetLens + start, count,
+                           numSyscalls);
+      if (ret > 0)
+      {
+        start += ret;
+        continue;
+      }
+      if (useSendmmsg)
+        return start ? (int)start : -1;
+    }
+
+    // plain send() fallback
+    for (idx = start; idx < start + count; idx++)
+    {
+      if (numSyscalls)
+        (*numSyscalls)++;
+      ssize_t sret = send(sock, pool + idx * packetStride, packetLens[idx], 0);
+      if (sret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return idx ? (int)idx : -1;
+      if (sret != (ssize_t)packetLens[idx])
+      {
+        HAPLogError(&logObject, "Tried to send %d bytes, but send only sent %d", (int)packetLens[idx], (int)sret);
+      }
+    }
+    start += count;
+  }
+  return (int)start;
+}
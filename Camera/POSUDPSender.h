@@ -0,0 +1,56 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef POSUDPSENDER_H
+#define POSUDPSENDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most packets handed to the kernel in one sendmmsg / UDP_SEGMENT call
+#define POS_UDP_BATCH_MAX 64
+
+/**
+ * Sends a batch of packets on a connected UDP socket.
+ *
+ * Packet n starts at pool + n * packetStride and is packetLens[n] bytes long.
+ * Uses UDP_SEGMENT when every packet but the last has the same size and the
+ * kernel supports it, sendmmsg otherwise, and falls back to one send() per
+ * packet on kernels without either.  On a nonblocking socket it stops at the
+ * first packet the kernel won't queue.
+ *
+ * @param numSyscalls Incremented by the number of socket calls made. May be NULL.
+ * @return Number of packets sent, or -1 if the first send failed.
+ */
+int POSUDPSendBatch(
+        int sock,
+        const uint8_t *pool,
+        size_t packetStride,
+        const size_t *packetLens,
+        size_t numPackets,
+        uint32_t *numSyscalls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
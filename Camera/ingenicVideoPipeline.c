@@ -96,6 +96,7 @@
 #include <HAP.h>
 #include <HAP+Internal.h>
 #include "App.h"
+#include "snapshot.h"
 
 static const HAPLogObject logObject = { .subsystem = kHAP_LogSubsystem, .category = "videoPipeline" };
 
@@ -524,7 +525,6 @@ static int statime_sp[3] = { 0 };
 static int bitrate_sp[3] = { 0 };
 
 
-pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void *get_jpeg_stream(void *args)
 {
   int val, i, chnNum, ret;
@@ -578,58 +578,29 @@ static void *get_jpeg_stream(void *args)
 				bitrate_sp[chnNum] = 0;
 				statime_sp[chnNum] = now;
 			}
-		char * snap_path = "/tmp/snap.jpg";
-
-		//	HAPLogDebug(&logObject, "Locking snapshot mutex");
-		if ( pthread_mutex_lock(&snapshot_mutex) != 0){
-			HAPLogError(&logObject, "Locking snapshot mutex failed: %s", strerror(errno));
-		}
-
-
-		//TTTHAPLogDebug(&logObject, "Open Snap file %s ", snap_path);
-		int snap_fd = open(snap_path, O_RDWR | O_CREAT | O_TRUNC, 0777);
-		if (snap_fd < 0) {
-			HAPLogError(&logObject, "failed: %s", strerror(errno));
+		// Copy the jpeg into a free snapshot frame and publish it.  Readers
+		// hold references instead of a lock, so this never waits on them.
+		snapshot_frame_t *snapshot = snapshotBeginWrite(len);
+		if (snapshot == NULL) {
+			HAPLogError(&logObject, "All snapshot frames busy, dropping jpeg %u", stream.seq);
 		}
 		else{
-			//TTTHAPLogDebug(&logObject, "OK");
-
-			int ret, nr_pack = stream.packCount;
-
-			// //TTTHAPLogDebug(&logObject, "----------packCount=%d, stream.seq=%u start----------", stream.packCount, stream.seq);
-			for (i = 0; i < nr_pack; i++) {
-			// //TTTHAPLogDebug(&logObject, "[%d]:%10u,%10lld,%10u,%10u,%10u", i, stream.pack[i].length, stream.pack[i].timestamp, stream.pack[i].frameEnd, *((uint32_t *)(&stream.pack[i].nalType)), stream.pack[i].sliceType);
+			uint8_t *dst = snapshot->data;
+			for (i = 0; i < stream.packCount; i++) {
 				IMPEncoderPack *pack = &stream.pack[i];
 				if(pack->length){
 					uint32_t remSize = stream.streamSize - pack->offset;
 					if(remSize < pack->length){
-						ret = write(snap_fd, (void *)(stream.virAddr + pack->offset), remSize);
-						if (ret != remSize) {
-							//TTTHAPLogDebug(&logObject, "stream write ret(%d) != pack[%d].remSize(%d) error:%s", ret, i, remSize, strerror(errno));
-							// return -1;
-						}
-						ret = write(snap_fd, (void *)stream.virAddr, pack->length - remSize);
-						if (ret != (pack->length - remSize)) {
-							//TTTHAPLogDebug(&logObject, "stream write ret(%d) != pack[%d].(length-remSize)(%d) error:%s", ret, i, (pack->length - remSize), strerror(errno));
-							// return -1;
-						}
+						// the pack wraps around the end of the stream buffer
+						memcpy(dst, (void *)(stream.virAddr + pack->offset), remSize);
+						memcpy(dst + remSize, (void *)stream.virAddr, pack->length - remSize);
 					}else {
-						ret = write(snap_fd, (void *)(stream.virAddr + pack->offset), pack->length);
-						if (ret != pack->length) {
-							//TTTHAPLogDebug(&logObject, "stream write ret(%d) != pack[%d].length(%d) error:%s", ret, i, pack->length, strerror(errno));
-							// return -1;
-						}
+						memcpy(dst, (void *)(stream.virAddr + pack->offset), pack->length);
 					}
+					dst += pack->length;
 				}
 			}
-			close(snap_fd);
-
-		////TTTHAPLogDebug(&logObject, "----------packCount=%d, stream.seq=%u end----------", stream.packCount, stream.seq);
-		}
-
-	//	HAPLogDebug(&logObject, "Unlocking snapshot mutex");
-		if ( pthread_mutex_unlock(&snapshot_mutex) != 0){
-			HAPLogError(&logObject, "Unocking snapshot mutex failed: %s", strerror(errno));
+			snapshotPublish(snapshot);
 		}
 
 		IMP_Encoder_ReleaseStream(chnNum, &stream);
@@ -22,64 +22,228 @@
 #include <stdio.h>
 #include <errno.h>
 
-extern pthread_mutex_t snapshot_mutex;
-
 static const HAPLogObject logObject = { .subsystem = kHAP_LogSubsystem, .category = "CameraGetSnapshot" };
 
-// The hardware video pipeline is setup to create jpeg snapshots at 640x480 (2hz)
+// One frame is current, one is being written and the rest cover readers still
+// holding older frames.  If all are busy the encoder skips a frame.
+#define SNAPSHOT_NUM_FRAMES 4
+
+static snapshot_frame_t snapshotFrames[SNAPSHOT_NUM_FRAMES];
+static snapshot_frame_t* currentSnapshot = NULL;
+static uint32_t nextSnapshotId = 1;
+
+snapshot_frame_t* snapshotBeginWrite(size_t size) {
+    snapshot_frame_t* current = __atomic_load_n(&currentSnapshot, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < SNAPSHOT_NUM_FRAMES; i++) {
+        snapshot_frame_t* frame = &snapshotFrames[i];
+        if (frame == current || __atomic_load_n(&frame->refCount, __ATOMIC_ACQUIRE) != 0)
+            continue;
+        if (frame->capacity < size) {
+            // Nobody can read this frame: a reader that raced us to it rechecks
+            // currentSnapshot before touching the data and backs off.
+            uint8_t* data = realloc(frame->data, size);
+            if (data == NULL) {
+                HAPLogError(&logObject, "Couldn't grow snapshot frame to %lu bytes", (unsigned long) size);
+                return NULL;
+            }
+            frame->data = data;
+            frame->capacity = size;
+        }
+        frame->size = size;
+        return frame;
+    }
+    return NULL;
+}
+
+void snapshotPublish(snapshot_frame_t* frame) {
+    frame->id = nextSnapshotId++;
+    __atomic_store_n(&currentSnapshot, frame, __ATOMIC_SEQ_CST);
+}
+
+snapshot_frame_t* snapshotAcquire(void) {
+    for (;;) {
+        snapshot_frame_t* frame = __atomic_load_n(&currentSnapshot, __ATOMIC_SEQ_CST);
+        if (frame == NULL)
+            return NULL;
+        __atomic_add_fetch(&frame->refCount, 1, __ATOMIC_SEQ_CST);
+        // The encoder only reuses frames that are neither current nor
+        // referenced, so if the frame is still current after taking the
+        // reference it can't be overwritten until we release it.
+        if (__atomic_load_n(&currentSnapshot, __ATOMIC_SEQ_CST) == frame)
+            return frame;
+        __atomic_sub_fetch(&frame->refCount, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void snapshotRelease(snapshot_frame_t* frame) {
+    __atomic_sub_fetch(&frame->refCount, 1, __ATOMIC_RELEASE);
+}
+
+// Scaled snapshots are kept per (frame, size) so that a burst of requests from
+// several controllers for the same size only scales once.
+#define SNAPSHOT_CACHE_ENTRIES 4
+
+typedef struct {
+    uint32_t frameId;
+    int width;
+    int height;
+    unsigned long size;
+    unsigned char* jpeg;
+    uint32_t lastUse;
+} snapshot_cache_entry_t;
+
+static snapshot_cache_entry_t snapshotCache[SNAPSHOT_CACHE_ENTRIES];
+static uint32_t snapshotCacheClock = 0;
+// Held while scaling, so concurrent requests for the same size wait for the first one
+static pthread_mutex_t snapshotCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Picks the smallest 1/n DCT scaling factor that still covers width x height.
+// Decoding at 1/2, 1/4 or 1/8 skips most of the IDCT work.
+static tjscalingfactor chooseScalingFactor(int snapWidth, int snapHeight, int width, int height) {
+    tjscalingfactor best = { 1, 1 };
+    int numFactors = 0;
+    tjscalingfactor* factors = tjGetScalingFactors(&numFactors);
+    if (factors == NULL)
+        return best;
+    for (int i = 0; i < numFactors; i++) {
+        if (factors[i].num != 1 || factors[i].denom > 8)
+            continue;
+        if (TJSCALED(snapWidth, factors[i]) >= width && TJSCALED(snapHeight, factors[i]) >= height &&
+            factors[i].denom > best.denom)
+            best = factors[i];
+    }
+    return best;
+}
+
+// Decodes the snapshot at reduced size and re-encodes the centre width x height,
+// padding with black if the source is narrower or shorter than requested.
+static int scaleSnapshot(
+        tjhandle tjInstanceIn,
+        unsigned char* srcbuf,
+        size_t srcsize,
+        int snapWidth,
+        int snapHeight,
+        int snapSubSamp,
+        int width,
+        int height,
+        unsigned char** jpegOut,
+        unsigned long* jpegOutSize) {
+    const int pixelFormat = TJPF_BGRX;
+    const int pixelSize = tjPixelSize[pixelFormat];
+    tjscalingfactor factor = chooseScalingFactor(snapWidth, snapHeight, width, height);
+    int scaledWidth = TJSCALED(snapWidth, factor);
+    int scaledHeight = TJSCALED(snapHeight, factor);
+    int scaledPitch = scaledWidth * pixelSize;
+    int result = -1;
+
+    HAPLogDebug(&logObject, "Decoding snapshot at %d/%d: %dx%d", factor.num, factor.denom, scaledWidth, scaledHeight);
+
+    unsigned char* scaledBuf = tjAlloc(scaledPitch * scaledHeight);
+    if (scaledBuf == NULL) {
+        HAPLogError(&logObject, "%s", "Couldn't allocate scaledBuf.");
+        return -1;
+    }
+    if (tjDecompress2(
+                tjInstanceIn, srcbuf, srcsize, scaledBuf, scaledWidth, scaledPitch, scaledHeight, pixelFormat,
+                TJFLAG_FASTDCT) < 0) {
+        HAPLogError(&logObject, "tjDecompress2: %s", tjGetErrorStr());
+        tjFree(scaledBuf);
+        return -1;
+    }
+
+    unsigned char* cropBuf = scaledBuf;
+    unsigned char* paddedBuf = NULL;
+    int cropPitch = scaledPitch;
+    if (scaledWidth >= width && scaledHeight >= height) {
+        // crop in place by pointing at the centre of the decoded image
+        cropBuf += ((scaledHeight - height) / 2) * scaledPitch + ((scaledWidth - width) / 2) * pixelSize;
+    } else {
+        paddedBuf = tjAlloc(width * height * pixelSize);
+        if (paddedBuf == NULL) {
+            HAPLogError(&logObject, "%s", "Couldn't allocate paddedBuf.");
+            tjFree(scaledBuf);
+            return -1;
+        }
+        HAPRawBufferZero(paddedBuf, width * height * pixelSize);
+        int copyWidth = scaledWidth < width ? scaledWidth : width;
+        int copyHeight = scaledHeight < height ? scaledHeight : height;
+        int srcX = (scaledWidth - copyWidth) / 2, srcY = (scaledHeight - copyHeight) / 2;
+        int dstX = (width - copyWidth) / 2, dstY = (height - copyHeight) / 2;
+        for (int y = 0; y < copyHeight; y++) {
+            HAPRawBufferCopyBytes(
+                    paddedBuf + ((dstY + y) * width + dstX) * pixelSize,
+                    scaledBuf + (srcY + y) * scaledPitch + srcX * pixelSize,
+                    copyWidth * pixelSize);
+        }
+        cropBuf = paddedBuf;
+        cropPitch = width * pixelSize;
+    }
+
+    tjhandle tjInstanceOut = tjInitCompress();
+    if (tjInstanceOut == NULL) {
+        HAPLogError(&logObject, "%s", tjGetErrorStr());
+    } else {
+        *jpegOut = NULL;
+        *jpegOutSize = 0;
+        if (tjCompress2(
+                    tjInstanceOut,
+                    cropBuf,
+                    width,
+                    cropPitch,
+                    height,
+                    pixelFormat,
+                    jpegOut,
+                    jpegOutSize,
+                    snapSubSamp,
+                    95,
+                    TJFLAG_FASTDCT) < 0) {
+            HAPLogError(&logObject, "tjCompress2: %s", tjGetErrorStr());
+            tjFree(*jpegOut);
+            *jpegOut = NULL;
+        } else {
+            result = 0;
+        }
+        tjDestroy(tjInstanceOut);
+    }
+
+    tjFree(paddedBuf);
+    tjFree(scaledBuf);
+    return result;
+}
+
+// The hardware video pipeline is setup to create jpeg snapshots at 640x360 (1hz)
 // This handles the majority of apple devices I've seen.
 // The apple watch, however, requests images at 320x240. This function will resize 
-// down (in software) if a request for an image smaller than 640x480 occurs.
+// down (in software) if a request for a smaller image occurs.
 int getSnapshot(unsigned long * jpegSize, uint8_t* jpegBuf, int width, int height) {
 
-	FILE *file=NULL;  
-	unsigned char *srcbuf=NULL;
-	size_t srcsize;
-    
-    struct timespec wait;
-    wait.tv_sec = 0;
-    wait.tv_nsec = 100000; //100 ms
-
-//	HAPLogInfo(&logObject, "Locking snapshot mutex");
-	if ( pthread_mutex_timedlock(&snapshot_mutex, &wait) != 0 ){
-		HAPLogError(&logObject, "Locking snapshot mutex failed: %s.  Exiting.", strerror(errno));
-        *jpegSize = 0;
-        return -1;
-	}	
-    
-    file=fopen("/tmp/snap.jpg", "rb");
-
-	fseek(file, 0, SEEK_END);
-	srcsize=ftell(file);
-	if( srcsize > *jpegSize ){
-            HAPLogError(&logObject, "No room in jpg buffer, reading partial file");
-            srcsize = *jpegSize;
+	snapshot_frame_t *snapshot = snapshotAcquire();
+	if (snapshot == NULL) {
+		HAPLogError(&logObject, "No snapshot available yet");
+		*jpegSize = 0;
+		return -1;
 	}
-	srcbuf=(unsigned char *)malloc(srcsize);
-	fseek(file, 0, SEEK_SET);
-	fread(srcbuf, srcsize, 1, file);
-	fclose(file);  
-	file=NULL;
-    
- //   HAPLogInfo(&logObject, "Unocking snapshot mutex");
-	if ( pthread_mutex_unlock(&snapshot_mutex) != 0 ){
-		HAPLogError(&logObject, "Unlocking snapshot mutex failed: %s.  Exiting.", strerror(errno));
-        *jpegSize = 0;
-        return -1;
-	}	
-
+	unsigned char *srcbuf = snapshot->data;
+	size_t srcsize = snapshot->size;
 
     HAPLogInfo(&logObject, "%lu bytes retrieved", (unsigned long) srcsize);
 
     tjhandle tjInstanceIn = NULL;
-    int flags = 0, snapWidth, snapHeight, snapSubSamp, snapColorspace;
-    int pixelFormat = TJPF_BGRX;
+    int snapWidth, snapHeight, snapSubSamp, snapColorspace;
 
-    if ((tjInstanceIn = tjInitDecompress()) == NULL)
+    if ((tjInstanceIn = tjInitDecompress()) == NULL) {
         HAPLogError(&logObject, "%s", tjGetErrorStr());
+        snapshotRelease(snapshot);
+        *jpegSize = 0;
+        return -1;
+    }
 
     if (tjDecompressHeader3(tjInstanceIn, srcbuf, srcsize, &snapWidth, &snapHeight, &snapSubSamp, &snapColorspace) < 0){
         HAPLogError(&logObject, "%s", tjGetErrorStr());
+        tjDestroy(tjInstanceIn);
+        snapshotRelease(snapshot);
+        *jpegSize = 0;
+        return -1;
     }
     HAPLogInfo(
             &logObject,
@@ -88,63 +252,71 @@ int getSnapshot(unsigned long * jpegSize, uint8_t* jpegBuf, int width, int heigh
             snapHeight,
             snapSubSamp,     // TJSAMP_420
             snapColorspace); // TJCS_YCbCr
+
+    int result = 0;
     // Don't resize if requested size is greater than snapshot from camera.
     if (height >= snapHeight) {
         HAPLogDebug(&logObject, "%s", "Snapshot not scaled.");
+        if (srcsize > *jpegSize) {
+            HAPLogError(&logObject, "No room in jpg buffer, returning partial image");
+            srcsize = *jpegSize;
+        }
         HAPRawBufferCopyBytes(jpegBuf, srcbuf, srcsize);
         *jpegSize = srcsize;
-        free(srcbuf);
 
     } else {
-        HAPLogDebug(&logObject, "%s", "Scaling snapshot.");
-        tjhandle tjInstanceOut = NULL;
-        unsigned char* dstBuf = NULL; /* Dynamically allocate the JPEG buffer */
-        unsigned long dstSize = 0;
-
-        dstSize = width * height * tjPixelSize[pixelFormat];
-
-        if ((dstBuf = (unsigned char*) tjAlloc(dstSize)) == NULL)
-            HAPLogError(&logObject, "%s", "Couldn't allocate dstBuf.");
-        // tjDecompress2 also handles the resizing.
-        if (tjDecompress2(tjInstanceIn, srcbuf, srcsize, dstBuf, width, 0, height, pixelFormat, flags) < 0)
-            HAPLogError(&logObject, "tjDecompress2: %s", tjGetErrorStr());
-
-        free(srcbuf);
-
-        if ((tjInstanceOut = tjInitCompress()) == NULL)
-            HAPLogError(&logObject, "%s", tjGetErrorStr());
-        if (tjCompress2(
-                    tjInstanceOut,
-                    dstBuf,
-                    width,
-                    0,
-                    height,
-                    pixelFormat,
-                    &jpegBuf,
-                    jpegSize, //contains the buffer size in and the image size out
-                    snapSubSamp,
-                    95,
-                    flags |= TJFLAG_NOREALLOC) < 0){
-            HAPLogError(&logObject, "%s", tjGetErrorStr());
+        pthread_mutex_lock(&snapshotCacheMutex);
+        snapshot_cache_entry_t* entry = NULL;
+        for (int i = 0; i < SNAPSHOT_CACHE_ENTRIES; i++) {
+            snapshot_cache_entry_t* e = &snapshotCache[i];
+            if (e->jpeg != NULL && e->frameId == snapshot->id && e->width == width && e->height == height) {
+                entry = e;
+                break;
+            }
         }
-        if (tjDecompressHeader3(tjInstanceIn, jpegBuf, *jpegSize, &snapWidth, &snapHeight, &snapSubSamp, &snapColorspace) < 0){
-            HAPLogError(&logObject, "tjDecompressHeader3: %s", tjGetErrorStr());
+        if (entry != NULL) {
+            HAPLogDebug(&logObject, "Scaled snapshot %dx%d served from cache.", width, height);
+        } else {
+            HAPLogDebug(&logObject, "%s", "Scaling snapshot.");
+            // replace the least recently used entry
+            entry = &snapshotCache[0];
+            for (int i = 1; i < SNAPSHOT_CACHE_ENTRIES; i++) {
+                if (snapshotCache[i].jpeg == NULL || snapshotCache[i].lastUse < entry->lastUse)
+                    entry = &snapshotCache[i];
+                if (entry->jpeg == NULL)
+                    break;
+            }
+            tjFree(entry->jpeg);
+            entry->jpeg = NULL;
+            if (scaleSnapshot(tjInstanceIn, srcbuf, srcsize, snapWidth, snapHeight, snapSubSamp, width, height,
+                        &entry->jpeg, &entry->size) == 0) {
+                entry->frameId = snapshot->id;
+                entry->width = width;
+                entry->height = height;
+                HAPLogInfo(&logObject, "Snapshot image resized: Width: %d, Height: %d", width, height);
+            } else {
+                entry = NULL;
+            }
         }
-        HAPLogInfo(
-                &logObject,
-                "Snapshot image resized: Width: %d, Height: %d, Sub: %d, Colorspace: %d",
-                snapWidth,
-                snapHeight,
-                snapSubSamp,     // TJSAMP_420
-                snapColorspace); // TJCS_YCbCr
-
-        tjFree(dstBuf);
-        dstBuf = NULL;
-        tjDestroy(tjInstanceOut);
-        tjInstanceOut = NULL;
+
+        if (entry == NULL) {
+            *jpegSize = 0;
+            result = -1;
+        } else if (entry->size > *jpegSize) {
+            HAPLogError(&logObject, "No room in jpg buffer for %lu byte scaled image", entry->size);
+            *jpegSize = 0;
+            result = -1;
+        } else {
+            entry->lastUse = ++snapshotCacheClock;
+            HAPRawBufferCopyBytes(jpegBuf, entry->jpeg, entry->size);
+            *jpegSize = entry->size;
+        }
+        pthread_mutex_unlock(&snapshotCacheMutex);
     }
     tjDestroy(tjInstanceIn);
     tjInstanceIn = NULL;
-    HAPLogInfo(&logObject, "Successful %s.", __func__);
-    return 0;
+    snapshotRelease(snapshot);
+    if (result == 0)
+        HAPLogInfo(&logObject, "Successful %s.", __func__);
+    return result;
 }
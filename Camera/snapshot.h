@@ -44,6 +44,40 @@ struct MemoryStruct {
     size_t size;
 };
 
+/**
+ * A JPEG published by the snapshot encoder thread.
+ *
+ * Frames live in a small fixed pool.  The encoder thread fills a frame nobody
+ * references and publishes it with an atomic pointer swap, readers take a
+ * reference on the current frame.  Neither side ever waits for the other.
+ */
+typedef struct {
+    uint32_t refCount;  // readers holding the frame, updated atomically
+    uint32_t id;        // increases with every published frame
+    size_t size;
+    size_t capacity;
+    uint8_t* data;
+} snapshot_frame_t;
+
+/**
+ * Returns a free frame with room for size bytes, or NULL if every frame is
+ * still referenced.  Only the encoder thread may call this.
+ */
+snapshot_frame_t* _Nullable snapshotBeginWrite(size_t size);
+
+/**
+ * Makes a frame returned by snapshotBeginWrite the current snapshot.
+ */
+void snapshotPublish(snapshot_frame_t* frame);
+
+/**
+ * Returns a reference to the current snapshot, or NULL before the first one
+ * is published.  Must be paired with snapshotRelease.
+ */
+snapshot_frame_t* _Nullable snapshotAcquire(void);
+
+void snapshotRelease(snapshot_frame_t* frame);
+
 int getSnapshot(unsigned long * outSize, uint8_t*  outBuffer, int, int);
 
 #if __has_feature(nullability)
@@ -0,0 +1,77 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host simulation of the subset of the Ingenic IMP SDK used by positron.
+ *
+ * Built as libimp_sim and linked into positron_host in place of the MIPS
+ * libimp.so / libsysutils.so / libalog.so.  Everything is configured from
+ * the environment so the application code doesn't change:
+ *
+ *   POS_SIM_SPEED            playback speed multiplier, 1 = real time (default 1)
+ *   POS_SIM_H264             Annex-B H.264 (or H.265) file replayed on encoder channels 0 and 1
+ *   POS_SIM_H264_CHN<n>      per channel override of POS_SIM_H264
+ *   POS_SIM_JPEG             JPEG file, or printf pattern such as snap%03d.jpg, replayed on the JPEG channel
+ *   POS_SIM_JPEG_PACK_BYTES  split each JPEG into packs of this size (default 0 = one pack)
+ *   POS_SIM_BACKLOG          frames added to IMP_Encoder_Query leftStreamFrames (default 0)
+ *   POS_SIM_WAV              16 bit mono WAV replayed on every AI device, silence if unset
+ *   POS_SIM_AO_PCM           raw 16 bit PCM file that receives everything sent to AO
+ *   POS_SIM_EV               exposure value reported by IMP_ISP_Tuning_GetEVAttr (default 1000, day)
+ *   POS_SIM_MOTION_PERIOD    seconds between simulated motion events, 0 = never (default 0)
+ *   POS_SIM_TIMESTAMP_DELAY_US  IMP_System_GetTimeStamp sleeps this long before reading (default 0)
+ *
+ * IMPEncoderStream.virAddr is only 32 bits wide, so stream buffers are mapped
+ * in the low 4 GB (MAP_32BIT) on 64 bit hosts.
+ */
+
+#ifndef IMP_SIM_H
+#define IMP_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Simulated time in us since IMP_System_Init, advances POS_SIM_SPEED times faster than CLOCK_MONOTONIC
+int64_t imp_sim_now_us(void);
+
+// Sleeps until the simulated clock reaches simTimeUs
+void imp_sim_sleep_until_us(int64_t simTimeUs);
+
+// Environment helpers with defaults
+const char *imp_sim_getenv(const char *name, const char *def);
+long imp_sim_getenv_long(const char *name, long def);
+double imp_sim_getenv_double(const char *name, double def);
+
+// Maps a whole file read only. Returns NULL if it can't be opened.
+uint8_t *imp_sim_map_file(const char *path, size_t *len);
+void imp_sim_unmap_file(uint8_t *data, size_t len);
+
+// Allocates a buffer whose address fits in the 32 bit IMP virAddr fields
+void *imp_sim_alloc32(size_t len);
+void imp_sim_free32(void *ptr, size_t len);
+
+#define IMP_SIM_LOG(fmt, ...) imp_sim_log(__func__, fmt, ##__VA_ARGS__)
+void imp_sim_log(const char *func, const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,496 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Audio part of the IMP simulation: AI replays a WAV file, AO consumes frames at the playout rate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <imp/imp_common.h>
+#include <imp/imp_audio.h>
+
+#include "imp_sim.h"
+
+#define SIM_AUDIO_MAX_DEV 2
+#define SIM_AUDIO_MAX_FRAME_BYTES (16 * 1024)
+
+typedef struct {
+  int enabled;
+  int chnEnabled;
+  IMPAudioIOAttr attr;
+  IMPAudioIChnParam chnParam;
+  int vol;
+  int gain;
+
+  // AI: replayed PCM and the next capture time
+  uint8_t *wav;
+  size_t wavLen;
+  const uint8_t *pcm;
+  size_t pcmLen;
+  size_t pcmPos;
+  int64_t nextFrameUs;
+  int seq;
+  int16_t *frameBuf;
+
+  // AO: simulated playout position
+  int64_t playoutUs;
+  FILE *pcmOut;
+
+  pthread_mutex_t lock;
+} sim_audio_dev;
+
+static sim_audio_dev aiDev[SIM_AUDIO_MAX_DEV];
+static sim_audio_dev aoDev[SIM_AUDIO_MAX_DEV];
+
+static int64_t frame_duration_us(const IMPAudioIOAttr *attr)
+{
+  if (attr->samplerate == 0)
+    return 0;
+  return (int64_t)attr->numPerFrm * 1000000 / attr->samplerate;
+}
+
+static int frame_bytes(const IMPAudioIOAttr *attr)
+{
+  return attr->numPerFrm * (attr->bitwidth / 8) * (attr->soundmode == AUDIO_SOUND_MODE_STEREO ? 2 : 1);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Finds the data chunk of a RIFF/WAVE file. Anything else is replayed as raw PCM.
+static void find_wav_data(sim_audio_dev *d)
+{
+  d->pcm = d->wav;
+  d->pcmLen = d->wavLen;
+  if (d->wavLen < 12 || memcmp(d->wav, "RIFF", 4) != 0 || memcmp(d->wav + 8, "WAVE", 4) != 0)
+    return;
+
+  size_t pos = 12;
+  while (pos + 8 <= d->wavLen)
+  {
+    uint32_t chunkLen = le32(d->wav + pos + 4);
+    if (memcmp(d->wav + pos, "fmt ", 4) == 0 && chunkLen >= 16 && pos + 8 + 16 <= d->wavLen)
+    {
+      uint32_t rate = le32(d->wav + pos + 12);
+      if (rate != (uint32_t)d->attr.samplerate)
+        IMP_SIM_LOG("wav is %u Hz, AI runs at %d Hz, replaying without resampling", rate, d->attr.samplerate);
+    }
+    if (memcmp(d->wav + pos, "data", 4) == 0)
+    {
+      d->pcm = d->wav + pos + 8;
+      d->pcmLen = (chunkLen < d->wavLen - pos - 8) ? chunkLen : d->wavLen - pos - 8;
+      return;
+    }
+    pos += 8 + chunkLen + (chunkLen & 1);
+  }
+}
+
+/*
+ * AI
+ */
+
+int IMP_AI_SetPubAttr(int audioDevId, IMPAudioIOAttr *attr)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || attr == NULL)
+    return -1;
+  if (frame_bytes(attr) > SIM_AUDIO_MAX_FRAME_BYTES)
+    return -1;
+  aiDev[audioDevId].attr = *attr;
+  return 0;
+}
+
+int IMP_AI_GetPubAttr(int audioDevId, IMPAudioIOAttr *attr)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || attr == NULL)
+    return -1;
+  *attr = aiDev[audioDevId].attr;
+  return 0;
+}
+
+int IMP_AI_Enable(int audioDevId)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  sim_audio_dev *d = &aiDev[audioDevId];
+  if (d->enabled)
+    return 0;
+
+  pthread_mutex_init(&d->lock, NULL);
+  d->frameBuf = imp_sim_alloc32(SIM_AUDIO_MAX_FRAME_BYTES);
+  if (d->frameBuf == NULL)
+    return -1;
+
+  const char *path = imp_sim_getenv("POS_SIM_WAV", NULL);
+  if (path != NULL)
+  {
+    d->wav = imp_sim_map_file(path, &d->wavLen);
+    if (d->wav == NULL)
+      IMP_SIM_LOG("can't open %s, capturing silence", path);
+    else
+      find_wav_data(d);
+  }
+  d->enabled = 1;
+  return 0;
+}
+
+int IMP_AI_Disable(int audioDevId)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aiDev[audioDevId].enabled)
+    return -1;
+  sim_audio_dev *d = &aiDev[audioDevId];
+  imp_sim_unmap_file(d->wav, d->wavLen);
+  imp_sim_free32(d->frameBuf, SIM_AUDIO_MAX_FRAME_BYTES);
+  d->wav = NULL;
+  d->pcm = NULL;
+  d->frameBuf = NULL;
+  d->enabled = 0;
+  pthread_mutex_destroy(&d->lock);
+  return 0;
+}
+
+int IMP_AI_EnableChn(int audioDevId, int aiChn)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aiDev[audioDevId].enabled)
+    return -1;
+  sim_audio_dev *d = &aiDev[audioDevId];
+  d->chnEnabled = 1;
+  d->pcmPos = 0;
+  d->nextFrameUs = imp_sim_now_us() + frame_duration_us(&d->attr);
+  return 0;
+}
+
+int IMP_AI_DisableChn(int audioDevId, int aiChn)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aiDev[audioDevId].chnEnabled = 0;
+  return 0;
+}
+
+int IMP_AI_SetChnParam(int audioDevId, int aiChn, IMPAudioIChnParam *chnParam)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || chnParam == NULL)
+    return -1;
+  aiDev[audioDevId].chnParam = *chnParam;
+  return 0;
+}
+
+int IMP_AI_GetChnParam(int audioDevId, int aiChn, IMPAudioIChnParam *chnParam)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || chnParam == NULL)
+    return -1;
+  *chnParam = aiDev[audioDevId].chnParam;
+  return 0;
+}
+
+int IMP_AI_SetVol(int audioDevId, int aiChn, int aiVol)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aiDev[audioDevId].vol = aiVol;
+  return 0;
+}
+
+int IMP_AI_GetVol(int audioDevId, int aiChn, int *vol)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || vol == NULL)
+    return -1;
+  *vol = aiDev[audioDevId].vol;
+  return 0;
+}
+
+int IMP_AI_SetGain(int audioDevId, int aiChn, int aiGain)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aiDev[audioDevId].gain = aiGain;
+  return 0;
+}
+
+int IMP_AI_GetGain(int audioDevId, int aiChn, int *aiGain)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || aiGain == NULL)
+    return -1;
+  *aiGain = aiDev[audioDevId].gain;
+  return 0;
+}
+
+int IMP_AI_PollingFrame(int audioDevId, int aiChn, unsigned int timeout_ms)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aiDev[audioDevId].chnEnabled)
+    return -1;
+  sim_audio_dev *d = &aiDev[audioDevId];
+  int64_t deadline = imp_sim_now_us() + (int64_t)timeout_ms * 1000;
+  if (d->nextFrameUs > deadline)
+  {
+    imp_sim_sleep_until_us(deadline);
+    return -1;
+  }
+  imp_sim_sleep_until_us(d->nextFrameUs);
+  return 0;
+}
+
+int IMP_AI_GetFrame(int audioDevId, int aiChn, IMPAudioFrame *frm, IMPBlock block)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aiDev[audioDevId].chnEnabled || frm == NULL)
+    return -1;
+  sim_audio_dev *d = &aiDev[audioDevId];
+
+  if (imp_sim_now_us() < d->nextFrameUs)
+  {
+    if (block != BLOCK)
+      return -1;
+    imp_sim_sleep_until_us(d->nextFrameUs);
+  }
+
+  pthread_mutex_lock(&d->lock);
+  int len = frame_bytes(&d->attr);
+  uint8_t *out = (uint8_t *)d->frameBuf;
+  if (d->pcm == NULL || d->pcmLen < (size_t)len)
+  {
+    memset(out, 0, len);
+  }
+  else
+  {
+    // loop the recording
+    int copied = 0;
+    while (copied < len)
+    {
+      if (d->pcmPos >= d->pcmLen)
+        d->pcmPos = 0;
+      size_t chunk = d->pcmLen - d->pcmPos;
+      if (chunk > (size_t)(len - copied))
+        chunk = len - copied;
+      memcpy(out + copied, d->pcm + d->pcmPos, chunk);
+      d->pcmPos += chunk;
+      copied += chunk;
+    }
+  }
+
+  frm->bitwidth = d->attr.bitwidth;
+  frm->soundmode = d->attr.soundmode;
+  frm->virAddr = (uint32_t *)d->frameBuf;
+  frm->phyAddr = (uint32_t)(uintptr_t)d->frameBuf;
+  frm->timeStamp = d->nextFrameUs - frame_duration_us(&d->attr);
+  frm->seq = d->seq++;
+  frm->len = len;
+  d->nextFrameUs += frame_duration_us(&d->attr);
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+int IMP_AI_ReleaseFrame(int audioDevId, int aiChn, IMPAudioFrame *frm)
+{
+  (void)aiChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || frm == NULL)
+    return -1;
+  return 0;
+}
+
+/*
+ * AO
+ */
+
+int IMP_AO_SetPubAttr(int audioDevId, IMPAudioIOAttr *attr)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || attr == NULL)
+    return -1;
+  aoDev[audioDevId].attr = *attr;
+  return 0;
+}
+
+int IMP_AO_GetPubAttr(int audioDevId, IMPAudioIOAttr *attr)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || attr == NULL)
+    return -1;
+  *attr = aoDev[audioDevId].attr;
+  return 0;
+}
+
+int IMP_AO_Enable(int audioDevId)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  sim_audio_dev *d = &aoDev[audioDevId];
+  if (d->enabled)
+    return 0;
+  pthread_mutex_init(&d->lock, NULL);
+  const char *path = imp_sim_getenv("POS_SIM_AO_PCM", NULL);
+  if (path != NULL)
+  {
+    d->pcmOut = fopen(path, "wb");
+    if (d->pcmOut == NULL)
+      IMP_SIM_LOG("can't open %s for writing", path);
+  }
+  d->enabled = 1;
+  return 0;
+}
+
+int IMP_AO_Disable(int audioDevId)
+{
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aoDev[audioDevId].enabled)
+    return -1;
+  sim_audio_dev *d = &aoDev[audioDevId];
+  if (d->pcmOut != NULL)
+    fclose(d->pcmOut);
+  d->pcmOut = NULL;
+  d->enabled = 0;
+  pthread_mutex_destroy(&d->lock);
+  return 0;
+}
+
+int IMP_AO_EnableChn(int audioDevId, int aoChn)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aoDev[audioDevId].enabled)
+    return -1;
+  aoDev[audioDevId].chnEnabled = 1;
+  aoDev[audioDevId].playoutUs = imp_sim_now_us();
+  return 0;
+}
+
+int IMP_AO_DisableChn(int audioDevId, int aoChn)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aoDev[audioDevId].chnEnabled = 0;
+  return 0;
+}
+
+int IMP_AO_SetVol(int audioDevId, int aoChn, int aoVol)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aoDev[audioDevId].vol = aoVol;
+  return 0;
+}
+
+int IMP_AO_GetVol(int audioDevId, int aoChn, int *vol)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || vol == NULL)
+    return -1;
+  *vol = aoDev[audioDevId].vol;
+  return 0;
+}
+
+int IMP_AO_SetGain(int audioDevId, int aoChn, int aoGain)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV)
+    return -1;
+  aoDev[audioDevId].gain = aoGain;
+  return 0;
+}
+
+int IMP_AO_GetGain(int audioDevId, int aoChn, int *aoGain)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || aoGain == NULL)
+    return -1;
+  *aoGain = aoDev[audioDevId].gain;
+  return 0;
+}
+
+// Accepts a frame into the simulated playout buffer, blocking while frmNum frames are already queued
+int IMP_AO_SendFrame(int audioDevId, int aoChn, IMPAudioFrame *data, IMPBlock block)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aoDev[audioDevId].chnEnabled || data == NULL)
+    return -1;
+  sim_audio_dev *d = &aoDev[audioDevId];
+  int bytesPerSample = (d->attr.bitwidth / 8) * (d->attr.soundmode == AUDIO_SOUND_MODE_STEREO ? 2 : 1);
+  int64_t durationUs = 0;
+  if (bytesPerSample > 0 && d->attr.samplerate > 0)
+    durationUs = (int64_t)(data->len / bytesPerSample) * 1000000 / d->attr.samplerate;
+  int64_t depthUs = (int64_t)(d->attr.frmNum > 0 ? d->attr.frmNum : 1) * frame_duration_us(&d->attr);
+
+  pthread_mutex_lock(&d->lock);
+  int64_t now = imp_sim_now_us();
+  if (d->playoutUs < now)
+    d->playoutUs = now; // underrun
+  if (d->playoutUs - now > depthUs)
+  {
+    if (block != BLOCK)
+    {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    int64_t wakeUs = d->playoutUs - depthUs;
+    pthread_mutex_unlock(&d->lock);
+    imp_sim_sleep_until_us(wakeUs);
+    pthread_mutex_lock(&d->lock);
+  }
+  d->playoutUs += durationUs;
+  if (d->pcmOut != NULL)
+    fwrite(data->virAddr, 1, data->len, d->pcmOut);
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+int IMP_AO_FlushChnBuf(int audioDevId, int aoChn)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aoDev[audioDevId].enabled)
+    return -1;
+  // wait for the queued audio to play out
+  imp_sim_sleep_until_us(aoDev[audioDevId].playoutUs);
+  if (aoDev[audioDevId].pcmOut != NULL)
+    fflush(aoDev[audioDevId].pcmOut);
+  return 0;
+}
+
+int IMP_AO_ClearChnBuf(int audioDevId, int aoChn)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || !aoDev[audioDevId].enabled)
+    return -1;
+  aoDev[audioDevId].playoutUs = imp_sim_now_us();
+  return 0;
+}
+
+int IMP_AO_QueryChnStat(int audioDevId, int aoChn, IMPAudioOChnState *status)
+{
+  (void)aoChn;
+  if (audioDevId < 0 || audioDevId >= SIM_AUDIO_MAX_DEV || status == NULL)
+    return -1;
+  sim_audio_dev *d = &aoDev[audioDevId];
+  int64_t frameUs = frame_duration_us(&d->attr);
+  int64_t queuedUs = d->playoutUs - imp_sim_now_us();
+  int busy = (frameUs > 0 && queuedUs > 0) ? (int)((queuedUs + frameUs - 1) / frameUs) : 0;
+  status->chnTotalNum = d->attr.frmNum;
+  status->chnBusyNum = busy < d->attr.frmNum ? busy : d->attr.frmNum;
+  status->chnFreeNum = status->chnTotalNum - status->chnBusyNum;
+  return 0;
+}
@@ -0,0 +1,595 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Encoder part of the IMP simulation: replays Annex-B and JPEG files as encoder output
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <imp/imp_common.h>
+#include <imp/imp_encoder.h>
+
+#include "imp_sim.h"
+
+#define SIM_ENC_MAX_CHN 3
+#define SIM_ENC_MAX_GROUP 2
+#define SIM_ENC_MAX_PACKS 64
+#define SIM_ENC_STREAM_BYTES (2 * 1024 * 1024)
+
+typedef struct {
+  int created;
+  int group;
+  int receiving;
+  IMPEncoderChnAttr attr;
+  IMPEncoderEncType encType;
+  uint32_t frmRateNum;
+  uint32_t frmRateDen;
+  uint32_t targetBitRate;
+
+  // replay source
+  uint8_t *src;
+  size_t srcLen;
+  size_t srcPos;
+  int jpegIndex;
+  char jpegPath[256];
+
+  // encoder output
+  uint8_t *streamBuf;
+  IMPEncoderPack packs[SIM_ENC_MAX_PACKS];
+  uint32_t seq;
+  int64_t nextFrameUs;
+  int idrRequested;
+  int streamOut; // a stream is held by the application
+
+  pthread_mutex_t lock;
+} sim_enc_chn;
+
+static sim_enc_chn encChn[SIM_ENC_MAX_CHN];
+static int encGroupCreated[SIM_ENC_MAX_GROUP];
+
+static int valid_chn(int chn)
+{
+  return chn >= 0 && chn < SIM_ENC_MAX_CHN && encChn[chn].created;
+}
+
+static int64_t frame_interval_us(const sim_enc_chn *c)
+{
+  if (c->frmRateNum == 0)
+    return 1000000;
+  return (int64_t)1000000 * c->frmRateDen / c->frmRateNum;
+}
+
+/*
+ * Annex-B scanning
+ */
+
+// Returns the offset of the first NAL byte after a start code at or after pos, or len if there is none
+static size_t next_nal(const uint8_t *buf, size_t len, size_t pos)
+{
+  while (pos + 3 <= len)
+  {
+    if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+      return pos + 3;
+    pos++;
+  }
+  return len;
+}
+
+// Returns the end of the NAL starting at start, trailing zero bytes of the next start code excluded
+static size_t nal_end(const uint8_t *buf, size_t len, size_t start)
+{
+  size_t next = next_nal(buf, len, start);
+  if (next == len)
+    return len;
+  next -= 3;
+  while (next > start && buf[next - 1] == 0)
+    next--;
+  return next;
+}
+
+static int nal_type(const sim_enc_chn *c, uint8_t header)
+{
+  if (c->encType == IMP_ENC_TYPE_HEVC)
+    return (header >> 1) & 0x3f;
+  return header & 0x1f;
+}
+
+static int nal_is_vcl(const sim_enc_chn *c, int type)
+{
+  if (c->encType == IMP_ENC_TYPE_HEVC)
+    return type < 32;
+  return type >= 1 && type <= 5;
+}
+
+// parameter set that starts a random access point, SPS for H.264 and VPS for H.265
+static int nal_starts_rap(const sim_enc_chn *c, int type)
+{
+  if (c->encType == IMP_ENC_TYPE_HEVC)
+    return type == 32;
+  return type == 7;
+}
+
+static void seek_next_rap(sim_enc_chn *c)
+{
+  size_t pos = c->srcPos;
+  int wrapped = 0;
+  for (;;)
+  {
+    size_t start = next_nal(c->src, c->srcLen, pos);
+    if (start >= c->srcLen)
+    {
+      if (wrapped)
+        return;
+      wrapped = 1;
+      pos = 0;
+      continue;
+    }
+    if (nal_starts_rap(c, nal_type(c, c->src[start])))
+    {
+      c->srcPos = start - 3;
+      return;
+    }
+    pos = start;
+  }
+}
+
+// Copies the next access unit (parameter sets, SEI, ... up to and including one slice) into the stream buffer
+static int fill_video_frame(sim_enc_chn *c, IMPEncoderStream *stream)
+{
+  uint32_t offset = 0;
+  uint32_t packCount = 0;
+  int wrapped = 0;
+
+  if (c->idrRequested)
+  {
+    seek_next_rap(c);
+    c->idrRequested = 0;
+  }
+
+  for (;;)
+  {
+    size_t start = next_nal(c->src, c->srcLen, c->srcPos);
+    if (start >= c->srcLen)
+    {
+      // loop the file
+      if (wrapped || packCount != 0)
+        break;
+      wrapped = 1;
+      c->srcPos = 0;
+      continue;
+    }
+    size_t end = nal_end(c->src, c->srcLen, start);
+    size_t nalLen = end - start;
+    c->srcPos = end;
+
+    if (nalLen == 0 || packCount == SIM_ENC_MAX_PACKS || offset + 4 + nalLen > SIM_ENC_STREAM_BYTES)
+    {
+      IMP_SIM_LOG("chn %d: dropping a %u byte nal", (int)(c - encChn), (unsigned)nalLen);
+      continue;
+    }
+
+    // the T31 always emits 4 byte start codes
+    c->streamBuf[offset] = 0;
+    c->streamBuf[offset + 1] = 0;
+    c->streamBuf[offset + 2] = 0;
+    c->streamBuf[offset + 3] = 1;
+    memcpy(c->streamBuf + offset + 4, c->src + start, nalLen);
+
+    int type = nal_type(c, c->src[start]);
+    IMPEncoderPack *pack = &c->packs[packCount++];
+    memset(pack, 0, sizeof(*pack));
+    pack->offset = offset;
+    pack->length = nalLen + 4;
+    pack->timestamp = c->nextFrameUs;
+    if (c->encType == IMP_ENC_TYPE_HEVC)
+    {
+      pack->nalType.h265NalType = (IMPEncoderH265NaluType)type;
+      pack->sliceType = (type >= 16 && type <= 21) ? IMP_ENC_SLICE_I : IMP_ENC_SLICE_P;
+    }
+    else
+    {
+      pack->nalType.h264NalType = (IMPEncoderH264NaluType)type;
+      pack->sliceType = (type == 5) ? IMP_ENC_SLICE_I : IMP_ENC_SLICE_P;
+    }
+    offset += nalLen + 4;
+
+    if (nal_is_vcl(c, type))
+      break;
+  }
+
+  if (packCount == 0)
+    return -1;
+  c->packs[packCount - 1].frameEnd = true;
+
+  stream->phyAddr = (uint32_t)(uintptr_t)c->streamBuf;
+  stream->virAddr = (uint32_t)(uintptr_t)c->streamBuf;
+  stream->streamSize = SIM_ENC_STREAM_BYTES;
+  stream->pack = c->packs;
+  stream->packCount = packCount;
+  return 0;
+}
+
+static int load_jpeg(sim_enc_chn *c)
+{
+  char path[300];
+
+  imp_sim_unmap_file(c->src, c->srcLen);
+  c->src = NULL;
+  c->srcLen = 0;
+
+  if (strchr(c->jpegPath, '%') == NULL)
+  {
+    c->src = imp_sim_map_file(c->jpegPath, &c->srcLen);
+    return c->src ? 0 : -1;
+  }
+
+  snprintf(path, sizeof(path), c->jpegPath, c->jpegIndex++);
+  c->src = imp_sim_map_file(path, &c->srcLen);
+  if (c->src == NULL && c->jpegIndex > 1)
+  {
+    // end of the sequence, start over
+    c->jpegIndex = 0;
+    snprintf(path, sizeof(path), c->jpegPath, c->jpegIndex++);
+    c->src = imp_sim_map_file(path, &c->srcLen);
+  }
+  return c->src ? 0 : -1;
+}
+
+static int fill_jpeg_frame(sim_enc_chn *c, IMPEncoderStream *stream)
+{
+  uint32_t packCount = 0;
+  size_t offset = 0;
+  size_t packBytes = imp_sim_getenv_long("POS_SIM_JPEG_PACK_BYTES", 0);
+
+  if ((strchr(c->jpegPath, '%') != NULL || c->src == NULL) && load_jpeg(c) != 0)
+    return -1;
+  if (c->srcLen > SIM_ENC_STREAM_BYTES)
+    return -1;
+  if (packBytes == 0)
+    packBytes = c->srcLen;
+
+  memcpy(c->streamBuf, c->src, c->srcLen);
+  while (offset < c->srcLen && packCount < SIM_ENC_MAX_PACKS)
+  {
+    IMPEncoderPack *pack = &c->packs[packCount++];
+    memset(pack, 0, sizeof(*pack));
+    pack->offset = offset;
+    pack->length = (c->srcLen - offset < packBytes) ? c->srcLen - offset : packBytes;
+    if (packCount == SIM_ENC_MAX_PACKS)
+      pack->length = c->srcLen - offset;
+    pack->timestamp = c->nextFrameUs;
+    pack->sliceType = IMP_ENC_SLICE_I;
+    offset += pack->length;
+  }
+  c->packs[packCount - 1].frameEnd = true;
+
+  stream->phyAddr = (uint32_t)(uintptr_t)c->streamBuf;
+  stream->virAddr = (uint32_t)(uintptr_t)c->streamBuf;
+  stream->streamSize = SIM_ENC_STREAM_BYTES;
+  stream->pack = c->packs;
+  stream->packCount = packCount;
+  return 0;
+}
+
+static void open_source(int chn)
+{
+  sim_enc_chn *c = &encChn[chn];
+  char name[32];
+
+  if (c->encType == IMP_ENC_TYPE_JPEG)
+  {
+    snprintf(c->jpegPath, sizeof(c->jpegPath), "%s", imp_sim_getenv("POS_SIM_JPEG", ""));
+    c->jpegIndex = 0;
+    if (c->jpegPath[0] == 0)
+      IMP_SIM_LOG("chn %d: POS_SIM_JPEG not set, no snapshots will be produced", chn);
+    return;
+  }
+
+  snprintf(name, sizeof(name), "POS_SIM_H264_CHN%d", chn);
+  const char *path = imp_sim_getenv(name, imp_sim_getenv("POS_SIM_H264", NULL));
+  if (path == NULL)
+  {
+    IMP_SIM_LOG("chn %d: POS_SIM_H264 not set, no video will be produced", chn);
+    return;
+  }
+  c->src = imp_sim_map_file(path, &c->srcLen);
+  c->srcPos = 0;
+  if (c->src == NULL)
+    IMP_SIM_LOG("chn %d: can't open %s", chn, path);
+}
+
+/*
+ * IMP_Encoder API
+ */
+
+int IMP_Encoder_CreateGroup(int encGroup)
+{
+  if (encGroup < 0 || encGroup >= SIM_ENC_MAX_GROUP)
+    return -1;
+  encGroupCreated[encGroup] = 1;
+  return 0;
+}
+
+int IMP_Encoder_DestroyGroup(int encGroup)
+{
+  if (encGroup < 0 || encGroup >= SIM_ENC_MAX_GROUP)
+    return -1;
+  encGroupCreated[encGroup] = 0;
+  return 0;
+}
+
+int IMP_Encoder_SetDefaultParam(IMPEncoderChnAttr *chnAttr, IMPEncoderProfile profile, IMPEncoderRcMode rcMode,
+                                uint16_t uWidth, uint16_t uHeight, uint32_t frmRateNum, uint32_t frmRateDen,
+                                uint32_t uGopLength, int uMaxSameSenceCnt, int iInitialQP, uint32_t uTargetBitRate)
+{
+  memset(chnAttr, 0, sizeof(*chnAttr));
+  chnAttr->encAttr.eProfile = profile;
+  chnAttr->encAttr.uWidth = uWidth;
+  chnAttr->encAttr.uHeight = uHeight;
+  chnAttr->encAttr.ePicFormat = IMP_ENC_PIC_FORMAT_420_8BITS;
+  chnAttr->rcAttr.attrRcMode.rcMode = rcMode;
+  chnAttr->rcAttr.outFrmRate.frmRateNum = frmRateNum;
+  chnAttr->rcAttr.outFrmRate.frmRateDen = frmRateDen;
+  switch (rcMode)
+  {
+  case IMP_ENC_RC_MODE_FIXQP:
+    chnAttr->rcAttr.attrRcMode.attrFixQp.iInitialQP = iInitialQP;
+    break;
+  case IMP_ENC_RC_MODE_CBR:
+    chnAttr->rcAttr.attrRcMode.attrCbr.uTargetBitRate = uTargetBitRate;
+    chnAttr->rcAttr.attrRcMode.attrCbr.iInitialQP = iInitialQP;
+    break;
+  default:
+    chnAttr->rcAttr.attrRcMode.attrCappedVbr.uTargetBitRate = uTargetBitRate;
+    chnAttr->rcAttr.attrRcMode.attrCappedVbr.uMaxBitRate = uTargetBitRate * 4 / 3;
+    chnAttr->rcAttr.attrRcMode.attrCappedVbr.iInitialQP = iInitialQP;
+    break;
+  }
+  chnAttr->gopAttr.uGopCtrlMode = IMP_ENC_GOP_CTRL_MODE_DEFAULT;
+  chnAttr->gopAttr.uGopLength = uGopLength;
+  chnAttr->gopAttr.uMaxSameSenceCnt = uMaxSameSenceCnt;
+  return 0;
+}
+
+int IMP_Encoder_CreateChn(int chn, const IMPEncoderChnAttr *attr)
+{
+  if (chn < 0 || chn >= SIM_ENC_MAX_CHN || attr == NULL || encChn[chn].created)
+    return -1;
+
+  sim_enc_chn *c = &encChn[chn];
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->lock, NULL);
+  c->attr = *attr;
+  c->encType = (IMPEncoderEncType)(attr->encAttr.eProfile >> 24);
+  c->frmRateNum = attr->rcAttr.outFrmRate.frmRateNum;
+  c->frmRateDen = attr->rcAttr.outFrmRate.frmRateDen ? attr->rcAttr.outFrmRate.frmRateDen : 1;
+  c->targetBitRate = attr->rcAttr.attrRcMode.attrCbr.uTargetBitRate;
+  c->group = -1;
+  c->streamBuf = imp_sim_alloc32(SIM_ENC_STREAM_BYTES);
+  if (c->streamBuf == NULL)
+  {
+    IMP_SIM_LOG("chn %d: can't allocate stream buffer", chn);
+    return -1;
+  }
+  open_source(chn);
+  c->created = 1;
+  return 0;
+}
+
+int IMP_Encoder_DestroyChn(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  sim_enc_chn *c = &encChn[chn];
+  pthread_mutex_lock(&c->lock);
+  imp_sim_unmap_file(c->src, c->srcLen);
+  imp_sim_free32(c->streamBuf, SIM_ENC_STREAM_BYTES);
+  c->src = NULL;
+  c->streamBuf = NULL;
+  c->created = 0;
+  pthread_mutex_unlock(&c->lock);
+  pthread_mutex_destroy(&c->lock);
+  return 0;
+}
+
+int IMP_Encoder_GetChnAttr(int chn, IMPEncoderChnAttr *const attr)
+{
+  if (!valid_chn(chn))
+    return -1;
+  *attr = encChn[chn].attr;
+  return 0;
+}
+
+int IMP_Encoder_RegisterChn(int encGroup, int chn)
+{
+  if (!valid_chn(chn) || encGroup < 0 || encGroup >= SIM_ENC_MAX_GROUP || !encGroupCreated[encGroup])
+    return -1;
+  encChn[chn].group = encGroup;
+  return 0;
+}
+
+int IMP_Encoder_UnRegisterChn(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  encChn[chn].group = -1;
+  return 0;
+}
+
+int IMP_Encoder_StartRecvPic(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  sim_enc_chn *c = &encChn[chn];
+  pthread_mutex_lock(&c->lock);
+  if (!c->receiving)
+  {
+    c->receiving = 1;
+    c->nextFrameUs = imp_sim_now_us() + frame_interval_us(c);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return 0;
+}
+
+int IMP_Encoder_StopRecvPic(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  encChn[chn].receiving = 0;
+  return 0;
+}
+
+int IMP_Encoder_Query(int chn, IMPEncoderChnStat *stat)
+{
+  if (!valid_chn(chn))
+    return -1;
+  sim_enc_chn *c = &encChn[chn];
+  int64_t behind = imp_sim_now_us() - c->nextFrameUs;
+
+  memset(stat, 0, sizeof(*stat));
+  stat->registered = c->group >= 0;
+  stat->leftStreamFrames = imp_sim_getenv_long("POS_SIM_BACKLOG", 0);
+  if (behind > 0)
+    stat->leftStreamFrames += behind / frame_interval_us(c);
+  stat->work_done = !c->receiving;
+  return 0;
+}
+
+int IMP_Encoder_PollingStream(int chn, uint32_t timeoutMsec)
+{
+  if (!valid_chn(chn))
+    return -1;
+  sim_enc_chn *c = &encChn[chn];
+  int64_t deadline = imp_sim_now_us() + (int64_t)timeoutMsec * 1000;
+
+  if (!c->receiving || (c->src == NULL && c->jpegPath[0] == 0))
+  {
+    imp_sim_sleep_until_us(deadline);
+    return -1;
+  }
+  if (c->nextFrameUs > deadline)
+  {
+    imp_sim_sleep_until_us(deadline);
+    return -1;
+  }
+  imp_sim_sleep_until_us(c->nextFrameUs);
+  return 0;
+}
+
+int IMP_Encoder_GetStream(int chn, IMPEncoderStream *stream, bool blockFlag)
+{
+  int ret;
+  if (!valid_chn(chn) || stream == NULL)
+    return -1;
+  sim_enc_chn *c = &encChn[chn];
+
+  if (!c->receiving)
+    return -1;
+  if (imp_sim_now_us() < c->nextFrameUs)
+  {
+    if (!blockFlag)
+      return -1;
+    imp_sim_sleep_until_us(c->nextFrameUs);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  if (c->encType == IMP_ENC_TYPE_JPEG)
+    ret = fill_jpeg_frame(c, stream);
+  else if (c->src != NULL)
+    ret = fill_video_frame(c, stream);
+  else
+    ret = -1;
+  if (ret == 0)
+  {
+    stream->seq = c->seq++;
+    c->streamOut = 1;
+  }
+  c->nextFrameUs += frame_interval_us(c);
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+int IMP_Encoder_ReleaseStream(int chn, IMPEncoderStream *stream)
+{
+  if (!valid_chn(chn) || stream == NULL)
+    return -1;
+  encChn[chn].streamOut = 0;
+  return 0;
+}
+
+int IMP_Encoder_RequestIDR(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  encChn[chn].idrRequested = 1;
+  return 0;
+}
+
+int IMP_Encoder_FlushStream(int chn)
+{
+  if (!valid_chn(chn))
+    return -1;
+  // the next frame handed out starts a new gop
+  encChn[chn].idrRequested = 1;
+  return 0;
+}
+
+int IMP_Encoder_GetChnFrmRate(int chn, IMPEncoderFrmRate *pstFps)
+{
+  if (!valid_chn(chn))
+    return -1;
+  pstFps->frmRateNum = encChn[chn].frmRateNum;
+  pstFps->frmRateDen = encChn[chn].frmRateDen;
+  return 0;
+}
+
+int IMP_Encoder_SetChnFrmRate(int chn, const IMPEncoderFrmRate *pstFps)
+{
+  if (!valid_chn(chn) || pstFps->frmRateNum == 0 || pstFps->frmRateDen == 0)
+    return -1;
+  encChn[chn].frmRateNum = pstFps->frmRateNum;
+  encChn[chn].frmRateDen = pstFps->frmRateDen;
+  return 0;
+}
+
+int IMP_Encoder_SetChnBitRate(int chn, int iTargetBitRate, int iMaxBitRate)
+{
+  (void)iMaxBitRate;
+  if (!valid_chn(chn))
+    return -1;
+  // replayed streams keep their recorded bitrate, the value is only kept for inspection
+  encChn[chn].targetBitRate = iTargetBitRate;
+  return 0;
+}
+
+int IMP_Encoder_SetChnGopLength(int chn, int iGopLength)
+{
+  if (!valid_chn(chn))
+    return -1;
+  encChn[chn].attr.gopAttr.uGopLength = iGopLength;
+  return 0;
+}
+
+int IMP_Encoder_GetChnEncType(int chn, IMPEncoderEncType *encType)
+{
+  if (!valid_chn(chn))
+    return -1;
+  *encType = encChn[chn].encType;
+  return 0;
+}
@@ -0,0 +1,187 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// IVS part of the IMP simulation: a move interface that reports motion on a fixed period
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <imp/imp_common.h>
+#include <imp/imp_isp.h>
+#include <imp/imp_ivs.h>
+#include <imp/imp_ivs_move.h>
+
+#include "imp_sim.h"
+
+#define SIM_IVS_MAX_GROUP 2
+#define SIM_IVS_MAX_CHN 4
+
+// Motion stays active for this long at the start of every POS_SIM_MOTION_PERIOD
+#define SIM_IVS_MOTION_US 2000000
+
+typedef struct {
+  int created;
+  int group;
+  int receiving;
+  IMPIVSInterface *inf;
+  IMP_IVS_MoveOutput output;
+  int64_t nextResultUs;
+  int64_t intervalUs;
+} sim_ivs_chn;
+
+static int ivsGroupCreated[SIM_IVS_MAX_GROUP];
+static sim_ivs_chn ivsChn[SIM_IVS_MAX_CHN];
+
+static int valid_chn(int chn)
+{
+  return chn >= 0 && chn < SIM_IVS_MAX_CHN && ivsChn[chn].created;
+}
+
+int IMP_IVS_CreateGroup(int GrpNum)
+{
+  if (GrpNum < 0 || GrpNum >= SIM_IVS_MAX_GROUP)
+    return -1;
+  ivsGroupCreated[GrpNum] = 1;
+  return 0;
+}
+
+int IMP_IVS_DestroyGroup(int GrpNum)
+{
+  if (GrpNum < 0 || GrpNum >= SIM_IVS_MAX_GROUP)
+    return -1;
+  ivsGroupCreated[GrpNum] = 0;
+  return 0;
+}
+
+IMPIVSInterface *IMP_IVS_CreateMoveInterface(IMP_IVS_MoveParam *param)
+{
+  if (param == NULL)
+    return NULL;
+  IMPIVSInterface *inf = calloc(1, sizeof(IMPIVSInterface) + sizeof(IMP_IVS_MoveParam));
+  if (inf == NULL)
+    return NULL;
+  inf->param = (uint8_t *)inf + sizeof(IMPIVSInterface);
+  inf->paramSize = sizeof(IMP_IVS_MoveParam);
+  inf->pixfmt = PIX_FMT_NV12;
+  memcpy(inf->param, param, sizeof(IMP_IVS_MoveParam));
+  return inf;
+}
+
+void IMP_IVS_DestroyMoveInterface(IMPIVSInterface *moveInterface)
+{
+  free(moveInterface);
+}
+
+int IMP_IVS_CreateChn(int ChnNum, IMPIVSInterface *handler)
+{
+  if (ChnNum < 0 || ChnNum >= SIM_IVS_MAX_CHN || handler == NULL || ivsChn[ChnNum].created)
+    return -1;
+  sim_ivs_chn *c = &ivsChn[ChnNum];
+  IMP_IVS_MoveParam *param = handler->param;
+  uint32_t fpsNum = 25, fpsDen = 1;
+
+  memset(c, 0, sizeof(*c));
+  IMP_ISP_Tuning_GetSensorFPS(&fpsNum, &fpsDen);
+  if (fpsNum == 0)
+    fpsNum = 25;
+  // the algorithm only looks at every (skipFrameCnt + 1)th frame
+  c->intervalUs = (int64_t)1000000 * fpsDen * (param->skipFrameCnt + 1) / fpsNum;
+  c->inf = handler;
+  c->group = -1;
+  c->created = 1;
+  return 0;
+}
+
+int IMP_IVS_DestroyChn(int ChnNum)
+{
+  if (!valid_chn(ChnNum))
+    return -1;
+  ivsChn[ChnNum].created = 0;
+  return 0;
+}
+
+int IMP_IVS_RegisterChn(int GrpNum, int ChnNum)
+{
+  if (!valid_chn(ChnNum) || GrpNum < 0 || GrpNum >= SIM_IVS_MAX_GROUP || !ivsGroupCreated[GrpNum])
+    return -1;
+  ivsChn[ChnNum].group = GrpNum;
+  return 0;
+}
+
+int IMP_IVS_UnRegisterChn(int ChnNum)
+{
+  if (!valid_chn(ChnNum))
+    return -1;
+  ivsChn[ChnNum].group = -1;
+  return 0;
+}
+
+int IMP_IVS_StartRecvPic(int ChnNum)
+{
+  if (!valid_chn(ChnNum))
+    return -1;
+  ivsChn[ChnNum].receiving = 1;
+  ivsChn[ChnNum].nextResultUs = imp_sim_now_us() + ivsChn[ChnNum].intervalUs;
+  return 0;
+}
+
+int IMP_IVS_StopRecvPic(int ChnNum)
+{
+  if (!valid_chn(ChnNum))
+    return -1;
+  ivsChn[ChnNum].receiving = 0;
+  return 0;
+}
+
+int IMP_IVS_PollingResult(int ChnNum, int timeoutMs)
+{
+  if (!valid_chn(ChnNum) || !ivsChn[ChnNum].receiving)
+    return -1;
+  sim_ivs_chn *c = &ivsChn[ChnNum];
+  if (timeoutMs >= 0 && c->nextResultUs > imp_sim_now_us() + (int64_t)timeoutMs * 1000)
+  {
+    imp_sim_sleep_until_us(imp_sim_now_us() + (int64_t)timeoutMs * 1000);
+    return -1;
+  }
+  imp_sim_sleep_until_us(c->nextResultUs);
+  return 0;
+}
+
+int IMP_IVS_GetResult(int ChnNum, void **result)
+{
+  if (!valid_chn(ChnNum) || result == NULL)
+    return -1;
+  sim_ivs_chn *c = &ivsChn[ChnNum];
+  IMP_IVS_MoveParam *param = c->inf->param;
+  int64_t periodUs = (int64_t)(imp_sim_getenv_double("POS_SIM_MOTION_PERIOD", 0) * 1000000);
+  int moving = periodUs > 0 && (c->nextResultUs % periodUs) < SIM_IVS_MOTION_US;
+
+  memset(&c->output, 0, sizeof(c->output));
+  for (int i = 0; i < param->roiRectCnt && i < IMP_IVS_MOVE_MAX_ROI_CNT; i++)
+    c->output.retRoi[i] = moving;
+  c->nextResultUs += c->intervalUs;
+  *result = &c->output;
+  return 0;
+}
+
+int IMP_IVS_ReleaseResult(int ChnNum, void *result)
+{
+  if (!valid_chn(ChnNum) || result != &ivsChn[ChnNum].output)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,456 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// System, log, frame source, ISP and OSD parts of the IMP simulation
+
+#define _GNU_SOURCE // MAP_32BIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <imp/imp_log.h>
+#include <imp/imp_common.h>
+#include <imp/imp_system.h>
+#include <imp/imp_framesource.h>
+#include <imp/imp_isp.h>
+
+#include "imp_sim.h"
+
+/*
+ * Clock and helpers
+ */
+
+static pthread_once_t clockOnce = PTHREAD_ONCE_INIT;
+static int64_t clockStartNs;
+static double clockSpeed = 1.0;
+static long timestampDelayUs;
+
+static int64_t monotonic_ns(void)
+{
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (int64_t)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+static void clock_init(void)
+{
+  clockStartNs = monotonic_ns();
+  clockSpeed = imp_sim_getenv_double("POS_SIM_SPEED", 1.0);
+  if (clockSpeed <= 0)
+    clockSpeed = 1.0;
+  timestampDelayUs = imp_sim_getenv_long("POS_SIM_TIMESTAMP_DELAY_US", 0);
+}
+
+int64_t imp_sim_now_us(void)
+{
+  pthread_once(&clockOnce, clock_init);
+  return (int64_t)((double)(monotonic_ns() - clockStartNs) * clockSpeed / 1000);
+}
+
+void imp_sim_sleep_until_us(int64_t simTimeUs)
+{
+  int64_t now = imp_sim_now_us();
+  if (simTimeUs <= now)
+    return;
+
+  int64_t waitNs = (int64_t)((double)(simTimeUs - now) * 1000 / clockSpeed);
+  struct timespec wait;
+  wait.tv_sec = waitNs / 1000000000;
+  wait.tv_nsec = waitNs % 1000000000;
+  while (nanosleep(&wait, &wait) != 0 && errno == EINTR)
+    ;
+}
+
+const char *imp_sim_getenv(const char *name, const char *def)
+{
+  const char *value = getenv(name);
+  return (value && value[0]) ? value : def;
+}
+
+long imp_sim_getenv_long(const char *name, long def)
+{
+  const char *value = getenv(name);
+  return (value && value[0]) ? strtol(value, NULL, 0) : def;
+}
+
+double imp_sim_getenv_double(const char *name, double def)
+{
+  const char *value = getenv(name);
+  return (value && value[0]) ? strtod(value, NULL) : def;
+}
+
+uint8_t *imp_sim_map_file(const char *path, size_t *len)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  *len = st.st_size;
+  return data;
+}
+
+void imp_sim_unmap_file(uint8_t *data, size_t len)
+{
+  if (data)
+    munmap(data, len);
+}
+
+void *imp_sim_alloc32(size_t len)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+  flags |= MAP_32BIT;
+#endif
+  void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  if ((uint64_t)(uintptr_t)ptr + len > 0xffffffffULL)
+  {
+    IMP_SIM_LOG("buffer at %p doesn't fit a 32 bit virAddr", ptr);
+    munmap(ptr, len);
+    return NULL;
+  }
+  return ptr;
+}
+
+void imp_sim_free32(void *ptr, size_t len)
+{
+  if (ptr)
+    munmap(ptr, len);
+}
+
+void imp_sim_log(const char *func, const char *fmt, ...)
+{
+  va_list args;
+  fprintf(stderr, "imp_sim %s: ", func);
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+/*
+ * Log
+ */
+
+static int logOption = IMP_LOG_OP_DEFAULT;
+
+void imp_log_fun(int le, int op, int out, const char *tag, const char *file, int line, const char *func,
+                 const char *fmt, ...)
+{
+  va_list args;
+  (void)le;
+  (void)op;
+  (void)out;
+  (void)file;
+  (void)line;
+  fprintf(stderr, "%s %s: ", tag, func);
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+}
+
+void IMP_Log_Set_Option(int op)
+{
+  logOption = op;
+}
+
+int IMP_Log_Get_Option(void)
+{
+  return logOption;
+}
+
+/*
+ * System
+ */
+
+int IMP_System_Init(void)
+{
+  imp_sim_now_us(); // starts the clock
+  IMP_SIM_LOG("speed %.2fx", imp_sim_getenv_double("POS_SIM_SPEED", 1.0));
+  return 0;
+}
+
+int IMP_System_Exit(void)
+{
+  return 0;
+}
+
+int64_t IMP_System_GetTimeStamp(void)
+{
+  pthread_once(&clockOnce, clock_init);
+  if (timestampDelayUs > 0)
+    usleep(timestampDelayUs); // a read the scheduler interrupted
+  return imp_sim_now_us();
+}
+
+int IMP_System_RebaseTimeStamp(int64_t basets)
+{
+  (void)basets;
+  return 0;
+}
+
+int IMP_System_GetVersion(IMPVersion *pstVersion)
+{
+  snprintf(pstVersion->aVersion, sizeof(pstVersion->aVersion), "IMP-sim");
+  return 0;
+}
+
+const char *IMP_System_GetCPUInfo(void)
+{
+  return "host";
+}
+
+int IMP_System_Bind(IMPCell *srcCell, IMPCell *dstCell)
+{
+  // The simulated encoders and IVS produce output on their own, bindings are only validated
+  if (srcCell == NULL || dstCell == NULL)
+    return -1;
+  return 0;
+}
+
+int IMP_System_UnBind(IMPCell *srcCell, IMPCell *dstCell)
+{
+  if (srcCell == NULL || dstCell == NULL)
+    return -1;
+  return 0;
+}
+
+/*
+ * Frame source
+ */
+
+#define SIM_FS_MAX_CHN 3
+
+static IMPFSChnAttr fsAttr[SIM_FS_MAX_CHN];
+static int fsCreated[SIM_FS_MAX_CHN];
+static int fsEnabled[SIM_FS_MAX_CHN];
+
+int IMP_FrameSource_CreateChn(int chnNum, IMPFSChnAttr *chn_attr)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || chn_attr == NULL)
+    return -1;
+  fsAttr[chnNum] = *chn_attr;
+  fsCreated[chnNum] = 1;
+  return 0;
+}
+
+int IMP_FrameSource_DestroyChn(int chnNum)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || !fsCreated[chnNum])
+    return -1;
+  fsCreated[chnNum] = 0;
+  return 0;
+}
+
+int IMP_FrameSource_SetChnAttr(int chnNum, const IMPFSChnAttr *chnAttr)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || !fsCreated[chnNum] || chnAttr == NULL)
+    return -1;
+  fsAttr[chnNum] = *chnAttr;
+  return 0;
+}
+
+int IMP_FrameSource_GetChnAttr(int chnNum, IMPFSChnAttr *chnAttr)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || !fsCreated[chnNum] || chnAttr == NULL)
+    return -1;
+  *chnAttr = fsAttr[chnNum];
+  return 0;
+}
+
+int IMP_FrameSource_EnableChn(int chnNum)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || !fsCreated[chnNum])
+    return -1;
+  fsEnabled[chnNum] = 1;
+  return 0;
+}
+
+int IMP_FrameSource_DisableChn(int chnNum)
+{
+  if (chnNum < 0 || chnNum >= SIM_FS_MAX_CHN || !fsCreated[chnNum])
+    return -1;
+  fsEnabled[chnNum] = 0;
+  return 0;
+}
+
+/*
+ * ISP
+ */
+
+static IMPISPTuningOpsMode ispHflip = IMPISP_TUNING_OPS_MODE_DISABLE;
+static IMPISPTuningOpsMode ispVflip = IMPISP_TUNING_OPS_MODE_DISABLE;
+static IMPISPRunningMode ispRunningMode = IMPISP_RUNNING_MODE_DAY;
+static uint32_t ispFpsNum = 25;
+static uint32_t ispFpsDen = 1;
+
+int IMP_ISP_Open(void)
+{
+  return 0;
+}
+
+int IMP_ISP_Close(void)
+{
+  return 0;
+}
+
+int IMP_ISP_AddSensor(IMPSensorInfo *pinfo)
+{
+  IMP_SIM_LOG("sensor %s", pinfo->name);
+  return 0;
+}
+
+int IMP_ISP_DelSensor(IMPSensorInfo *pinfo)
+{
+  (void)pinfo;
+  return 0;
+}
+
+int IMP_ISP_EnableSensor(void)
+{
+  return 0;
+}
+
+int IMP_ISP_DisableSensor(void)
+{
+  return 0;
+}
+
+int IMP_ISP_EnableTuning(void)
+{
+  return 0;
+}
+
+int IMP_ISP_DisableTuning(void)
+{
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetSensorFPS(uint32_t fps_num, uint32_t fps_den)
+{
+  if (fps_num == 0 || fps_den == 0)
+    return -1;
+  ispFpsNum = fps_num;
+  ispFpsDen = fps_den;
+  return 0;
+}
+
+int IMP_ISP_Tuning_GetSensorFPS(uint32_t *fps_num, uint32_t *fps_den)
+{
+  *fps_num = ispFpsNum;
+  *fps_den = ispFpsDen;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetBrightness(unsigned char bright)
+{
+  (void)bright;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetContrast(unsigned char contrast)
+{
+  (void)contrast;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetSharpness(unsigned char sharpness)
+{
+  (void)sharpness;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetSaturation(unsigned char sat)
+{
+  (void)sat;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetISPHflip(IMPISPTuningOpsMode mode)
+{
+  ispHflip = mode;
+  return 0;
+}
+
+int IMP_ISP_Tuning_GetISPHflip(IMPISPTuningOpsMode *pmode)
+{
+  *pmode = ispHflip;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetISPVflip(IMPISPTuningOpsMode mode)
+{
+  ispVflip = mode;
+  return 0;
+}
+
+int IMP_ISP_Tuning_GetISPVflip(IMPISPTuningOpsMode *pmode)
+{
+  *pmode = ispVflip;
+  return 0;
+}
+
+int IMP_ISP_Tuning_SetISPRunningMode(IMPISPRunningMode mode)
+{
+  ispRunningMode = mode;
+  return 0;
+}
+
+int IMP_ISP_Tuning_GetISPRunningMode(IMPISPRunningMode *pmode)
+{
+  *pmode = ispRunningMode;
+  return 0;
+}
+
+int IMP_ISP_Tuning_GetEVAttr(IMPISPEVAttr *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->ev = (uint32_t)imp_sim_getenv_long("POS_SIM_EV", 1000);
+  attr->expr_us = 1000000 / 25;
+  attr->again = 1024;
+  attr->dgain = 1024;
+  return 0;
+}
+
+/*
+ * OSD
+ */
+
+int IMP_OSD_SetPoolSize(int size)
+{
+  (void)size;
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Audio encoder cost on the host: the real time factor of AAC-ELD and Opus at the
+// configurations the camera advertises, over speech-like PCM (voiced harmonics with
+// syllables and pauses over room noise) or a 16 bit mono WAV recording.  Also prints the
+// payload bitrate each one comes out at.
+// Not run by ctest, start it by hand:  ./bench_audio_encoder [seconds] [speech.wav]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "POSAudioEncoder.h"
+
+#define MAX_SECONDS 600
+#define BIT_RATE 24000
+
+typedef struct
+{
+  const char *name;
+  uint16_t codecType;
+  uint32_t sampleRate;
+  uint32_t rtpTimeMs;
+} Config;
+
+// the Supported Audio Stream Configuration
+static const Config configs[] = {
+    {"AAC-ELD 16 kHz 30 ms", POS_AUDIO_CODEC_AAC_ELD, 16000, 30},
+    {"Opus 16 kHz 20 ms", POS_AUDIO_CODEC_OPUS, 16000, 20},
+    {"Opus 24 kHz 20 ms", POS_AUDIO_CODEC_OPUS, 24000, 20},
+};
+
+static double cpu_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Voiced speech for two thirds of every 3 s, the pitch wandering, four syllables a second
+static int16_t *MakeSpeech(uint32_t sampleRate, size_t numSamples)
+{
+  int16_t *samples = malloc(numSamples * sizeof(int16_t));
+  uint32_t random = 3;
+  double phase = 0;
+
+  if (samples == NULL)
+    exit(1);
+  for (size_t idx = 0; idx < numSamples; idx++)
+  {
+    double t = (double)idx / sampleRate;
+    random = random * 1664525 + 1013904223;
+    double sample = ((int32_t)(random >> 16) - 32768) / 256.0;
+    if (fmod(t, 3) < 2)
+    {
+      double speech = 0;
+      phase += 2 * M_PI * (140 + 20 * sin(2 * M_PI * 0.7 * t)) / sampleRate;
+      for (int harmonic = 1; harmonic * 140 < sampleRate / 2 && harmonic <= 30; harmonic++)
+        speech += sin(harmonic * phase) / harmonic;
+      sample += 4000 * (0.55 - 0.45 * cos(2 * M_PI * 4 * t)) * speech;
+    }
+    samples[idx] = (int16_t)lrint(sample);
+  }
+  return samples;
+}
+
+// The samples of a 16 bit PCM mono WAV file, its rate in sampleRate
+static int16_t *LoadWAV(const char *path, uint32_t *sampleRate, size_t *numSamples)
+{
+  FILE *file = fopen(path, "rb");
+  uint8_t header[12], chunk[8], format[16];
+  int16_t *samples = NULL;
+
+  if (file == NULL || fread(header, 1, 12, file) != 12 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+  {
+    fprintf(stderr, "%s: not a WAV file\n", path);
+    exit(1);
+  }
+  *sampleRate = 0;
+  while (fread(chunk, 1, 8, file) == 8)
+  {
+    uint32_t chunkBytes = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+    if (!memcmp(chunk, "fmt ", 4) && chunkBytes >= 16 && fread(format, 1, 16, file) == 16)
+    {
+      // PCM, mono, 16 bit
+      if (format[0] != 1 || format[2] != 1 || format[14] != 16)
+      {
+        fprintf(stderr, "%s: only 16 bit PCM mono\n", path);
+        exit(1);
+      }
+      *sampleRate = format[4] | format[5] << 8 | format[6] << 16 | (uint32_t)format[7] << 24;
+      fseek(file, chunkBytes - 16 + (chunkBytes & 1), SEEK_CUR);
+    }
+    else if (!memcmp(chunk, "data", 4) && *sampleRate != 0)
+    {
+      samples = malloc(chunkBytes);
+      if (samples == NULL)
+        exit(1);
+      *numSamples = fread(samples, 2, chunkBytes / 2, file);
+      break;
+    }
+    else
+      fseek(file, chunkBytes + (chunkBytes & 1), SEEK_CUR);
+  }
+  fclose(file);
+  if (samples == NULL)
+  {
+    fprintf(stderr, "%s: no samples\n", path);
+    exit(1);
+  }
+  return samples;
+}
+
+static void Run(const Config *config, const int16_t *samples, size_t numSamples)
+{
+  POSAudioEncoder encoder;
+  static uint8_t payload[POS_AUDIO_AAC_MAX_AUS_PER_PACKET * POS_AUDIO_AAC_MAX_AU_BYTES + 16];
+  uint64_t payloadBytes = 0;
+  uint64_t payloadTime;
+  size_t numFrames = 0;
+
+  if (POSAudioEncoderOpen(&encoder, config->codecType, config->sampleRate, config->rtpTimeMs, BIT_RATE, true) !=
+      kHAPError_None)
+  {
+    fprintf(stderr, "%s: can't open the encoder\n", config->name);
+    exit(1);
+  }
+  double start = cpu_seconds();
+  for (size_t idx = 0; idx + encoder.frameSamples <= numSamples; idx += encoder.frameSamples)
+  {
+    uint64_t sampleTime = (uint64_t)idx * 1000000000ull / config->sampleRate;
+    payloadBytes += POSAudioEncoderEncode(&encoder, samples + idx, encoder.frameSamples, sampleTime, payload,
+                                          sizeof(payload), &payloadTime);
+    numFrames++;
+  }
+  double seconds = cpu_seconds() - start;
+  double audioSeconds = (double)(numFrames * encoder.frameSamples) / config->sampleRate;
+  POSAudioEncoderClose(&encoder);
+
+  printf("%-22s %8.1fx real time  %7.1f us/frame  %6.2f%% of a core  %5.1f kbit/s\n", config->name,
+         audioSeconds / seconds, seconds * 1e6 / (double)numFrames, 100 * seconds / audioSeconds,
+         payloadBytes * 8 / audioSeconds / 1000);
+}
+
+int main(int argc, char **argv)
+{
+  long seconds = argc > 1 ? atol(argv[1]) : 60;
+  int16_t *wav = NULL;
+  uint32_t wavRate = 0;
+  size_t wavSamples = 0;
+
+  if (seconds <= 0 || seconds > MAX_SECONDS)
+    seconds = 60;
+  if (argc > 2)
+  {
+    wav = LoadWAV(argv[2], &wavRate, &wavSamples);
+    printf("%s, %.1f s at %u Hz\n", argv[2], (double)wavSamples / wavRate, wavRate);
+  }
+  else
+    printf("%ld s of generated speech\n", seconds);
+
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+  {
+    const Config *config = &configs[c];
+    if (wav != NULL)
+    {
+      // the recording only runs through the configurations at its rate
+      if (config->sampleRate == wavRate)
+        Run(config, wav, wavSamples);
+      continue;
+    }
+    size_t numSamples = (size_t)seconds * config->sampleRate;
+    int16_t *samples = MakeSpeech(config->sampleRate, numSamples);
+    Run(config, samples, numSamples);
+    free(samples);
+  }
+  free(wav);
+  return 0;
+}
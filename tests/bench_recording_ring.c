@@ -0,0 +1,266 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Keyframe lookups of the HKSV recording ring on the host.  Replays a stream through the
+// simulated encoder at 24 fps into ring_buffer_vi, with the frames in a 7 MB frame memory
+// the way get_hksv_video_record stores them, and on every frame times what the recording
+// loop asks the ring: the keyframes of the last 6 s, the oldest of them where the preroll
+// starts, and the keyframe after the tail where the next fragment starts.  Each is timed
+// with the keyframe index and with the scan over the frames it replaced, which reads the
+// first byte of every frame, and the answers are compared.
+// Not run by ctest, start it by hand:  ./bench_recording_ring [frames] [stream.264]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <imp/imp_encoder.h>
+#include <imp/imp_system.h>
+
+#include "POSRingBufferVideoIn.h"
+
+// as in POSRecordingController.c
+#define RING_BUFFER_SIZE_VIDEO 256
+#define RMEM_BUFFER_V_SIZE (1024 * 1024 * 7)
+#define PREROLL_US 6000000
+#define FPS 24
+// the recording stream has a keyframe every 4 s
+#define GOP_FRAMES (4 * FPS)
+// each lookup is repeated to get above the clock resolution
+#define REPEAT 50
+
+static ring_buffer_vi_element_t vringstorage[RING_BUFFER_SIZE_VIDEO];
+static ring_buffer_vi_t vring;
+static volatile size_t sink;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double seconds, long lookups)
+{
+  printf("%-36s %8.1f ns/lookup\n", name, seconds * 1e9 / (double)lookups);
+}
+
+// 2 Mbit/s at 24 fps: 60 KB keyframes behind an SPS and PPS, 9 KB P frames
+static void WriteStream(const char *path, long frames)
+{
+  static uint8_t nal[64 * 1024];
+  static const uint8_t startCode[4] = {0, 0, 0, 1};
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL)
+  {
+    perror(path);
+    exit(1);
+  }
+  memset(nal, 0x5a, sizeof(nal));
+  for (long frame = 0; frame < frames; frame++)
+  {
+    static const uint8_t headers[] = {0x67, 0x68, 0x65};
+    bool keyFrame = frame % GOP_FRAMES == 0;
+    size_t first = keyFrame ? 0 : 2;
+
+    for (size_t n = first; n < sizeof(headers); n++)
+    {
+      size_t numBytes = n < 2 ? 8 : keyFrame ? 60000 : 9000;
+      nal[0] = keyFrame || n < 2 ? headers[n] : 0x41;
+      fwrite(startCode, 1, sizeof(startCode), file);
+      fwrite(nal, 1, numBytes, file);
+    }
+  }
+  fclose(file);
+}
+
+static size_t CountIndexed(uint64_t prerollStart)
+{
+  size_t newestIndex = (vring.head_index - 1) & RING_BUFFER_MASK((&vring));
+  size_t count = ptr_ring_buffer_vi_count_keyframes(&vring, prerollStart);
+  if (count && ptr_ring_buffer_vi_is_keyframe(&vring, newestIndex))
+    count--;
+  return count;
+}
+
+static size_t CountScan(uint64_t prerollStart)
+{
+  size_t newestIndex = (vring.head_index - 1) & RING_BUFFER_MASK((&vring));
+  size_t count = 0;
+  for (size_t index = vring.tail_index; index != newestIndex; index = (index + 1) & RING_BUFFER_MASK((&vring)))
+  {
+    if ((*(uint8_t *)vring.buffer[index].loc & 0x1f) == 5 && vring.buffer[index].timestamp > prerollStart)
+      count++;
+  }
+  return count;
+}
+
+static size_t FindIndexed(uint64_t prerollStart)
+{
+  size_t index = RING_BUFFER_SIZE_VIDEO;
+  ptr_ring_buffer_vi_find_keyframe(&vring, prerollStart, &index);
+  return index;
+}
+
+static size_t FindScan(uint64_t prerollStart)
+{
+  for (size_t index = vring.tail_index; index != vring.head_index; index = (index + 1) & RING_BUFFER_MASK((&vring)))
+  {
+    if ((*(uint8_t *)vring.buffer[index].loc & 0x1f) == 5 && vring.buffer[index].timestamp >= prerollStart)
+      return index;
+  }
+  return RING_BUFFER_SIZE_VIDEO;
+}
+
+static size_t NextIndexed(void)
+{
+  size_t index = RING_BUFFER_SIZE_VIDEO;
+  ptr_ring_buffer_vi_next_keyframe(&vring, vring.tail_index, &index);
+  return index;
+}
+
+static size_t NextScan(void)
+{
+  for (size_t index = (vring.tail_index + 1) & RING_BUFFER_MASK((&vring)); index != vring.head_index;
+       index = (index + 1) & RING_BUFFER_MASK((&vring)))
+  {
+    if ((*(uint8_t *)vring.buffer[index].loc & 0x1f) == 5)
+      return index;
+  }
+  return RING_BUFFER_SIZE_VIDEO;
+}
+
+int main(int argc, char **argv)
+{
+  long frames = argc > 1 ? atol(argv[1]) : 2400;
+  char path[] = "/tmp/bench_recording_ring_XXXXXX";
+  const char *stream = argc > 2 ? argv[2] : path;
+  uint8_t *rmem = malloc(RMEM_BUFFER_V_SIZE);
+  uint8_t *rmemHead = rmem;
+  IMPEncoderChnAttr attr;
+  double seconds[6] = {0};
+  long numLookups = 0, numDisagree = 0;
+
+  if (rmem == NULL)
+    return 1;
+  if (argc <= 2)
+  {
+    int fd = mkstemp(path);
+    if (fd < 0)
+      return 1;
+    close(fd);
+    WriteStream(path, GOP_FRAMES * 4);
+  }
+  setenv("POS_SIM_H264", stream, 1);
+  setenv("POS_SIM_SPEED", "1000", 1);
+  if (IMP_System_Init() != 0 || IMP_Encoder_CreateGroup(0) != 0 ||
+      IMP_Encoder_SetDefaultParam(&attr, IMP_ENC_PROFILE_AVC_MAIN, IMP_ENC_RC_MODE_CBR, 1920, 1080, FPS, 1, GOP_FRAMES,
+                                  2, -1, 2000) != 0 ||
+      IMP_Encoder_CreateChn(0, &attr) != 0 || IMP_Encoder_RegisterChn(0, 0) != 0 ||
+      IMP_Encoder_StartRecvPic(0) != 0)
+  {
+    fprintf(stderr, "simulated encoder: %s\n", stream);
+    return 1;
+  }
+  ptr_ring_buffer_vi_init(&vring, vringstorage, RING_BUFFER_SIZE_VIDEO);
+
+  for (long frame = 0; frame < frames; frame++)
+  {
+    IMPEncoderStream encoded;
+    ring_buffer_vi_element_t newElement = {0};
+    size_t len = 0;
+
+    if (IMP_Encoder_PollingStream(0, 1000) != 0 || IMP_Encoder_GetStream(0, &encoded, true) != 0)
+      return 1;
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+      len += encoded.pack[n].length - 4;
+    if (rmemHead + len > rmem + RMEM_BUFFER_V_SIZE)
+      rmemHead = rmem;
+
+    // stored like get_hksv_video_record, without the start codes and parameter sets
+    newElement.loc = rmemHead;
+    newElement.timestamp = (uint64_t)frame * 1000000 / FPS;
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+    {
+      uint8_t *nal = (uint8_t *)(uintptr_t)encoded.virAddr + encoded.pack[n].offset + 4;
+      size_t numBytes = encoded.pack[n].length - 4;
+      uint8_t NALType = nal[0] & 0x1f;
+      if (NALType == 7 || NALType == 8)
+        continue;
+      if (rmemHead == newElement.loc)
+        newElement.nal_type = NALType;
+      if (NALType == 5)
+        newElement.flags |= RING_BUFFER_VI_FLAG_KEYFRAME;
+      memcpy(rmemHead, nal, numBytes);
+      rmemHead += numBytes;
+    }
+    newElement.len = rmemHead - (uint8_t *)newElement.loc;
+    IMP_Encoder_ReleaseStream(0, &encoded);
+    if (newElement.len == 0)
+      continue;
+    if (ptr_ring_buffer_vi_is_full(&vring))
+    {
+      ring_buffer_vi_element_t freeEle;
+      ptr_ring_buffer_vi_dequeue(&vring, &freeEle);
+    }
+    ptr_ring_buffer_vi_queue(&vring, &newElement);
+    if (ptr_ring_buffer_vi_num_items(&vring) < 2)
+      continue;
+
+    uint64_t newest = newElement.timestamp;
+    uint64_t prerollStart = newest > PREROLL_US ? newest - PREROLL_US : 0;
+    size_t results[6] = {0};
+    for (int op = 0; op < 6; op++)
+    {
+      double start = now_seconds();
+      for (int r = 0; r < REPEAT; r++)
+      {
+        switch (op)
+        {
+        case 0: results[op] = CountIndexed(prerollStart); break;
+        case 1: results[op] = CountScan(prerollStart); break;
+        case 2: results[op] = FindIndexed(prerollStart); break;
+        case 3: results[op] = FindScan(prerollStart); break;
+        case 4: results[op] = NextIndexed(); break;
+        default: results[op] = NextScan(); break;
+        }
+        sink = results[op];
+      }
+      seconds[op] += now_seconds() - start;
+    }
+    numLookups += REPEAT;
+    // a frame that starts with an SEI hides its IDR from the scans
+    if (results[0] != results[1] || results[2] != results[3] || results[4] != results[5])
+      numDisagree++;
+  }
+  IMP_Encoder_StopRecvPic(0);
+  if (argc <= 2)
+    unlink(path);
+
+  printf("%ld frames at %d fps, ring of %d, %ld lookups each\n", frames, FPS, RING_BUFFER_SIZE_VIDEO, numLookups);
+  report("count preroll keyframes, index", seconds[0], numLookups);
+  report("count preroll keyframes, scan", seconds[1], numLookups);
+  report("find preroll start, index", seconds[2], numLookups);
+  report("find preroll start, scan", seconds[3], numLookups);
+  report("find next fragment, index", seconds[4], numLookups);
+  report("find next fragment, scan", seconds[5], numLookups);
+  printf("%ld frames where index and scan disagree\n", numDisagree);
+  return 0;
+}
@@ -0,0 +1,197 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Snapshot request latency on the host for sizes below the 640x360 the snapshot encoder
+// publishes: the 320x240 an Apple Watch asks for, 480x270 and 320x180.  Each size is
+// timed on a new frame, which decodes at a DCT scaling factor, crops and re-encodes, on
+// a repeat request for the same frame that the cache answers, and against a full size
+// decode and encode, what every request cost before scaling in the DCT domain.
+// Not run by ctest, start it by hand:  ./bench_snapshot [requests] [snapshot.jpg]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_WIDTH 640
+#define SNAPSHOT_HEIGHT 360
+#define MAX_JPEG_BYTES (512 * 1024)
+
+static uint8_t source[MAX_JPEG_BYTES];
+static unsigned long sourceBytes;
+static uint8_t reply[MAX_JPEG_BYTES];
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int width, int height, double seconds, long requests, unsigned long bytes)
+{
+  printf("%-30s %3dx%-3d %8.2f ms/request  %7lu bytes\n", name, width, height, seconds * 1e3 / (double)requests,
+         bytes);
+}
+
+// A frame the size the encoder publishes, gradients under fine detail so the DCT has work
+static void MakeSnapshot(void)
+{
+  static uint8_t pixels[SNAPSHOT_WIDTH * SNAPSHOT_HEIGHT * 3];
+  uint32_t random = 1;
+  unsigned char *jpeg = NULL;
+
+  for (int y = 0; y < SNAPSHOT_HEIGHT; y++)
+  {
+    for (int x = 0; x < SNAPSHOT_WIDTH; x++)
+    {
+      uint8_t *pixel = &pixels[(y * SNAPSHOT_WIDTH + x) * 3];
+      random = random * 1664525 + 1013904223;
+      int grain = (int)(random >> 28) - 8;
+      pixel[0] = (uint8_t)(x * 255 / SNAPSHOT_WIDTH + grain);
+      pixel[1] = (uint8_t)(y * 255 / SNAPSHOT_HEIGHT + grain);
+      pixel[2] = (uint8_t)(((x / 16 + y / 16) & 1) * 128 + 64 + grain);
+    }
+  }
+  tjhandle compressor = tjInitCompress();
+  if (compressor == NULL ||
+      tjCompress2(compressor, pixels, SNAPSHOT_WIDTH, 0, SNAPSHOT_HEIGHT, TJPF_RGB, &jpeg, &sourceBytes, TJSAMP_420,
+                  85, 0) < 0 ||
+      sourceBytes > sizeof(source))
+  {
+    fprintf(stderr, "tjCompress2: %s\n", tjGetErrorStr());
+    exit(1);
+  }
+  memcpy(source, jpeg, sourceBytes);
+  tjFree(jpeg);
+  tjDestroy(compressor);
+}
+
+static void LoadSnapshot(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    perror(path);
+    exit(1);
+  }
+  sourceBytes = fread(source, 1, sizeof(source), file);
+  fclose(file);
+}
+
+// Hands the snapshot to getSnapshot as a new frame, so its scaled sizes aren't cached yet
+static void Publish(void)
+{
+  snapshot_frame_t *frame = snapshotBeginWrite(sourceBytes);
+  if (frame == NULL)
+  {
+    fprintf(stderr, "no free snapshot frame\n");
+    exit(1);
+  }
+  memcpy(frame->data, source, sourceBytes);
+  snapshotPublish(frame);
+}
+
+static unsigned long Request(int width, int height)
+{
+  unsigned long numBytes = sizeof(reply);
+  int replyWidth, replyHeight, subsampling, colorspace;
+
+  if (getSnapshot(&numBytes, reply, width, height) != 0)
+  {
+    fprintf(stderr, "getSnapshot %dx%d failed\n", width, height);
+    exit(1);
+  }
+  tjhandle decompressor = tjInitDecompress();
+  if (decompressor == NULL ||
+      tjDecompressHeader3(decompressor, reply, numBytes, &replyWidth, &replyHeight, &subsampling, &colorspace) < 0 ||
+      replyWidth != width || replyHeight != height)
+  {
+    fprintf(stderr, "asked for %dx%d, got something else\n", width, height);
+    exit(1);
+  }
+  tjDestroy(decompressor);
+  return numBytes;
+}
+
+// Decode at full size and encode the requested size out of it, without the fast DCT
+static unsigned long FullDecodeEncode(int width, int height)
+{
+  int snapWidth, snapHeight, subsampling, colorspace;
+  unsigned char *jpeg = NULL;
+  unsigned long numBytes = 0;
+
+  tjhandle decompressor = tjInitDecompress();
+  tjhandle compressor = tjInitCompress();
+  unsigned char *pixels = NULL;
+  if (decompressor == NULL || compressor == NULL ||
+      tjDecompressHeader3(decompressor, source, sourceBytes, &snapWidth, &snapHeight, &subsampling, &colorspace) < 0 ||
+      (pixels = tjAlloc(snapWidth * snapHeight * 4)) == NULL ||
+      tjDecompress2(decompressor, source, sourceBytes, pixels, snapWidth, 0, snapHeight, TJPF_BGRX, 0) < 0 ||
+      tjCompress2(compressor, pixels, width, snapWidth * 4, height, TJPF_BGRX, &jpeg, &numBytes, subsampling, 95,
+                  0) < 0)
+  {
+    fprintf(stderr, "full size decode and encode: %s\n", tjGetErrorStr());
+    exit(1);
+  }
+  tjFree(jpeg);
+  tjFree(pixels);
+  tjDestroy(compressor);
+  tjDestroy(decompressor);
+  return numBytes;
+}
+
+int main(int argc, char **argv)
+{
+  // 320x180 is the one of them that decodes at 1/2, the others need all of 640x360
+  static const int sizes[][2] = {{320, 240}, {480, 270}, {320, 180}};
+  long requests = argc > 1 ? atol(argv[1]) : 200;
+  unsigned long numBytes = 0;
+  double start;
+
+  if (argc > 2)
+    LoadSnapshot(argv[2]);
+  else
+    MakeSnapshot();
+  printf("snapshot %lu bytes, %ld requests a size\n", sourceBytes, requests);
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    int width = sizes[s][0], height = sizes[s][1];
+
+    start = now_seconds();
+    for (long n = 0; n < requests; n++)
+      numBytes = FullDecodeEncode(width, height);
+    report("full size decode and encode", width, height, now_seconds() - start, requests, numBytes);
+
+    start = now_seconds();
+    for (long n = 0; n < requests; n++)
+    {
+      Publish();
+      numBytes = Request(width, height);
+    }
+    report("new frame, DCT scaled", width, height, now_seconds() - start, requests, numBytes);
+
+    start = now_seconds();
+    for (long n = 0; n < requests; n++)
+      numBytes = Request(width, height);
+    report("same frame, cached", width, height, now_seconds() - start, requests, numBytes);
+  }
+  return 0;
+}
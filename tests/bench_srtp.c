@@ -0,0 +1,101 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SRTP throughput on the host: one packet at a time with srtp_encrypt, and a
+// frame at a time with srtp_encrypt_many as POSRTPStreamPollPackets does.
+// Not run by ctest, start it by hand:  ./bench_srtp [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "POSSRTPCrypto.h"
+
+// a 64 KB frame cut into 1200 byte packets, about an IDR at 1080p
+#define BENCH_PACKETS 54
+#define BENCH_PAYLOAD_BYTES 1200
+
+static uint8_t payload[BENCH_PACKETS][BENCH_PAYLOAD_BYTES];
+static uint8_t packets[BENCH_PACKETS][BENCH_PAYLOAD_BYTES + 12 + 10];
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double seconds, long frames)
+{
+  double megabytes = (double)frames * BENCH_PACKETS * BENCH_PAYLOAD_BYTES / 1e6;
+  printf("%-28s %8.1f MB/s  %8.1f us/frame\n", name, megabytes / seconds, seconds * 1e6 / (double)frames);
+}
+
+int main(int argc, char **argv)
+{
+  long frames = argc > 1 ? atol(argv[1]) : 2000;
+  uint8_t masterKey[16];
+  uint8_t masterSalt[14];
+  srtp_encrypt_job jobs[BENCH_PACKETS];
+  srtp_ctx srtp;
+  uint32_t index = 0;
+  double start;
+
+  memset(masterKey, 0x42, sizeof(masterKey));
+  memset(masterSalt, 0x24, sizeof(masterSalt));
+  memset(payload, 0x5a, sizeof(payload));
+  memset(packets, 0, sizeof(packets));
+  memset(&srtp, 0, sizeof(srtp));
+  srtp_setupContext(&srtp, NULL, (const char *)masterKey, sizeof(masterKey), (const char *)masterSalt, 10,
+                    0x11223344);
+
+  start = now_seconds();
+  for (long frame = 0; frame < frames; frame++)
+  {
+    for (size_t idx = 0; idx < BENCH_PACKETS; idx++, index++)
+    {
+      srtp_encrypt(&srtp, packets[idx] + 12, payload[idx], 0, BENCH_PAYLOAD_BYTES, index);
+      srtp_authenticate(&srtp, packets[idx] + 12 + BENCH_PAYLOAD_BYTES, packets[idx], 12 + BENCH_PAYLOAD_BYTES,
+                        index >> 16);
+    }
+  }
+  report("srtp_encrypt per packet", now_seconds() - start, frames);
+
+  start = now_seconds();
+  for (long frame = 0; frame < frames; frame++)
+  {
+    for (size_t idx = 0; idx < BENCH_PACKETS; idx++, index++)
+    {
+      jobs[idx].packet = packets[idx] + 12;
+      jobs[idx].data_bytes = payload[idx];
+      jobs[idx].num_header_bytes = 0;
+      jobs[idx].num_data_bytes = BENCH_PAYLOAD_BYTES;
+      jobs[idx].index = index;
+    }
+    srtp_encrypt_many(&srtp, jobs, BENCH_PACKETS);
+    for (size_t idx = 0; idx < BENCH_PACKETS; idx++)
+    {
+      srtp_authenticate(&srtp, packets[idx] + 12 + BENCH_PAYLOAD_BYTES, packets[idx], 12 + BENCH_PAYLOAD_BYTES,
+                        jobs[idx].index >> 16);
+    }
+  }
+  report("srtp_encrypt_many per frame", now_seconds() - start, frames);
+
+  srtp_freeContext(&srtp, NULL);
+  return 0;
+}
@@ -0,0 +1,174 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares two recordings of the same scene made by the T31 encoder at the same fixed
+// QP (IMP_ENC_RC_MODE_FIXQP), one H.264 and one H.265.  For each it reports the
+// elementary stream bitrate, and the packets and bytes on the wire once the RTP
+// payloader has cut it up and SRTP, UDP and IPv4 have added their overhead.
+// Not run by ctest, start it by hand:  ./bench_video_bitrate <h264 file> <h265 file> [fps]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "POSRTPController.h"
+
+// IPv4 and UDP headers
+#define BENCH_IP_UDP_BYTES 28
+
+typedef struct
+{
+  uint32_t pictures;
+  uint64_t streamBytes;
+  uint32_t packets;
+  uint64_t wireBytes;
+} BenchResult;
+
+static uint8_t *read_file(const char *path, size_t *numBytes)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *bytes = malloc(size > 0 ? (size_t)size : 1);
+  if (bytes == NULL || fread(bytes, 1, (size_t)size, file) != (size_t)size)
+  {
+    free(bytes);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  *numBytes = (size_t)size;
+  return bytes;
+}
+
+// Offset of the NALU after the next start code at or after pos, or numBytes
+static size_t next_nal(const uint8_t *bytes, size_t numBytes, size_t pos)
+{
+  for (; pos + 3 <= numBytes; pos++)
+  {
+    if (bytes[pos] == 0 && bytes[pos + 1] == 0 && bytes[pos + 2] == 1)
+      return pos + 3;
+  }
+  return numBytes;
+}
+
+static void poll_packets(POSRTPStreamRef *stream, BenchResult *result)
+{
+  static uint8_t packet[2048];
+  for (;;)
+  {
+    size_t numPacketBytes = 0;
+    POSRTPStreamPollPacket(stream, packet, sizeof(packet), &numPacketBytes);
+    if (numPacketBytes == 0)
+      return;
+    result->packets++;
+    result->wireBytes += numPacketBytes + BENCH_IP_UDP_BYTES;
+  }
+}
+
+// Packetizes a recording the way the video thread does, a picture ends with its VCL NALU
+static int bench_recording(const char *path, RTPType encodeType, uint32_t fps, BenchResult *result)
+{
+  POSRTPStreamRef stream;
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x55000000, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+  size_t numBytes;
+  uint8_t *bytes = read_file(path, &numBytes);
+
+  if (bytes == NULL)
+  {
+    fprintf(stderr, "can't read %s\n", path);
+    return -1;
+  }
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(&stream, &rtpParameters, encodeType, 90000, 0x11223344, 0, "positron-bench", &srtpParameters,
+                    &srtpParameters);
+  memset(result, 0, sizeof(*result));
+
+  size_t start = next_nal(bytes, numBytes, 0);
+  while (start < numBytes)
+  {
+    size_t end = next_nal(bytes, numBytes, start);
+    size_t next = end;
+    // drop the start code, and the zero byte of a 4 byte one
+    if (end < numBytes)
+    {
+      end -= 3;
+      while (end > start && bytes[end - 1] == 0)
+        end--;
+    }
+    size_t numPayloadBytes = 0;
+    HAPTimeNS sampleTime = (HAPTimeNS)result->pictures * 1000000000ull / fps;
+    bool VCL = encodeType == RTPType_H265 ? ((bytes[start] >> 1) & 0x3f) < 32
+                                          : (bytes[start] & 0x1f) >= 1 && (bytes[start] & 0x1f) <= 5;
+
+    result->streamBytes += end - start + 4;
+    POSRTPStreamPushPayload(&stream, bytes + start, end - start, &numPayloadBytes, sampleTime, sampleTime);
+    poll_packets(&stream, result);
+    if (VCL)
+    {
+      if (encodeType == RTPType_H264)
+      {
+        POSRTPStreamEndAccessUnit(&stream, &numPayloadBytes);
+        poll_packets(&stream, result);
+      }
+      result->pictures++;
+    }
+    start = next;
+  }
+  POSRTPStreamEnd(&stream);
+  free(bytes);
+  return result->pictures != 0 ? 0 : -1;
+}
+
+static void report(const char *name, const BenchResult *result, uint32_t fps)
+{
+  double seconds = (double)result->pictures / fps;
+  printf("%-6s %6u pictures  %8.1f kbit/s stream  %7.1f packets/s  %8.1f kbit/s on the wire\n", name,
+         result->pictures, (double)result->streamBytes * 8 / seconds / 1000, result->packets / seconds,
+         (double)result->wireBytes * 8 / seconds / 1000);
+}
+
+int main(int argc, char **argv)
+{
+  BenchResult h264, h265;
+  uint32_t fps = argc > 3 ? (uint32_t)atoi(argv[3]) : 30;
+
+  if (argc < 3 || fps == 0)
+  {
+    fprintf(stderr, "usage: %s <h264 file> <h265 file> [fps]\n", argv[0]);
+    return 2;
+  }
+  if (bench_recording(argv[1], RTPType_H264, fps, &h264) != 0 ||
+      bench_recording(argv[2], RTPType_H265, fps, &h265) != 0)
+    return 1;
+
+  report("H.264", &h264, fps);
+  report("H.265", &h265, fps);
+  // per picture, in case the recordings aren't the same length
+  double stream = 1 - ((double)h265.streamBytes / h265.pictures) / ((double)h264.streamBytes / h264.pictures);
+  double wire = 1 - ((double)h265.wireBytes / h265.pictures) / ((double)h264.wireBytes / h264.pictures);
+  printf("H.265 saves %.1f%% of the stream and %.1f%% on the wire\n", stream * 100, wire * 100);
+  return 0;
+}
@@ -0,0 +1,298 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// The video path end to end on the host.  Replays a stream through the simulated encoder
+// in real time and sends every frame the way the video thread does: packetized once,
+// paced for all viewers together and fanned out to one to four viewers, each with its
+// own SRTP keys and SSRC and a UDP socket connected to a loopback receiver that is
+// drained after each frame.  For each number of viewers it reports the send thread's
+// CPU time per frame, what went out on the wire and in how many send calls, what the
+// receivers got, the latency from GetStream to the last packet handed to a socket, and
+// the largest leftStreamFrames backlog of the encoder.
+// Not run by ctest, start it by hand:  ./bench_video_pipeline [frames] [stream.264]
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <imp/imp_encoder.h>
+#include <imp/imp_system.h>
+
+#include "POSRTPController.h"
+#include "POSRTPFanout.h"
+
+#define MAX_VIEWERS POS_RTP_FANOUT_MAX_VIEWERS
+#define FPS 30
+#define GOP_FRAMES 30
+#define BITRATE_KBPS 2000
+#define PAYLOAD_TYPE 99
+// as in POSCameraController.c
+#define PACING_PERCENT 50
+#define PACING_BURST_BYTES 4500
+
+typedef struct
+{
+  POSRTPStreamRef stream;
+  POSRTPPacketHistory history;
+  POSSRTPParameters srtpParameters;
+  int sock;
+  int receiverSock;
+  uint64_t packetsReceived;
+  uint64_t bytesReceived;
+} Viewer;
+
+static Viewer viewers[MAX_VIEWERS];
+static POSRTPStreamRef packetizer;
+static POSRTPFanout fanout;
+static POSRTPPacer pacer;
+static uint8_t pool[POS_UDP_BATCH_MAX][POS_RTP_FANOUT_PACKET_STRIDE];
+static size_t packetLens[POS_UDP_BATCH_MAX];
+
+static uint64_t now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// 2 Mbit/s at 30 fps: 40 KB keyframes behind an SPS and PPS, 7 KB P frames
+static void WriteStream(const char *path)
+{
+  static uint8_t nal[40000];
+  static const uint8_t startCode[4] = {0, 0, 0, 1};
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL)
+  {
+    perror(path);
+    exit(1);
+  }
+  memset(nal, 0x5a, sizeof(nal));
+  for (int frame = 0; frame < GOP_FRAMES; frame++)
+  {
+    static const uint8_t headers[] = {0x67, 0x68, 0x65};
+    bool keyFrame = frame == 0;
+    size_t first = keyFrame ? 0 : 2;
+
+    for (size_t n = first; n < sizeof(headers); n++)
+    {
+      size_t numBytes = n < 2 ? 8 : keyFrame ? sizeof(nal) : 7000;
+      nal[0] = keyFrame || n < 2 ? headers[n] : 0x41;
+      fwrite(startCode, 1, sizeof(startCode), file);
+      fwrite(nal, 1, numBytes, file);
+    }
+  }
+  fclose(file);
+}
+
+static void StartViewers(size_t numViewers)
+{
+  POSRTPParameters rtpParameters = {.type = PAYLOAD_TYPE, .ssrc = 0x55000000, .maxBitRate = BITRATE_KBPS,
+                                    .RTCPInterval = 0.5f, .maximumMTU = 1378};
+  HAPTime now = now_ns(CLOCK_MONOTONIC);
+
+  POSRTPFanoutInit(&fanout, &pacer);
+  POSRTPPacerInit(&pacer, PACING_BURST_BYTES);
+  for (size_t idx = 0; idx < numViewers; idx++)
+  {
+    Viewer *viewer = &viewers[idx];
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addrLen = sizeof(addr);
+    int bufferBytes = 1 << 20;
+
+    viewer->receiverSock = socket(AF_INET, SOCK_DGRAM, 0);
+    viewer->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (viewer->receiverSock < 0 || viewer->sock < 0)
+    {
+      perror("socket");
+      exit(1);
+    }
+    setsockopt(viewer->receiverSock, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+    if (bind(viewer->receiverSock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(viewer->receiverSock, (struct sockaddr *)&addr, &addrLen) != 0 ||
+        connect(viewer->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+      perror("loopback");
+      exit(1);
+    }
+
+    memset(&viewer->srtpParameters, 0, sizeof(viewer->srtpParameters));
+    viewer->srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+    memset(viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x40 + (int)idx, 16);
+    memset(viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x20 + (int)idx, 14);
+    POSRTPStreamStart(&viewer->stream, &rtpParameters, RTPType_H264, 90000, 0x11223344 + (uint32_t)idx, now,
+                      "positron-bench", &viewer->srtpParameters, &viewer->srtpParameters);
+    POSRTPStreamSetHistory(&viewer->stream, &viewer->history);
+    POSRTPFanoutAddViewer(&fanout, &viewer->stream, viewer->sock);
+    viewer->packetsReceived = 0;
+    viewer->bytesReceived = 0;
+  }
+  // the first viewer starts the shared packetizer, as in POSCameraController.c
+  POSRTPStreamStartPacketizer(&packetizer, &rtpParameters, RTPType_H264, 90000,
+                              viewers[0].stream.context_output_srtp.tag_size, now);
+}
+
+static void StopViewers(size_t numViewers)
+{
+  for (size_t idx = 0; idx < numViewers; idx++)
+  {
+    POSRTPFanoutRemoveViewer(&fanout, &viewers[idx].stream);
+    close(viewers[idx].sock);
+    close(viewers[idx].receiverSock);
+  }
+}
+
+// Reads everything waiting on a viewer's loopback receiver
+static void Receive(Viewer *viewer)
+{
+  static uint8_t bytes[2048];
+
+  for (;;)
+  {
+    ssize_t ret = recv(viewer->receiverSock, bytes, sizeof(bytes), MSG_DONTWAIT);
+    if (ret < 0)
+      return;
+    viewer->packetsReceived++;
+    viewer->bytesReceived += (uint64_t)ret;
+  }
+}
+
+static void SendPackets(uint32_t *numSyscalls)
+{
+  size_t numPackets;
+
+  for (;;)
+  {
+    POSRTPStreamPollPackets(&packetizer, pool, sizeof(pool[0]), POS_UDP_BATCH_MAX, packetLens, &numPackets);
+    if (numPackets == 0)
+      break;
+    POSRTPFanoutSend(&fanout, &packetizer, (const uint8_t *)pool, sizeof(pool[0]), packetLens, numPackets,
+                     now_ns(CLOCK_MONOTONIC), numSyscalls);
+  }
+}
+
+static void Run(size_t numViewers, long frames)
+{
+  uint64_t cpuNs = 0, latencyNs = 0, maxLatencyNs = 0;
+  uint64_t packetsSent = 0, packetsDropped = 0, packetsReceived = 0, bytesReceived = 0;
+  uint32_t numSyscalls = 0, maxBacklog = 0;
+
+  StartViewers(numViewers);
+  IMP_Encoder_FlushStream(0);
+  uint64_t start = now_ns(CLOCK_MONOTONIC);
+  for (long frame = 0; frame < frames; frame++)
+  {
+    IMPEncoderStream encoded;
+    IMPEncoderChnStat stat;
+    size_t frameBytes = 0;
+    size_t numPayloadBytes;
+
+    if (IMP_Encoder_PollingStream(0, 1000) != 0 || IMP_Encoder_GetStream(0, &encoded, true) != 0)
+      exit(1);
+    uint64_t got = now_ns(CLOCK_MONOTONIC);
+    uint64_t cpuStart = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+      frameBytes += encoded.pack[n].length;
+    POSRTPPacerStartFrame(&pacer, frameBytes * numViewers, FPS, viewers[0].stream.bitRate * numViewers,
+                          PACING_PERCENT);
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+    {
+      IMPEncoderPack *pack = &encoded.pack[n];
+      POSRTPStreamPushPayload(&packetizer, (void *)(uintptr_t)(encoded.virAddr + pack->offset + 4),
+                              pack->length - 4, &numPayloadBytes, got, got);
+      if (numPayloadBytes > 0)
+        SendPackets(&numSyscalls);
+    }
+    POSRTPStreamEndAccessUnit(&packetizer, &numPayloadBytes);
+    if (numPayloadBytes > 0)
+      SendPackets(&numSyscalls);
+    uint64_t sent = now_ns(CLOCK_MONOTONIC);
+    cpuNs += now_ns(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    latencyNs += sent - got;
+    if (sent - got > maxLatencyNs)
+      maxLatencyNs = sent - got;
+
+    IMP_Encoder_Query(0, &stat);
+    if (stat.leftStreamFrames > maxBacklog)
+      maxBacklog = stat.leftStreamFrames;
+    IMP_Encoder_ReleaseStream(0, &encoded);
+    for (size_t v = 0; v < numViewers; v++)
+      Receive(&viewers[v]);
+  }
+  double seconds = (double)(now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+  for (size_t v = 0; v < numViewers; v++)
+  {
+    Receive(&viewers[v]);
+    packetsSent += fanout.viewers[v].packetsSent;
+    packetsDropped += fanout.viewers[v].packetsDropped;
+    packetsReceived += viewers[v].packetsReceived;
+    bytesReceived += viewers[v].bytesReceived;
+  }
+  StopViewers(numViewers);
+
+  printf("%7zu %8.0f %6.1f%% %8.2f %8.0f %7.1f %8llu %8llu %7.2f %7.2f %7u\n", numViewers,
+         (double)cpuNs / 1e3 / (double)frames, 100.0 * (double)cpuNs / 1e9 / seconds,
+         (double)bytesReceived * 8 / 1e6 / seconds, (double)packetsSent / seconds,
+         (double)numSyscalls / (double)frames, (unsigned long long)packetsDropped,
+         (unsigned long long)(packetsSent - packetsReceived), (double)latencyNs / 1e6 / (double)frames,
+         (double)maxLatencyNs / 1e6, maxBacklog);
+}
+
+int main(int argc, char **argv)
+{
+  long frames = argc > 1 ? atol(argv[1]) : 150;
+  char path[] = "/tmp/bench_video_pipeline_XXXXXX";
+  const char *stream = argc > 2 ? argv[2] : path;
+  IMPEncoderChnAttr attr;
+
+  if (argc <= 2)
+  {
+    int fd = mkstemp(path);
+    if (fd < 0)
+      return 1;
+    close(fd);
+    WriteStream(path);
+  }
+  // in real time, the pacer sleeps on the wall clock
+  setenv("POS_SIM_H264", stream, 1);
+  setenv("POS_SIM_SPEED", "1", 1);
+  if (IMP_System_Init() != 0 || IMP_Encoder_CreateGroup(0) != 0 ||
+      IMP_Encoder_SetDefaultParam(&attr, IMP_ENC_PROFILE_AVC_MAIN, IMP_ENC_RC_MODE_CBR, 1920, 1080, FPS, 1, GOP_FRAMES,
+                                  2, -1, BITRATE_KBPS) != 0 ||
+      IMP_Encoder_CreateChn(0, &attr) != 0 || IMP_Encoder_RegisterChn(0, 0) != 0 ||
+      IMP_Encoder_StartRecvPic(0) != 0)
+  {
+    fprintf(stderr, "simulated encoder: %s\n", stream);
+    return 1;
+  }
+
+  printf("%ld frames at %d fps per run, paced to %d%% of the frame interval\n", frames, FPS, PACING_PERCENT);
+  printf("viewers  cpu us/f   core   Mbit/s  pkts/s  calls/f  dropped     lost  lat ms  max ms backlog\n");
+  for (size_t numViewers = 1; numViewers <= MAX_VIEWERS; numViewers++)
+    Run(numViewers, frames);
+  IMP_Encoder_StopRecvPic(0);
+  if (argc <= 2)
+    unlink(path);
+  return 0;
+}
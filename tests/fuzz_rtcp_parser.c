@@ -0,0 +1,187 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Fuzz target for POSRTCPParse, the first thing to see bytes from the network
+// after SRTCP authentication.
+//
+// With -DPOSITRON_FUZZ=ON and clang this is a libFuzzer binary:
+//     ./fuzz_rtcp_parser ../tests/corpus/rtcp
+// Otherwise it is a replay driver for ctest that runs every corpus file, each of
+// its truncations and each single bit flip through the parser under the sanitizers.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "POSRTCPParser.h"
+
+#include "pos_test.h"
+
+// The handlers read everything they are given, so an out of bounds pointer shows up in the sanitizers
+static volatile uint32_t sink;
+
+static void OnSenderReport(void *context, const POSRTCPSenderInfo *senderInfo)
+{
+  (void)context;
+  sink += senderInfo->senderSSRC + senderInfo->ntpMSW + senderInfo->octetCount;
+}
+
+static void OnReportBlock(void *context, const POSRTCPReportBlock *reportBlock)
+{
+  (void)context;
+  sink += reportBlock->sourceSSRC + (uint32_t)reportBlock->cumulativeLost + reportBlock->delaySinceLastSR;
+}
+
+static void OnSDESItem(void *context, uint32_t ssrc, uint8_t itemType, const uint8_t *item, uint8_t numItemBytes)
+{
+  const uint8_t *bytes = ((const uint8_t **)context)[0];
+  const uint8_t *end = ((const uint8_t **)context)[1];
+
+  POS_TEST_CHECK(itemType != 0);
+  POS_TEST_CHECK(item >= bytes && item + numItemBytes <= end);
+  sink += ssrc;
+  for (uint8_t idx = 0; idx < numItemBytes; idx++)
+    sink += item[idx];
+}
+
+static void OnBye(void *context, uint32_t ssrc)
+{
+  (void)context;
+  sink += ssrc;
+}
+
+static void OnNack(void *context, uint32_t senderSSRC, uint32_t mediaSSRC, uint16_t pid, uint16_t blp)
+{
+  (void)context;
+  sink += senderSSRC + mediaSSRC + pid + blp;
+}
+
+static void OnTmmbr(void *context, const POSRTCPTmmbr *tmmbr)
+{
+  (void)context;
+  POS_TEST_CHECK(tmmbr->exponent < 64 && tmmbr->mantissa < (1 << 17) && tmmbr->overhead < (1 << 9));
+  sink += tmmbr->mediaSSRC;
+}
+
+static void OnPli(void *context, uint32_t senderSSRC, uint32_t mediaSSRC)
+{
+  (void)context;
+  sink += senderSSRC + mediaSSRC;
+}
+
+static void OnFir(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr)
+{
+  (void)context;
+  sink += senderSSRC + ssrc + seqNr;
+}
+
+static void OnTstr(void *context, uint32_t senderSSRC, uint32_t ssrc, uint8_t seqNr, uint8_t index)
+{
+  (void)context;
+  POS_TEST_CHECK(index < 32);
+  sink += senderSSRC + ssrc + seqNr;
+}
+
+static void OnRemb(void *context, uint32_t senderSSRC, uint32_t ssrc, uint64_t bitRate)
+{
+  (void)context;
+  sink += senderSSRC + ssrc + (uint32_t)bitRate;
+}
+
+static const POSRTCPHandlers handlers = {
+  .senderReport = OnSenderReport,
+  .reportBlock = OnReportBlock,
+  .sdesItem = OnSDESItem,
+  .bye = OnBye,
+  .nack = OnNack,
+  .tmmbr = OnTmmbr,
+  .pli = OnPli,
+  .fir = OnFir,
+  .tstr = OnTstr,
+  .remb = OnRemb,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  // a copy of exactly size bytes, so reading one past the end is caught even when the fuzzer's buffer is larger
+  uint8_t *bytes = malloc(size ? size : 1);
+  POS_TEST_CHECK(bytes != NULL);
+  memcpy(bytes, data, size);
+  const uint8_t *bounds[2] = {bytes, bytes + size};
+
+  POSRTCPParse(bytes, size, &handlers, bounds);
+  // and once with no handlers at all
+  POSRTCPHandlers noHandlers;
+  memset(&noHandlers, 0, sizeof(noHandlers));
+  POSRTCPParse(bytes, size, &noHandlers, NULL);
+
+  free(bytes);
+  return 0;
+}
+
+#ifndef POSITRON_FUZZ
+
+static size_t ReplayFile(const char *path)
+{
+  static uint8_t bytes[65536];
+  FILE *file = fopen(path, "rb");
+  POS_TEST_CHECK(file != NULL);
+  size_t numBytes = fread(bytes, 1, sizeof(bytes), file);
+  fclose(file);
+
+  for (size_t prefix = 0; prefix <= numBytes; prefix++)
+    LLVMFuzzerTestOneInput(bytes, prefix);
+  for (size_t bit = 0; bit < numBytes * 8; bit++)
+  {
+    bytes[bit / 8] ^= (uint8_t)(1 << bit % 8);
+    LLVMFuzzerTestOneInput(bytes, numBytes);
+    bytes[bit / 8] ^= (uint8_t)(1 << bit % 8);
+  }
+  return 1;
+}
+
+// Arguments are corpus files or directories of them, like libFuzzer takes
+int main(int argc, char **argv)
+{
+  size_t numFiles = 0;
+
+  for (int arg = 1; arg < argc; arg++)
+  {
+    DIR *dir = opendir(argv[arg]);
+    if (dir == NULL)
+    {
+      numFiles += ReplayFile(argv[arg]);
+      continue;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", argv[arg], entry->d_name);
+      numFiles += ReplayFile(path);
+    }
+    closedir(dir);
+  }
+  POS_TEST_CHECK(numFiles > 0);
+  printf("rtcp parser replayed %zu corpus files\n", numFiles);
+  return 0;
+}
+
+#endif
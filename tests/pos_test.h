@@ -0,0 +1,75 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Minimal checks shared by the host tests.  A failed check prints where it
+// failed and exits, so ctest reports the test as failed.
+
+#ifndef POS_TEST_H
+#define POS_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POS_TEST_CHECK(cond)                                                                                  \
+  do                                                                                                          \
+  {                                                                                                           \
+    if (!(cond))                                                                                              \
+    {                                                                                                         \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                \
+      exit(1);                                                                                                \
+    }                                                                                                         \
+  } while (0)
+
+#define POS_TEST_CHECK_BYTES(actual, expected, numBytes)                                                      \
+  do                                                                                                          \
+  {                                                                                                           \
+    if (memcmp((actual), (expected), (numBytes)) != 0)                                                        \
+    {                                                                                                         \
+      fprintf(stderr, "%s:%d: %s differs from %s\n", __FILE__, __LINE__, #actual, #expected);                 \
+      pos_test_dump("  got     ", (const uint8_t *)(actual), (numBytes));                                     \
+      pos_test_dump("  expected", (const uint8_t *)(expected), (numBytes));                                   \
+      exit(1);                                                                                                \
+    }                                                                                                         \
+  } while (0)
+
+static inline void pos_test_dump(const char *label, const uint8_t *bytes, size_t numBytes)
+{
+  fprintf(stderr, "%s ", label);
+  for (size_t idx = 0; idx < numBytes; idx++)
+    fprintf(stderr, "%02x", bytes[idx]);
+  fprintf(stderr, "\n");
+}
+
+// Parses a hex string into bytes, returns the number of bytes
+static inline size_t pos_test_hex(uint8_t *bytes, size_t maxBytes, const char *hex)
+{
+  size_t numBytes = 0;
+  unsigned int value;
+
+  while (hex[0] && hex[1] && numBytes < maxBytes)
+  {
+    if (sscanf(hex, "%2x", &value) != 1)
+      break;
+    bytes[numBytes++] = (uint8_t)value;
+    hex += 2;
+  }
+  return numBytes;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs POSAudioASRC between a virtual controller clock and a virtual AO clock a
+// few hundred ppm apart, the way the speaker thread drives it, and checks that
+// the PI controller finds the drift and holds the buffered audio on its target.
+
+#include <math.h>
+#include <string.h>
+
+#include "POSAudioASRC.h"
+
+#include "pos_test.h"
+
+#define SAMPLE_RATE 16000
+#define PACKET_SAMPLES 320 // 20 ms packets from the controller
+#define PLAY_SAMPLES 480   // 30 ms frames to the speaker, SPK_PLAY_SAMPLES
+#define TARGET_US 90000
+#define RING_SAMPLES 16384
+
+#define MS ((int64_t)1000000)
+#define SECONDS ((int64_t)1000000000)
+
+static int64_t Abs(int64_t value)
+{
+  return value < 0 ? -value : value;
+}
+
+typedef struct
+{
+    int32_t ppm;          // of the controller clock against the AO clock
+    int32_t finalPPM;
+    int64_t maxErrorUs;   // of the occupancy from the target, once settled
+    uint32_t numUnderruns;
+    uint32_t numOverruns;
+} DriftResult;
+
+// The controller sends a packet every 20 ms of its own clock into a ring, the speaker thread
+// moves it into the converter and plays a frame every 30 ms of the AO clock.  Time is AO ns.
+static void RunDrift(DriftResult *result, int64_t duration)
+{
+  static POSAudioASRC asrc;
+  static int16_t ring[RING_SAMPLES];
+  static int16_t frame[PLAY_SAMPLES];
+  size_t ringSamples = 0;
+  // a faster controller clock sends its 20 ms packets in less AO time
+  const int64_t packetPeriod = 20 * MS * 1000000 / (1000000 + result->ppm);
+  int64_t nextPacket = 0;
+  int64_t lastPacket = 0;
+  int64_t settled = duration / 2;
+
+  POSAudioASRCInit(&asrc);
+  // the jitter buffer has filled the ring to the target before the speaker starts
+  ringSamples = TARGET_US / 1000 * SAMPLE_RATE / 1000;
+  memset(ring, 0, sizeof ring);
+  for (int64_t now = 0; now < duration; now += 30 * MS)
+  {
+    while (nextPacket <= now)
+    {
+      if (ringSamples + PACKET_SAMPLES > RING_SAMPLES)
+        result->numOverruns++;
+      else
+        ringSamples += PACKET_SAMPLES;
+      lastPacket = nextPacket;
+      nextPacket += packetPeriod;
+    }
+
+    while (!POSAudioASRCCanRead(&asrc, PLAY_SAMPLES))
+    {
+      if (ringSamples < PACKET_SAMPLES)
+      {
+        result->numUnderruns++;
+        ringSamples = PACKET_SAMPLES;
+      }
+      POSAudioASRCWrite(&asrc, ring, PACKET_SAMPLES);
+      ringSamples -= PACKET_SAMPLES;
+    }
+
+    // as the speaker thread: evened out over the packet period
+    int64_t sinceWriteUs = (now - lastPacket) / 1000;
+    int64_t periodUs = packetPeriod / 1000;
+    if (sinceWriteUs > periodUs)
+      sinceWriteUs = periodUs;
+    int64_t occupancyUs = (int64_t)ringSamples * 1000000 / SAMPLE_RATE +
+                          POSAudioASRCQueuedUs(&asrc, SAMPLE_RATE) + sinceWriteUs - periodUs / 2;
+    POSAudioASRCSteer(&asrc, occupancyUs > 0 ? occupancyUs : 0, TARGET_US);
+    POSAudioASRCRead(&asrc, frame, PLAY_SAMPLES);
+
+    if (now >= settled && Abs(asrc.occupancyUs - TARGET_US) > result->maxErrorUs)
+      result->maxErrorUs = Abs(asrc.occupancyUs - TARGET_US);
+  }
+  result->finalPPM = asrc.ppm;
+}
+
+// Crystals a few hundred ppm apart either way: well within ten minutes, about 40 s time
+// constants, the correction matches the drift and the buffered audio sits on the target
+static void test_drift(void)
+{
+  static const int32_t drifts[] = {0, 300, -300, 800};
+
+  for (size_t idx = 0; idx < sizeof drifts / sizeof drifts[0]; idx++)
+  {
+    DriftResult result;
+    memset(&result, 0, sizeof result);
+    result.ppm = drifts[idx];
+    RunDrift(&result, 10 * 60 * SECONDS);
+    POS_TEST_CHECK(result.numUnderruns == 0 && result.numOverruns == 0);
+    POS_TEST_CHECK(Abs(result.finalPPM - result.ppm) <= 20);
+    POS_TEST_CHECK(result.maxErrorUs < 500);
+  }
+}
+
+// Past POS_AUDIO_ASRC_MAX_PPM the correction saturates instead of winding up
+static void test_drift_limit(void)
+{
+  DriftResult result;
+
+  memset(&result, 0, sizeof result);
+  result.ppm = 3000;
+  RunDrift(&result, 60 * SECONDS);
+  POS_TEST_CHECK(result.finalPPM == POS_AUDIO_ASRC_MAX_PPM);
+}
+
+// Each phase has unity gain, so a constant comes through unchanged at any rate
+static void test_constant(void)
+{
+  static POSAudioASRC asrc;
+  int16_t input[PACKET_SAMPLES];
+  int16_t output[PLAY_SAMPLES];
+
+  for (size_t idx = 0; idx < PACKET_SAMPLES; idx++)
+    input[idx] = 10000;
+  POSAudioASRCInit(&asrc);
+  asrc.step = ((uint64_t)1 << 32) + 777 * 4295;
+  for (int round = 0; round < 100; round++)
+  {
+    while (!POSAudioASRCCanRead(&asrc, PLAY_SAMPLES))
+      POS_TEST_CHECK(POSAudioASRCWrite(&asrc, input, PACKET_SAMPLES) == PACKET_SAMPLES);
+    POSAudioASRCRead(&asrc, output, PLAY_SAMPLES);
+    // the first few samples still see the silence in front
+    for (size_t idx = round == 0 ? POS_AUDIO_ASRC_TAPS : 0; idx < PLAY_SAMPLES; idx++)
+      POS_TEST_CHECK(Abs(output[idx] - 10000) <= 2);
+  }
+}
+
+// A 1 kHz tone keeps its level and frequency through a 1000 ppm correction
+static void test_tone(void)
+{
+  static POSAudioASRC asrc;
+  int16_t input[PACKET_SAMPLES];
+  int16_t output[PLAY_SAMPLES];
+  uint64_t inputIndex = 0;
+  double sumSquares = 0;
+  uint32_t numCrossings = 0;
+  size_t numOutput = 0;
+  int16_t last = 0;
+
+  POSAudioASRCInit(&asrc);
+  asrc.step = ((uint64_t)1 << 32) + 1000 * 4295;
+  while (numOutput < 100 * SAMPLE_RATE / 10)
+  {
+    while (!POSAudioASRCCanRead(&asrc, PLAY_SAMPLES))
+    {
+      for (size_t idx = 0; idx < PACKET_SAMPLES; idx++, inputIndex++)
+        input[idx] = (int16_t)lround(10000 * sin(2 * M_PI * 1000 * inputIndex / SAMPLE_RATE));
+      POSAudioASRCWrite(&asrc, input, PACKET_SAMPLES);
+    }
+    POSAudioASRCRead(&asrc, output, PLAY_SAMPLES);
+    for (size_t idx = 0; idx < PLAY_SAMPLES; idx++, numOutput++)
+    {
+      if (numOutput < PLAY_SAMPLES)
+        continue;
+      sumSquares += (double)output[idx] * output[idx];
+      numCrossings += last < 0 && output[idx] >= 0;
+      last = output[idx];
+    }
+  }
+  double rms = sqrt(sumSquares / (numOutput - PLAY_SAMPLES));
+  POS_TEST_CHECK(fabs(rms - 10000 / sqrt(2)) < 10000 / sqrt(2) * 0.01);
+  // played 0.1% fast, 1001 Hz
+  double seconds = (double)(numOutput - PLAY_SAMPLES) / SAMPLE_RATE;
+  POS_TEST_CHECK(fabs(numCrossings / seconds - 1001) < 2);
+}
+
+int main(void)
+{
+  test_drift();
+  test_drift_limit();
+  test_constant();
+  test_tone();
+  printf("audio asrc tests passed\n");
+  return 0;
+}
@@ -0,0 +1,228 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Encodes a tone with AAC-ELD at every packet time a controller may select and sends it
+// over a UDP loopback socket as a SRTP audio stream.  The receiving stream is set up
+// the way the camera sets up the return audio, verifies and decrypts every packet,
+// and the test walks the RFC 3640 AU header section and decodes each access unit with
+// fdk-aac.  Nothing may go missing: each packet carries rtpTime / 30 ms access units,
+// its RTP timestamp is the one of its first access unit, so it steps by exactly the
+// samples of the packet before, and what comes out of the decoder is the tone.
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aacdecoder_lib.h"
+
+#include "POSAudioEncoder.h"
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define SAMPLE_RATE 16000
+#define TONE_HZ 440
+#define TONE_AMPLITUDE 8000
+#define NUM_FRAMES 200
+#define FRAME_NS 30000000ull
+// granules the encoder may keep before its first access unit
+#define ENCODER_DELAY_FRAMES 2
+#define PAYLOAD_TYPE 110
+#define CAMERA_SSRC 0x0a0b0c0d
+#define CONTROLLER_SSRC 0x01020304
+
+static int16_t decoded[NUM_FRAMES * POS_AUDIO_AAC_FRAME_SAMPLES];
+
+// Power of frequency in samples, Goertzel
+static double Power(const int16_t *samples, size_t numSamples, double frequency)
+{
+  double coefficient = 2 * cos(2 * M_PI * frequency / SAMPLE_RATE);
+  double s1 = 0, s2 = 0;
+  for (size_t idx = 0; idx < numSamples; idx++)
+  {
+    double s0 = samples[idx] + coefficient * s1 - s2;
+    s2 = s1;
+    s1 = s0;
+  }
+  return (s1 * s1 + s2 * s2 - coefficient * s1 * s2) / numSamples;
+}
+
+static void test_packet_time(uint32_t rtpTimeMs)
+{
+  POSAudioEncoder encoder;
+  POSRTPStreamRef camera, controller;
+  AACENC_InfoStruct info;
+  POSRTPParameters cameraParameters = {.type = PAYLOAD_TYPE, .ssrc = CONTROLLER_SSRC, .maxBitRate = 24,
+                                       .RTCPInterval = 0.5f, .maximumMTU = 1378};
+  POSRTPParameters controllerParameters = {.type = PAYLOAD_TYPE, .ssrc = CAMERA_SSRC, .maxBitRate = 24,
+                                           .RTCPInterval = 0.5f, .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addrLen = sizeof(addr);
+  int bufferBytes = 1 << 20;
+  HAPTime startTime = 10000000000ull;
+
+  // a controller asking for 60 ms gets two 30 ms granules a packet, and never more than fit
+  uint32_t AUsPerPacket = rtpTimeMs / 30;
+  if (AUsPerPacket > POS_AUDIO_AAC_MAX_AUS_PER_PACKET)
+    AUsPerPacket = POS_AUDIO_AAC_MAX_AUS_PER_PACKET;
+  POS_TEST_CHECK(POSAudioEncoderOpen(&encoder, POS_AUDIO_CODEC_AAC_ELD, SAMPLE_RATE, rtpTimeMs, 24000, true) ==
+                 kHAPError_None);
+  POS_TEST_CHECK(encoder.frameSamples == POS_AUDIO_AAC_FRAME_SAMPLES);
+  POS_TEST_CHECK(encoder.aacAUsPerPacket == AUsPerPacket);
+
+  // decode with the AudioSpecificConfig the encoder put out
+  HANDLE_AACDECODER decoder = aacDecoder_Open(TT_MP4_RAW, 1);
+  POS_TEST_CHECK(decoder != NULL);
+  POS_TEST_CHECK(aacEncInfo(encoder.aac, &info) == AACENC_OK);
+  UCHAR *conf[] = {info.confBuf};
+  UINT confBytes[] = {info.confSize};
+  POS_TEST_CHECK(aacDecoder_ConfigRaw(decoder, conf, confBytes) == AAC_DEC_OK);
+
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x5a, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0xa5, 14);
+  POSRTPStreamStart(&camera, &cameraParameters, RTPType_Simple, SAMPLE_RATE, CAMERA_SSRC, startTime,
+                    "positron-test", &srtpParameters, &srtpParameters);
+  POSRTPStreamStart(&controller, &controllerParameters, RTPType_Simple, SAMPLE_RATE, CONTROLLER_SSRC, startTime,
+                    "positron-test", &srtpParameters, &srtpParameters);
+
+  int rx = socket(AF_INET, SOCK_DGRAM, 0);
+  int tx = socket(AF_INET, SOCK_DGRAM, 0);
+  POS_TEST_CHECK(rx >= 0 && tx >= 0);
+  setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+  POS_TEST_CHECK(bind(rx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  POS_TEST_CHECK(getsockname(rx, (struct sockaddr *)&addr, &addrLen) == 0);
+  POS_TEST_CHECK(connect(tx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+  uint32_t numPackets = 0;
+  uint32_t numAUs = 0;
+  uint32_t firstTimeStamp = 0;
+  uint16_t firstSeq = 0;
+  size_t numDecoded = 0;
+  double phase = 0;
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    int16_t samples[POS_AUDIO_AAC_FRAME_SAMPLES];
+    uint8_t payload[POS_AUDIO_AAC_MAX_AUS_PER_PACKET * POS_AUDIO_AAC_MAX_AU_BYTES + 16];
+    uint8_t packet[sizeof(payload) + 32];
+    uint64_t payloadTime = 0;
+    size_t numPayloadBytes;
+    size_t numPacketBytes;
+
+    for (size_t idx = 0; idx < POS_AUDIO_AAC_FRAME_SAMPLES; idx++)
+    {
+      samples[idx] = (int16_t)(TONE_AMPLITUDE * sin(phase));
+      phase += 2 * M_PI * TONE_HZ / SAMPLE_RATE;
+    }
+    uint64_t sampleTime = startTime + frame * FRAME_NS;
+    size_t numBytes = POSAudioEncoderEncode(&encoder, samples, POS_AUDIO_AAC_FRAME_SAMPLES, sampleTime, payload,
+                                            sizeof(payload), &payloadTime);
+    if (numBytes == 0)
+      continue;
+    // the packet is stamped with its first granule, the one encoded AUsPerPacket - 1 frames ago
+    POS_TEST_CHECK(payloadTime == sampleTime - (AUsPerPacket - 1) * FRAME_NS);
+
+    POSRTPStreamPushPayload(&camera, payload, numBytes, &numPayloadBytes, payloadTime, sampleTime);
+    POSRTPStreamPollPacket(&camera, packet, sizeof(packet), &numPacketBytes);
+    POS_TEST_CHECK(numPacketBytes > 0);
+    POS_TEST_CHECK(send(tx, packet, numPacketBytes, 0) == (ssize_t)numPacketBytes);
+
+    // the controller's end
+    ssize_t ret = recv(rx, packet, sizeof(packet), 0);
+    POS_TEST_CHECK(ret == (ssize_t)numPacketBytes);
+    uint16_t seq = (uint16_t)(packet[2] << 8 | packet[3]);
+    uint32_t timeStamp = (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+    if (numPackets == 0)
+    {
+      firstSeq = seq;
+      firstTimeStamp = timeStamp;
+    }
+    POS_TEST_CHECK(seq == (uint16_t)(firstSeq + numPackets));
+    POS_TEST_CHECK(timeStamp - firstTimeStamp == numPackets * AUsPerPacket * POS_AUDIO_AAC_FRAME_SAMPLES);
+
+    HAPTimeNS receivedTime;
+    POSRTPStreamPushPacket(&controller, packet, (size_t)ret, &numPayloadBytes, sampleTime);
+    POS_TEST_CHECK(numPayloadBytes == numBytes);
+    numPayloadBytes = 0;
+    POSRTPStreamPollPayload(&controller, payload, sizeof(payload), &numPayloadBytes, &receivedTime);
+    POS_TEST_CHECK(numPayloadBytes == numBytes);
+    numPackets++;
+
+    // RFC 3640 s3.2.1, a 13 bit AU-size and a 3 bit AU-Index(-delta) of 0 per access unit
+    size_t headerBits = (size_t)payload[0] << 8 | payload[1];
+    POS_TEST_CHECK(headerBits == AUsPerPacket * 16);
+    size_t offset = 2 + headerBits / 8;
+    for (uint32_t au = 0; au < AUsPerPacket; au++)
+    {
+      uint16_t header = (uint16_t)(payload[2 + au * 2] << 8 | payload[3 + au * 2]);
+      UINT auBytes = header >> 3;
+      POS_TEST_CHECK((header & 7) == 0);
+      POS_TEST_CHECK(auBytes > 0 && offset + auBytes <= numBytes);
+
+      UCHAR *auData[] = {payload + offset};
+      UINT bytesValid = auBytes;
+      POS_TEST_CHECK(aacDecoder_Fill(decoder, auData, &auBytes, &bytesValid) == AAC_DEC_OK);
+      POS_TEST_CHECK(bytesValid == 0);
+      POS_TEST_CHECK(aacDecoder_DecodeFrame(decoder, &decoded[numDecoded], POS_AUDIO_AAC_FRAME_SAMPLES, 0) ==
+                     AAC_DEC_OK);
+      numDecoded += POS_AUDIO_AAC_FRAME_SAMPLES;
+      offset += auBytes;
+      numAUs++;
+    }
+    POS_TEST_CHECK(offset == numBytes);
+  }
+
+  // less than a packet's worth of granules still waiting, and what fdk-aac holds back
+  POS_TEST_CHECK(numAUs + AUsPerPacket + ENCODER_DELAY_FRAMES > NUM_FRAMES);
+  POS_TEST_CHECK(numAUs == numPackets * AUsPerPacket);
+  CStreamInfo *streamInfo = aacDecoder_GetStreamInfo(decoder);
+  POS_TEST_CHECK(streamInfo != NULL && streamInfo->sampleRate == SAMPLE_RATE);
+
+  // the tone, once the decoder delay is over
+  size_t settled = numDecoded / 4;
+  size_t numSettled = numDecoded - settled;
+  double tonePower = Power(&decoded[settled], numSettled, TONE_HZ);
+  double otherPower = Power(&decoded[settled], numSettled, 3 * TONE_HZ + 100);
+  double expectedPower = (double)TONE_AMPLITUDE * TONE_AMPLITUDE * numSettled / 4;
+  POS_TEST_CHECK(tonePower > expectedPower / 4 && tonePower < expectedPower * 4);
+  POS_TEST_CHECK(tonePower > otherPower * 100);
+  printf("%3u ms: %u packets of %u access units, %zu samples decoded\n", rtpTimeMs, numPackets, AUsPerPacket,
+         numDecoded);
+
+  close(rx);
+  close(tx);
+  aacDecoder_Close(decoder);
+  POSAudioEncoderClose(&encoder);
+  POSRTPStreamEnd(&camera);
+  POSRTPStreamEnd(&controller);
+}
+
+int main(void)
+{
+  test_packet_time(30);
+  test_packet_time(60);
+  test_packet_time(90);
+  test_packet_time(120);
+  test_packet_time(150);
+  return 0;
+}
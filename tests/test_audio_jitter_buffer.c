@@ -0,0 +1,315 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Loopback harness for POSAudioJitterBuffer: 20 ms packets go through a virtual
+// network with delay, jitter, reordering and loss into the jitter buffer, and a
+// virtual speaker drains what it hands out in real time.
+
+#include <string.h>
+
+#include "POSAudioJitterBuffer.h"
+
+#include "pos_test.h"
+
+#define MS ((HAPTime)1000000)
+
+#define CLOCK_RATE 16000
+#define PACKET_MS 20
+#define POP_MS 10
+#define LEAD_MS 30
+#define MAX_PACKETS 4000
+
+typedef struct
+{
+    // network, per packet
+    uint32_t delayMs[MAX_PACKETS]; // from sending to arrival
+    bool lost[MAX_PACKETS];
+    uint32_t numPackets;
+    uint32_t pauseFrom;            // packets from here to pauseTo aren't sent, a gap in talking
+    uint32_t pauseTo;
+    // results
+    uint32_t numPlayed;
+    uint32_t lastPlayed;
+    bool outOfOrder;
+    uint32_t numConcealed;
+    uint32_t numConcealedWithNext;
+    uint32_t numStretched;
+    uint32_t numDropped;
+    uint32_t numRebuffers;  // not counting the one after the end of the stream
+    uint32_t numUnderruns;  // the speaker ran dry while playing
+    uint32_t maxBufferedMs; // once settled
+    uint32_t endBufferedMs; // when the last packet was handed out
+    uint32_t random;
+} Loopback;
+
+static uint32_t Random(Loopback *loop, uint32_t range)
+{
+  loop->random = loop->random * 1664525 + 1013904223;
+  return (loop->random >> 8) % range;
+}
+
+static bool Sent(const Loopback *loop, uint32_t packet)
+{
+  return !loop->lost[packet] && (packet < loop->pauseFrom || packet >= loop->pauseTo);
+}
+
+static void Run(Loopback *loop, POSAudioJitterBuffer *jb)
+{
+  // extended sequence numbers start near the 16 bit wrap, as they might from the controller
+  const uint32_t firstIndex = 65500;
+  uint32_t bufferedMs = 0;
+  uint8_t payload[8];
+
+  POSAudioJitterBufferInit(jb, CLOCK_RATE, LEAD_MS);
+  loop->lastPlayed = 0xffffffff;
+  HAPTime endMs = (HAPTime)loop->numPackets * PACKET_MS + 1000;
+  for (HAPTime nowMs = 1; nowMs < endMs; nowMs++)
+  {
+    // everything arriving in this ms, in arrival order
+    for (uint32_t packet = 0; packet < loop->numPackets; packet++)
+    {
+      if (!Sent(loop, packet) || (HAPTime)packet * PACKET_MS + loop->delayMs[packet] != nowMs)
+        continue;
+      memcpy(payload, &packet, sizeof packet);
+      memset(payload + sizeof packet, 0xa5, sizeof(payload) - sizeof packet);
+      uint32_t numRebuffers = jb->numRebuffers;
+      POSAudioJitterBufferInsert(jb, firstIndex + packet, packet * PACKET_MS * (CLOCK_RATE / 1000), payload,
+                                 sizeof(payload), nowMs * MS);
+      loop->numRebuffers += jb->numRebuffers - numRebuffers;
+    }
+    if (nowMs % POP_MS != 0)
+      continue;
+
+    // the speaker plays POP_MS since the last round
+    if (bufferedMs >= POP_MS)
+      bufferedMs -= POP_MS;
+    else
+    {
+      if (jb->playing)
+        loop->numUnderruns++;
+      bufferedMs = 0;
+    }
+
+    const uint8_t *bytes;
+    size_t numBytes;
+    for (;;)
+    {
+      uint32_t numRebuffers = jb->numRebuffers;
+      POSAudioJitterBufferAction action = POSAudioJitterBufferPop(jb, bufferedMs, nowMs * MS, &bytes, &numBytes);
+      if (jb->playIndex - firstIndex < loop->numPackets)
+        loop->numRebuffers += jb->numRebuffers - numRebuffers;
+      if (action == kPOSAudioJitterBuffer_Wait)
+        break;
+      if (action == kPOSAudioJitterBuffer_Play || action == kPOSAudioJitterBuffer_Drop)
+      {
+        uint32_t packet;
+        POS_TEST_CHECK(numBytes == sizeof(payload));
+        memcpy(&packet, bytes, sizeof packet);
+        if (loop->lastPlayed != 0xffffffff && packet <= loop->lastPlayed)
+          loop->outOfOrder = true;
+        loop->lastPlayed = packet;
+      }
+      if (action == kPOSAudioJitterBuffer_Play)
+        loop->numPlayed++;
+      if (action == kPOSAudioJitterBuffer_Drop)
+        loop->numDropped++;
+      if (action == kPOSAudioJitterBuffer_Stretch)
+        loop->numStretched++;
+      // past the end of the stream it conceals until it gives up, that isn't counted
+      if (action == kPOSAudioJitterBuffer_Conceal && jb->playIndex - 1 - firstIndex < loop->numPackets)
+      {
+        loop->numConcealed++;
+        if (bytes != NULL)
+        {
+          // the FEC source is the packet after the missing one
+          uint32_t packet;
+          memcpy(&packet, bytes, sizeof packet);
+          POS_TEST_CHECK(jb->playIndex == firstIndex + packet);
+          loop->numConcealedWithNext++;
+        }
+      }
+      if (action != kPOSAudioJitterBuffer_Drop)
+        bufferedMs += PACKET_MS;
+    }
+    if (nowMs > 5000 && nowMs < (HAPTime)loop->numPackets * PACKET_MS && bufferedMs > loop->maxBufferedMs)
+      loop->maxBufferedMs = bufferedMs;
+    if (loop->lastPlayed == loop->numPackets - 1 && loop->endBufferedMs == 0)
+      loop->endBufferedMs = bufferedMs;
+  }
+}
+
+// A constant 40 ms path plays every packet in order, without touching it
+static void test_clean_network(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.numPackets = 1000;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+    loop.delayMs[packet] = 40;
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(loop.numPlayed == loop.numPackets);
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(loop.numConcealed == 0 && loop.numDropped == 0 && loop.numStretched == 0);
+  POS_TEST_CHECK(loop.numUnderruns == 0);
+  POS_TEST_CHECK(jb.packetMs == PACKET_MS);
+  POS_TEST_CHECK(POSAudioJitterBufferTargetDelayMs(&jb) == LEAD_MS);
+}
+
+// 0-60 ms of jitter reorders packets.  The target delay grows with it, late packets and
+// concealment stay rare once it has, and what plays is still in order.
+static void test_jitter(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.random = 1;
+  loop.numPackets = 3000;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+    loop.delayMs[packet] = 40 + Random(&loop, 61);
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(POSAudioJitterBufferTargetDelayMs(&jb) > LEAD_MS + 30);
+  POS_TEST_CHECK(POSAudioJitterBufferTargetDelayMs(&jb) < POS_AUDIO_JB_MAX_DELAY_MS);
+  POS_TEST_CHECK(loop.numPlayed + jb.numLate + loop.numDropped == loop.numPackets);
+  POS_TEST_CHECK(jb.numLate < loop.numPackets / 50);
+  POS_TEST_CHECK(loop.numConcealed < loop.numPackets / 50);
+  POS_TEST_CHECK(loop.numRebuffers == 0);
+}
+
+// Drops 5% of the packets, never two in a row and never the first or the last, those aren't gaps
+static uint32_t lose_packets(Loopback *loop)
+{
+  uint32_t numLost = 0;
+
+  for (uint32_t packet = 1; packet < loop->numPackets - 1; packet++)
+  {
+    loop->lost[packet] = !loop->lost[packet - 1] && Random(loop, 20) == 0;
+    numLost += loop->lost[packet];
+  }
+  return numLost;
+}
+
+// 5% loss on a steady path: each lost packet is concealed once and nothing else is disturbed.
+// The target delay is just the lead, so the gap runs the speaker low before the packet after
+// it is even sent and there is nothing for FEC.
+static void test_loss(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.random = 2;
+  loop.numPackets = 3000;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+    loop.delayMs[packet] = 40;
+  uint32_t numLost = lose_packets(&loop);
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(numLost > 100);
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(loop.numPlayed == loop.numPackets - numLost);
+  POS_TEST_CHECK(loop.numConcealed == numLost);
+  POS_TEST_CHECK(loop.numConcealedWithNext == 0);
+  POS_TEST_CHECK(loop.numUnderruns == 0 && jb.numLate == 0);
+}
+
+// 5% loss with jitter: the delay the jitter builds up gives the packet after a gap time to
+// arrive, so concealment mostly has it for FEC
+static void test_loss_with_jitter(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.random = 3;
+  loop.numPackets = 3000;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+    loop.delayMs[packet] = 40 + Random(&loop, 41);
+  uint32_t numLost = lose_packets(&loop);
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(loop.numConcealed >= numLost && loop.numConcealed < numLost + loop.numPackets / 50);
+  POS_TEST_CHECK(loop.numConcealedWithNext > loop.numConcealed / 2);
+  POS_TEST_CHECK(loop.numRebuffers == 0);
+}
+
+// A 200 ms delay spike: the speaker runs dry and the buffer rebuffers, then the packets
+// sent during the spike arrive in a burst and what is over the excess threshold is dropped
+// so the latency doesn't stay 200 ms up
+static void test_delay_spike(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.numPackets = 1000;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+  {
+    loop.delayMs[packet] = 40;
+    if (packet >= 300 && packet < 310)
+      loop.delayMs[packet] = (310 - packet) * PACKET_MS + 40;
+  }
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(loop.numDropped > 0);
+  POS_TEST_CHECK(loop.numPlayed + loop.numDropped + jb.numLate == loop.numPackets);
+  POS_TEST_CHECK(loop.lastPlayed == loop.numPackets - 1);
+  POS_TEST_CHECK(loop.numRebuffers == 1);
+  // the excess threshold counts the packets held back too, the speaker can be a packet or two over it
+  uint32_t limitMs = POSAudioJitterBufferTargetDelayMs(&jb) + POS_AUDIO_JB_EXCESS_MS + 2 * PACKET_MS;
+  POS_TEST_CHECK(loop.maxBufferedMs <= limitMs && loop.endBufferedMs <= limitMs);
+}
+
+// The controller stops talking for two seconds, the buffer rebuffers once and plays the next talkspurt
+static void test_talkspurts(void)
+{
+  static Loopback loop;
+  static POSAudioJitterBuffer jb;
+
+  memset(&loop, 0, sizeof loop);
+  loop.numPackets = 1000;
+  loop.pauseFrom = 400;
+  loop.pauseTo = 500;
+  for (uint32_t packet = 0; packet < loop.numPackets; packet++)
+    loop.delayMs[packet] = 40;
+  Run(&loop, &jb);
+
+  POS_TEST_CHECK(!loop.outOfOrder);
+  POS_TEST_CHECK(loop.numPlayed == loop.numPackets - (loop.pauseTo - loop.pauseFrom));
+  POS_TEST_CHECK(loop.numRebuffers == 1);
+  // only the gap up to the rebuffer is concealed
+  POS_TEST_CHECK(loop.numConcealed * PACKET_MS <= POS_AUDIO_JB_MAX_CONCEAL_MS + PACKET_MS);
+}
+
+int main(void)
+{
+  test_clean_network();
+  test_jitter();
+  test_loss();
+  test_loss_with_jitter();
+  test_delay_spike();
+  test_talkspurts();
+  printf("audio jitter buffer tests passed\n");
+  return 0;
+}
@@ -0,0 +1,225 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the speaker frame ring between a producer and a consumer thread, the return
+// audio decoder and the speaker thread on the camera.  The producer writes bursts of
+// sequence numbered, timestamped frames and backs off when the ring is full, the
+// consumer checks every frame arrives once, in order and intact, and collects the
+// enqueue to dequeue latency into a histogram.  A single threaded test first checks
+// the eventfd is only signalled when the ring goes from empty to non-empty.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "POSRingBufferAudioOut.h"
+
+#include "pos_test.h"
+
+#define NUM_SLOTS 16
+#define FRAME_BYTES 64
+#define NUM_FRAMES 200000
+#define MAX_BURST 32
+
+typedef struct
+{
+  uint32_t seq;
+  uint32_t pad;
+  uint64_t enqueueNs;
+  uint8_t fill[FRAME_BYTES - 16];
+} TestFrame;
+
+static uint8_t storage[NUM_SLOTS * FRAME_BYTES];
+static ring_buffer_ao_t ring = {.event_fd = -1};
+static uint32_t numFull;
+
+static const int bucketUs[] = {1, 4, 16, 64, 256, 1000, 4000};
+#define NUM_BUCKETS (sizeof(bucketUs) / sizeof(bucketUs[0]) + 1)
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Returns the value of the eventfd counter and clears it, 0 if nothing was signalled
+static uint64_t take_wakeups(void)
+{
+  uint64_t count;
+  if (read(ring.event_fd, &count, sizeof(count)) != sizeof(count))
+  {
+    POS_TEST_CHECK(errno == EAGAIN);
+    return 0;
+  }
+  return count;
+}
+
+static void put(uint32_t seq)
+{
+  TestFrame *frame = ring_buffer_ao_write_slot(&ring);
+  POS_TEST_CHECK(frame != NULL);
+  frame->seq = seq;
+  ring_buffer_ao_commit_write(&ring);
+}
+
+static uint32_t get(void)
+{
+  const TestFrame *frame = ring_buffer_ao_read_slot(&ring, 0);
+  POS_TEST_CHECK(frame != NULL);
+  uint32_t seq = frame->seq;
+  ring_buffer_ao_commit_read(&ring);
+  return seq;
+}
+
+static void test_wakeups(void)
+{
+  POS_TEST_CHECK(ring_buffer_ao_init(&ring, storage, FRAME_BYTES, NUM_SLOTS) == 0);
+  POS_TEST_CHECK(ring.event_fd >= 0);
+  POS_TEST_CHECK(ring_buffer_ao_read_slot(&ring, 0) == NULL);
+
+  // Only the first of three frames into an empty ring signals
+  put(1);
+  put(2);
+  put(3);
+  POS_TEST_CHECK(take_wakeups() == 1);
+
+  // Nor does a frame while the consumer is behind
+  POS_TEST_CHECK(get() == 1);
+  put(4);
+  POS_TEST_CHECK(take_wakeups() == 0);
+
+  // Once drained the next frame signals again
+  POS_TEST_CHECK(get() == 2);
+  POS_TEST_CHECK(get() == 3);
+  POS_TEST_CHECK(get() == 4);
+  POS_TEST_CHECK(ring_buffer_ao_read_slot(&ring, 0) == NULL);
+  POS_TEST_CHECK(take_wakeups() == 0);
+  put(5);
+  POS_TEST_CHECK(take_wakeups() == 1);
+
+  // Every slot is usable, the one after is an overrun
+  for (uint32_t seq = 6; seq < 5 + NUM_SLOTS; seq++)
+    put(seq);
+  POS_TEST_CHECK(ring_buffer_ao_num_items(&ring) == NUM_SLOTS);
+  POS_TEST_CHECK(take_wakeups() == 0);
+  POS_TEST_CHECK(ring_buffer_ao_write_slot(&ring) == NULL);
+  POS_TEST_CHECK(ring.overruns == 1);
+  for (uint32_t seq = 5; seq < 5 + NUM_SLOTS; seq++)
+    POS_TEST_CHECK(get() == seq);
+
+  // A reset drops a wakeup nobody picked up
+  put(1);
+  POS_TEST_CHECK(ring_buffer_ao_init(&ring, storage, FRAME_BYTES, NUM_SLOTS) == 0);
+  POS_TEST_CHECK(take_wakeups() == 0);
+  POS_TEST_CHECK(ring_buffer_ao_num_items(&ring) == 0);
+  POS_TEST_CHECK(ring.overruns == 0);
+}
+
+static void *ProducerThread(void *context)
+{
+  uint32_t rng = 0x12345678;
+  uint32_t seq = 0;
+  (void)context;
+
+  while (seq < NUM_FRAMES)
+  {
+    rng = rng * 1664525 + 1013904223;
+    uint32_t burst = 1 + (rng >> 16) % MAX_BURST;
+    for (uint32_t idx = 0; idx < burst && seq < NUM_FRAMES; idx++)
+    {
+      TestFrame *frame;
+      while ((frame = ring_buffer_ao_write_slot(&ring)) == NULL)
+      {
+        numFull++;
+        sched_yield();
+      }
+      frame->seq = seq;
+      for (size_t byte = 0; byte < sizeof(frame->fill); byte++)
+        frame->fill[byte] = (uint8_t)(seq + byte);
+      frame->enqueueNs = now_ns();
+      ring_buffer_ao_commit_write(&ring);
+      seq++;
+    }
+    // Sometimes let the consumer drain the ring and go to sleep
+    if ((rng >> 8) % 4 == 0)
+      usleep(50);
+  }
+  return NULL;
+}
+
+int main(void)
+{
+  uint64_t histogram[NUM_BUCKETS] = {0};
+  uint64_t maxLatencyNs = 0;
+  uint32_t numSleeps = 0;
+  pthread_t producer;
+
+  test_wakeups();
+
+  POS_TEST_CHECK(ring_buffer_ao_init(&ring, storage, FRAME_BYTES, NUM_SLOTS) == 0);
+  POS_TEST_CHECK(pthread_create(&producer, NULL, ProducerThread, NULL) == 0);
+
+  for (uint32_t seq = 0; seq < NUM_FRAMES; seq++)
+  {
+    if (ring_buffer_ao_num_items(&ring) == 0)
+      numSleeps++;
+    // A lost wakeup leaves the consumer waiting here
+    const TestFrame *frame = ring_buffer_ao_read_slot(&ring, 1000);
+    POS_TEST_CHECK(frame != NULL);
+    uint64_t latencyNs = now_ns() - frame->enqueueNs;
+    POS_TEST_CHECK(frame->seq == seq);
+    for (size_t byte = 0; byte < sizeof(frame->fill); byte++)
+      POS_TEST_CHECK(frame->fill[byte] == (uint8_t)(seq + byte));
+    ring_buffer_ao_commit_read(&ring);
+
+    size_t bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 && latencyNs >= (uint64_t)bucketUs[bucket] * 1000)
+      bucket++;
+    histogram[bucket]++;
+    if (latencyNs > maxLatencyNs)
+      maxLatencyNs = latencyNs;
+
+    // Now and then fall behind so the producer finds the ring full
+    if (seq % 1024 == 1023)
+      usleep(200);
+  }
+  POS_TEST_CHECK(pthread_join(producer, NULL) == 0);
+  POS_TEST_CHECK(ring_buffer_ao_num_items(&ring) == 0);
+  POS_TEST_CHECK(ring_buffer_ao_read_slot(&ring, 0) == NULL);
+  POS_TEST_CHECK(ring.overruns == numFull);
+  POS_TEST_CHECK(numFull > 0);
+  POS_TEST_CHECK(numSleeps > 0);
+
+  printf("%u frames, %u times the consumer found the ring empty, %u times the producer found it full\n",
+         NUM_FRAMES, numSleeps, numFull);
+  printf("enqueue to dequeue latency:\n");
+  for (size_t bucket = 0; bucket < NUM_BUCKETS; bucket++)
+  {
+    if (bucket < NUM_BUCKETS - 1)
+      printf("  < %5d us %8llu\n", bucketUs[bucket], (unsigned long long)histogram[bucket]);
+    else
+      printf("  >=%5d us %8llu\n", bucketUs[bucket - 1], (unsigned long long)histogram[bucket]);
+  }
+  printf("  max %llu us\n", (unsigned long long)(maxLatencyNs / 1000));
+  return 0;
+}
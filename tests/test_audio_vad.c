@@ -0,0 +1,346 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs a day and a night recording fixture through the audio thread's silence suppression:
+// speech bursts over street noise that steps up with traffic and a fan, and over the near
+// silence of a night.  Each codec encodes the fixture once with every frame sent and once
+// gated by POSAudioVAD with RFC 3389 comfort noise in the gaps, the way
+// get_srtp_audio_stream does.  No frame where the speech stands out of the noise may be
+// suppressed and the noise between the bursts must be.  The comfort noise has to carry the
+// level of the floor, the first packet of a talkspurt has the marker and nothing older, and
+// every timestamp follows the capture clock.  Prints the share suppressed, the packets,
+// bytes on the wire and CPU time with and without the detector.
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "POSAudioEncoder.h"
+#include "POSAudioVAD.h"
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define SAMPLE_RATE 16000
+#define SCENE_SECONDS 60
+#define SCENE_SAMPLES (SCENE_SECONDS * SAMPLE_RATE)
+#define PAYLOAD_TYPE 110
+#define CN_PAYLOAD_TYPE 13
+#define MTU 1378
+// HMAC-SHA1-80
+#define TAG_BYTES 10
+// IPv4 and UDP headers
+#define IP_UDP_BYTES 28
+// as in POSCameraController.c
+#define AUDIO_CN_REFRESH_NS 1000000000ULL
+#define AUDIO_CN_LEVEL_CHANGE_DB 3
+#define START_TIME_NS 10000000000ull
+// the floor needs this long to settle at the start and after the noise steps up
+#define SETTLE_SECONDS 3
+#define NUM_FLOORS 3
+
+typedef struct
+{
+  const char *name;
+  // the noise steps up at these seconds, to these RMS in int16 units
+  struct
+  {
+    uint32_t second;
+    double noiseRMS;
+  } floors[NUM_FLOORS];
+  uint32_t burstPeriodMs;
+  uint32_t burstMs;
+  double speechRMS;
+  // what the suppression has to reach, bytes depend on how well the codec squeezes the noise
+  uint32_t minSuppressedPercent;
+  uint32_t minBytesSavedPercent;
+} Scene;
+
+static const Scene scenes[] = {
+    // traffic picks up, then a fan turns on, 7 dB is more than the floor may follow at once
+    {"day", {{0, 184}, {13, 260}, {31, 582}}, 6000, 1500, 3300, 60, 40},
+    // the heating comes on
+    {"night", {{0, 6}, {33, 9}, {SCENE_SECONDS, 9}}, 10000, 1000, 3300, 80, 40},
+};
+
+typedef struct
+{
+  uint32_t numFrames;
+  uint32_t numSuppressed;
+  uint32_t numPackets;
+  uint32_t numCNPackets;
+  uint64_t wireBytes;
+  double cpuSeconds;
+} Result;
+
+static int16_t fixture[SCENE_SAMPLES];
+// the speech alone, to tell which frames have to be sent
+static int16_t speechOnly[SCENE_SAMPLES];
+
+static uint32_t Random(uint32_t *state)
+{
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static bool InBurst(const Scene *scene, size_t sample)
+{
+  return sample * 1000 / SAMPLE_RATE % scene->burstPeriodMs >= scene->burstPeriodMs - scene->burstMs;
+}
+
+static double NoiseRMS(const Scene *scene, size_t sample)
+{
+  int floor = NUM_FLOORS - 1;
+  while (sample < (size_t)scene->floors[floor].second * SAMPLE_RATE)
+    floor--;
+  return scene->floors[floor].noiseRMS;
+}
+
+// Whether the floor had SETTLE_SECONDS since the noise last stepped
+static bool Settled(const Scene *scene, size_t sample)
+{
+  for (int floor = 0; floor < NUM_FLOORS; floor++)
+  {
+    size_t step = (size_t)scene->floors[floor].second * SAMPLE_RATE;
+    if (sample >= step && sample < step + SETTLE_SECONDS * SAMPLE_RATE)
+      return false;
+  }
+  return true;
+}
+
+// -dBov of the floor, the scale POSAudioVADNoiseLevel uses
+static double NoiseLevel(const Scene *scene, size_t sample)
+{
+  double rms = NoiseRMS(scene, sample);
+  return 10 * log10((double)(1 << 30) / (rms * rms));
+}
+
+// Voiced speech, harmonics of a wandering pitch, four syllables a second, over gaussian noise
+static void MakeFixture(const Scene *scene)
+{
+  uint32_t random = 7;
+  double phase = 0;
+
+  for (size_t idx = 0; idx < SCENE_SAMPLES; idx++)
+  {
+    double t = (double)idx / SAMPLE_RATE;
+    // sum of 12 uniform values, close enough to gaussian, unit variance
+    double noise = -6;
+    for (int n = 0; n < 12; n++)
+      noise += (Random(&random) & 0xffff) / 65536.0;
+    double sample = noise * NoiseRMS(scene, idx);
+
+    speechOnly[idx] = 0;
+    if (InBurst(scene, idx))
+    {
+      double speech = 0;
+      double envelope = 0.55 - 0.45 * cos(2 * M_PI * 4 * t);
+      phase += 2 * M_PI * (140 + 20 * sin(2 * M_PI * 0.7 * t)) / SAMPLE_RATE;
+      for (int harmonic = 1; harmonic <= 20; harmonic++)
+        speech += sin(harmonic * phase) / harmonic;
+      // the harmonics sum to an RMS of about 0.9
+      speech = scene->speechRMS * envelope * speech / 0.9;
+      speechOnly[idx] = (int16_t)lrint(speech);
+      sample += speech;
+    }
+    if (sample > 32767)
+      sample = 32767;
+    if (sample < -32768)
+      sample = -32768;
+    fixture[idx] = (int16_t)lrint(sample);
+  }
+}
+
+static double ThreadSeconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Packetizes and protects one payload like send_audio_payload, and checks the RTP header
+static void SendPayload(POSRTPStreamRef *stream, uint8_t *bytes, size_t numBytes, uint8_t payloadType,
+                        bool markerBit, uint64_t sampleTime, uint32_t clockRate, Result *result)
+{
+  static uint32_t firstTimeStamp;
+  uint8_t packet[2048];
+  size_t numPayloadBytes = 0;
+
+  POSRTPStreamPushPayloadAs(stream, bytes, numBytes, &numPayloadBytes, payloadType, markerBit, sampleTime,
+                            sampleTime);
+  while (numPayloadBytes > 0)
+  {
+    size_t numPacketBytes = 0;
+    POSRTPStreamPollPacket(stream, packet, sizeof(packet), &numPacketBytes);
+    if (numPacketBytes == 0)
+      break;
+    POS_TEST_CHECK(numPacketBytes == 12 + numBytes + TAG_BYTES);
+    POS_TEST_CHECK((packet[1] & 0x7f) == payloadType);
+    POS_TEST_CHECK(((packet[1] & 0x80) != 0) == markerBit);
+
+    // comfort noise and audio share the capture clock, RFC 3389 s4
+    uint32_t timeStamp =
+        (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+    if (result->numPackets == 0)
+      firstTimeStamp = timeStamp - (uint32_t)((sampleTime - START_TIME_NS) * clockRate / 1000000000ull);
+    int32_t drift =
+        (int32_t)(timeStamp - firstTimeStamp - (uint32_t)((sampleTime - START_TIME_NS) * clockRate / 1000000000ull));
+    POS_TEST_CHECK(drift >= -1 && drift <= 1);
+
+    result->numPackets++;
+    result->wireBytes += IP_UDP_BYTES + numPacketBytes;
+  }
+}
+
+static void RunScene(const Scene *scene, uint16_t codecType, uint32_t rtpTimeMs, bool suppress, Result *result)
+{
+  POSAudioEncoder encoder;
+  POSAudioVAD vad;
+  POSRTPStreamRef stream;
+  POSSRTPParameters srtpParameters;
+  uint32_t clockRate = POSAudioEncoderRTPClockRate(codecType, SAMPLE_RATE);
+  POSRTPParameters rtpParameters = {.type = PAYLOAD_TYPE, .ssrc = 0x01020304, .maxBitRate = 24, .RTCPInterval = 0.5f,
+                                    .maximumMTU = MTU};
+  uint8_t payload[POS_AUDIO_AAC_MAX_AUS_PER_PACKET * POS_AUDIO_AAC_MAX_AU_BYTES + 16];
+  bool silent = false;
+  bool talkspurt = true;
+  uint64_t lastComfortNoise = 0;
+  uint8_t lastComfortNoiseLevel = 0;
+  uint64_t talkspurtTime = START_TIME_NS;
+  size_t lastSpeechEnd = 0;
+
+  memset(result, 0, sizeof(*result));
+  POS_TEST_CHECK(POSAudioEncoderOpen(&encoder, codecType, SAMPLE_RATE, rtpTimeMs, 24000, true) == kHAPError_None);
+  uint32_t frameMs = encoder.frameSamples * 1000 / encoder.sampleRate;
+  POSAudioVADInit(&vad, frameMs);
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x5a, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0xa5, 14);
+  POSRTPStreamStart(&stream, &rtpParameters, RTPType_Simple, clockRate, 0x0a0b0c0d, START_TIME_NS, "positron-test",
+                    &srtpParameters, &srtpParameters);
+
+  for (size_t start = 0; start + encoder.frameSamples <= SCENE_SAMPLES; start += encoder.frameSamples)
+  {
+    const int16_t *samples = fixture + start;
+    uint64_t sampleTime = START_TIME_NS + (uint64_t)start * 1000000000ull / SAMPLE_RATE;
+    // speech that lifts the frame 3 dB clear of POS_AUDIO_VAD_THRESHOLD_SHIFT above the noise,
+    // the floor creeps up about that much under a burst
+    double speechEnergy = 0;
+    for (size_t idx = 0; idx < encoder.frameSamples; idx++)
+      speechEnergy += (double)speechOnly[start + idx] * speechOnly[start + idx];
+    bool speech = speechEnergy / encoder.frameSamples >
+                  ((2 << POS_AUDIO_VAD_THRESHOLD_SHIFT) - 1) * NoiseRMS(scene, start) * NoiseRMS(scene, start);
+    double cpuStart = ThreadSeconds();
+
+    bool inBurst = InBurst(scene, start) || InBurst(scene, start + encoder.frameSamples - 1);
+    if (inBurst)
+      lastSpeechEnd = start + encoder.frameSamples;
+    result->numFrames++;
+    if (suppress && !POSAudioVADProcess(&vad, samples, encoder.frameSamples))
+    {
+      uint8_t level = POSAudioVADNoiseLevel(&vad);
+
+      POS_TEST_CHECK(!speech);
+      result->numSuppressed++;
+      if (!silent || sampleTime - lastComfortNoise >= AUDIO_CN_REFRESH_NS ||
+          level >= lastComfortNoiseLevel + AUDIO_CN_LEVEL_CHANGE_DB ||
+          level + AUDIO_CN_LEVEL_CHANGE_DB <= lastComfortNoiseLevel)
+      {
+        SendPayload(&stream, &level, sizeof level, CN_PAYLOAD_TYPE, false, sampleTime, clockRate, result);
+        result->numCNPackets++;
+        // once the floor has settled the controller plays noise of the right loudness
+        bool settled = Settled(scene, start);
+        if (settled)
+        {
+          // the first one carries what the burst left of the floor, the refreshes the floor itself,
+          // both a whole dB under the -dBov they are rounded from
+          double error = fabs(level - NoiseLevel(scene, start));
+          POS_TEST_CHECK(error < (silent ? 2 : AUDIO_CN_LEVEL_CHANGE_DB + 1));
+        }
+        lastComfortNoise = sampleTime;
+        lastComfortNoiseLevel = level;
+      }
+      POSAudioEncoderFlush(&encoder);
+      silent = true;
+      talkspurt = true;
+    }
+    else
+    {
+      uint64_t payloadTime = 0;
+
+      if (silent)
+        talkspurtTime = sampleTime;
+      silent = false;
+      size_t numBytes = POSAudioEncoderEncode(&encoder, samples, encoder.frameSamples, sampleTime, payload,
+                                              sizeof(payload), &payloadTime);
+      if (numBytes > 0)
+      {
+        // nothing packed before the silence comes along
+        POS_TEST_CHECK(payloadTime >= talkspurtTime);
+        SendPayload(&stream, payload, numBytes, PAYLOAD_TYPE, suppress && talkspurt, payloadTime, clockRate, result);
+        talkspurt = false;
+      }
+      // the noise between bursts goes once the hangover has run out
+      bool settled = Settled(scene, start);
+      if (suppress && settled && !inBurst)
+        POS_TEST_CHECK((start - lastSpeechEnd) * 1000 / SAMPLE_RATE < POS_AUDIO_VAD_HANGOVER_MS + frameMs);
+    }
+    result->cpuSeconds += ThreadSeconds() - cpuStart;
+  }
+  POSRTPStreamEnd(&stream);
+  POSAudioEncoderClose(&encoder);
+}
+
+int main(void)
+{
+  static const struct
+  {
+    const char *name;
+    uint16_t type;
+    uint32_t rtpTimeMs;
+  } codecs[] = {{"AAC-ELD", POS_AUDIO_CODEC_AAC_ELD, 60}, {"Opus", POS_AUDIO_CODEC_OPUS, 20}};
+
+  printf("%-6s %-8s %-6s %10s %8s %4s %11s %6s %8s\n", "scene", "codec", "", "suppressed", "packets", "CN",
+         "wire bytes", "saved", "cpu ms");
+  for (size_t s = 0; s < sizeof(scenes) / sizeof(scenes[0]); s++)
+  {
+    const Scene *scene = &scenes[s];
+    MakeFixture(scene);
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++)
+    {
+      Result all, gated;
+      RunScene(scene, codecs[c].type, codecs[c].rtpTimeMs, false, &all);
+      RunScene(scene, codecs[c].type, codecs[c].rtpTimeMs, true, &gated);
+
+      uint32_t suppressedPercent = gated.numSuppressed * 100 / gated.numFrames;
+      uint32_t bytesSavedPercent = (uint32_t)((all.wireBytes - gated.wireBytes) * 100 / all.wireBytes);
+      printf("%-6s %-8s %-6s %10s %8u %4s %11llu %6s %8.1f\n", scene->name, codecs[c].name, "all", "", all.numPackets,
+             "", (unsigned long long)all.wireBytes, "", all.cpuSeconds * 1000);
+      printf("%-6s %-8s %-6s %9u%% %8u %4u %11llu %5u%% %8.1f\n", "", "", "VAD", suppressedPercent, gated.numPackets,
+             gated.numCNPackets, (unsigned long long)gated.wireBytes, bytesSavedPercent, gated.cpuSeconds * 1000);
+
+      POS_TEST_CHECK(all.numSuppressed == 0 && all.numCNPackets == 0);
+      POS_TEST_CHECK(suppressedPercent >= scene->minSuppressedPercent);
+      POS_TEST_CHECK(bytesSavedPercent >= scene->minBytesSavedPercent);
+      POS_TEST_CHECK(gated.numPackets < all.numPackets);
+      // at most one refresh a second plus the onsets and level steps
+      POS_TEST_CHECK(gated.numCNPackets <= SCENE_SECONDS + 2 * SCENE_SECONDS * 1000 / scene->burstPeriodMs);
+    }
+  }
+  return 0;
+}
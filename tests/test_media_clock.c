@@ -0,0 +1,224 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feeds POSMediaClock readings from virtual clocks, a sensor timer that drifts and
+// jitters against CLOCK_MONOTONIC and a wall clock that gets stepped, and checks
+// that media times stay continuous.
+
+#include <string.h>
+
+#include <imp/imp_system.h>
+
+#include "POSMediaClock.h"
+
+#include "pos_test.h"
+
+#define US ((int64_t)1000)
+#define MS ((int64_t)1000000)
+#define SECONDS ((int64_t)1000000000)
+
+// 2023-11-14 in Unix ns, so the NTP conversion sees a realistic wall clock
+#define WALL_CLOCK_START ((int64_t)1700000000 * SECONDS)
+
+typedef struct
+{
+    int64_t monotonic;
+    int64_t realtimeOffset;
+    int64_t sensorBaseUs; // sensor reading at monotonic 0
+    int32_t sensorPPM;    // how much faster the sensor timer runs
+    uint32_t random;
+} VirtualClocks;
+
+static int64_t SensorUs(const VirtualClocks *clocks, int64_t monotonic)
+{
+  return clocks->sensorBaseUs + (monotonic + monotonic / 1000000 * clocks->sensorPPM) / US;
+}
+
+// Deterministic +-maxUs of scheduling noise between reading the clocks
+static int64_t Jitter(VirtualClocks *clocks, int64_t maxUs)
+{
+  clocks->random = clocks->random * 1664525 + 1013904223;
+  return (int64_t)(clocks->random >> 8) % (2 * maxUs + 1) - maxUs;
+}
+
+static void Observe(POSMediaClock *clock, VirtualClocks *clocks, int64_t jitterUs)
+{
+  POSMediaClockObserve(clock, (HAPTime)clocks->monotonic, (HAPTime)(clocks->monotonic + clocks->realtimeOffset),
+                       SensorUs(clocks, clocks->monotonic) + Jitter(clocks, jitterUs));
+}
+
+static int64_t Abs(int64_t value)
+{
+  return value < 0 ? -value : value;
+}
+
+// A sensor timer 50 ppm fast, sampled once a frame with 200 us of noise, for ten minutes.
+// Frame times converted back to CLOCK_MONOTONIC stay close and never go backwards.
+static void test_sensor_drift(void)
+{
+  POSMediaClock clock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+  VirtualClocks clocks = {.monotonic = 100 * SECONDS, .realtimeOffset = WALL_CLOCK_START - 100 * SECONDS,
+                          .sensorBaseUs = 5000000, .sensorPPM = 50, .random = 1};
+  HAPTime lastFrameTime = 0;
+  int64_t maxError = 0;
+
+  for (int frame = 0; frame < 10 * 60 * 30; frame++)
+  {
+    clocks.monotonic += 33333333;
+    Observe(&clock, &clocks, 200);
+    // a frame captured a little before the sample, as the encoder hands it over
+    int64_t captured = clocks.monotonic - 5 * MS;
+    HAPTime frameTime = POSMediaClockFromSensor(&clock, SensorUs(&clocks, captured));
+    POS_TEST_CHECK(frameTime > lastFrameTime);
+    if (frame >= 30 && Abs((int64_t)frameTime - captured) > maxError)
+      maxError = Abs((int64_t)frameTime - captured);
+    lastFrameTime = frameTime;
+  }
+  // the smoothing lags the 1.7 us per frame drift by about 16 frames and averages the noise
+  POS_TEST_CHECK(maxError < 150 * US);
+  POS_TEST_CHECK(clock.sensorSteps == 0 && clock.realtimeSteps == 0);
+}
+
+// The wall clock steps an hour, as when ntpd first syncs.  Sender reports follow it at once,
+// media times don't move.
+static void test_wall_clock_step(void)
+{
+  POSMediaClock clock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+  VirtualClocks clocks = {.monotonic = 100 * SECONDS, .realtimeOffset = WALL_CLOCK_START - 100 * SECONDS,
+                          .sensorBaseUs = 5000000, .random = 2};
+
+  for (int frame = 0; frame < 100; frame++)
+  {
+    clocks.monotonic += 33333333;
+    Observe(&clock, &clocks, 0);
+  }
+  HAPTime frameTime = POSMediaClockFromSensor(&clock, SensorUs(&clocks, clocks.monotonic));
+  NTPEpochTime before = POSMediaClockToNTPTime(&clock, (HAPTime)clocks.monotonic);
+
+  clocks.realtimeOffset += 3600 * SECONDS;
+  Observe(&clock, &clocks, 0);
+  POS_TEST_CHECK(clock.realtimeSteps == 1);
+  NTPEpochTime after = POSMediaClockToNTPTime(&clock, (HAPTime)clocks.monotonic);
+  POS_TEST_CHECK((after >> 32) - (before >> 32) == 3600);
+  // within the us the sensor timestamps are rounded to
+  POS_TEST_CHECK(Abs((int64_t)POSMediaClockFromSensor(&clock, SensorUs(&clocks, clocks.monotonic)) -
+                     (int64_t)frameTime) < US);
+
+  // a 100 ms slew is smaller than a step and is smoothed in over a few seconds instead
+  clocks.realtimeOffset += 100 * MS;
+  Observe(&clock, &clocks, 0);
+  POS_TEST_CHECK(clock.realtimeSteps == 1);
+  POS_TEST_CHECK(Abs(clock.realtimeOffset - clocks.realtimeOffset) > 90 * MS);
+  for (int frame = 0; frame < 300; frame++)
+  {
+    clocks.monotonic += 33333333;
+    Observe(&clock, &clocks, 0);
+  }
+  POS_TEST_CHECK(Abs(clock.realtimeOffset - clocks.realtimeOffset) < 1 * MS);
+}
+
+// The IMP timer restarts, the offset is taken over from the next sample
+static void test_sensor_restart(void)
+{
+  POSMediaClock clock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+  VirtualClocks clocks = {.monotonic = 100 * SECONDS, .realtimeOffset = WALL_CLOCK_START - 100 * SECONDS,
+                          .sensorBaseUs = 5000000, .random = 3};
+
+  clocks.monotonic += 33333333;
+  Observe(&clock, &clocks, 0);
+  clocks.sensorBaseUs = -100 * 1000000;
+  clocks.monotonic += 33333333;
+  Observe(&clock, &clocks, 0);
+  POS_TEST_CHECK(clock.sensorSteps == 1);
+  POS_TEST_CHECK(POSMediaClockFromSensor(&clock, SensorUs(&clocks, clocks.monotonic)) == (HAPTime)clocks.monotonic);
+
+  // a missing IMP reading leaves the sensor offset alone
+  POSMediaClockObserve(&clock, (HAPTime)clocks.monotonic, (HAPTime)(clocks.monotonic + clocks.realtimeOffset), -1);
+  POS_TEST_CHECK(POSMediaClockFromSensor(&clock, SensorUs(&clocks, clocks.monotonic)) == (HAPTime)clocks.monotonic);
+}
+
+static void test_ntp_time(void)
+{
+  POSMediaClock clock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+  // the Unix epoch is 2208988800 s into the NTP era, half a second is half the fraction
+  POSMediaClockObserve(&clock, 10 * SECONDS, 0, -1);
+  POS_TEST_CHECK(POSMediaClockToNTPTime(&clock, 10 * SECONDS) == (NTPEpochTime)2208988800 << 32);
+  NTPEpochTime half = POSMediaClockToNTPTime(&clock, 10 * SECONDS + 500 * MS);
+  POS_TEST_CHECK(half >> 32 == 2208988800);
+  POS_TEST_CHECK(Abs((int64_t)(uint32_t)half - 0x80000000LL) <= 1);
+}
+
+// Media times of frames are differences of the same conversion, so they add up exactly
+// and don't overflow after weeks of uptime
+static void test_media_time(void)
+{
+  uint64_t total = 0;
+  HAPTime start = (HAPTime)30 * 24 * 3600 * SECONDS;
+  HAPTime time = start;
+
+  POS_TEST_CHECK(POSMediaClockToMediaTime(start, 90000) == (uint64_t)30 * 24 * 3600 * 90000);
+  for (int frame = 0; frame < 30 * 3600; frame++)
+  {
+    HAPTime next = time + 33333333;
+    total += POSMediaClockToMediaTime(next, 90000) - POSMediaClockToMediaTime(time, 90000);
+    time = next;
+  }
+  POS_TEST_CHECK(total == POSMediaClockToMediaTime(time, 90000) - POSMediaClockToMediaTime(start, 90000));
+  // an hour of 30 fps is 3600 s less 1.2 ms of rounding in the frame period
+  POS_TEST_CHECK(total >= (uint64_t)3600 * 90000 - 108 && total <= (uint64_t)3600 * 90000);
+  POS_TEST_CHECK(POSMediaClockToMediaTime(start + 20833, 48000) - POSMediaClockToMediaTime(start, 48000) == 0);
+  POS_TEST_CHECK(POSMediaClockToMediaTime(start + 20834, 48000) - POSMediaClockToMediaTime(start, 48000) == 1);
+}
+
+// main makes every IMP timestamp read too slow to keep.  A clock that never gets a
+// sensor sample still converts at once, from the raw offset of a single reading.
+static void test_slow_sensor_reads(void)
+{
+  POSMediaClock clock = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+  for (int frame = 0; frame < 5; frame++)
+  {
+    int64_t sensorUs = IMP_System_GetTimeStamp();
+    HAPTime before = POSMediaClockNow();
+    HAPTime frameTime = POSMediaClockFromSensor(&clock, sensorUs);
+    HAPTime after = POSMediaClockNow();
+    POS_TEST_CHECK(!clock.sensorValid);
+    // off by at most half a read from when the frame was stamped
+    POS_TEST_CHECK(frameTime <= after);
+    POS_TEST_CHECK(frameTime + 10 * MS >= before);
+  }
+
+  // the wall clock needs no IMP read and is valid after the first conversion
+  HAPTime now = POSMediaClockNow();
+  NTPEpochTime ntp = POSMediaClockToNTPTime(&clock, now);
+  POS_TEST_CHECK(clock.realtimeValid);
+  POS_TEST_CHECK(Abs((int64_t)(POSMediaClockToNTPTime(&clock, now) - ntp)) < ((int64_t)1 << 32) / 100);
+}
+
+int main(void)
+{
+  setenv("POS_SIM_TIMESTAMP_DELAY_US", "2000", 1);
+  test_sensor_drift();
+  test_wall_clock_step();
+  test_sensor_restart();
+  test_ntp_time();
+  test_media_time();
+  test_slow_sensor_reads();
+  printf("media clock tests passed\n");
+  return 0;
+}
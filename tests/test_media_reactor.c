@@ -0,0 +1,173 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives the media reactor through datagram socketpairs.  While packets stream in
+// nonstop handleTick still only runs on the POS_MEDIA_REACTOR_TICK_MS timer, every
+// datagram reaches handlePacket once, and POSMediaReactorRemove waits for a callback
+// in progress to return and nothing runs for the socket afterwards.
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "POSMediaReactor.h"
+
+#include "pos_test.h"
+
+#define MAX_TICKS 64
+#define STREAM_MS 1000
+#define SLOW_PACKET_MS 200
+
+typedef struct
+{
+  uint32_t numPackets;
+  uint32_t numBytes;
+  uint32_t numTicks;
+  uint64_t tickNs[MAX_TICKS];
+  int inCallback;
+} TestSession;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(uint32_t ms)
+{
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+static void HandlePacket(void *context, uint8_t *packet, size_t numBytes)
+{
+  TestSession *session = context;
+  __atomic_store_n(&session->inCallback, 1, __ATOMIC_SEQ_CST);
+  // a packet starting with 's' keeps the reactor busy
+  if (packet[0] == 's')
+    sleep_ms(SLOW_PACKET_MS);
+  __atomic_add_fetch(&session->numPackets, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&session->numBytes, (uint32_t)numBytes, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&session->inCallback, 0, __ATOMIC_SEQ_CST);
+}
+
+static void HandleTick(void *context)
+{
+  TestSession *session = context;
+  uint32_t tick = __atomic_load_n(&session->numTicks, __ATOMIC_SEQ_CST);
+  if (tick < MAX_TICKS)
+    session->tickNs[tick] = now_ns();
+  __atomic_store_n(&session->numTicks, tick + 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_tick_cadence(void)
+{
+  static TestSession session;
+  static uint8_t packet[200];
+  int fds[2];
+  uint32_t numSent = 0;
+  uint32_t numSentBytes = 0;
+
+  POS_TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+  const POSMediaReactorHandler handler = {.handlePacket = HandlePacket, .handleTick = HandleTick, .context = &session};
+  POS_TEST_CHECK(POSMediaReactorAdd(fds[0], &handler) == 0);
+
+  // A few packets every millisecond, every one of them a receive batch of its own
+  memset(packet, 'p', sizeof(packet));
+  uint64_t startNs = now_ns();
+  while (now_ns() - startNs < (uint64_t)STREAM_MS * 1000000)
+  {
+    for (int idx = 0; idx < 3; idx++)
+    {
+      size_t numBytes = 20 + numSent % 180;
+      POS_TEST_CHECK(send(fds[1], packet, numBytes, 0) == (ssize_t)numBytes);
+      numSent++;
+      numSentBytes += numBytes;
+    }
+    sleep_ms(1);
+  }
+  uint64_t endNs = now_ns();
+  for (int wait = 0; wait < 100 && __atomic_load_n(&session.numPackets, __ATOMIC_SEQ_CST) < numSent; wait++)
+    sleep_ms(10);
+  POSMediaReactorRemove(fds[0]);
+
+  POS_TEST_CHECK(session.numPackets == numSent);
+  POS_TEST_CHECK(session.numBytes == numSentBytes);
+
+  // Ticks from the timer alone, not one per receive batch
+  uint32_t numTicks = session.numTicks;
+  uint32_t expectedTicks = (uint32_t)((endNs - startNs) / 1000000 / POS_MEDIA_REACTOR_TICK_MS);
+  printf("%u packets in %u ms, %u ticks\n", numSent, (uint32_t)((endNs - startNs) / 1000000), numTicks);
+  POS_TEST_CHECK(numTicks >= expectedTicks - 2);
+  POS_TEST_CHECK(numTicks <= expectedTicks + 3);
+  for (uint32_t tick = 1; tick < numTicks && tick < MAX_TICKS; tick++)
+  {
+    uint64_t intervalMs = (session.tickNs[tick] - session.tickNs[tick - 1]) / 1000000;
+    POS_TEST_CHECK(intervalMs >= POS_MEDIA_REACTOR_TICK_MS / 2);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void test_remove_waits(void)
+{
+  static TestSession session;
+  int fds[2];
+
+  POS_TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+  const POSMediaReactorHandler handler = {.handlePacket = HandlePacket, .handleTick = HandleTick, .context = &session};
+  POS_TEST_CHECK(POSMediaReactorAdd(fds[0], &handler) == 0);
+
+  POS_TEST_CHECK(send(fds[1], "slow", 4, 0) == 4);
+  for (int wait = 0; wait < 1000 && !__atomic_load_n(&session.inCallback, __ATOMIC_SEQ_CST); wait++)
+    sleep_ms(1);
+  POS_TEST_CHECK(__atomic_load_n(&session.inCallback, __ATOMIC_SEQ_CST));
+
+  // Returns only once the slow packet is done
+  uint64_t startNs = now_ns();
+  POSMediaReactorRemove(fds[0]);
+  uint64_t blockedMs = (now_ns() - startNs) / 1000000;
+  POS_TEST_CHECK(!__atomic_load_n(&session.inCallback, __ATOMIC_SEQ_CST));
+  POS_TEST_CHECK(session.numPackets == 1);
+  POS_TEST_CHECK(blockedMs >= SLOW_PACKET_MS / 2);
+
+  // Nothing more for the socket, neither packets nor ticks
+  uint32_t numTicks = session.numTicks;
+  POS_TEST_CHECK(send(fds[1], "fast", 4, 0) == 4);
+  sleep_ms(3 * POS_MEDIA_REACTOR_TICK_MS);
+  POS_TEST_CHECK(session.numPackets == 1);
+  POS_TEST_CHECK(session.numTicks == numTicks);
+
+  // Removing it again is harmless
+  POSMediaReactorRemove(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+  printf("remove blocked %u ms for the callback in progress\n", (uint32_t)blockedMs);
+}
+
+int main(void)
+{
+  test_tick_cadence();
+  test_remove_waits();
+  return 0;
+}
@@ -0,0 +1,247 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Plays scripted receiver report sequences into POSRateController on the 100 ms
+// feedback tick, the report fields repeating between reports as they do on the stream.
+
+#include <string.h>
+
+#include "POSRateController.h"
+
+#include "pos_test.h"
+
+#define MIN_BITRATE 200000
+#define MAX_BITRATE 2000000
+#define MAX_FPS 30
+#define TICK_MS 100
+
+typedef struct
+{
+  POSRateController rc;
+  POSRateFeedback feedback;
+  uint32_t nowMs;
+  uint32_t numApplied;
+  uint32_t bitRate;
+  uint32_t frameRate;
+} RateScript;
+
+static void script_init(RateScript *script)
+{
+  memset(script, 0, sizeof(*script));
+  script->nowMs = 1000;
+  POSRateControllerInit(&script->rc, MIN_BITRATE, MAX_BITRATE, MAX_FPS, script->nowMs);
+  script->bitRate = MAX_BITRATE;
+  script->frameRate = MAX_FPS;
+}
+
+// One feedback tick, returns whether the encoder was touched
+static bool script_tick(RateScript *script)
+{
+  uint32_t bitRate, frameRate;
+
+  script->nowMs += TICK_MS;
+  if (!POSRateControllerUpdate(&script->rc, &script->feedback, script->nowMs, &bitRate, &frameRate))
+    return false;
+  script->numApplied++;
+  script->bitRate = bitRate;
+  script->frameRate = frameRate;
+  return true;
+}
+
+// A new receiver report arrives, then the ticks up to the next one repeat it
+static void script_report(RateScript *script, uint8_t fractionLost, uint32_t rttMs, uint32_t intervalMs)
+{
+  script->feedback.reportCount++;
+  script->feedback.fractionLost = fractionLost;
+  script->feedback.rttMs = rttMs;
+  for (uint32_t ms = 0; ms < intervalMs; ms += TICK_MS)
+    script_tick(script);
+}
+
+// Each lossy report cuts the rate once, however many ticks repeat it
+static void test_backoff_per_report(void)
+{
+  static RateScript script;
+
+  script_init(&script);
+  script_report(&script, 64, 50, 1000);
+  // 25% loss would keep 1 - loss / 2, but no cut is smaller than the 85% a delay rise gets
+  POS_TEST_CHECK(script.rc.targetBitRate == MAX_BITRATE * 218 / 256);
+  POS_TEST_CHECK(script.bitRate == script.rc.targetBitRate);
+  POS_TEST_CHECK(script.numApplied == 1);
+
+  script_report(&script, 64, 50, 1000);
+  POS_TEST_CHECK(script.rc.targetBitRate == (uint32_t)((uint64_t)MAX_BITRATE * 218 / 256 * 218 / 256));
+  POS_TEST_CHECK(script.numApplied == 2);
+
+  // a report with the RTT well above the lowest one seen cuts to 85%, once
+  uint32_t before = script.rc.targetBitRate;
+  script_report(&script, 0, 50 + POS_RATE_RTT_RISE_MS + 100, 5000);
+  POS_TEST_CHECK(script.rc.targetBitRate == (uint32_t)((uint64_t)before * 218 / 256));
+
+  // reports closer together than the RTT still cut once each
+  before = script.rc.targetBitRate;
+  script_report(&script, 64, 50, 200);
+  script_report(&script, 64, 50, 200);
+  POS_TEST_CHECK(script.rc.targetBitRate == (uint32_t)((uint64_t)before * 218 / 256 * 218 / 256));
+
+  // ten seconds of one stale lossy report don't walk the rate down to the floor
+  script_init(&script);
+  script_report(&script, 128, 50, 10000);
+  POS_TEST_CHECK(script.rc.targetBitRate == MAX_BITRATE * 192 / 256);
+}
+
+// After a back off the rate holds, then climbs on each clean report back to the maximum
+static void test_probe_and_recover(void)
+{
+  static RateScript script;
+
+  script_init(&script);
+  script_report(&script, 128, 50, 1000);
+  uint32_t backedOff = script.rc.targetBitRate;
+  POS_TEST_CHECK(backedOff == MAX_BITRATE * 192 / 256);
+
+  // still inside POS_RATE_HOLD_MS
+  script_report(&script, 0, 50, 500);
+  POS_TEST_CHECK(script.rc.targetBitRate == backedOff);
+  POS_TEST_CHECK(script.rc.state == kPOSRateState_Hold);
+
+  script_report(&script, 0, 50, 1000);
+  script_report(&script, 0, 50, 1000);
+  // the ticks between reports don't probe
+  uint32_t probed = script.rc.targetBitRate;
+  POS_TEST_CHECK(probed > backedOff);
+  POS_TEST_CHECK(probed <= (uint32_t)((uint64_t)backedOff * (100 + 2 * POS_RATE_PROBE_PERCENT) / 100));
+  POS_TEST_CHECK(script.rc.state == kPOSRateState_Increase);
+
+  int numReports = 0;
+  while (script.rc.targetBitRate < MAX_BITRATE && numReports < 60)
+  {
+    script_report(&script, 2, 50, 1000);
+    numReports++;
+  }
+  POS_TEST_CHECK(script.rc.targetBitRate == MAX_BITRATE);
+  POS_TEST_CHECK(script.bitRate == MAX_BITRATE);
+  // about 8% per second from 75%
+  POS_TEST_CHECK(numReports >= 2 && numReports <= 6);
+
+  // moderate loss neither cuts nor probes
+  script_report(&script, (POS_RATE_LOSS_LOW + POS_RATE_LOSS_HIGH) / 2, 50, 1000);
+  POS_TEST_CHECK(script.rc.state == kPOSRateState_Hold);
+  POS_TEST_CHECK(script.rc.targetBitRate == MAX_BITRATE);
+}
+
+// Small moves stay off the encoder, and the frame rate has a gap between halving and restoring
+static void test_hysteresis(void)
+{
+  static RateScript script;
+
+  script_init(&script);
+  // every report loses half, the rate halves down to under 30%
+  while (script.rc.targetBitRate * 100ull >= MAX_BITRATE * (uint64_t)POS_RATE_FPS_DOWN_PERCENT)
+    script_report(&script, 255, 50, 1000);
+  POS_TEST_CHECK(script.frameRate == MAX_FPS / 2);
+  POS_TEST_CHECK(script.rc.targetBitRate >= MIN_BITRATE);
+  script_report(&script, 0, 50, 1000);
+  script_report(&script, 0, 50, 1000);
+
+  // frequent clean reports probe in steps below POS_RATE_CHANGE_PERCENT
+  script_report(&script, 0, 50, 200);
+  uint32_t applied = script.bitRate;
+  uint32_t numApplied = script.numApplied;
+  script_report(&script, 0, 50, 200);
+  POS_TEST_CHECK(script.rc.targetBitRate > applied);
+  POS_TEST_CHECK(script.numApplied == numApplied);
+  POS_TEST_CHECK(script.bitRate == applied);
+  for (int i = 0; i < 10; i++)
+    script_report(&script, 0, 50, 200);
+  POS_TEST_CHECK(script.numApplied > numApplied);
+  POS_TEST_CHECK(script.bitRate * 100ull >= applied * (uint64_t)(100 + POS_RATE_CHANGE_PERCENT));
+
+  // between the thresholds the halved frame rate stays
+  while (script.rc.targetBitRate * 100ull <= MAX_BITRATE * (uint64_t)(POS_RATE_FPS_DOWN_PERCENT + 5))
+    script_report(&script, 0, 50, 1000);
+  POS_TEST_CHECK(script.frameRate == MAX_FPS / 2);
+  while (script.rc.targetBitRate * 100ull <= MAX_BITRATE * (uint64_t)POS_RATE_FPS_UP_PERCENT)
+  {
+    POS_TEST_CHECK(script.frameRate == MAX_FPS / 2);
+    script_report(&script, 0, 50, 1000);
+  }
+  POS_TEST_CHECK(script.frameRate == MAX_FPS);
+}
+
+// A TMMBR bounds the rate, probing never goes past it, and clearing it lets the rate climb again
+static void test_tmmbr_cap(void)
+{
+  static RateScript script;
+
+  script_init(&script);
+  POSRateControllerSetCap(&script.rc, 600000);
+  script_tick(&script);
+  POS_TEST_CHECK(script.bitRate == 600000);
+  for (int i = 0; i < 30; i++)
+  {
+    script_report(&script, 0, 50, 1000);
+    POS_TEST_CHECK(script.rc.targetBitRate <= 600000);
+  }
+  POS_TEST_CHECK(script.bitRate == 600000);
+
+  // a cap below the floor still leaves the floor
+  POSRateControllerSetCap(&script.rc, 1000);
+  script_tick(&script);
+  POS_TEST_CHECK(script.bitRate == MIN_BITRATE);
+
+  POSRateControllerSetCap(&script.rc, 0);
+  for (int i = 0; i < 60; i++)
+    script_report(&script, 0, 50, 1000);
+  POS_TEST_CHECK(script.bitRate == MAX_BITRATE);
+}
+
+// The socket queue is read on every tick, with no report needed, but cuts at most once per RTT
+static void test_queue_backoff(void)
+{
+  static RateScript script;
+
+  script_init(&script);
+  script_report(&script, 0, 50, 1000);
+  uint32_t numApplied = script.numApplied;
+  // 200 ms of video at the maximum rate
+  script.feedback.queuedBytes = MAX_BITRATE / 8 / 5;
+  for (int i = 0; i < 10; i++)
+    script_tick(&script);
+  // cuts at 0, 300, 600 and 900 ms
+  POS_TEST_CHECK(script.numApplied - numApplied == 4);
+  POS_TEST_CHECK(script.rc.targetBitRate == (uint32_t)((uint64_t)MAX_BITRATE * 218 / 256 * 218 / 256 * 218 / 256 * 218 / 256));
+
+  script.feedback.queuedBytes = 0;
+  uint32_t drained = script.rc.targetBitRate;
+  for (int i = 0; i < 10; i++)
+    script_tick(&script);
+  POS_TEST_CHECK(script.rc.targetBitRate == drained);
+}
+
+int main(void)
+{
+  test_backoff_per_report();
+  test_probe_and_recover();
+  test_hysteresis();
+  test_tmmbr_cap();
+  test_queue_backoff();
+  printf("rate controller tests passed\n");
+  return 0;
+}
@@ -0,0 +1,180 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives POSRTPStreamCheckFeedback from a virtual clock and checks the RFC 3550
+// report schedule and the dropout time, without waiting on the real one.
+
+#include <string.h>
+
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define MS ((HAPTime)1000000)
+#define SECONDS ((HAPTime)1000000000)
+
+// the clock never starts at 0, CheckFeedback takes that as no time at all
+#define START_TIME (10 * SECONDS)
+#define TICK (10 * MS)
+
+static void start_stream(POSRTPStreamRef *stream, uint32_t maxBitRate, uint32_t sessionBitRate)
+{
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x11223344, .maxBitRate = maxBitRate, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378, .sessionBitRate = sessionBitRate};
+  POSSRTPParameters srtpParameters;
+
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(stream, &rtpParameters, RTPType_H264, 90000, 0x55667788, START_TIME, "positron-test",
+                    &srtpParameters, &srtpParameters);
+}
+
+// Ticks the stream like the media reactor does until endTime, returns the number of reports
+// and the shortest and longest gap between them
+static size_t run_reports(POSRTPStreamRef *stream, HAPTime endTime, HAPTime *firstReport, HAPTime *minGap,
+                          HAPTime *maxGap)
+{
+  static uint8_t packet[1500];
+  size_t numPacketBytes;
+  size_t numReports = 0;
+  HAPTime lastReport = 0;
+
+  *minGap = ~(HAPTime)0;
+  *maxGap = 0;
+  for (HAPTime now = START_TIME + TICK; now <= endTime; now += TICK)
+  {
+    POSRTPStreamCheckFeedback(stream, now, packet, sizeof(packet), &numPacketBytes, NULL, NULL, NULL);
+    if (numPacketBytes == 0)
+      continue;
+    if (numReports == 0)
+    {
+      *firstReport = now;
+    }
+    else
+    {
+      if (now - lastReport < *minGap)
+        *minGap = now - lastReport;
+      if (now - lastReport > *maxGap)
+        *maxGap = now - lastReport;
+    }
+    lastReport = now;
+    numReports++;
+  }
+  return numReports;
+}
+
+// At 2 Mbps the 5% RTCP share is far more than two members need, so Tmin rules:
+// the first report comes after half of it and the rest after [0.5, 1.5) of it
+static void test_minimum_interval(void)
+{
+  static POSRTPStreamRef stream;
+  HAPTime firstReport, minGap, maxGap;
+
+  start_stream(&stream, 2000, 0);
+  size_t numReports = run_reports(&stream, START_TIME + 600 * SECONDS, &firstReport, &minGap, &maxGap);
+
+  POS_TEST_CHECK(firstReport - START_TIME >= 250 * MS / 2);
+  POS_TEST_CHECK(firstReport - START_TIME < 250 * MS * 3 / 2 + TICK);
+  // each gap is rounded up to the next tick
+  POS_TEST_CHECK(minGap >= 500 * MS / 2);
+  POS_TEST_CHECK(maxGap < 500 * MS * 3 / 2 + TICK);
+  // the mean gap is 500 ms plus half a tick, about 1180 reports in 600 s
+  POS_TEST_CHECK(numReports > 1100 && numReports < 1260);
+}
+
+// At 16 kbps the RTCP share is 100 bytes per second, so the interval follows the average report
+// size instead.  With nothing sent or received each report is an empty receiver report, so the
+// average shrinks from its initial 100 bytes and the reports come closer together.
+static void test_bandwidth_interval(void)
+{
+  static POSRTPStreamRef stream;
+  static uint8_t packet[1500];
+  size_t numPacketBytes;
+  size_t numReports = 0;
+
+  start_stream(&stream, 16, 0);
+  // 2 members * 100 bytes / 100 bytes per second, Tmin isn't halved into it
+  POS_TEST_CHECK(stream.nextRTCPReportHAPTime - START_TIME >= 2 * SECONDS / 2);
+  for (HAPTime now = START_TIME + TICK; now <= START_TIME + 600 * SECONDS; now += TICK)
+  {
+    uint32_t avgRTCPSize = stream.avgRTCPSize;
+    POSRTPStreamCheckFeedback(&stream, now, packet, sizeof(packet), &numPacketBytes, NULL, NULL, NULL);
+    if (numPacketBytes == 0)
+      continue;
+    numReports++;
+    HAPTime bandwidthInterval = 2 * (HAPTime)avgRTCPSize * SECONDS / 100;
+    POS_TEST_CHECK(stream.nextRTCPReportHAPTime - now >= bandwidthInterval / 2);
+    POS_TEST_CHECK(stream.nextRTCPReportHAPTime - now < bandwidthInterval * 3 / 2);
+  }
+  // the average settles near the 8 byte report plus IP and UDP, the 1/16 step rounds towards the old value
+  POS_TEST_CHECK(stream.avgRTCPSize < 8 + POS_RTCP_IP_UDP_HEADER_SIZE + 16);
+  // still fewer reports than Tmin alone allows
+  POS_TEST_CHECK(numReports > 100 && numReports < 1200);
+}
+
+// A low rate audio stream takes its RTCP share from the session the controller negotiated, not from
+// its own bitrate: 24 kbps of Opus next to 299 kbps of video still reports every Tmin
+static void test_session_bandwidth(void)
+{
+  static POSRTPStreamRef stream;
+  HAPTime firstReport, minGap, maxGap;
+
+  start_stream(&stream, 24, 24 + 299);
+  size_t numReports = run_reports(&stream, START_TIME + 600 * SECONDS, &firstReport, &minGap, &maxGap);
+
+  POS_TEST_CHECK(minGap >= 500 * MS / 2);
+  POS_TEST_CHECK(maxGap < 500 * MS * 3 / 2 + TICK);
+  POS_TEST_CHECK(numReports > 1100 && numReports < 1260);
+
+  // a TMMBR only moves the media rate, the report schedule stays where it was
+  stream.bitRate = 8000;
+  HAPTime now = stream.nextRTCPReportHAPTime;
+  static uint8_t packet[1500];
+  size_t numPacketBytes;
+  POSRTPStreamCheckFeedback(&stream, now, packet, sizeof(packet), &numPacketBytes, NULL, NULL, NULL);
+  POS_TEST_CHECK(numPacketBytes > 0);
+  POS_TEST_CHECK(stream.nextRTCPReportHAPTime - now < 500 * MS * 3 / 2);
+}
+
+// The dropout time counts seconds since the last packet from the controller, here since the start
+static void test_dropout_time(void)
+{
+  static POSRTPStreamRef stream;
+  static uint8_t packet[1500];
+  size_t numPacketBytes;
+  uint32_t dropoutTime = 0xffffffff;
+
+  start_stream(&stream, 2000, 0);
+  POSRTPStreamCheckFeedback(&stream, START_TIME + 500 * MS, packet, sizeof(packet), &numPacketBytes, NULL, NULL,
+                            &dropoutTime);
+  POS_TEST_CHECK(dropoutTime <= 1);
+  POSRTPStreamCheckFeedback(&stream, START_TIME + 12 * SECONDS + 500 * MS, packet, sizeof(packet), &numPacketBytes,
+                            NULL, NULL, &dropoutTime);
+  POS_TEST_CHECK(dropoutTime >= 12 && dropoutTime <= 13);
+}
+
+int main(void)
+{
+  test_minimum_interval();
+  test_bandwidth_interval();
+  test_session_bandwidth();
+  test_dropout_time();
+  printf("rtcp interval tests passed\n");
+  return 0;
+}
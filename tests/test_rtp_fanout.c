@@ -0,0 +1,643 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a synthetic H.264 stream through the simulated encoder, packetizes every
+// frame once and fans it out to several viewers, each a UDP socket connected to its
+// own loopback receiver.  Every receiver authenticates and decrypts its packets with
+// its own keys and SSRC, finds its own sequence numbers without a gap, its own
+// timestamp base and its own FEC parity, and rebuilds exactly the NALUs the encoder
+// put out.  A viewer whose socket stops taking packets is skipped without holding up
+// the others and picks up again once the stall is over.  Prints the send thread's CPU
+// time per frame for one to four viewers.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <imp/imp_encoder.h>
+#include <imp/imp_system.h>
+
+#include "POSRTPController.h"
+#include "POSRTPFanout.h"
+
+#include "pos_test.h"
+
+#define NUM_VIEWERS POS_RTP_FANOUT_MAX_VIEWERS
+#define NUM_FRAMES 90
+#define GOP_FRAMES 30
+#define FRAME_NS 33333333ull
+#define PAYLOAD_TYPE 99
+#define FEC_PAYLOAD_TYPE 115
+#define MAX_NAL_BYTES 40000
+#define NAL_STREAM_BYTES (4 * 1024 * 1024)
+
+// A frame as the simulated encoder put it out, NALUs without their start codes
+typedef struct
+{
+  size_t numNALUs;
+  size_t offsets[8];
+  size_t lens[8];
+  uint8_t *bytes;
+} Frame;
+
+// What a loopback controller got
+typedef struct
+{
+  int sock;
+  srtp_ctx srtp, srtcp, fecSrtp, fecSrtcp;
+  uint32_t ssrc;
+  bool first;
+  uint16_t nextSeq;
+  uint32_t roc;
+  uint32_t firstTimeStamp;
+  uint32_t numPackets;
+  uint32_t numGaps;
+  uint32_t numLost;
+  uint32_t numParity;
+  uint16_t lastParitySeq;
+  uint32_t parityRoc;
+  // rebuilt NALUs, each as a 4 byte length and its bytes
+  uint8_t *nalStream;
+  size_t nalStreamBytes;
+  size_t fuStart;
+  bool inFU;
+  // after a gap nothing is kept until the next key frame, whose NALUs start at resyncOffset
+  bool resyncing;
+  size_t resyncOffset;
+  // timestamp of every packet, relative to the first
+  uint32_t timeStamps[8192];
+} Receiver;
+
+typedef struct
+{
+  POSRTPStreamRef stream;
+  POSRTPFecEncoder fec;
+  POSRTPFecBatch fecBatch;
+  POSRTPPacketHistory history;
+  POSSRTPParameters srtpParameters;
+  int sock;
+} Viewer;
+
+static Frame frames[NUM_FRAMES];
+static Viewer viewers[NUM_VIEWERS];
+static Receiver receivers[NUM_VIEWERS];
+static POSRTPStreamRef packetizer;
+static POSRTPFanout fanout;
+static POSRTPPacer pacer;
+static uint8_t pool[POS_UDP_BATCH_MAX][POS_RTP_FANOUT_PACKET_STRIDE];
+static size_t packetLens[POS_UDP_BATCH_MAX];
+static uint8_t expected[NAL_STREAM_BYTES];
+static size_t expectedBytes;
+// where each key frame's SPS starts in expected
+static size_t keyFrameOffsets[NUM_FRAMES / GOP_FRAMES + 1];
+static size_t numKeyFrames;
+
+// sends on this socket fail with EAGAIN, as if its buffer were full
+static int stalledSock = -1;
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+  static ssize_t (*realSendmsg)(int, const struct msghdr *, int);
+  if (!realSendmsg)
+    realSendmsg = (ssize_t(*)(int, const struct msghdr *, int))dlsym(RTLD_NEXT, "sendmsg");
+  if (fd == stalledSock)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  return realSendmsg(fd, msg, flags);
+}
+
+int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+  static int (*realSendmmsg)(int, struct mmsghdr *, unsigned int, int);
+  if (!realSendmmsg)
+    realSendmmsg = (int (*)(int, struct mmsghdr *, unsigned int, int))dlsym(RTLD_NEXT, "sendmmsg");
+  if (fd == stalledSock)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  return realSendmmsg(fd, msgs, vlen, flags);
+}
+
+static uint32_t Random(uint32_t *state)
+{
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+// Writes an Annex-B stream of GOP_FRAMES frame GOPs: SPS, PPS and an IDR, then P slices.
+// The bytes after each NALU header are never 0, so there is no start code to escape.
+static void WriteStream(const char *path)
+{
+  static uint8_t nal[MAX_NAL_BYTES];
+  static const uint8_t startCode[4] = {0, 0, 0, 1};
+  uint32_t random = 1;
+  FILE *file = fopen(path, "wb");
+  POS_TEST_CHECK(file != NULL);
+
+  for (int frame = 0; frame < GOP_FRAMES; frame++)
+  {
+    size_t numNALUs = frame == 0 ? 3 : 1;
+    for (size_t n = 0; n < numNALUs; n++)
+    {
+      size_t numBytes;
+      if (frame != 0)
+      {
+        nal[0] = 0x41;
+        // some fit in a single packet, most are fragmented
+        numBytes = frame % 7 == 3 ? 200 + Random(&random) % 600 : 1500 + Random(&random) % 9000;
+      }
+      else if (n == 0)
+      {
+        nal[0] = 0x67;
+        numBytes = 12;
+      }
+      else if (n == 1)
+      {
+        nal[0] = 0x68;
+        numBytes = 4;
+      }
+      else
+      {
+        nal[0] = 0x65;
+        numBytes = 25000 + Random(&random) % 10000;
+      }
+      for (size_t idx = 1; idx < numBytes; idx++)
+        nal[idx] = (uint8_t)(1 + Random(&random) % 255);
+      POS_TEST_CHECK(fwrite(startCode, 1, sizeof(startCode), file) == sizeof(startCode));
+      POS_TEST_CHECK(fwrite(nal, 1, numBytes, file) == numBytes);
+    }
+  }
+  POS_TEST_CHECK(fclose(file) == 0);
+}
+
+static void AppendNAL(uint8_t *stream, size_t *numStreamBytes, const uint8_t *bytes, size_t numBytes)
+{
+  POS_TEST_CHECK(*numStreamBytes + 4 + numBytes <= NAL_STREAM_BYTES);
+  stream[*numStreamBytes] = (uint8_t)(numBytes >> 24);
+  stream[*numStreamBytes + 1] = (uint8_t)(numBytes >> 16);
+  stream[*numStreamBytes + 2] = (uint8_t)(numBytes >> 8);
+  stream[*numStreamBytes + 3] = (uint8_t)numBytes;
+  memcpy(stream + *numStreamBytes + 4, bytes, numBytes);
+  *numStreamBytes += 4 + numBytes;
+}
+
+// Pulls NUM_FRAMES frames out of the simulated encoder, and lists the NALUs a receiver
+// should rebuild: the packetizer sends the SPS and PPS it keeps right before each IDR
+static void RecordFrames(void)
+{
+  IMPEncoderChnAttr attr;
+  const uint8_t *sps = NULL, *pps = NULL;
+  size_t spsBytes = 0, ppsBytes = 0;
+
+  POS_TEST_CHECK(IMP_System_Init() == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateGroup(0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_SetDefaultParam(&attr, IMP_ENC_PROFILE_AVC_MAIN, IMP_ENC_RC_MODE_CBR, 1920, 1080, 30,
+                                             1, GOP_FRAMES, 2, -1, 2000) == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateChn(0, &attr) == 0);
+  POS_TEST_CHECK(IMP_Encoder_RegisterChn(0, 0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_StartRecvPic(0) == 0);
+
+  for (int idx = 0; idx < NUM_FRAMES; idx++)
+  {
+    IMPEncoderStream stream;
+    Frame *frame = &frames[idx];
+
+    POS_TEST_CHECK(IMP_Encoder_PollingStream(0, 1000) == 0);
+    POS_TEST_CHECK(IMP_Encoder_GetStream(0, &stream, true) == 0);
+    POS_TEST_CHECK(stream.packCount <= 8);
+    frame->bytes = malloc(stream.streamSize);
+    POS_TEST_CHECK(frame->bytes != NULL);
+    frame->numNALUs = stream.packCount;
+    for (uint32_t n = 0; n < stream.packCount; n++)
+    {
+      const uint8_t *nal = (const uint8_t *)(uintptr_t)stream.virAddr + stream.pack[n].offset + 4;
+      size_t numBytes = stream.pack[n].length - 4;
+      frame->offsets[n] = stream.pack[n].offset;
+      frame->lens[n] = numBytes;
+      memcpy(frame->bytes + frame->offsets[n], nal, numBytes);
+      nal = frame->bytes + frame->offsets[n];
+      switch (nal[0] & 0x1f)
+      {
+      case 7:
+        sps = nal;
+        spsBytes = numBytes;
+        break;
+      case 8:
+        pps = nal;
+        ppsBytes = numBytes;
+        break;
+      case 5:
+        keyFrameOffsets[numKeyFrames++] = expectedBytes;
+        AppendNAL(expected, &expectedBytes, sps, spsBytes);
+        AppendNAL(expected, &expectedBytes, pps, ppsBytes);
+        AppendNAL(expected, &expectedBytes, nal, numBytes);
+        break;
+      default:
+        AppendNAL(expected, &expectedBytes, nal, numBytes);
+      }
+    }
+    IMP_Encoder_ReleaseStream(0, &stream);
+  }
+  IMP_Encoder_StopRecvPic(0);
+}
+
+static void StartViewers(size_t numViewers, HAPTime now)
+{
+  POSRTPParameters rtpParameters = {.type = PAYLOAD_TYPE, .ssrc = 0x55000000, .maxBitRate = 2000,
+                                    .RTCPInterval = 0.5f, .maximumMTU = 1378};
+
+  POSRTPFanoutInit(&fanout, &pacer);
+  POSRTPPacerInit(&pacer, 4500);
+  POSRTPStreamStartPacketizer(&packetizer, &rtpParameters, RTPType_H264, 90000, 10, now);
+
+  for (size_t idx = 0; idx < numViewers; idx++)
+  {
+    Viewer *viewer = &viewers[idx];
+    Receiver *receiver = &receivers[idx];
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addrLen = sizeof(addr);
+    int bufferBytes = 1 << 20;
+
+    // the controller's end
+    receiver->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    POS_TEST_CHECK(receiver->sock >= 0);
+    setsockopt(receiver->sock, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+    POS_TEST_CHECK(bind(receiver->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    POS_TEST_CHECK(getsockname(receiver->sock, (struct sockaddr *)&addr, &addrLen) == 0);
+    viewer->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    POS_TEST_CHECK(viewer->sock >= 0);
+    POS_TEST_CHECK(connect(viewer->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    // every viewer its own keys, SSRC and FEC
+    memset(&viewer->srtpParameters, 0, sizeof(viewer->srtpParameters));
+    viewer->srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+    memset(viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x40 + (int)idx, 16);
+    memset(viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x20 + (int)idx, 14);
+    receiver->ssrc = 0x11223344 + (uint32_t)idx * 0x01010101;
+    POSRTPStreamStart(&viewer->stream, &rtpParameters, RTPType_H264, 90000, receiver->ssrc, now, "positron-test",
+                      &viewer->srtpParameters, &viewer->srtpParameters);
+    POSRTPStreamSetHistory(&viewer->stream, &viewer->history);
+    POSRTPFecInit(&viewer->fec, FEC_PAYLOAD_TYPE, receiver->ssrc + 1);
+    POSRTPFecSetFractionLost(&viewer->fec, (uint8_t)(10 + 20 * idx));
+    POSRTPStreamSetFec(&viewer->stream, &viewer->fec, &viewer->fecBatch, &viewer->srtpParameters);
+    POS_TEST_CHECK(POSRTPFanoutAddViewer(&fanout, &viewer->stream, viewer->sock) == kHAPError_None);
+
+    srtp_freeContext(&receiver->srtp, &receiver->srtcp);
+    srtp_freeContext(&receiver->fecSrtp, &receiver->fecSrtcp);
+    srtp_setupContext(&receiver->srtp, &receiver->srtcp,
+                      (const char *)viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                      (const char *)viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10, receiver->ssrc);
+    srtp_setupContext(&receiver->fecSrtp, &receiver->fecSrtcp,
+                      (const char *)viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                      (const char *)viewer->srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10,
+                      receiver->ssrc + 1);
+    receiver->first = true;
+    receiver->numPackets = 0;
+    receiver->numGaps = 0;
+    receiver->numLost = 0;
+    receiver->numParity = 0;
+    receiver->lastParitySeq = viewer->fec.seq;
+    receiver->parityRoc = 0;
+    receiver->nalStreamBytes = 0;
+    receiver->inFU = false;
+    receiver->resyncing = false;
+    if (receiver->nalStream == NULL)
+      receiver->nalStream = malloc(NAL_STREAM_BYTES);
+    POS_TEST_CHECK(receiver->nalStream != NULL);
+  }
+}
+
+static void StopViewers(size_t numViewers)
+{
+  for (size_t idx = 0; idx < numViewers; idx++)
+  {
+    POSRTPFanoutRemoveViewer(&fanout, &viewers[idx].stream);
+    close(viewers[idx].sock);
+    close(receivers[idx].sock);
+  }
+  POS_TEST_CHECK(POSRTPFanoutNumViewers(&fanout) == 0);
+}
+
+// Rebuilds NALUs from a decrypted payload, single NALU, STAP-A or FU-A
+static void Depacketize(Receiver *receiver, const uint8_t *payload, size_t numBytes)
+{
+  uint8_t NALType = payload[0] & 0x1f;
+
+  if (NALType == 24)
+  {
+    size_t pos = 1;
+    while (pos + 2 <= numBytes)
+    {
+      size_t nalBytes = (size_t)payload[pos] << 8 | payload[pos + 1];
+      POS_TEST_CHECK(pos + 2 + nalBytes <= numBytes);
+      AppendNAL(receiver->nalStream, &receiver->nalStreamBytes, payload + pos + 2, nalBytes);
+      pos += 2 + nalBytes;
+    }
+    POS_TEST_CHECK(pos == numBytes);
+    return;
+  }
+  if (NALType != 28)
+  {
+    POS_TEST_CHECK(!receiver->inFU);
+    AppendNAL(receiver->nalStream, &receiver->nalStreamBytes, payload, numBytes);
+    return;
+  }
+
+  uint8_t *stream = receiver->nalStream;
+  if (payload[1] & 0x80)
+  {
+    POS_TEST_CHECK(!receiver->inFU);
+    uint8_t header = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+    receiver->fuStart = receiver->nalStreamBytes;
+    receiver->inFU = true;
+    AppendNAL(stream, &receiver->nalStreamBytes, &header, 1);
+  }
+  POS_TEST_CHECK(receiver->inFU);
+  POS_TEST_CHECK(receiver->nalStreamBytes + numBytes - 2 <= NAL_STREAM_BYTES);
+  memcpy(stream + receiver->nalStreamBytes, payload + 2, numBytes - 2);
+  receiver->nalStreamBytes += numBytes - 2;
+  size_t nalBytes = receiver->nalStreamBytes - receiver->fuStart - 4;
+  stream[receiver->fuStart] = (uint8_t)(nalBytes >> 24);
+  stream[receiver->fuStart + 1] = (uint8_t)(nalBytes >> 16);
+  stream[receiver->fuStart + 2] = (uint8_t)(nalBytes >> 8);
+  stream[receiver->fuStart + 3] = (uint8_t)nalBytes;
+  if (payload[1] & 0x40)
+    receiver->inFU = false;
+}
+
+// Reads everything waiting on the controller's socket
+static void Receive(Receiver *receiver)
+{
+  static uint8_t bytes[2048];
+  static uint8_t plain[2048];
+
+  for (;;)
+  {
+    ssize_t ret = recv(receiver->sock, bytes, sizeof(bytes), MSG_DONTWAIT);
+    if (ret < 0)
+    {
+      POS_TEST_CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+      return;
+    }
+    POS_TEST_CHECK(ret > 12 + 10);
+    size_t numBytes = (size_t)ret - 10;
+    uint16_t seq = (uint16_t)(bytes[2] << 8 | bytes[3]);
+    uint32_t timeStamp = (uint32_t)bytes[4] << 24 | (uint32_t)bytes[5] << 16 | (uint32_t)bytes[6] << 8 | bytes[7];
+    uint32_t ssrc = (uint32_t)bytes[8] << 24 | (uint32_t)bytes[9] << 16 | (uint32_t)bytes[10] << 8 | bytes[11];
+
+    if ((bytes[1] & 0x7f) == FEC_PAYLOAD_TYPE)
+    {
+      // parity under the viewer's FEC SSRC, keyed for it
+      POS_TEST_CHECK(ssrc == receiver->ssrc + 1);
+      if (seq < receiver->lastParitySeq)
+        receiver->parityRoc++;
+      receiver->lastParitySeq = seq;
+      POS_TEST_CHECK(srtp_verifyAuthentication(&receiver->fecSrtp, bytes + numBytes, bytes, numBytes,
+                                               receiver->parityRoc));
+      receiver->numParity++;
+      continue;
+    }
+
+    POS_TEST_CHECK((bytes[1] & 0x7f) == PAYLOAD_TYPE);
+    POS_TEST_CHECK(ssrc == receiver->ssrc);
+    if (receiver->first)
+    {
+      receiver->nextSeq = seq;
+      receiver->firstTimeStamp = timeStamp;
+      receiver->first = false;
+    }
+    if (seq != receiver->nextSeq)
+    {
+      // a stall, drop the NALU it cut in half and wait for a key frame
+      receiver->numGaps++;
+      receiver->numLost += (uint16_t)(seq - receiver->nextSeq);
+      if (receiver->inFU)
+        receiver->nalStreamBytes = receiver->fuStart;
+      receiver->inFU = false;
+      receiver->resyncing = true;
+    }
+    if (seq < receiver->nextSeq)
+      receiver->roc++;
+    receiver->nextSeq = seq + 1;
+    POS_TEST_CHECK(srtp_verifyAuthentication(&receiver->srtp, bytes + numBytes, bytes, numBytes, receiver->roc));
+    srtp_decrypt(&receiver->srtp, plain, bytes + 12, numBytes - 12, receiver->roc << 16 | seq);
+    // a key frame starts with its SPS, on its own or in a STAP-A
+    uint8_t NALType = plain[0] & 0x1f;
+    if (receiver->resyncing && (NALType == 7 || (NALType == 24 && (plain[3] & 0x1f) == 7)))
+    {
+      receiver->resyncing = false;
+      receiver->resyncOffset = receiver->nalStreamBytes;
+    }
+    if (!receiver->resyncing)
+      Depacketize(receiver, plain, numBytes - 12);
+    POS_TEST_CHECK(receiver->numPackets < sizeof(receiver->timeStamps) / sizeof(receiver->timeStamps[0]));
+    receiver->timeStamps[receiver->numPackets++] = timeStamp - receiver->firstTimeStamp;
+  }
+}
+
+// Packetizes one frame and sends it to every viewer, returns the send thread's CPU time in ns
+static uint64_t SendFrame(const Frame *frame, HAPTime now)
+{
+  struct timespec start, end;
+  size_t numPayloadBytes;
+  size_t numPackets;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  for (size_t n = 0; n <= frame->numNALUs; n++)
+  {
+    if (n < frame->numNALUs)
+      POSRTPStreamPushPayload(&packetizer, frame->bytes + frame->offsets[n], frame->lens[n], &numPayloadBytes, now,
+                              now);
+    else
+      POSRTPStreamEndAccessUnit(&packetizer, &numPayloadBytes);
+    if (numPayloadBytes == 0)
+      continue;
+    do
+    {
+      POSRTPStreamPollPackets(&packetizer, pool, sizeof(pool[0]), POS_UDP_BATCH_MAX, packetLens, &numPackets);
+      if (numPackets != 0)
+        POSRTPFanoutSend(&fanout, &packetizer, (const uint8_t *)pool, sizeof(pool[0]), packetLens, numPackets, now,
+                         NULL);
+    } while (numPackets != 0);
+  }
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  return (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+}
+
+static void test_fanout(void)
+{
+  HAPTime now = 10000000000ull;
+
+  StartViewers(NUM_VIEWERS, now);
+  for (int idx = 0; idx < NUM_FRAMES; idx++)
+  {
+    now += FRAME_NS;
+    SendFrame(&frames[idx], now);
+    for (size_t v = 0; v < NUM_VIEWERS; v++)
+      Receive(&receivers[v]);
+  }
+
+  for (size_t v = 0; v < NUM_VIEWERS; v++)
+  {
+    Receiver *receiver = &receivers[v];
+    POSRTPSenderStats stats;
+
+    // all of it, rebuilt into exactly what the encoder put out
+    POS_TEST_CHECK(receiver->numGaps == 0);
+    POS_TEST_CHECK(!receiver->inFU);
+    POS_TEST_CHECK(receiver->nalStreamBytes == expectedBytes);
+    POS_TEST_CHECK_BYTES(receiver->nalStream, expected, expectedBytes);
+    POS_TEST_CHECK(receiver->numPackets == receivers[0].numPackets);
+    POS_TEST_CHECK(memcmp(receiver->timeStamps, receivers[0].timeStamps,
+                          receiver->numPackets * sizeof(receiver->timeStamps[0])) == 0);
+    POS_TEST_CHECK(receiver->numParity == viewers[v].fec.parityPacketsBuilt);
+    POS_TEST_CHECK(receiver->numParity > 0);
+
+    // sender reports and the NACK history follow the viewer's own packets
+    POSRTPStreamGetSenderStats(&viewers[v].stream, &stats);
+    POS_TEST_CHECK(stats.packetCount == receiver->numPackets);
+    POS_TEST_CHECK(stats.rtpTimeStamp == receiver->firstTimeStamp + receiver->timeStamps[receiver->numPackets - 1]);
+    const POSRTPHistorySlot *slot = &viewers[v].history.slots[(uint16_t)(receiver->nextSeq - 1) &
+                                                                 (POS_RTP_HISTORY_PACKETS - 1)];
+    POS_TEST_CHECK(slot->seq == (uint16_t)(receiver->nextSeq - 1));
+
+    // every IDR counted for the PLI holdoff
+    POS_TEST_CHECK(viewers[v].stream.keyFramesPushed == NUM_FRAMES / GOP_FRAMES);
+  }
+  // a different timestamp base and sequence numbers for each
+  POS_TEST_CHECK(receivers[0].firstTimeStamp != receivers[1].firstTimeStamp);
+  printf("%u packets to each of %d viewers, %u to %u FEC parity\n", receivers[0].numPackets, NUM_VIEWERS,
+         receivers[0].numParity, receivers[NUM_VIEWERS - 1].numParity);
+  StopViewers(NUM_VIEWERS);
+}
+
+static void test_stalled_viewer(void)
+{
+  HAPTime now = 10000000000ull;
+  int stallFrame = 40;
+  uint32_t framesSkipped = 0;
+  size_t bytesBeforeStall = 0;
+
+  StartViewers(3, now);
+  for (int idx = 0; idx < NUM_FRAMES; idx++)
+  {
+    now += FRAME_NS;
+    // the second viewer's socket takes nothing for two frames
+    stalledSock = idx >= stallFrame && idx < stallFrame + 2 ? viewers[1].sock : -1;
+    if (idx == stallFrame)
+      bytesBeforeStall = receivers[1].nalStreamBytes;
+    uint32_t packetsDropped = fanout.viewers[1].packetsDropped;
+    SendFrame(&frames[idx], now);
+    if (fanout.viewers[1].packetsDropped != packetsDropped)
+      framesSkipped++;
+    for (size_t v = 0; v < 3; v++)
+      Receive(&receivers[v]);
+  }
+  stalledSock = -1;
+
+  POSRTPViewer *stalled = &fanout.viewers[1];
+  POS_TEST_CHECK(stalled->stream == &viewers[1].stream);
+  POS_TEST_CHECK(stalled->stalls == 1);
+  POS_TEST_CHECK(stalled->packetsDropped > 0);
+
+  // the others didn't notice
+  for (size_t v = 0; v < 3; v += 2)
+  {
+    POS_TEST_CHECK(receivers[v].numGaps == 0);
+    POS_TEST_CHECK(receivers[v].nalStreamBytes == expectedBytes);
+    POS_TEST_CHECK(fanout.viewers[v].stalls == 0);
+  }
+
+  // one gap, sequence numbers still used up, and back after POS_RTP_FANOUT_STALL_NS
+  POSRTPSenderStats stats;
+  POSRTPStreamGetSenderStats(&viewers[1].stream, &stats);
+  POS_TEST_CHECK(receivers[1].numGaps == 1);
+  POS_TEST_CHECK(receivers[1].numLost == stalled->packetsDropped);
+  POS_TEST_CHECK(receivers[1].numPackets + receivers[1].numLost == receivers[0].numPackets);
+  POS_TEST_CHECK(stats.packetCount == receivers[0].numPackets);
+  POS_TEST_CHECK(stalled->packetsSent == receivers[1].numPackets);
+  POS_TEST_CHECK(framesSkipped == (POS_RTP_FANOUT_STALL_NS + FRAME_NS - 1) / FRAME_NS);
+
+  // everything up to the stall, and everything from the next key frame on
+  POS_TEST_CHECK(!receivers[1].resyncing);
+  POS_TEST_CHECK(receivers[1].resyncOffset >= bytesBeforeStall);
+  POS_TEST_CHECK_BYTES(receivers[1].nalStream, expected, bytesBeforeStall);
+  size_t keyFrame = keyFrameOffsets[numKeyFrames - 1];
+  POS_TEST_CHECK(receivers[1].nalStreamBytes - receivers[1].resyncOffset == expectedBytes - keyFrame);
+  POS_TEST_CHECK_BYTES(receivers[1].nalStream + receivers[1].resyncOffset, expected + keyFrame,
+                       expectedBytes - keyFrame);
+  printf("stalled viewer: %u packets dropped over %u frames\n", stalled->packetsDropped, framesSkipped);
+  StopViewers(3);
+}
+
+static void test_cpu_per_viewer(void)
+{
+  uint64_t previousNs = 0;
+
+  printf("viewers  send thread CPU per frame  added by the last viewer\n");
+  for (size_t numViewers = 1; numViewers <= NUM_VIEWERS; numViewers++)
+  {
+    HAPTime now = 10000000000ull;
+    uint64_t totalNs = 0;
+
+    StartViewers(numViewers, now);
+    for (int idx = 0; idx < NUM_FRAMES; idx++)
+    {
+      now += FRAME_NS;
+      totalNs += SendFrame(&frames[idx], now);
+      for (size_t v = 0; v < numViewers; v++)
+        Receive(&receivers[v]);
+    }
+    for (size_t v = 0; v < numViewers; v++)
+      POS_TEST_CHECK(receivers[v].nalStreamBytes == expectedBytes);
+    StopViewers(numViewers);
+
+    uint64_t perFrameNs = totalNs / NUM_FRAMES;
+    printf("%7zu  %20llu us  %21lld us\n", numViewers, (unsigned long long)(perFrameNs / 1000),
+           numViewers == 1 ? 0ll : (long long)(perFrameNs - previousNs) / 1000);
+    previousNs = perFrameNs;
+  }
+}
+
+int main(void)
+{
+  char path[] = "/tmp/test_rtp_fanout_XXXXXX";
+  int fd = mkstemp(path);
+  POS_TEST_CHECK(fd >= 0);
+  close(fd);
+  WriteStream(path);
+  setenv("POS_SIM_H264", path, 1);
+  setenv("POS_SIM_SPEED", "100", 1);
+  RecordFrames();
+  unlink(path);
+
+  test_fanout();
+  test_stalled_viewer();
+  test_cpu_per_viewer();
+  return 0;
+}
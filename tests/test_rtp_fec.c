@@ -0,0 +1,646 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Sends frames through POSRTPFecEncoder, drops packets on the way and rebuilds them
+// the way an RFC 5109 receiver would, from the parity packets alone.  A recovered
+// packet has to match the one that was sent byte for byte.  Also runs the encoder
+// behind a POSRTPStreamRef, where the parity has to come from the plaintext and go
+// out SRTP protected, and reports the residual frame loss against the overhead.
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "POSRTPController.h"
+#include "POSRTPFec.h"
+
+#include "pos_test.h"
+
+#define FEC_PAYLOAD_TYPE 118
+#define MEDIA_SSRC 0x11223344
+#define MAX_PACKETS 1024
+#define MAX_PARITY 1024
+
+typedef struct
+{
+  uint8_t bytes[12 + POS_RTP_FEC_MAX_PAYLOAD + 64];
+  size_t numBytes;
+  bool sent;
+  bool received;
+} Packet;
+
+typedef struct
+{
+  POSRTPFecEncoder fec;
+  uint16_t firstSeq;
+  uint16_t nextSeq;
+  uint32_t timestamp;
+  uint32_t random;
+  Packet media[MAX_PACKETS];
+  uint8_t parity[MAX_PARITY][POS_RTP_FEC_PARITY_STRIDE];
+  size_t parityLens[MAX_PARITY];
+  bool parityLost[MAX_PARITY];
+  size_t numParity;
+  uint16_t nextParitySeq;
+} Loopback;
+
+static uint32_t Random(Loopback *loop)
+{
+  loop->random = loop->random * 1664525 + 1013904223;
+  return loop->random >> 8;
+}
+
+static void LoopbackInit(Loopback *loop, uint16_t firstSeq, uint8_t fractionLost)
+{
+  memset(loop, 0, sizeof(*loop));
+  POSRTPFecInit(&loop->fec, FEC_PAYLOAD_TYPE, MEDIA_SSRC + 1);
+  POSRTPFecSetFractionLost(&loop->fec, fractionLost);
+  loop->firstSeq = firstSeq;
+  loop->nextSeq = firstSeq;
+  loop->timestamp = 0xfffff000; // wraps during the test
+  loop->random = 1;
+  loop->nextParitySeq = loop->fec.seq;
+}
+
+static Packet *MediaPacket(Loopback *loop, uint16_t seq)
+{
+  uint16_t idx = (uint16_t)(seq - loop->firstSeq);
+  POS_TEST_CHECK(idx < MAX_PACKETS);
+  return &loop->media[idx];
+}
+
+// Checks the RTP header of a parity packet and keeps a copy
+static void CollectParity(Loopback *loop, size_t numReady)
+{
+  for (size_t n = 0; n < numReady; n++)
+  {
+    const uint8_t *bytes = loop->fec.parityPackets + n * POS_RTP_FEC_PARITY_STRIDE;
+    size_t numBytes = loop->fec.parityLens[n];
+
+    POS_TEST_CHECK(numBytes > POS_RTP_FEC_HEADER_BYTES && numBytes <= POS_RTP_FEC_PARITY_STRIDE - 2);
+    POS_TEST_CHECK(bytes[0] == 0x80);
+    POS_TEST_CHECK(bytes[1] == FEC_PAYLOAD_TYPE);
+    POS_TEST_CHECK((uint16_t)(bytes[2] << 8 | bytes[3]) == loop->nextParitySeq);
+    POS_TEST_CHECK(((uint32_t)bytes[8] << 24 | (uint32_t)bytes[9] << 16 | (uint32_t)bytes[10] << 8 | bytes[11]) ==
+                   MEDIA_SSRC + 1);
+    POS_TEST_CHECK((bytes[12] & 0xc0) == 0x40); // E = 0, L = 1
+    loop->nextParitySeq++;
+
+    POS_TEST_CHECK(loop->numParity < MAX_PARITY);
+    memcpy(loop->parity[loop->numParity], bytes, numBytes);
+    loop->parityLens[loop->numParity] = numBytes;
+    loop->numParity++;
+  }
+}
+
+// Sends one packet of payloadLen random bytes, the marker bit ends the frame
+static void SendPacket(Loopback *loop, size_t payloadLen, bool marker)
+{
+  Packet *packet = MediaPacket(loop, loop->nextSeq);
+  uint8_t *bytes = packet->bytes;
+
+  POS_TEST_CHECK(12 + payloadLen <= sizeof(packet->bytes));
+  bytes[0] = 0x80 | (Random(loop) & 0x3f); // P, X and CC have to come back too
+  bytes[1] = (marker ? 0x80 : 0) | 99;
+  bytes[2] = (uint8_t)(loop->nextSeq >> 8);
+  bytes[3] = (uint8_t)loop->nextSeq;
+  bytes[4] = (uint8_t)(loop->timestamp >> 24);
+  bytes[5] = (uint8_t)(loop->timestamp >> 16);
+  bytes[6] = (uint8_t)(loop->timestamp >> 8);
+  bytes[7] = (uint8_t)loop->timestamp;
+  bytes[8] = (uint8_t)(MEDIA_SSRC >> 24);
+  bytes[9] = (uint8_t)(MEDIA_SSRC >> 16);
+  bytes[10] = (uint8_t)(MEDIA_SSRC >> 8);
+  bytes[11] = (uint8_t)MEDIA_SSRC;
+  for (size_t idx = 0; idx < payloadLen; idx++)
+    bytes[12 + idx] = (uint8_t)Random(loop);
+  packet->numBytes = 12 + payloadLen;
+  packet->sent = true;
+  packet->received = true;
+  loop->nextSeq++;
+
+  CollectParity(loop, POSRTPFecAddPacket(&loop->fec, bytes, packet->numBytes));
+}
+
+// Sends a frame of numPackets packets, each up to maxPayload bytes
+static void SendFrame(Loopback *loop, size_t numPackets, size_t maxPayload)
+{
+  for (size_t n = 0; n < numPackets; n++)
+    SendPacket(loop, 1 + Random(loop) % maxPayload, n == numPackets - 1);
+  loop->timestamp += 3000;
+}
+
+// Rebuilds the packet a parity packet is missing, returns false unless exactly one is
+static bool RecoverOne(Loopback *loop, const uint8_t *parity, size_t parityLen)
+{
+  uint16_t snBase = (uint16_t)(parity[14] << 8 | parity[15]);
+  uint16_t protectionLength = (uint16_t)(parity[22] << 8 | parity[23]);
+  uint64_t mask = 0;
+  for (int b = 0; b < 6; b++)
+    mask = mask << 8 | parity[24 + b];
+  POS_TEST_CHECK(parityLen == POS_RTP_FEC_HEADER_BYTES + protectionLength);
+
+  Packet *missing = NULL;
+  uint16_t missingSeq = 0;
+  for (int position = 0; position < 48; position++)
+  {
+    if (!(mask & ((uint64_t)1 << (47 - position))))
+      continue;
+    uint16_t seq = (uint16_t)(snBase + position);
+    Packet *packet = MediaPacket(loop, seq);
+    POS_TEST_CHECK(packet->sent);
+    if (packet->received)
+      continue;
+    if (missing)
+      return false;
+    missing = packet;
+    missingSeq = seq;
+  }
+  if (!missing)
+    return false;
+
+  uint8_t byte0 = parity[12];
+  uint8_t byte1 = parity[13];
+  uint32_t ts = (uint32_t)parity[16] << 24 | (uint32_t)parity[17] << 16 | (uint32_t)parity[18] << 8 | parity[19];
+  uint16_t length = (uint16_t)(parity[20] << 8 | parity[21]);
+  uint8_t payload[POS_RTP_FEC_MAX_PAYLOAD];
+  memcpy(payload, parity + POS_RTP_FEC_HEADER_BYTES, protectionLength);
+
+  for (int position = 0; position < 48; position++)
+  {
+    if (!(mask & ((uint64_t)1 << (47 - position))))
+      continue;
+    const Packet *packet = MediaPacket(loop, (uint16_t)(snBase + position));
+    if (packet == missing)
+      continue;
+    const uint8_t *bytes = packet->bytes;
+    size_t payloadLen = packet->numBytes - 12;
+    POS_TEST_CHECK(payloadLen <= protectionLength);
+    byte0 ^= bytes[0];
+    byte1 ^= bytes[1];
+    ts ^= (uint32_t)bytes[4] << 24 | (uint32_t)bytes[5] << 16 | (uint32_t)bytes[6] << 8 | bytes[7];
+    length ^= (uint16_t)payloadLen;
+    for (size_t idx = 0; idx < payloadLen; idx++)
+      payload[idx] ^= bytes[12 + idx];
+  }
+  POS_TEST_CHECK(length <= protectionLength);
+
+  uint8_t rebuilt[12 + POS_RTP_FEC_MAX_PAYLOAD];
+  rebuilt[0] = 0x80 | (byte0 & 0x3f);
+  rebuilt[1] = byte1;
+  rebuilt[2] = (uint8_t)(missingSeq >> 8);
+  rebuilt[3] = (uint8_t)missingSeq;
+  rebuilt[4] = (uint8_t)(ts >> 24);
+  rebuilt[5] = (uint8_t)(ts >> 16);
+  rebuilt[6] = (uint8_t)(ts >> 8);
+  rebuilt[7] = (uint8_t)ts;
+  rebuilt[8] = (uint8_t)(MEDIA_SSRC >> 24);
+  rebuilt[9] = (uint8_t)(MEDIA_SSRC >> 16);
+  rebuilt[10] = (uint8_t)(MEDIA_SSRC >> 8);
+  rebuilt[11] = (uint8_t)MEDIA_SSRC;
+  memcpy(rebuilt + 12, payload, length);
+
+  POS_TEST_CHECK(12 + (size_t)length == missing->numBytes);
+  POS_TEST_CHECK_BYTES(rebuilt, missing->bytes, missing->numBytes);
+  missing->received = true;
+  return true;
+}
+
+// Runs recovery until no parity packet helps any more, row parity can unlock a column and back
+static size_t Recover(Loopback *loop)
+{
+  size_t numRecovered = 0;
+  bool progress = true;
+
+  while (progress)
+  {
+    progress = false;
+    for (size_t n = 0; n < loop->numParity; n++)
+    {
+      if (loop->parityLost[n])
+        continue;
+      if (RecoverOne(loop, loop->parity[n], loop->parityLens[n]))
+      {
+        numRecovered++;
+        progress = true;
+      }
+    }
+  }
+  return numRecovered;
+}
+
+static size_t CountLost(const Loopback *loop)
+{
+  size_t numLost = 0;
+  for (size_t idx = 0; idx < MAX_PACKETS; idx++)
+    numLost += loop->media[idx].sent && !loop->media[idx].received;
+  return numLost;
+}
+
+static void Drop(Loopback *loop, uint16_t seq)
+{
+  MediaPacket(loop, seq)->received = false;
+}
+
+// Under 1% loss FEC is off and nothing extra goes out
+static void test_off(void)
+{
+  static Loopback loop;
+  LoopbackInit(&loop, 1000, 2);
+
+  for (int frame = 0; frame < 20; frame++)
+    SendFrame(&loop, 8, POS_RTP_FEC_MAX_PAYLOAD);
+  POS_TEST_CHECK(loop.numParity == 0);
+  POS_TEST_CHECK(loop.fec.packetsProtected == 0);
+
+  // payload type 0 turns it off whatever the loss
+  POSRTPFecInit(&loop.fec, 0, MEDIA_SSRC + 1);
+  POSRTPFecSetFractionLost(&loop.fec, 200);
+  SendFrame(&loop, 8, POS_RTP_FEC_MAX_PAYLOAD);
+  POS_TEST_CHECK(loop.numParity == 0);
+}
+
+// 1x5 blocks: one loss anywhere in a row comes back, across a sequence number wrap,
+// with packets of every length and frames that end blocks early
+static void test_row_parity(void)
+{
+  static Loopback loop;
+  LoopbackInit(&loop, 65000, 10);
+
+  for (int frame = 0; frame < 100; frame++)
+    SendFrame(&loop, 1 + frame % 9, POS_RTP_FEC_MAX_PAYLOAD);
+  POS_TEST_CHECK((uint16_t)(loop.nextSeq - loop.firstSeq) == loop.fec.packetsProtected);
+  POS_TEST_CHECK(loop.numParity == loop.fec.parityPacketsBuilt);
+
+  // each parity packet covers its own run of packets, drop the last one of each
+  size_t numDropped = 0;
+  for (size_t n = 0; n < loop.numParity; n++)
+  {
+    const uint8_t *parity = loop.parity[n];
+    uint16_t snBase = (uint16_t)(parity[14] << 8 | parity[15]);
+    uint64_t mask = 0;
+    for (int b = 0; b < 6; b++)
+      mask = mask << 8 | parity[24 + b];
+    int numProtected = __builtin_popcountll(mask);
+    POS_TEST_CHECK(numProtected >= 1 && numProtected <= 5);
+    POS_TEST_CHECK(mask == (((uint64_t)1 << numProtected) - 1) << (48 - numProtected));
+    Drop(&loop, (uint16_t)(snBase + n % numProtected));
+    numDropped++;
+  }
+  POS_TEST_CHECK(numDropped > 100);
+  POS_TEST_CHECK(Recover(&loop) == numDropped);
+  POS_TEST_CHECK(CountLost(&loop) == 0);
+}
+
+// Two losses in one row can't be rebuilt from row parity, and nothing wrong comes back
+static void test_double_loss(void)
+{
+  static Loopback loop;
+  LoopbackInit(&loop, 3000, 10);
+
+  SendFrame(&loop, 10, 200);
+  POS_TEST_CHECK(loop.numParity == 2);
+  Drop(&loop, 3001);
+  Drop(&loop, 3003);
+  Drop(&loop, 3007);
+  POS_TEST_CHECK(Recover(&loop) == 1);
+  POS_TEST_CHECK(CountLost(&loop) == 2);
+  POS_TEST_CHECK(!MediaPacket(&loop, 3001)->received);
+  POS_TEST_CHECK(!MediaPacket(&loop, 3003)->received);
+}
+
+// 4x4 blocks add column parity: a burst that takes out a whole row comes back from the
+// columns, and a 2x2 square comes back once the rows and columns unlock each other
+static void test_burst(void)
+{
+  static Loopback loop;
+  LoopbackInit(&loop, 40000, 30);
+
+  SendFrame(&loop, 16, POS_RTP_FEC_MAX_PAYLOAD);
+  SendFrame(&loop, 16, POS_RTP_FEC_MAX_PAYLOAD);
+  POS_TEST_CHECK(loop.numParity == 16);
+
+  for (uint16_t seq = 40004; seq < 40008; seq++)
+    Drop(&loop, seq);
+  // second block: a 2x2 square plus one more in a spare row and column
+  Drop(&loop, 40016 + 5);
+  Drop(&loop, 40016 + 6);
+  Drop(&loop, 40016 + 9);
+  Drop(&loop, 40016 + 10);
+  Drop(&loop, 40016 + 15);
+  POS_TEST_CHECK(Recover(&loop) == 4 + 1);
+  // the square itself has two losses in every row and column it touches
+  POS_TEST_CHECK(CountLost(&loop) == 4);
+
+  // with one corner back the rest of the square unlocks
+  MediaPacket(&loop, 40016 + 5)->received = true;
+  POS_TEST_CHECK(Recover(&loop) == 3);
+  POS_TEST_CHECK(CountLost(&loop) == 0);
+}
+
+// A new shape takes effect at the next block, a gap in the sequence numbers or an
+// oversized packet closes the current block early and goes out unprotected
+static void test_block_boundaries(void)
+{
+  static Loopback loop;
+  LoopbackInit(&loop, 500, 10);
+
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, 100, false);
+  POSRTPFecSetFractionLost(&loop.fec, 30);
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, 100, false);
+  POS_TEST_CHECK(loop.numParity == 1); // still 1x5
+  POS_TEST_CHECK(loop.fec.rows == 1);
+
+  // first packet of the next block picks up 4x4, then a gap closes it after 3
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, 100, false);
+  POS_TEST_CHECK(loop.fec.rows == 4 && loop.fec.cols == 4);
+  loop.nextSeq++;
+  SendPacket(&loop, 100, false);
+  // one row parity and three column parities, the empty column is skipped
+  POS_TEST_CHECK(loop.numParity == 1 + 4);
+
+  // the packet after the gap closed the block and went out unprotected, the next one
+  // starts a block that an oversized packet closes again
+  POS_TEST_CHECK(loop.fec.packetsProtected == 8);
+  SendPacket(&loop, 100, false);
+  SendPacket(&loop, POS_RTP_FEC_MAX_PAYLOAD + 1, false);
+  POS_TEST_CHECK(loop.numParity == 1 + 4 + 2);
+  POS_TEST_CHECK(loop.fec.packetsProtected == 9);
+
+  Drop(&loop, 502);
+  Drop(&loop, 505);
+  Drop(&loop, 510);
+  POS_TEST_CHECK(Recover(&loop) == 3);
+  Drop(&loop, 509);
+  Drop(&loop, 511);
+  POS_TEST_CHECK(Recover(&loop) == 0);
+}
+
+// Frames of FRAME_PACKETS packets over a link that drops LINK_LOSS percent of everything,
+// media and parity alike, with the block shape the receiver report of that loss picks.
+// Prints the residual frame loss with and without FEC against the bytes FEC adds.
+#define FRAME_PACKETS 8
+#define ROUND_FRAMES 100
+#define ROUNDS 20
+static void test_residual_loss(void)
+{
+  static Loopback loop;
+  static const uint32_t linkLoss[] = {1, 3, 5, 10, 15, 25};
+
+  printf("link loss  fec block  overhead  frames lost without fec  with fec\n");
+  for (size_t row = 0; row < sizeof(linkLoss) / sizeof(linkLoss[0]); row++)
+  {
+    uint8_t fractionLost = (uint8_t)(linkLoss[row] * 256 / 100);
+    size_t numFrames = 0, numLostBefore = 0, numLostAfter = 0;
+    uint64_t mediaBytes = 0, parityBytes = 0;
+
+    for (uint32_t round = 0; round < ROUNDS; round++)
+    {
+      LoopbackInit(&loop, (uint16_t)(round * 7919), fractionLost);
+      loop.random = round + 1;
+      // full packets at the MTU HAP negotiates and a shorter last one, like the packetizer sends
+      for (int frame = 0; frame < ROUND_FRAMES; frame++)
+      {
+        for (int n = 0; n < FRAME_PACKETS - 1; n++)
+          SendPacket(&loop, 1350, false);
+        SendPacket(&loop, 1 + Random(&loop) % 1350, true);
+        loop.timestamp += 3000;
+      }
+      for (size_t idx = 0; idx < ROUND_FRAMES * FRAME_PACKETS; idx++)
+      {
+        loop.media[idx].received = Random(&loop) % 100 >= linkLoss[row];
+        mediaBytes += loop.media[idx].numBytes;
+      }
+      for (size_t n = 0; n < loop.numParity; n++)
+      {
+        loop.parityLost[n] = Random(&loop) % 100 < linkLoss[row];
+        parityBytes += loop.parityLens[n];
+      }
+
+      bool frameLost[ROUND_FRAMES] = {false};
+      for (size_t idx = 0; idx < ROUND_FRAMES * FRAME_PACKETS; idx++)
+        frameLost[idx / FRAME_PACKETS] |= !loop.media[idx].received;
+      for (int frame = 0; frame < ROUND_FRAMES; frame++)
+        numLostBefore += frameLost[frame];
+      Recover(&loop);
+      memset(frameLost, 0, sizeof(frameLost));
+      for (size_t idx = 0; idx < ROUND_FRAMES * FRAME_PACKETS; idx++)
+        frameLost[idx / FRAME_PACKETS] |= !loop.media[idx].received;
+      for (int frame = 0; frame < ROUND_FRAMES; frame++)
+        numLostAfter += frameLost[frame];
+      numFrames += ROUND_FRAMES;
+    }
+
+    printf("%8u%%  %5ux%-3u  %7.1f%%  %22.1f%%  %7.1f%%\n", linkLoss[row], loop.fec.rows, loop.fec.cols,
+           100.0 * parityBytes / mediaBytes, 100.0 * numLostBefore / numFrames, 100.0 * numLostAfter / numFrames);
+    // under 1% FEC is off
+    if (linkLoss[row] <= 1)
+    {
+      POS_TEST_CHECK(parityBytes == 0 && numLostAfter == numLostBefore);
+      continue;
+    }
+    POS_TEST_CHECK(numLostAfter < numLostBefore);
+    // what the block shapes are picked for: at a few percent most damaged frames come back
+    if (linkLoss[row] <= 10)
+      POS_TEST_CHECK(numLostAfter * 3 < numLostBefore);
+  }
+}
+
+// Runs the encoder behind a POSRTPStreamRef with SRTP: the parity has to be built from the
+// plaintext, go out encrypted and authenticated under the FEC SSRC, and rebuild the plaintext
+// of a lost packet.  The sender reports name the FEC SSRC next to the media one.
+static void test_stream_srtp(void)
+{
+  static Loopback loop;
+  static POSRTPStreamRef stream;
+  static POSRTPFecEncoder fec;
+  static POSRTPFecBatch batch;
+  static uint8_t pool[16][1500];
+  static uint8_t slice[8000];
+  size_t packetLens[16];
+  size_t numPackets, numPayloadBytes;
+  srtp_ctx mediaSrtp, mediaRtcp, fecSrtp, fecRtcp;
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x99887766, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+  HAPTime now = 10000000000ull;
+
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(&stream, &rtpParameters, RTPType_H264, 90000, MEDIA_SSRC, now, "positron-test", &srtpParameters,
+                    &srtpParameters);
+  POSRTPFecInit(&fec, FEC_PAYLOAD_TYPE, MEDIA_SSRC + 1);
+  POSRTPFecSetFractionLost(&fec, 10);
+  POSRTPStreamSetFec(&stream, &fec, &batch, &srtpParameters);
+
+  // the controller's view of the camera's keys
+  memset(&mediaSrtp, 0, sizeof(mediaSrtp));
+  memset(&mediaRtcp, 0, sizeof(mediaRtcp));
+  memset(&fecSrtp, 0, sizeof(fecSrtp));
+  memset(&fecRtcp, 0, sizeof(fecRtcp));
+  srtp_setupContext(&mediaSrtp, &mediaRtcp, (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                    (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10, MEDIA_SSRC);
+  srtp_setupContext(&fecSrtp, &fecRtcp, (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                    (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10, MEDIA_SSRC + 1);
+
+  memset(&loop, 0, sizeof(loop));
+  loop.random = 7;
+  loop.nextParitySeq = fec.seq;
+  uint32_t mediaRoc = 0, fecRoc = 0;
+  uint16_t lastFecSeq = fec.seq;
+  bool first = true;
+  for (int frame = 0; frame < 40; frame++)
+  {
+    size_t numSliceBytes = 200 + Random(&loop) % (sizeof(slice) - 200);
+    for (size_t idx = 0; idx < numSliceBytes; idx++)
+      slice[idx] = (uint8_t)Random(&loop);
+    slice[0] = 0x41;
+    now += 33000000;
+    POSRTPStreamPushPayload(&stream, slice, numSliceBytes, &numPayloadBytes, now, now);
+    do
+    {
+      POSRTPStreamPollPackets(&stream, pool, sizeof(pool[0]), 16, packetLens, &numPackets);
+      for (size_t n = 0; n < numPackets; n++)
+      {
+        uint8_t *bytes = pool[n];
+        uint16_t seq = (uint16_t)(bytes[2] << 8 | bytes[3]);
+        if (first)
+          loop.firstSeq = loop.nextSeq = seq;
+        else if (seq < loop.nextSeq)
+          mediaRoc++;
+        first = false;
+        POS_TEST_CHECK(seq == loop.nextSeq);
+        loop.nextSeq++;
+        size_t numBytes = packetLens[n] - 10;
+        POS_TEST_CHECK(srtp_verifyAuthentication(&mediaSrtp, bytes + numBytes, bytes, numBytes, mediaRoc));
+
+        Packet *packet = MediaPacket(&loop, seq);
+        memcpy(packet->bytes, bytes, 12);
+        srtp_decrypt(&mediaSrtp, packet->bytes + 12, bytes + 12, numBytes - 12, mediaRoc << 16 | seq);
+        packet->numBytes = numBytes;
+        packet->sent = true;
+        packet->received = true;
+      }
+      for (size_t n = 0; n < batch.numPackets; n++)
+      {
+        uint8_t *bytes = batch.packets[n];
+        uint16_t seq = (uint16_t)(bytes[2] << 8 | bytes[3]);
+        size_t numBytes = batch.lens[n] - 10;
+
+        POS_TEST_CHECK(batch.after[n] < numPackets);
+        POS_TEST_CHECK(n == 0 || batch.after[n] >= batch.after[n - 1]);
+        if (seq < lastFecSeq)
+          fecRoc++;
+        lastFecSeq = seq;
+        POS_TEST_CHECK(srtp_verifyAuthentication(&fecSrtp, bytes + numBytes, bytes, numBytes, fecRoc));
+
+        static uint8_t parity[POS_RTP_FEC_PARITY_STRIDE];
+        static uint8_t wrongKeystream[POS_RTP_FEC_PARITY_STRIDE];
+        memcpy(parity, bytes, 12);
+        srtp_decrypt(&fecSrtp, parity + 12, bytes + 12, numBytes - 12, fecRoc << 16 | seq);
+        // only the RTP header is in the clear, and under the FEC SSRC's keystream, not the media one
+        POS_TEST_CHECK(memcmp(parity + 12, bytes + 12, numBytes - 12) != 0);
+        srtp_decrypt(&mediaSrtp, wrongKeystream, bytes + 12, numBytes - 12, fecRoc << 16 | seq);
+        POS_TEST_CHECK(memcmp(parity + 12, wrongKeystream, numBytes - 12) != 0);
+        POS_TEST_CHECK(loop.numParity < MAX_PARITY);
+        memcpy(loop.parity[loop.numParity], parity, numBytes);
+        loop.parityLens[loop.numParity] = numBytes;
+        loop.numParity++;
+      }
+      // each batch starts over
+      POS_TEST_CHECK(batch.numPackets == 0 || numPackets != 0);
+    } while (numPackets != 0);
+  }
+  POS_TEST_CHECK(batch.numDropped == 0);
+  POS_TEST_CHECK(loop.numParity == fec.parityPacketsBuilt);
+  POS_TEST_CHECK(loop.numParity > 40);
+
+  // parity over the ciphertext would rebuild garbage, the checks in RecoverOne compare against the plaintext
+  size_t numDropped = 0;
+  for (size_t n = 0; n < loop.numParity; n++)
+  {
+    const uint8_t *parity = loop.parity[n];
+    POS_TEST_CHECK(parity[1] == FEC_PAYLOAD_TYPE);
+    uint16_t snBase = (uint16_t)(parity[14] << 8 | parity[15]);
+    Drop(&loop, snBase);
+    numDropped++;
+  }
+  POS_TEST_CHECK(Recover(&loop) == numDropped);
+  POS_TEST_CHECK(CountLost(&loop) == 0);
+
+  // one sender report, decrypted the way the controller would
+  static uint8_t report[1500];
+  size_t numReportBytes = 0;
+  POSRTPStreamCheckFeedback(&stream, stream.nextRTCPReportHAPTime, report, sizeof(report), &numReportBytes, NULL,
+                            NULL, NULL);
+  POS_TEST_CHECK(numReportBytes > 8 + 4 + 10);
+  size_t numCompoundBytes = numReportBytes - 4 - 10;
+  uint32_t rtcpIndex = (uint32_t)report[numCompoundBytes] << 24 | (uint32_t)report[numCompoundBytes + 1] << 16 |
+                       (uint32_t)report[numCompoundBytes + 2] << 8 | report[numCompoundBytes + 3];
+  POS_TEST_CHECK(rtcpIndex & 0x80000000);
+  static uint8_t compound[1500];
+  memcpy(compound, report, 8);
+  srtp_decrypt(&mediaRtcp, compound + 8, report + 8, (uint32_t)numCompoundBytes - 8, rtcpIndex & 0x7fffffff);
+  size_t offset = 0;
+  bool sawSdes = false;
+  while (offset + 4 <= numCompoundBytes)
+  {
+    const uint8_t *rtcp = compound + offset;
+    size_t numRtcpBytes = 4 * ((size_t)(rtcp[2] << 8 | rtcp[3]) + 1);
+    if (rtcp[1] == 202)
+    {
+      // two chunks with the same CNAME, the media SSRC first
+      POS_TEST_CHECK((rtcp[0] & 0x1f) == 2);
+      POS_TEST_CHECK(((uint32_t)rtcp[4] << 24 | (uint32_t)rtcp[5] << 16 | (uint32_t)rtcp[6] << 8 | rtcp[7]) == MEDIA_SSRC);
+      size_t chunkBytes = (6 + rtcp[9] + 4) & ~(size_t)3;
+      const uint8_t *chunk = rtcp + 4 + chunkBytes;
+      POS_TEST_CHECK(((uint32_t)chunk[0] << 24 | (uint32_t)chunk[1] << 16 | (uint32_t)chunk[2] << 8 | chunk[3]) ==
+                     MEDIA_SSRC + 1);
+      POS_TEST_CHECK(chunk[4] == 1 && chunk[5] == rtcp[9]);
+      POS_TEST_CHECK_BYTES(chunk + 6, rtcp + 10, rtcp[9]);
+      POS_TEST_CHECK(4 + 2 * chunkBytes == numRtcpBytes);
+      sawSdes = true;
+    }
+    offset += numRtcpBytes;
+  }
+  POS_TEST_CHECK(offset == numCompoundBytes);
+  POS_TEST_CHECK(sawSdes);
+
+  POSRTPStreamEnd(&stream);
+  srtp_freeContext(&mediaSrtp, &mediaRtcp);
+  srtp_freeContext(&fecSrtp, &fecRtcp);
+}
+
+int main(void)
+{
+  test_off();
+  test_row_parity();
+  test_double_loss();
+  test_burst();
+  test_block_boundaries();
+  test_stream_srtp();
+  test_residual_loss();
+  printf("rtp fec tests passed\n");
+  return 0;
+}
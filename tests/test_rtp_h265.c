@@ -0,0 +1,405 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a synthetic H.265 stream through the simulated encoder and the RFC 7798
+// payloader.  The receiver rebuilds the NALUs from single NAL unit, aggregation and
+// fragmentation unit packets and must get exactly what the encoder put out, with the
+// VPS, SPS and PPS aggregated in front of every IRAP picture (IDR, CRA and IDR without
+// leading pictures), one timestamp per picture and the marker on its last packet.
+// Then writes the init segment of an HEVC recording track from the same parameter
+// sets and checks its hvc1 sample entry and hvcC record.
+
+#include <string.h>
+#include <unistd.h>
+
+#include <imp/imp_encoder.h>
+#include <imp/imp_system.h>
+
+#include "POSMP4Muxer.h"
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define NUM_FRAMES 90
+#define GOP_FRAMES 30
+#define FRAME_NS 33333333ull
+#define PAYLOAD_TYPE 99
+#define MAX_NAL_BYTES 40000
+#define NAL_STREAM_BYTES (4 * 1024 * 1024)
+
+// IRAP picture types of the three GOPs
+static const uint8_t IRAPTypes[NUM_FRAMES / GOP_FRAMES] = {19, 21, 20};
+
+// The SPS up to its profile_tier_level: NAL header, vps id, max sub layers 1 with temporal
+// id nesting, Main profile with the Main compatibility flags, progressive source and
+// frame only constraint flags, level 4.1.  As RBSP, the stream carries it escaped.
+static const uint8_t SPSHeader[15] = {0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x00,
+                                      0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7b};
+
+static uint8_t expected[NAL_STREAM_BYTES];
+static size_t expectedBytes;
+static uint8_t received[NAL_STREAM_BYTES];
+static size_t receivedBytes;
+static uint8_t VPS[128], SPS[128], PPS[128];
+static size_t VPSBytes, SPSBytes, PPSBytes;
+
+static uint32_t Random(uint32_t *state)
+{
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static void AppendNAL(uint8_t *stream, size_t *numStreamBytes, const uint8_t *bytes, size_t numBytes)
+{
+  POS_TEST_CHECK(*numStreamBytes + 4 + numBytes <= NAL_STREAM_BYTES);
+  stream[*numStreamBytes] = (uint8_t)(numBytes >> 24);
+  stream[*numStreamBytes + 1] = (uint8_t)(numBytes >> 16);
+  stream[*numStreamBytes + 2] = (uint8_t)(numBytes >> 8);
+  stream[*numStreamBytes + 3] = (uint8_t)numBytes;
+  memcpy(stream + *numStreamBytes + 4, bytes, numBytes);
+  *numStreamBytes += 4 + numBytes;
+}
+
+// Inserts the emulation prevention bytes, ITU-T H.265 7.4.2
+static size_t Escape(uint8_t *nal, const uint8_t *rbsp, size_t numBytes)
+{
+  size_t n = 0;
+  int zeros = 0;
+  for (size_t idx = 0; idx < numBytes; idx++)
+  {
+    if (zeros >= 2 && rbsp[idx] <= 3)
+    {
+      nal[n++] = 3;
+      zeros = 0;
+    }
+    zeros = rbsp[idx] == 0 ? zeros + 1 : 0;
+    nal[n++] = rbsp[idx];
+  }
+  return n;
+}
+
+// Writes three GOPs: VPS, SPS, PPS, a prefix SEI and an IRAP picture, then TRAIL_R pictures.
+// The bytes after each NALU header are never 0, so there is no start code to escape.
+static void WriteStream(const char *path)
+{
+  static uint8_t nal[MAX_NAL_BYTES];
+  static const uint8_t startCode[4] = {0, 0, 0, 1};
+  uint32_t random = 3;
+  FILE *file = fopen(path, "wb");
+  POS_TEST_CHECK(file != NULL);
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    size_t numNALUs = frame % GOP_FRAMES == 0 ? 5 : 1;
+    for (size_t n = 0; n < numNALUs; n++)
+    {
+      size_t numBytes;
+      size_t first = 2;
+      uint8_t NALType = numNALUs == 1 ? 1 : n == 0 ? 32 : n == 1 ? 33 : n == 2 ? 34 : n == 3 ? 39 : IRAPTypes[frame / GOP_FRAMES];
+      nal[0] = (uint8_t)(NALType << 1);
+      nal[1] = 0x01; // layer 0, TemporalId 0
+      if (NALType == 33)
+      {
+        first = Escape(nal, SPSHeader, sizeof(SPSHeader));
+        numBytes = first + 20;
+      }
+      else if (NALType == 1)
+        // some fit in a single packet, most are fragmented
+        numBytes = frame % 7 == 3 ? 200 + Random(&random) % 600 : 1500 + Random(&random) % 9000;
+      else if (NALType >= 16 && NALType <= 23)
+        numBytes = 20000 + Random(&random) % 10000;
+      else
+        numBytes = 6 + Random(&random) % 20;
+      for (size_t idx = first; idx < numBytes; idx++)
+        nal[idx] = (uint8_t)(1 + Random(&random) % 255);
+      POS_TEST_CHECK(fwrite(startCode, 1, sizeof(startCode), file) == sizeof(startCode));
+      POS_TEST_CHECK(fwrite(nal, 1, numBytes, file) == numBytes);
+    }
+  }
+  POS_TEST_CHECK(fclose(file) == 0);
+}
+
+// Rebuilds the NALUs of one packet: a single NAL unit, an aggregation packet or a fragmentation unit
+static void Depacketize(const uint8_t *payload, size_t numBytes, bool *inFU, size_t *fuStart, uint32_t *numAPs)
+{
+  uint8_t NALType = (payload[0] >> 1) & 0x3f;
+
+  POS_TEST_CHECK(numBytes > 2);
+  if (NALType == 48)
+  {
+    // the parameter sets, in order, under the layer and TemporalId of the picture they precede
+    static const uint8_t parameterSetTypes[3] = {32, 33, 34};
+    size_t pos = 2;
+    int n = 0;
+    POS_TEST_CHECK(!*inFU);
+    POS_TEST_CHECK((payload[0] & 0x81) == 0 && payload[1] == 0x01);
+    while (pos + 2 <= numBytes)
+    {
+      size_t nalBytes = (size_t)payload[pos] << 8 | payload[pos + 1];
+      POS_TEST_CHECK(pos + 2 + nalBytes <= numBytes);
+      POS_TEST_CHECK(n < 3 && ((payload[pos + 2] >> 1) & 0x3f) == parameterSetTypes[n]);
+      AppendNAL(received, &receivedBytes, payload + pos + 2, nalBytes);
+      pos += 2 + nalBytes;
+      n++;
+    }
+    POS_TEST_CHECK(pos == numBytes && n == 3);
+    (*numAPs)++;
+    return;
+  }
+  if (NALType != 49)
+  {
+    POS_TEST_CHECK(!*inFU);
+    AppendNAL(received, &receivedBytes, payload, numBytes);
+    return;
+  }
+
+  // FU: the payload header, then S, E and the type, the NAL header isn't sent
+  POS_TEST_CHECK(numBytes > 3);
+  if (payload[2] & 0x80)
+  {
+    uint8_t header[2] = {(uint8_t)((payload[0] & 0x81) | ((payload[2] & 0x3f) << 1)), payload[1]};
+    POS_TEST_CHECK(!*inFU);
+    *fuStart = receivedBytes;
+    *inFU = true;
+    AppendNAL(received, &receivedBytes, header, 2);
+  }
+  POS_TEST_CHECK(*inFU);
+  POS_TEST_CHECK(receivedBytes + numBytes - 3 <= NAL_STREAM_BYTES);
+  memcpy(received + receivedBytes, payload + 3, numBytes - 3);
+  receivedBytes += numBytes - 3;
+  size_t nalBytes = receivedBytes - *fuStart - 4;
+  received[*fuStart] = (uint8_t)(nalBytes >> 24);
+  received[*fuStart + 1] = (uint8_t)(nalBytes >> 16);
+  received[*fuStart + 2] = (uint8_t)(nalBytes >> 8);
+  received[*fuStart + 3] = (uint8_t)nalBytes;
+  if (payload[2] & 0x40)
+    *inFU = false;
+}
+
+static void test_payloader(void)
+{
+  static uint8_t packet[2048];
+  POSRTPStreamRef stream;
+  POSRTPParameters rtpParameters = {.type = PAYLOAD_TYPE, .ssrc = 0x55000000, .maxBitRate = 2000,
+                                    .RTCPInterval = 0.5f, .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+  IMPEncoderChnAttr attr;
+  HAPTime now = 10000000000ull;
+  uint32_t numPackets = 0, numAPs = 0, numFUs = 0, numPictures = 0;
+  uint32_t firstTimeStamp = 0;
+  uint16_t nextSeq = 0;
+  size_t fuStart = 0;
+  bool inFU = false;
+
+  // no SRTP, the packets come out as they go into the cipher
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  POSRTPStreamStart(&stream, &rtpParameters, RTPType_H265, 90000, 0x11223344, now, "positron-test", &srtpParameters,
+                    &srtpParameters);
+
+  POS_TEST_CHECK(IMP_System_Init() == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateGroup(0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_SetDefaultParam(&attr, IMP_ENC_PROFILE_HEVC_MAIN, IMP_ENC_RC_MODE_CBR, 1920, 1080, 30,
+                                             1, GOP_FRAMES, 2, -1, 2000) == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateChn(0, &attr) == 0);
+  POS_TEST_CHECK(IMP_Encoder_RegisterChn(0, 0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_StartRecvPic(0) == 0);
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    IMPEncoderStream encoded;
+    uint32_t timeStamp = 0;
+    bool marker = false;
+
+    now += FRAME_NS;
+    POS_TEST_CHECK(IMP_Encoder_PollingStream(0, 1000) == 0);
+    POS_TEST_CHECK(IMP_Encoder_GetStream(0, &encoded, true) == 0);
+    POS_TEST_CHECK(encoded.packCount == (frame % GOP_FRAMES == 0 ? 5u : 1u));
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+    {
+      uint8_t *nal = (uint8_t *)(uintptr_t)encoded.virAddr + encoded.pack[n].offset + 4;
+      size_t numBytes = encoded.pack[n].length - 4;
+      uint8_t NALType = (nal[0] >> 1) & 0x3f;
+      size_t numPayloadBytes = 0;
+
+      POS_TEST_CHECK(!marker);
+      switch (NALType)
+      {
+      case 32:
+        memcpy(VPS, nal, numBytes);
+        VPSBytes = numBytes;
+        break;
+      case 33:
+        memcpy(SPS, nal, numBytes);
+        SPSBytes = numBytes;
+        break;
+      case 34:
+        memcpy(PPS, nal, numBytes);
+        PPSBytes = numBytes;
+        break;
+      default:
+        if (NALType >= 16 && NALType <= 23)
+        {
+          AppendNAL(expected, &expectedBytes, VPS, VPSBytes);
+          AppendNAL(expected, &expectedBytes, SPS, SPSBytes);
+          AppendNAL(expected, &expectedBytes, PPS, PPSBytes);
+        }
+        AppendNAL(expected, &expectedBytes, nal, numBytes);
+      }
+
+      POSRTPStreamPushPayload(&stream, nal, numBytes, &numPayloadBytes, now, now);
+      for (;;)
+      {
+        size_t numPacketBytes = 0;
+        POSRTPStreamPollPacket(&stream, packet, sizeof(packet), &numPacketBytes);
+        if (numPacketBytes == 0)
+          break;
+        POS_TEST_CHECK(numPacketBytes <= rtpParameters.maximumMTU);
+        POS_TEST_CHECK((packet[1] & 0x7f) == PAYLOAD_TYPE);
+        uint16_t seq = (uint16_t)(packet[2] << 8 | packet[3]);
+        uint32_t packetTimeStamp =
+            (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+        if (numPackets == 0)
+        {
+          nextSeq = seq;
+          firstTimeStamp = packetTimeStamp;
+        }
+        POS_TEST_CHECK(seq == nextSeq);
+        nextSeq++;
+        if (timeStamp == 0)
+          timeStamp = packetTimeStamp;
+        POS_TEST_CHECK(packetTimeStamp == timeStamp);
+        POS_TEST_CHECK(!marker);
+        marker = (packet[1] & 0x80) != 0;
+        if (((packet[12] >> 1) & 0x3f) == 49)
+          numFUs++;
+        Depacketize(packet + 12, numPacketBytes - 12, &inFU, &fuStart, &numAPs);
+        numPackets++;
+      }
+    }
+    IMP_Encoder_ReleaseStream(0, &encoded);
+
+    // one timestamp per picture, 90 kHz, and the marker on its last packet
+    POS_TEST_CHECK(marker);
+    POS_TEST_CHECK(!inFU);
+    uint32_t ticks = timeStamp - firstTimeStamp;
+    POS_TEST_CHECK(ticks + 1 >= (uint32_t)frame * 3000 && ticks <= (uint32_t)frame * 3000 + 1);
+    numPictures++;
+  }
+  IMP_Encoder_StopRecvPic(0);
+
+  POS_TEST_CHECK(receivedBytes == expectedBytes);
+  POS_TEST_CHECK_BYTES(received, expected, expectedBytes);
+  POS_TEST_CHECK(numAPs == NUM_FRAMES / GOP_FRAMES);
+  POS_TEST_CHECK(numFUs > NUM_FRAMES);
+  // every IRAP picture counted for the PLI holdoff
+  POS_TEST_CHECK(stream.keyFramesPushed == NUM_FRAMES / GOP_FRAMES);
+  printf("%u pictures in %u packets, %u aggregation packets, %u fragments\n", numPictures, numPackets, numAPs,
+         numFUs);
+  POSRTPStreamEnd(&stream);
+}
+
+// Returns the offset of the payload of the first box of type under parent, or 0
+static size_t FindBox(const uint8_t *bytes, size_t start, size_t end, const char *type)
+{
+  for (size_t pos = start; pos + 8 <= end;)
+  {
+    size_t size = (size_t)bytes[pos] << 24 | (size_t)bytes[pos + 1] << 16 | (size_t)bytes[pos + 2] << 8 | bytes[pos + 3];
+    POS_TEST_CHECK(size >= 8 && pos + size <= end);
+    if (memcmp(bytes + pos + 4, type, 4) == 0)
+      return pos + 8;
+    pos += size;
+  }
+  return 0;
+}
+
+static void test_hvc1_sample_entry(void)
+{
+  static uint8_t init[4096];
+  static POSMp4VideoTrack videoTrack;
+  static POSMp4AudioTrack audioTrack;
+
+  videoTrack.hevc = true;
+  memcpy(videoTrack.VPSNALU, VPS, VPSBytes);
+  videoTrack.VPSNALUNumBytes = VPSBytes;
+  memcpy(videoTrack.SPSNALU, SPS, SPSBytes);
+  videoTrack.SPSNALUNumBytes = SPSBytes;
+  memcpy(videoTrack.PPSNALU, PPS, PPSBytes);
+  videoTrack.PPSNALUNumBytes = PPSBytes;
+  audioTrack.mute = true;
+  int numBytes = POSWriteMoov((char *)init, sizeof(init), &videoTrack, &audioTrack);
+  POS_TEST_CHECK(numBytes > 0 && numBytes <= (int)sizeof(init));
+
+  // moov/trak/mdia/minf/stbl/stsd/hvc1/hvcC
+  size_t end = (size_t)numBytes;
+  size_t pos = FindBox(init, 0, end, "moov");
+  POS_TEST_CHECK(pos != 0);
+  static const char *path[] = {"trak", "mdia", "minf", "stbl"};
+  for (size_t idx = 0; idx < sizeof(path) / sizeof(path[0]); idx++)
+  {
+    end = pos - 8 + ((size_t)init[pos - 8] << 24 | (size_t)init[pos - 7] << 16 | (size_t)init[pos - 6] << 8 |
+                     init[pos - 5]);
+    pos = FindBox(init, pos, end, path[idx]);
+    POS_TEST_CHECK(pos != 0);
+  }
+  end = pos - 8 + ((size_t)init[pos - 8] << 24 | (size_t)init[pos - 7] << 16 | (size_t)init[pos - 6] << 8 |
+                   init[pos - 5]);
+  pos = FindBox(init, pos, end, "stsd");
+  POS_TEST_CHECK(pos != 0);
+  POS_TEST_CHECK(FindBox(init, pos + 8, end, "avc1") == 0);
+  size_t sampleEntry = FindBox(init, pos + 8, end, "hvc1");
+  POS_TEST_CHECK(sampleEntry != 0);
+  // the compressor name of the VisualSampleEntry, then its hvcC
+  POS_TEST_CHECK(memcmp(init + sampleEntry + 42, "\x04hevc", 5) == 0);
+  const uint8_t *hvcC = init + FindBox(init, sampleEntry + 78, end, "hvcC");
+  POS_TEST_CHECK(hvcC != init);
+
+  // HEVCDecoderConfigurationRecord, ISO/IEC 14496-15 8.3.3.1.2, the profile_tier_level from the unescaped SPS
+  POS_TEST_CHECK(hvcC[0] == 1);
+  POS_TEST_CHECK_BYTES(hvcC + 1, SPSHeader + 3, 12);
+  POS_TEST_CHECK(hvcC[13] == 0xf0 && hvcC[14] == 0x00);
+  POS_TEST_CHECK(hvcC[16] == 0xfd);
+  // one temporal layer, nested, 4 byte lengths
+  POS_TEST_CHECK(hvcC[21] == (1 << 3 | 1 << 2 | 3));
+  POS_TEST_CHECK(hvcC[22] == 3);
+  const uint8_t *array = hvcC + 23;
+  const uint8_t *parameterSets[3] = {VPS, SPS, PPS};
+  size_t parameterSetBytes[3] = {VPSBytes, SPSBytes, PPSBytes};
+  for (int idx = 0; idx < 3; idx++)
+  {
+    POS_TEST_CHECK(array[0] == (0x80 | (32 + idx)));
+    POS_TEST_CHECK(array[1] == 0 && array[2] == 1);
+    POS_TEST_CHECK(((size_t)array[3] << 8 | array[4]) == parameterSetBytes[idx]);
+    POS_TEST_CHECK_BYTES(array + 5, parameterSets[idx], parameterSetBytes[idx]);
+    array += 5 + parameterSetBytes[idx];
+  }
+}
+
+int main(void)
+{
+  char path[] = "/tmp/test_rtp_h265_XXXXXX";
+  int fd = mkstemp(path);
+  POS_TEST_CHECK(fd >= 0);
+  close(fd);
+  WriteStream(path);
+  setenv("POS_SIM_H264", path, 1);
+  setenv("POS_SIM_SPEED", "100", 1);
+
+  test_payloader();
+  unlink(path);
+  test_hvc1_sample_entry();
+  return 0;
+}
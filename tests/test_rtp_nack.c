@@ -0,0 +1,360 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Sends video through a POSRTPStreamRef with a packet history over a lossy virtual
+// link.  The receiver answers gaps with Generic NACKs, protected with SRTCP as a
+// controller would send them, and every packet resent has to be the one originally
+// sent, byte for byte.  Also checks the retransmission budget, the resend holdoff
+// and NACKs for packets that already left the history.
+
+#include <string.h>
+
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define CONTROLLER_SSRC 0x11223344
+#define CAMERA_SSRC 0x55667788
+#define MAX_PACKETS 4096
+#define MS ((HAPTime)1000000)
+
+typedef struct
+{
+    uint8_t bytes[1500];
+    size_t numBytes;
+    bool received;
+} SentPacket;
+
+typedef struct
+{
+    POSRTPStreamRef stream;
+    POSRTPPacketHistory history;
+    srtp_ctx controllerSrtp;
+    srtp_ctx controllerRtcp;
+    uint32_t rtcpIndex;
+    uint16_t firstSeq;
+    uint32_t numSent;
+    SentPacket sent[MAX_PACKETS];
+    uint32_t random;
+    uint32_t lossPercent;
+    uint32_t numLost;
+    uint32_t numResent;
+    HAPTime now;
+} Loopback;
+
+static void LoopbackStart(Loopback *loop, uint32_t lossPercent)
+{
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = CONTROLLER_SSRC, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+
+  memset(loop, 0, sizeof(*loop));
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(&loop->stream, &rtpParameters, RTPType_H264, 90000, CAMERA_SSRC, 1, "positron-test",
+                    &srtpParameters, &srtpParameters);
+  POSRTPStreamSetHistory(&loop->stream, &loop->history);
+  // the controller's outgoing keys are the camera's incoming ones
+  srtp_setupContext(&loop->controllerSrtp, &loop->controllerRtcp,
+                    (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 16,
+                    (const char *)srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 10, CONTROLLER_SSRC);
+  loop->rtcpIndex = 1;
+  loop->random = 1;
+  loop->lossPercent = lossPercent;
+  loop->now = 10000 * MS;
+}
+
+static uint32_t Random(Loopback *loop)
+{
+  loop->random = loop->random * 1664525 + 1013904223;
+  return loop->random >> 8;
+}
+
+static uint16_t PacketSeq(const uint8_t *bytes)
+{
+  return (uint16_t)(bytes[2] << 8 | bytes[3]);
+}
+
+static SentPacket *Sent(Loopback *loop, uint16_t seq)
+{
+  uint16_t idx = (uint16_t)(seq - loop->firstSeq);
+  POS_TEST_CHECK(idx < loop->numSent);
+  return &loop->sent[idx];
+}
+
+// Pushes one frame and keeps a copy of every packet, the link drops lossPercent of them
+static void SendFrame(Loopback *loop, size_t numSliceBytes)
+{
+  static uint8_t slice[20000];
+  static uint8_t pool[16][1500];
+  size_t packetLens[16];
+  size_t numPackets;
+  size_t numPayloadBytes;
+
+  POS_TEST_CHECK(numSliceBytes <= sizeof(slice));
+  for (size_t idx = 0; idx < numSliceBytes; idx++)
+    slice[idx] = (uint8_t)Random(loop);
+  slice[0] = 0x41;
+  POSRTPStreamPushPayload(&loop->stream, slice, numSliceBytes, &numPayloadBytes, loop->now, loop->now);
+  do
+  {
+    POSRTPStreamPollPackets(&loop->stream, pool, sizeof(pool[0]), 16, packetLens, &numPackets);
+    for (size_t n = 0; n < numPackets; n++)
+    {
+      if (loop->numSent == 0)
+        loop->firstSeq = PacketSeq(pool[n]);
+      POS_TEST_CHECK(PacketSeq(pool[n]) == (uint16_t)(loop->firstSeq + loop->numSent));
+      POS_TEST_CHECK(loop->numSent < MAX_PACKETS);
+      SentPacket *packet = &loop->sent[loop->numSent++];
+      memcpy(packet->bytes, pool[n], packetLens[n]);
+      packet->numBytes = packetLens[n];
+      packet->received = Random(loop) % 100 >= loop->lossPercent;
+      loop->numLost += !packet->received;
+    }
+  } while (numPackets != 0);
+}
+
+// Sends an empty RR and a Generic NACK with the given FCIs, protected the way the controller would
+static void SendNack(Loopback *loop, uint32_t mediaSSRC, const uint16_t *fci, size_t numFci)
+{
+  uint8_t bytes[8 + 12 + 4 * 32 + 4 + 10];
+  size_t numBytes = 0;
+
+  POS_TEST_CHECK(numFci <= 32);
+  bytes[numBytes++] = 0x80; // RR, no report blocks
+  bytes[numBytes++] = 201;
+  bytes[numBytes++] = 0;
+  bytes[numBytes++] = 1;
+  store_bigendian((uint32_t *)(bytes + numBytes), CONTROLLER_SSRC);
+  numBytes += 4;
+
+  bytes[numBytes++] = 0x81; // RTPFB, FMT 1
+  bytes[numBytes++] = 205;
+  bytes[numBytes++] = 0;
+  bytes[numBytes++] = (uint8_t)(2 + numFci);
+  store_bigendian((uint32_t *)(bytes + numBytes), CONTROLLER_SSRC);
+  numBytes += 4;
+  store_bigendian((uint32_t *)(bytes + numBytes), mediaSSRC);
+  numBytes += 4;
+  for (size_t n = 0; n < numFci; n++)
+  {
+    bytes[numBytes++] = (uint8_t)(fci[2 * n] >> 8);
+    bytes[numBytes++] = (uint8_t)fci[2 * n];
+    bytes[numBytes++] = (uint8_t)(fci[2 * n + 1] >> 8);
+    bytes[numBytes++] = (uint8_t)fci[2 * n + 1];
+  }
+
+  // SRTCP https://datatracker.ietf.org/doc/html/rfc3711#section-3.4
+  srtp_encrypt(&loop->controllerRtcp, bytes + 8, bytes + 8, 0, numBytes - 8, loop->rtcpIndex);
+  store_bigendian((uint32_t *)(bytes + numBytes), loop->rtcpIndex | 0x80000000);
+  srtp_authenticate(&loop->controllerRtcp, bytes + numBytes + 4, bytes, (uint32_t)numBytes,
+                    loop->rtcpIndex | 0x80000000);
+  numBytes += 4 + 10;
+  loop->rtcpIndex++;
+
+  size_t numPayloadBytes;
+  POSRTPStreamPushPacket(&loop->stream, bytes, numBytes, &numPayloadBytes, loop->now);
+}
+
+// NACKs every packet not received yet, packing runs of up to 17 into one FCI
+static size_t NackLost(Loopback *loop)
+{
+  uint16_t fci[2 * 32];
+  size_t numFci = 0;
+  size_t numRequested = 0;
+
+  for (uint32_t idx = 0; idx < loop->numSent && numFci < 32; idx++)
+  {
+    if (loop->sent[idx].received)
+      continue;
+    uint16_t pid = (uint16_t)(loop->firstSeq + idx);
+    uint16_t blp = 0;
+    numRequested++;
+    for (uint32_t bit = 1; bit <= 16 && idx + bit < loop->numSent; bit++)
+    {
+      if (!loop->sent[idx + bit].received)
+      {
+        blp |= (uint16_t)(1 << (bit - 1));
+        numRequested++;
+      }
+    }
+    fci[2 * numFci] = pid;
+    fci[2 * numFci + 1] = blp;
+    numFci++;
+    idx += 16;
+  }
+  if (numFci)
+    SendNack(loop, CAMERA_SSRC, fci, numFci);
+  return numRequested;
+}
+
+// Polls retransmissions, each has to be the packet as first sent.  The link drops them too.
+static size_t Resend(Loopback *loop)
+{
+  static uint8_t packet[1500];
+  size_t numPacketBytes;
+  size_t numResent = 0;
+
+  for (;;)
+  {
+    POSRTPStreamPollRetransmission(&loop->stream, loop->now, packet, sizeof(packet), &numPacketBytes);
+    if (numPacketBytes == 0)
+      break;
+    SentPacket *sent = Sent(loop, PacketSeq(packet));
+    POS_TEST_CHECK(numPacketBytes == sent->numBytes);
+    POS_TEST_CHECK_BYTES(packet, sent->bytes, numPacketBytes);
+    if (Random(loop) % 100 >= loop->lossPercent)
+      sent->received = true;
+    numResent++;
+  }
+  loop->numResent += numResent;
+  return numResent;
+}
+
+static uint32_t CountLost(const Loopback *loop)
+{
+  uint32_t numLost = 0;
+  for (uint32_t idx = 0; idx < loop->numSent; idx++)
+    numLost += !loop->sent[idx].received;
+  return numLost;
+}
+
+// 5% loss on a 30 fps stream, the receiver NACKs after every frame: everything arrives
+// in the end, and nothing is resent more than the losses call for
+static void test_lossy_link(void)
+{
+  static Loopback loop;
+  LoopbackStart(&loop, 5);
+
+  for (int frame = 0; frame < 300; frame++)
+  {
+    SendFrame(&loop, 1000 + (size_t)(Random(&loop) % 5000));
+    loop.now += 33 * MS;
+    NackLost(&loop);
+    Resend(&loop);
+  }
+  for (int round = 0; round < 10 && CountLost(&loop); round++)
+  {
+    loop.now += 33 * MS;
+    NackLost(&loop);
+    Resend(&loop);
+  }
+  POS_TEST_CHECK(loop.numSent > 600);
+  POS_TEST_CHECK(loop.numLost > loop.numSent / 40);
+  POS_TEST_CHECK(CountLost(&loop) == 0);
+  // a resend is only lost again at the same rate
+  POS_TEST_CHECK(loop.numResent <= loop.numLost + loop.numLost / 5);
+  POS_TEST_CHECK(loop.stream.rtxPacketsSent == loop.numResent);
+  POS_TEST_CHECK(loop.stream.rtxPacketsMissed == 0);
+}
+
+// A NACK storm is held to the budget, 20% of 2 Mbps with at most 100 ms banked,
+// and what's left goes out as the budget refills
+static void test_budget(void)
+{
+  static Loopback loop;
+  LoopbackStart(&loop, 0);
+
+  for (int frame = 0; frame < 10; frame++)
+    SendFrame(&loop, 6000);
+  POS_TEST_CHECK(loop.numSent >= 40);
+  for (uint32_t idx = 0; idx < 40; idx++)
+    loop.sent[idx].received = false;
+  POS_TEST_CHECK(NackLost(&loop) == 40);
+
+  size_t numFirst = Resend(&loop);
+  size_t numBytes = 0;
+  for (uint32_t idx = 0; idx < 40; idx++)
+    numBytes += loop.sent[idx].received ? loop.sent[idx].numBytes : 0;
+  POS_TEST_CHECK(numFirst > 0 && numFirst < 40);
+  POS_TEST_CHECK(numBytes <= 2000000 / 8 * POS_RTP_RTX_MAX_PERCENT / 100 / 10);
+
+  // nothing more until time passes, then 1500 bytes per 30 ms on top of what was left
+  POS_TEST_CHECK(Resend(&loop) == 0);
+  loop.now += 30 * MS;
+  size_t numSecond = Resend(&loop);
+  POS_TEST_CHECK(numSecond >= 1 && numSecond <= 2);
+  // a long quiet spell banks no more than 100 ms
+  loop.now += 1000 * MS;
+  POS_TEST_CHECK(Resend(&loop) <= 2000000 / 8 * POS_RTP_RTX_MAX_PERCENT / 100 / 10 / 1000);
+  for (int round = 0; round < 100 && CountLost(&loop); round++)
+  {
+    loop.now += 30 * MS;
+    Resend(&loop);
+  }
+  POS_TEST_CHECK(CountLost(&loop) == 0);
+  POS_TEST_CHECK(loop.stream.rtxPacketsMissed == 0);
+}
+
+// A packet NACKed twice within a round trip goes out once, and again after the holdoff
+static void test_holdoff(void)
+{
+  static Loopback loop;
+  uint16_t fci[2];
+  LoopbackStart(&loop, 0);
+
+  SendFrame(&loop, 3000);
+  fci[0] = (uint16_t)(loop.firstSeq + 1);
+  fci[1] = 0;
+  SendNack(&loop, CAMERA_SSRC, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 1);
+  loop.now += 5 * MS;
+  SendNack(&loop, CAMERA_SSRC, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 0);
+  loop.now += 10 * MS;
+  SendNack(&loop, CAMERA_SSRC, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 1);
+  POS_TEST_CHECK(loop.stream.rtxPacketsSent == 2);
+}
+
+// NACKs for packets that already left the history, or for another SSRC, resend nothing
+static void test_stale_nacks(void)
+{
+  static Loopback loop;
+  uint16_t fci[2];
+  LoopbackStart(&loop, 0);
+
+  while (loop.numSent < POS_RTP_HISTORY_PACKETS + 20)
+    SendFrame(&loop, 8000);
+
+  fci[0] = (uint16_t)(loop.firstSeq + 2);
+  fci[1] = 0x0003;
+  SendNack(&loop, CAMERA_SSRC, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 0);
+  POS_TEST_CHECK(loop.stream.rtxPacketsMissed == 3);
+
+  fci[0] = (uint16_t)(loop.firstSeq + loop.numSent - 1);
+  fci[1] = 0;
+  SendNack(&loop, CAMERA_SSRC + 1, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 0);
+  SendNack(&loop, CAMERA_SSRC, fci, 1);
+  POS_TEST_CHECK(Resend(&loop) == 1);
+  POS_TEST_CHECK(loop.stream.rtxPacketsMissed == 3);
+}
+
+int main(void)
+{
+  test_lossy_link();
+  test_budget();
+  test_holdoff();
+  test_stale_nacks();
+  printf("rtp nack tests passed\n");
+  return 0;
+}
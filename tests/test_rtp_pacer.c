@@ -0,0 +1,278 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Paces frames onto a UDP socket over loopback and checks when the datagrams arrive,
+// from the kernel's receive timestamps: a frame is spread over its share of the frame
+// interval after the initial burst, FEC parity sent between the media packets is paced
+// with them, and bytes charged for retransmissions from another thread hold the next
+// packets back by the time the link needs for them.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "POSRTPPacer.h"
+#include "POSUDPSender.h"
+
+#include "pos_test.h"
+
+#define PACKET_BYTES 1200
+#define BURST_BYTES 4500
+#define FRAME_RATE 10
+#define SPREAD_PERCENT 50
+#define MAX_ARRIVALS 256
+#define MS 1000000LL
+
+typedef struct
+{
+  int sendSock;
+  int recvSock;
+  POSRTPPacer pacer;
+  uint8_t pool[POS_UDP_BATCH_MAX][PACKET_BYTES];
+  size_t packetLens[POS_UDP_BATCH_MAX];
+} Link;
+
+static void LinkOpen(Link *link)
+{
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  int on = 1;
+  int bufferBytes = 4 << 20;
+
+  memset(link, 0, sizeof(*link));
+  link->recvSock = socket(AF_INET, SOCK_DGRAM, 0);
+  POS_TEST_CHECK(link->recvSock >= 0);
+  setsockopt(link->recvSock, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+  POS_TEST_CHECK(setsockopt(link->recvSock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  POS_TEST_CHECK(bind(link->recvSock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  POS_TEST_CHECK(getsockname(link->recvSock, (struct sockaddr *)&addr, &addrLen) == 0);
+  link->sendSock = socket(AF_INET, SOCK_DGRAM, 0);
+  POS_TEST_CHECK(link->sendSock >= 0);
+  POS_TEST_CHECK(connect(link->sendSock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  POSRTPPacerInit(&link->pacer, BURST_BYTES);
+}
+
+static void LinkClose(Link *link)
+{
+  close(link->sendSock);
+  close(link->recvSock);
+}
+
+// Sends numPackets packets through the pacer as the video send thread does, the first
+// byte of each numbers it
+static void SendPaced(Link *link, size_t numPackets, uint8_t firstNumber)
+{
+  POS_TEST_CHECK(numPackets <= POS_UDP_BATCH_MAX);
+  for (size_t n = 0; n < numPackets; n++)
+  {
+    link->pool[n][0] = (uint8_t)(firstNumber + n);
+    link->packetLens[n] = PACKET_BYTES;
+  }
+  for (size_t first = 0; first < numPackets;)
+  {
+    size_t numAdmitted = POSRTPPacerAdmit(&link->pacer, &link->packetLens[first], numPackets - first);
+    POS_TEST_CHECK(POSUDPSendBatch(link->sendSock, link->pool[first], sizeof(link->pool[0]), &link->packetLens[first],
+                                   numAdmitted, NULL) == (int)numAdmitted);
+    first += numAdmitted;
+  }
+}
+
+// Reads numPackets datagrams, checks they come in order and returns their arrival times
+static void Receive(Link *link, size_t numPackets, uint8_t firstNumber, int64_t *arrivalNs)
+{
+  for (size_t n = 0; n < numPackets; n++)
+  {
+    uint8_t bytes[2048];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = bytes, .iov_len = sizeof(bytes)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+    ssize_t numBytes = recvmsg(link->recvSock, &msg, 0);
+    POS_TEST_CHECK(numBytes == PACKET_BYTES);
+    POS_TEST_CHECK(bytes[0] == (uint8_t)(firstNumber + n));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    POS_TEST_CHECK(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS);
+    struct timespec stamp;
+    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+    arrivalNs[n] = (int64_t)stamp.tv_sec * 1000000000LL + stamp.tv_nsec;
+  }
+}
+
+// From the first packet to the last of numBytes at the rate picked for the frame: the burst
+// goes at once and the last packet leaves as soon as the ones before it are paid for
+static int64_t ExpectedNs(const Link *link, size_t numBytes)
+{
+  return (int64_t)(numBytes - PACKET_BYTES - BURST_BYTES) * 1000000000LL / link->pacer.bytesPerSecond;
+}
+
+// 48 packets go out over about half of the 100 ms frame interval, evenly after the burst
+static void test_frame_spread(void)
+{
+  static Link link;
+  static int64_t arrivalNs[MAX_ARRIVALS];
+  const size_t numPackets = 48;
+
+  LinkOpen(&link);
+  POSRTPPacerStartFrame(&link.pacer, numPackets * PACKET_BYTES, FRAME_RATE, 100000, SPREAD_PERCENT);
+  SendPaced(&link, numPackets, 0);
+  Receive(&link, numPackets, 0, arrivalNs);
+
+  int64_t spanNs = arrivalNs[numPackets - 1] - arrivalNs[0];
+  int64_t expectedNs = ExpectedNs(&link, numPackets * PACKET_BYTES);
+  printf("frame of %zu packets: %.1f ms, paced for %.1f ms, %u waits\n", numPackets, spanNs / 1e6,
+         expectedNs / 1e6, link.pacer.waits);
+  // the sleeps only ever run late, the upper bound leaves room for a loaded machine
+  POS_TEST_CHECK(spanNs >= expectedNs - MS);
+  POS_TEST_CHECK(spanNs < 2 * expectedNs + 20 * MS);
+  POS_TEST_CHECK(spanNs < 1000 / FRAME_RATE * MS);
+  // the burst leaves back to back, the gaps of the rest average out at one packet time
+  POS_TEST_CHECK(arrivalNs[2] - arrivalNs[0] < 2 * MS);
+  int64_t packetNs = (int64_t)PACKET_BYTES * 1000000000LL / link.pacer.bytesPerSecond;
+  int64_t secondHalfNs = arrivalNs[numPackets - 1] - arrivalNs[numPackets / 2];
+  POS_TEST_CHECK(secondHalfNs >= (int64_t)(numPackets / 2 - 1) * packetNs - 2 * MS);
+  LinkClose(&link);
+}
+
+// Parity packets sent in between media runs take their share of the budget, the frame
+// with parity takes as long as a frame that many packets bigger
+static void test_parity_paced(void)
+{
+  static Link link;
+  static int64_t arrivalNs[MAX_ARRIVALS];
+  const size_t numMedia = 40, numParityPerRun = 2, mediaRun = 10;
+  const size_t numPackets = numMedia + numMedia / mediaRun * numParityPerRun;
+
+  LinkOpen(&link);
+  POSRTPPacerStartFrame(&link.pacer, numMedia * PACKET_BYTES, FRAME_RATE, 100000, SPREAD_PERCENT);
+  uint8_t number = 0;
+  for (size_t run = 0; run < numMedia / mediaRun; run++)
+  {
+    SendPaced(&link, mediaRun, number);
+    number += mediaRun;
+    SendPaced(&link, numParityPerRun, number);
+    number += numParityPerRun;
+  }
+  Receive(&link, numPackets, 0, arrivalNs);
+
+  int64_t spanNs = arrivalNs[numPackets - 1] - arrivalNs[0];
+  int64_t expectedNs = ExpectedNs(&link, numPackets * PACKET_BYTES);
+  printf("frame of %zu packets with %zu parity: %.1f ms, paced for %.1f ms\n", numMedia,
+         numPackets - numMedia, spanNs / 1e6, expectedNs / 1e6);
+  POS_TEST_CHECK(spanNs >= expectedNs - MS);
+  POS_TEST_CHECK(spanNs < 2 * expectedNs + 20 * MS);
+  // no parity run leaves as a burst of its own
+  for (size_t n = mediaRun + 1; n < numPackets; n += mediaRun + numParityPerRun)
+    POS_TEST_CHECK(arrivalNs[n] - arrivalNs[n - 2] >= (int64_t)PACKET_BYTES * 1000000000LL / link.pacer.bytesPerSecond - MS);
+  LinkClose(&link);
+}
+
+typedef struct
+{
+  Link *link;
+  size_t numPackets;
+} Resender;
+
+// Resends from another thread straight to the socket, as the feedback tick does
+static void *ResendThread(void *context)
+{
+  Resender *resender = context;
+  static uint8_t bytes[PACKET_BYTES];
+  int resendSock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+
+  getsockname(resender->link->recvSock, (struct sockaddr *)&addr, &addrLen);
+  connect(resendSock, (struct sockaddr *)&addr, sizeof(addr));
+  memset(bytes, 0xee, sizeof(bytes));
+  for (size_t n = 0; n < resender->numPackets; n++)
+  {
+    send(resendSock, bytes, sizeof(bytes), 0);
+    POSRTPPacerCharge(&resender->link->pacer, sizeof(bytes));
+  }
+  close(resendSock);
+  return NULL;
+}
+
+// Retransmissions charged while a frame is going out push the rest of it back by their time on the link
+static void test_retransmissions_charged(void)
+{
+  static Link link;
+  static int64_t arrivalNs[MAX_ARRIVALS];
+  const size_t numPackets = 48, numResent = 16;
+  Resender resender = {.link = &link, .numPackets = numResent};
+  pthread_t thread;
+
+  LinkOpen(&link);
+  POSRTPPacerStartFrame(&link.pacer, numPackets * PACKET_BYTES, FRAME_RATE, 100000, SPREAD_PERCENT);
+  SendPaced(&link, numPackets / 2, 0);
+  POS_TEST_CHECK(pthread_create(&thread, NULL, ResendThread, &resender) == 0);
+  POS_TEST_CHECK(pthread_join(thread, NULL) == 0);
+  SendPaced(&link, numPackets / 2, (uint8_t)(numPackets / 2));
+
+  // the resent packets land between the two halves, take the frame's packets only
+  size_t numVideo = 0;
+  int64_t firstNs = 0;
+  for (size_t n = 0; n < numPackets + numResent; n++)
+  {
+    uint8_t bytes[2048];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = bytes, .iov_len = sizeof(bytes)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    POS_TEST_CHECK(recvmsg(link.recvSock, &msg, 0) == PACKET_BYTES);
+    struct timespec stamp;
+    memcpy(&stamp, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(stamp));
+    int64_t ns = (int64_t)stamp.tv_sec * 1000000000LL + stamp.tv_nsec;
+    if (n == 0)
+      firstNs = ns;
+    if (bytes[0] == 0xee)
+      continue;
+    POS_TEST_CHECK(bytes[0] == numVideo);
+    arrivalNs[numVideo++] = ns;
+  }
+  POS_TEST_CHECK(numVideo == numPackets);
+  POS_TEST_CHECK(arrivalNs[0] == firstNs);
+
+  int64_t spanNs = arrivalNs[numPackets - 1] - arrivalNs[0];
+  int64_t expectedNs = ExpectedNs(&link, (numPackets + numResent) * PACKET_BYTES);
+  printf("frame of %zu packets with %zu resent: %.1f ms, paced for %.1f ms\n", numPackets, numResent,
+         spanNs / 1e6, expectedNs / 1e6);
+  POS_TEST_CHECK(spanNs >= expectedNs - MS);
+  POS_TEST_CHECK(spanNs < 2 * expectedNs + 20 * MS);
+  // the first packet after the resends waits for all of them
+  int64_t resentNs = (int64_t)numResent * PACKET_BYTES * 1000000000LL / link.pacer.bytesPerSecond;
+  POS_TEST_CHECK(arrivalNs[numPackets / 2] - arrivalNs[numPackets / 2 - 1] >= resentNs - 2 * MS);
+  LinkClose(&link);
+}
+
+int main(void)
+{
+  test_frame_spread();
+  test_parity_paced();
+  test_retransmissions_charged();
+  printf("rtp pacer tests passed\n");
+  return 0;
+}
@@ -0,0 +1,380 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a night scene through the simulated encoder and the H.264 payloader: access
+// unit delimiters, SEI and small P slices, a few slices that only just fit a packet or
+// don't, and an IDR every GOP.  The receiver rebuilds the NALUs from single NAL unit,
+// STAP-A and FU-A packets and must get exactly what the encoder put out, with one
+// timestamp per access unit and the marker on its last packet.  Then compares the
+// packet count and bytes on the wire with one packet per NALU.
+// Pass a recording to compare that instead:  ./test_rtp_stap [night.264]
+
+#include <string.h>
+#include <unistd.h>
+
+#include <imp/imp_encoder.h>
+#include <imp/imp_system.h>
+
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define NUM_FRAMES 300
+#define GOP_FRAMES 60
+#define FRAME_NS 33333333ull
+#define MTU 1378
+// HMAC-SHA1-80
+#define TAG_BYTES 10
+// IPv4 and UDP headers
+#define IP_UDP_BYTES 28
+#define MAX_NAL_BYTES 20000
+#define NAL_STREAM_BYTES (8 * 1024 * 1024)
+
+static uint8_t expected[NAL_STREAM_BYTES];
+static size_t expectedBytes;
+static uint8_t received[NAL_STREAM_BYTES];
+static size_t receivedBytes;
+
+static uint32_t Random(uint32_t *state)
+{
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static void AppendNAL(uint8_t *stream, size_t *numStreamBytes, const uint8_t *bytes, size_t numBytes)
+{
+  POS_TEST_CHECK(*numStreamBytes + 4 + numBytes <= NAL_STREAM_BYTES);
+  stream[*numStreamBytes] = (uint8_t)(numBytes >> 24);
+  stream[*numStreamBytes + 1] = (uint8_t)(numBytes >> 16);
+  stream[*numStreamBytes + 2] = (uint8_t)(numBytes >> 8);
+  stream[*numStreamBytes + 3] = (uint8_t)numBytes;
+  memcpy(stream + *numStreamBytes + 4, bytes, numBytes);
+  *numStreamBytes += 4 + numBytes;
+}
+
+// Writes GOP_FRAMES frame GOPs of a static night scene.  Every access unit starts with a
+// delimiter and an SEI, the IDR has the SPS and PPS in front, most P slices are a few
+// hundred bytes.  The bytes after each NALU header are never 0, so there is no start
+// code to escape.
+static void WriteStream(const char *path)
+{
+  static uint8_t nal[MAX_NAL_BYTES];
+  static const uint8_t startCode[4] = {0, 0, 0, 1};
+  uint32_t random = 5;
+  FILE *file = fopen(path, "wb");
+  POS_TEST_CHECK(file != NULL);
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    bool keyFrame = frame % GOP_FRAMES == 0;
+    static const uint8_t keyFrameTypes[] = {9, 7, 8, 6, 5};
+    static const uint8_t frameTypes[] = {9, 6, 1};
+    const uint8_t *types = keyFrame ? keyFrameTypes : frameTypes;
+    size_t numNALUs = keyFrame ? sizeof(keyFrameTypes) : sizeof(frameTypes);
+
+    for (size_t n = 0; n < numNALUs; n++)
+    {
+      size_t numBytes;
+      switch (types[n])
+      {
+      case 9:
+        nal[0] = 0x09;
+        numBytes = 2;
+        break;
+      case 7:
+        nal[0] = 0x67;
+        numBytes = 12;
+        break;
+      case 8:
+        nal[0] = 0x68;
+        numBytes = 4;
+        break;
+      case 6:
+        nal[0] = 0x06;
+        numBytes = 20 + Random(&random) % 30;
+        break;
+      case 5:
+        nal[0] = 0x65;
+        numBytes = 6000 + Random(&random) % 6000;
+        break;
+      default:
+        nal[0] = 0x41;
+        // mostly small, some that fill the STAP-A, some that need FU-A
+        if (frame % 10 == 4)
+          numBytes = 1250 + Random(&random) % 120;
+        else if (frame % 10 == 7)
+          numBytes = 1400 + Random(&random) % 2000;
+        else
+          numBytes = 60 + Random(&random) % 600;
+      }
+      for (size_t idx = 1; idx < numBytes; idx++)
+        nal[idx] = (uint8_t)(1 + Random(&random) % 255);
+      POS_TEST_CHECK(fwrite(startCode, 1, sizeof(startCode), file) == sizeof(startCode));
+      POS_TEST_CHECK(fwrite(nal, 1, numBytes, file) == numBytes);
+    }
+  }
+  POS_TEST_CHECK(fclose(file) == 0);
+}
+
+// Frames in an Annex-B file, the simulated encoder ends one at every slice
+static uint32_t CountFrames(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  uint32_t numFrames = 0, zeros = 0;
+  int c;
+
+  POS_TEST_CHECK(file != NULL);
+  while ((c = fgetc(file)) != EOF)
+  {
+    if (c == 1 && zeros >= 2)
+    {
+      int NALType = fgetc(file) & 0x1f;
+      if (NALType >= 1 && NALType <= 5)
+        numFrames++;
+      zeros = 0;
+      continue;
+    }
+    zeros = c == 0 ? zeros + 1 : 0;
+  }
+  fclose(file);
+  return numFrames;
+}
+
+// Packets and bytes on the wire if every NALU went out on its own, FU-A when it doesn't fit
+static void CountUnaggregated(size_t numBytes, uint32_t *numPackets, uint64_t *wireBytes)
+{
+  size_t maxPayloadBytes = MTU - 12 - TAG_BYTES;
+  if (numBytes <= maxPayloadBytes)
+  {
+    *numPackets += 1;
+    *wireBytes += IP_UDP_BYTES + 12 + numBytes + TAG_BYTES;
+    return;
+  }
+  // the NAL header goes into the FU indicator and header, 2 bytes a fragment
+  size_t left = numBytes - 1;
+  while (left > 0)
+  {
+    size_t fragmentBytes = left < maxPayloadBytes - 2 ? left : maxPayloadBytes - 2;
+    *numPackets += 1;
+    *wireBytes += IP_UDP_BYTES + 12 + 2 + fragmentBytes + TAG_BYTES;
+    left -= fragmentBytes;
+  }
+}
+
+// Rebuilds NALUs from one payload, single NALU, STAP-A or FU-A
+static void Depacketize(const uint8_t *payload, size_t numBytes, bool *inFU, size_t *fuStart, uint32_t *numSTAPs)
+{
+  uint8_t NALType = payload[0] & 0x1f;
+
+  if (NALType == 24)
+  {
+    size_t pos = 1;
+    uint8_t NRI = 0;
+    int n = 0;
+    POS_TEST_CHECK(!*inFU);
+    while (pos + 2 <= numBytes)
+    {
+      size_t nalBytes = (size_t)payload[pos] << 8 | payload[pos + 1];
+      POS_TEST_CHECK(nalBytes > 0 && pos + 2 + nalBytes <= numBytes);
+      if ((payload[pos + 2] & 0x60) > NRI)
+        NRI = payload[pos + 2] & 0x60;
+      AppendNAL(received, &receivedBytes, payload + pos + 2, nalBytes);
+      pos += 2 + nalBytes;
+      n++;
+    }
+    // a STAP-A of one NALU would waste its 3 bytes, and the NRI is the highest of the NALUs
+    POS_TEST_CHECK(pos == numBytes && n > 1);
+    POS_TEST_CHECK((payload[0] & 0x60) == NRI);
+    (*numSTAPs)++;
+    return;
+  }
+  if (NALType != 28)
+  {
+    POS_TEST_CHECK(!*inFU);
+    AppendNAL(received, &receivedBytes, payload, numBytes);
+    return;
+  }
+
+  if (payload[1] & 0x80)
+  {
+    uint8_t header = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+    POS_TEST_CHECK(!*inFU);
+    *fuStart = receivedBytes;
+    *inFU = true;
+    AppendNAL(received, &receivedBytes, &header, 1);
+  }
+  POS_TEST_CHECK(*inFU);
+  POS_TEST_CHECK(receivedBytes + numBytes - 2 <= NAL_STREAM_BYTES);
+  memcpy(received + receivedBytes, payload + 2, numBytes - 2);
+  receivedBytes += numBytes - 2;
+  size_t nalBytes = receivedBytes - *fuStart - 4;
+  received[*fuStart] = (uint8_t)(nalBytes >> 24);
+  received[*fuStart + 1] = (uint8_t)(nalBytes >> 16);
+  received[*fuStart + 2] = (uint8_t)(nalBytes >> 8);
+  received[*fuStart + 3] = (uint8_t)nalBytes;
+  if (payload[1] & 0x40)
+    *inFU = false;
+}
+
+static void PollPackets(POSRTPStreamRef *stream, uint32_t *numPackets, uint64_t *wireBytes, uint32_t *timeStamp,
+                        bool *marker, bool *inFU, size_t *fuStart, uint32_t *numSTAPs)
+{
+  static uint8_t packet[2048];
+
+  for (;;)
+  {
+    size_t numPacketBytes = 0;
+    POSRTPStreamPollPacket(stream, packet, sizeof(packet), &numPacketBytes);
+    if (numPacketBytes == 0)
+      return;
+    POS_TEST_CHECK(numPacketBytes + TAG_BYTES <= MTU);
+    uint32_t packetTimeStamp =
+        (uint32_t)packet[4] << 24 | (uint32_t)packet[5] << 16 | (uint32_t)packet[6] << 8 | packet[7];
+    if (*numPackets == 0 || *marker)
+      *timeStamp = packetTimeStamp;
+    POS_TEST_CHECK(packetTimeStamp == *timeStamp);
+    *marker = (packet[1] & 0x80) != 0;
+    Depacketize(packet + 12, numPacketBytes - 12, inFU, fuStart, numSTAPs);
+    *numPackets += 1;
+    *wireBytes += IP_UDP_BYTES + numPacketBytes + TAG_BYTES;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  char path[] = "/tmp/test_rtp_stap_XXXXXX";
+  const char *recording = argc > 1 ? argv[1] : NULL;
+  POSRTPStreamRef stream;
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x55000000, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = MTU - TAG_BYTES};
+  POSSRTPParameters srtpParameters;
+  IMPEncoderChnAttr attr;
+  HAPTime now = 10000000000ull;
+  uint32_t numPackets = 0, numSTAPs = 0, numUnaggregated = 0, numAccessUnits = 0;
+  uint64_t wireBytes = 0, unaggregatedWireBytes = 0;
+  uint32_t timeStamp = 0;
+  size_t fuStart = 0;
+  bool inFU = false, marker = false;
+
+  if (recording == NULL)
+  {
+    int fd = mkstemp(path);
+    POS_TEST_CHECK(fd >= 0);
+    close(fd);
+    WriteStream(path);
+    recording = path;
+  }
+  setenv("POS_SIM_H264", recording, 1);
+  setenv("POS_SIM_SPEED", "100", 1);
+
+  // in the clear to read the payloads, the MTU leaves room for the SRTP tag
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  POSRTPStreamStart(&stream, &rtpParameters, RTPType_H264, 90000, 0x11223344, now, "positron-test",
+                    &srtpParameters, &srtpParameters);
+
+  POS_TEST_CHECK(IMP_System_Init() == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateGroup(0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_SetDefaultParam(&attr, IMP_ENC_PROFILE_AVC_MAIN, IMP_ENC_RC_MODE_CBR, 1920, 1080, 30,
+                                             1, GOP_FRAMES, 2, -1, 2000) == 0);
+  POS_TEST_CHECK(IMP_Encoder_CreateChn(0, &attr) == 0);
+  POS_TEST_CHECK(IMP_Encoder_RegisterChn(0, 0) == 0);
+  POS_TEST_CHECK(IMP_Encoder_StartRecvPic(0) == 0);
+
+  const uint8_t *SPS = NULL, *PPS = NULL;
+  size_t SPSBytes = 0, PPSBytes = 0;
+  static uint8_t parameterSets[256];
+  // one pass over the recording, the simulated encoder loops it
+  uint32_t numFrames = CountFrames(recording);
+  POS_TEST_CHECK(numFrames > 0);
+  for (uint32_t frame = 0; frame < numFrames; frame++)
+  {
+    IMPEncoderStream encoded;
+    size_t numPayloadBytes = 0;
+    uint32_t numFramePackets = numPackets;
+
+    now += FRAME_NS;
+    POS_TEST_CHECK(IMP_Encoder_PollingStream(0, 1000) == 0);
+    POS_TEST_CHECK(IMP_Encoder_GetStream(0, &encoded, true) == 0);
+    for (uint32_t n = 0; n < encoded.packCount; n++)
+    {
+      uint8_t *nal = (uint8_t *)(uintptr_t)encoded.virAddr + encoded.pack[n].offset + 4;
+      size_t numBytes = encoded.pack[n].length - 4;
+      uint8_t NALType = nal[0] & 0x1f;
+
+      // the payloader keeps the parameter sets and sends them right before the IDR
+      if (NALType == 7 && numBytes <= 128)
+      {
+        memcpy(parameterSets, nal, numBytes);
+        SPS = parameterSets;
+        SPSBytes = numBytes;
+      }
+      else if (NALType == 8 && numBytes <= 128)
+      {
+        memcpy(parameterSets + 128, nal, numBytes);
+        PPS = parameterSets + 128;
+        PPSBytes = numBytes;
+      }
+      else
+      {
+        if (NALType == 5 && SPS != NULL && PPS != NULL)
+        {
+          AppendNAL(expected, &expectedBytes, SPS, SPSBytes);
+          AppendNAL(expected, &expectedBytes, PPS, PPSBytes);
+          CountUnaggregated(SPSBytes, &numUnaggregated, &unaggregatedWireBytes);
+          CountUnaggregated(PPSBytes, &numUnaggregated, &unaggregatedWireBytes);
+        }
+        AppendNAL(expected, &expectedBytes, nal, numBytes);
+        CountUnaggregated(numBytes, &numUnaggregated, &unaggregatedWireBytes);
+      }
+
+      POSRTPStreamPushPayload(&stream, nal, numBytes, &numPayloadBytes, now, now);
+      if (numPayloadBytes > 0)
+        PollPackets(&stream, &numPackets, &wireBytes, &timeStamp, &marker, &inFU, &fuStart, &numSTAPs);
+    }
+    POSRTPStreamEndAccessUnit(&stream, &numPayloadBytes);
+    if (numPayloadBytes > 0)
+      PollPackets(&stream, &numPackets, &wireBytes, &timeStamp, &marker, &inFU, &fuStart, &numSTAPs);
+    IMP_Encoder_ReleaseStream(0, &encoded);
+
+    // everything of the access unit is out, the last packet with the marker
+    POS_TEST_CHECK(marker);
+    POS_TEST_CHECK(!inFU);
+    // the delimiter, SEI and slice of a small P frame share one packet
+    if (recording == path && frame % GOP_FRAMES != 0 && frame % 10 != 4 && frame % 10 != 7)
+      POS_TEST_CHECK(numPackets - numFramePackets == 1);
+    numAccessUnits++;
+  }
+  IMP_Encoder_StopRecvPic(0);
+  if (recording == path)
+    unlink(path);
+
+  POS_TEST_CHECK(receivedBytes == expectedBytes);
+  POS_TEST_CHECK_BYTES(received, expected, expectedBytes);
+  printf("%u access units\n", numAccessUnits);
+  printf("one packet per NALU  %6u packets  %8llu bytes on the wire\n", numUnaggregated,
+         (unsigned long long)unaggregatedWireBytes);
+  printf("STAP-A               %6u packets  %8llu bytes on the wire, %u STAP-A\n", numPackets,
+         (unsigned long long)wireBytes, numSTAPs);
+  if (recording == path)
+  {
+    POS_TEST_CHECK(numAccessUnits == NUM_FRAMES);
+    POS_TEST_CHECK(numPackets * 2 < numUnaggregated);
+    POS_TEST_CHECK(wireBytes < unaggregatedWireBytes);
+  }
+  POSRTPStreamEnd(&stream);
+  return 0;
+}
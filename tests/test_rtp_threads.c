@@ -0,0 +1,124 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the two halves of a POSRTPStreamRef on two threads, as the camera does: a
+// send thread pushing frames and polling packets, and an rtcp thread building
+// reports and taking packets in.  Checks the published sender counters only ever
+// move forward together.  Meant to be run under ThreadSanitizer too, which flags any
+// field both halves touch: configure with -DCMAKE_C_FLAGS="-fsanitize=thread -Wno-tsan"
+// (gcc warns that TSan doesn't model the fences in the sender stats seqlock).  No
+// packet history, its slots are copied racily by design and checked afterwards.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+#define NUM_FRAMES 3000
+#define KEY_FRAME_INTERVAL 30
+
+static POSRTPStreamRef stream;
+static int senderDone;
+
+static void *SendThread(void *context)
+{
+  static uint8_t sps[] = {0x67, 0x64, 0x00, 0x1f, 0xac, 0x2b, 0x40, 0x28, 0x02, 0xdd, 0x08};
+  static uint8_t pps[] = {0x68, 0xee, 0x3c, 0xb0};
+  static uint8_t slice[4000];
+  static uint8_t pool[16][1500];
+  size_t packetLens[16];
+  size_t numPackets;
+  size_t numPayloadBytes;
+  (void)context;
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    HAPTime frameTime = (HAPTime)(frame + 1) * 33333333;
+    bool keyFrame = frame % KEY_FRAME_INTERVAL == 0;
+    if (keyFrame)
+    {
+      POSRTPStreamPushPayload(&stream, sps, sizeof(sps), &numPayloadBytes, frameTime, frameTime);
+      POSRTPStreamPushPayload(&stream, pps, sizeof(pps), &numPayloadBytes, frameTime, frameTime);
+    }
+    size_t numSliceBytes = keyFrame ? sizeof(slice) : 500 + frame % 1000;
+    slice[0] = keyFrame ? 0x65 : 0x41;
+    POSRTPStreamPushPayload(&stream, slice, numSliceBytes, &numPayloadBytes, frameTime, frameTime);
+    do
+    {
+      POSRTPStreamPollPackets(&stream, pool, sizeof(pool[0]), 16, packetLens, &numPackets);
+    } while (numPackets != 0);
+  }
+  __atomic_store_n(&senderDone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int main(void)
+{
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x11223344, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+  static uint8_t report[1500];
+  size_t numReportBytes;
+  size_t numPayloadBytes;
+  uint32_t numReports = 0;
+  POSRTPSenderStats last;
+  pthread_t sender;
+
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(&stream, &rtpParameters, RTPType_H264, 90000, 0x55667788, 1, "positron-test", &srtpParameters,
+                    &srtpParameters);
+  memset(&last, 0, sizeof last);
+
+  POS_TEST_CHECK(pthread_create(&sender, NULL, SendThread, NULL) == 0);
+  for (HAPTime now = 10000000000ULL; !__atomic_load_n(&senderDone, __ATOMIC_ACQUIRE); now += 1000000000)
+  {
+    POSRTPSenderStats stats;
+    POSRTPStreamGetSenderStats(&stream, &stats);
+    POS_TEST_CHECK((stats.seq & 1) == 0);
+    POS_TEST_CHECK(stats.seq >= last.seq);
+    POS_TEST_CHECK(stats.packetCount >= last.packetCount);
+    POS_TEST_CHECK(stats.octetCount >= last.octetCount);
+    // an octet count that moved without its packet count is a torn snapshot
+    POS_TEST_CHECK((stats.packetCount == last.packetCount) == (stats.octetCount == last.octetCount));
+    last = stats;
+
+    // a report each round, and it goes back in as if the controller had sent it, the keys are the same
+    bool newKeyFrame;
+    uint32_t bitRate;
+    POSRTPStreamCheckFeedback(&stream, now, report, sizeof(report), &numReportBytes, &bitRate, &newKeyFrame, NULL);
+    if (numReportBytes != 0)
+    {
+      numReports++;
+      POSRTPStreamPushPacket(&stream, report, numReportBytes, &numPayloadBytes, now);
+    }
+  }
+  POS_TEST_CHECK(pthread_join(sender, NULL) == 0);
+
+  POSRTPSenderStats stats;
+  POSRTPStreamGetSenderStats(&stream, &stats);
+  POS_TEST_CHECK(stats.packetCount > NUM_FRAMES);
+  POS_TEST_CHECK(stats.packetCount >= last.packetCount && stats.octetCount >= last.octetCount);
+  POS_TEST_CHECK(numReports > 0);
+  POS_TEST_CHECK(__atomic_load_n(&stream.keyFramesPushed, __ATOMIC_RELAXED) == NUM_FRAMES / KEY_FRAME_INTERVAL);
+  printf("rtp thread tests passed, %u reports\n", numReports);
+  return 0;
+}
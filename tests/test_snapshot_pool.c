@@ -0,0 +1,155 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Stress test for the snapshot frame pool: an encoder thread publishing frames of
+// changing sizes as fast as it can, and reader threads holding on to them while
+// they check every byte.  A frame a reader holds must never be rewritten or
+// regrown underneath it.  Meant to be run under ThreadSanitizer too, see
+// test_rtp_threads.c for the flags.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#include "pos_test.h"
+
+#define MIN_FRAMES 20000
+#define MIN_READS 2000
+#define NUM_READERS 4
+#define HEADER_BYTES 8
+
+static uint32_t writerDone;
+static uint32_t numChecked[NUM_READERS];
+static uint32_t numWritten;
+
+// The writer runs until it has published MIN_FRAMES and every reader has checked MIN_READS
+static bool EnoughReads(void)
+{
+  for (int r = 0; r < NUM_READERS; r++)
+  {
+    if (__atomic_load_n(&numChecked[r], __ATOMIC_RELAXED) < MIN_READS)
+      return false;
+  }
+  return true;
+}
+
+// A frame carries the id it will be published under and its size, then a fill byte
+static void FillFrame(snapshot_frame_t *frame, uint32_t id)
+{
+  uint32_t size = (uint32_t)frame->size;
+  memcpy(frame->data, &id, 4);
+  memcpy(frame->data + 4, &size, 4);
+  memset(frame->data + HEADER_BYTES, (uint8_t)id, frame->size - HEADER_BYTES);
+}
+
+static void CheckFrame(const snapshot_frame_t *frame)
+{
+  uint32_t id;
+  uint32_t size;
+  memcpy(&id, frame->data, 4);
+  memcpy(&size, frame->data + 4, 4);
+  POS_TEST_CHECK(id == frame->id);
+  POS_TEST_CHECK(size == frame->size);
+  for (size_t idx = HEADER_BYTES; idx < frame->size; idx++)
+    POS_TEST_CHECK(frame->data[idx] == (uint8_t)id);
+}
+
+static void *WriterThread(void *context)
+{
+  uint32_t *numDropped = context;
+  uint32_t numPublished = 0;
+
+  for (uint32_t n = 0; n < MIN_FRAMES || !EnoughReads(); n++)
+  {
+    // sizes wander up and down so frames get regrown while readers are around
+    size_t size = HEADER_BYTES + 1000 + (size_t)(n * 7919u % 60000u);
+    snapshot_frame_t *frame = snapshotBeginWrite(size);
+    if (frame == NULL)
+    {
+      (*numDropped)++;
+      continue;
+    }
+    POS_TEST_CHECK(frame->size == size && frame->capacity >= size);
+    POS_TEST_CHECK(__atomic_load_n(&frame->refCount, __ATOMIC_ACQUIRE) == 0);
+    FillFrame(frame, numPublished + 1);
+    snapshotPublish(frame);
+    numPublished++;
+    POS_TEST_CHECK(frame->id == numPublished);
+  }
+  numWritten = numPublished + *numDropped;
+  __atomic_store_n(&writerDone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *ReaderThread(void *context)
+{
+  uint32_t *checked = context;
+  uint32_t lastId = 0;
+
+  while (!__atomic_load_n(&writerDone, __ATOMIC_ACQUIRE))
+  {
+    snapshot_frame_t *frame = snapshotAcquire();
+    if (frame == NULL)
+      continue;
+    POS_TEST_CHECK(frame->id >= lastId);
+    lastId = frame->id;
+    CheckFrame(frame);
+    // hold it while the writer moves on, then check it didn't change
+    sched_yield();
+    CheckFrame(frame);
+    POS_TEST_CHECK(frame->id == lastId);
+    snapshotRelease(frame);
+    __atomic_add_fetch(checked, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+int main(void)
+{
+  pthread_t writer;
+  pthread_t readers[NUM_READERS];
+  uint32_t numDropped = 0;
+
+  POS_TEST_CHECK(snapshotAcquire() == NULL);
+
+  for (int r = 0; r < NUM_READERS; r++)
+    POS_TEST_CHECK(pthread_create(&readers[r], NULL, ReaderThread, &numChecked[r]) == 0);
+  POS_TEST_CHECK(pthread_create(&writer, NULL, WriterThread, &numDropped) == 0);
+  POS_TEST_CHECK(pthread_join(writer, NULL) == 0);
+  for (int r = 0; r < NUM_READERS; r++)
+    POS_TEST_CHECK(pthread_join(readers[r], NULL) == 0);
+
+  // the last frame published is current, and every reference was given back
+  snapshot_frame_t *frame = snapshotAcquire();
+  POS_TEST_CHECK(frame != NULL);
+  POS_TEST_CHECK(frame->id == numWritten - numDropped);
+  CheckFrame(frame);
+  POS_TEST_CHECK(frame->refCount == 1);
+  snapshotRelease(frame);
+
+  uint32_t totalChecked = 0;
+  for (int r = 0; r < NUM_READERS; r++)
+    totalChecked += numChecked[r];
+  POS_TEST_CHECK(EnoughReads());
+  POS_TEST_CHECK(numWritten >= MIN_FRAMES && numDropped < numWritten);
+  printf("snapshot pool tests passed, %u frames read, %u dropped\n", totalChecked, numDropped);
+  return 0;
+}
@@ -0,0 +1,339 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Known answer tests for POSSRTPCrypto, and a check that the batched
+// encryption POSRTPStreamPollPackets does produces the same packets as
+// polling them one at a time.
+
+#include <string.h>
+
+#include "POSSRTPCrypto.h"
+#include "POSRTPController.h"
+
+#include "pos_test.h"
+
+// https://datatracker.ietf.org/doc/html/rfc3711#appendix-B.2
+static void test_aes_cm_keystream(void)
+{
+  srtp_ctx ctx;
+  uint8_t zeros[48];
+  uint8_t keystream[48];
+  uint8_t expected[48];
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.key_size = 16;
+  pos_test_hex(ctx.encr_key, 16, "2B7E151628AED2A6ABF7158809CF4F3C");
+  pos_test_hex(ctx.salt_key, 14, "F0F1F2F3F4F5F6F7F8F9FAFBFCFD");
+  mbedtls_aes_init(&ctx.aes);
+  mbedtls_aes_setkey_enc(&ctx.aes, ctx.encr_key, 128);
+
+  memset(zeros, 0, sizeof(zeros));
+  pos_test_hex(expected, sizeof(expected),
+               "E03EAD0935C95E80E166B16DD92B4EB4"
+               "D23513162B02D0F72A43A2FE4A5F97AB"
+               "41E95B3BB0A2E8DD477901E4FCA894C0");
+  srtp_encrypt(&ctx, keystream, zeros, 0, sizeof(zeros), 0);
+  POS_TEST_CHECK_BYTES(keystream, expected, sizeof(expected));
+
+  // the keystream runs on across the FU header bytes and the payload
+  memset(keystream, 0, sizeof(keystream));
+  srtp_encrypt(&ctx, keystream, zeros, 2, sizeof(zeros) - 2, 0);
+  POS_TEST_CHECK_BYTES(keystream, expected, sizeof(expected));
+
+  mbedtls_aes_free(&ctx.aes);
+}
+
+// https://datatracker.ietf.org/doc/html/rfc3711#appendix-B.3
+static void test_key_derivation(void)
+{
+  uint8_t masterKey[16];
+  uint8_t masterSalt[14];
+  uint8_t sessionKey[16];
+  uint8_t sessionSalt[14];
+  uint8_t authKey[20];
+  uint8_t expected[20];
+  srtp_ctx srtp;
+  srtp_ctx srtcp;
+
+  pos_test_hex(masterKey, sizeof(masterKey), "E1F97A0D3E018BE0D64FA32C06DE4139");
+  pos_test_hex(masterSalt, sizeof(masterSalt), "0EC675AD498AFEEBB6960B3AABE6");
+
+  srtp_session_key((char *)sessionKey, sizeof(sessionKey), (const char *)masterKey, sizeof(masterKey),
+                   (const char *)masterSalt, 0);
+  pos_test_hex(expected, sizeof(expected), "C61E7A93744F39EE10734AFE3FF7A087");
+  POS_TEST_CHECK_BYTES(sessionKey, expected, sizeof(sessionKey));
+
+  srtp_session_key((char *)authKey, sizeof(authKey), (const char *)masterKey, sizeof(masterKey),
+                   (const char *)masterSalt, 1);
+  pos_test_hex(expected, sizeof(expected), "CEBE321F6FF7716B6FD4AB49AF256A156D38BAA4");
+  POS_TEST_CHECK_BYTES(authKey, expected, sizeof(authKey));
+
+  srtp_session_key((char *)sessionSalt, sizeof(sessionSalt), (const char *)masterKey, sizeof(masterKey),
+                   (const char *)masterSalt, 2);
+  pos_test_hex(expected, sizeof(expected), "30CBBC08863D8C85D49DB34A9AE1");
+  POS_TEST_CHECK_BYTES(sessionSalt, expected, sizeof(sessionSalt));
+
+  // with SSRC 0 the context holds the session keys as derived
+  memset(&srtp, 0, sizeof(srtp));
+  memset(&srtcp, 0, sizeof(srtcp));
+  srtp_setupContext(&srtp, &srtcp, (const char *)masterKey, sizeof(masterKey), (const char *)masterSalt, 10, 0);
+  POS_TEST_CHECK_BYTES(srtp.encr_key, sessionKey, sizeof(sessionKey));
+  POS_TEST_CHECK_BYTES(srtp.auth_key, authKey, sizeof(authKey));
+  POS_TEST_CHECK_BYTES(srtp.salt_key, sessionSalt, sizeof(sessionSalt));
+  srtp_freeContext(&srtp, &srtcp);
+}
+
+// https://datatracker.ietf.org/doc/html/rfc2202#section-3, test case 1
+static void test_hmac_sha1(void)
+{
+  uint8_t key[20];
+  uint8_t digest[20];
+  uint8_t expected[20];
+
+  memset(key, 0x0b, sizeof(key));
+  pos_test_hex(expected, sizeof(expected), "B617318655057264E28BC0B6FB378C8EF146BE00");
+  hmac_sha1_aad(digest, key, sizeof(key), (uint8_t *)"Hi There", 8, NULL, 0);
+  POS_TEST_CHECK_BYTES(digest, expected, sizeof(expected));
+}
+
+// A whole protected packet with the RFC 3711 B.3 master key, cross checked against openssl
+static void test_protect_packet(void)
+{
+  uint8_t masterKey[16];
+  uint8_t masterSalt[14];
+  uint8_t payload[20];
+  uint8_t packet[12 + 20 + 10];
+  uint8_t expected[sizeof(packet)];
+  uint8_t decrypted[sizeof(payload)];
+  srtp_ctx srtp;
+
+  pos_test_hex(masterKey, sizeof(masterKey), "E1F97A0D3E018BE0D64FA32C06DE4139");
+  pos_test_hex(masterSalt, sizeof(masterSalt), "0EC675AD498AFEEBB6960B3AABE6");
+  memset(&srtp, 0, sizeof(srtp));
+  srtp_setupContext(&srtp, NULL, (const char *)masterKey, sizeof(masterKey), (const char *)masterSalt, 10,
+                    0xdeadbeef);
+  for (size_t idx = 0; idx < sizeof(payload); idx++)
+    payload[idx] = (uint8_t)idx;
+
+  pos_test_hex(packet, 12, "8060000100000000DEADBEEF");
+  srtp_encrypt(&srtp, packet + 12, payload, 0, sizeof(payload), 1);
+  srtp_authenticate(&srtp, packet + 12 + sizeof(payload), packet, 12 + sizeof(payload), 1 >> 16);
+  pos_test_hex(expected, sizeof(expected),
+               "8060000100000000DEADBEEF"
+               "0AACFBA28409026B58BB4AB6CF1E8C7331534608"
+               "2ADBCC15EDC7079F0D16");
+  POS_TEST_CHECK_BYTES(packet, expected, sizeof(expected));
+
+  POS_TEST_CHECK(srtp_verifyAuthentication(&srtp, packet + 32, packet, 32, 0));
+  srtp_decrypt(&srtp, decrypted, packet + 12, sizeof(payload), 1);
+  POS_TEST_CHECK_BYTES(decrypted, payload, sizeof(payload));
+
+  // a single flipped bit anywhere fails the tag
+  packet[20] ^= 0x01;
+  POS_TEST_CHECK(!srtp_verifyAuthentication(&srtp, packet + 32, packet, 32, 0));
+  packet[20] ^= 0x01;
+  POS_TEST_CHECK(!srtp_verifyAuthentication(&srtp, packet + 32, packet, 32, 1));
+  srtp_freeContext(&srtp, NULL);
+}
+
+static void test_encrypt_many(void)
+{
+  uint8_t masterKey[32];
+  uint8_t masterSalt[14];
+  static uint8_t payload[4][1200];
+  static uint8_t single[4][1202];
+  static uint8_t batched[4][1202];
+  srtp_encrypt_job jobs[4];
+  srtp_ctx srtp;
+
+  memset(masterKey, 0x5a, sizeof(masterKey));
+  memset(masterSalt, 0xa5, sizeof(masterSalt));
+  memset(&srtp, 0, sizeof(srtp));
+  srtp_setupContext(&srtp, NULL, (const char *)masterKey, sizeof(masterKey), (const char *)masterSalt, 10,
+                    0x12345678);
+  for (size_t packet = 0; packet < 4; packet++)
+  {
+    for (size_t idx = 0; idx < sizeof(payload[0]); idx++)
+      payload[packet][idx] = (uint8_t)(packet * 31 + idx);
+    // an FU-A header in front of every other packet
+    size_t numHeaderBytes = (packet & 1) ? 2 : 0;
+    single[packet][0] = batched[packet][0] = 0x7c;
+    single[packet][1] = batched[packet][1] = 0x85;
+    srtp_encrypt(&srtp, single[packet], payload[packet], numHeaderBytes, sizeof(payload[0]), 0x10000 + packet);
+    jobs[packet].packet = batched[packet];
+    jobs[packet].data_bytes = payload[packet];
+    jobs[packet].num_header_bytes = numHeaderBytes;
+    jobs[packet].num_data_bytes = sizeof(payload[0]);
+    jobs[packet].index = 0x10000 + packet;
+  }
+  srtp_encrypt_many(&srtp, jobs, 4);
+  for (size_t packet = 0; packet < 4; packet++)
+  {
+    size_t numBytes = sizeof(payload[0]) + ((packet & 1) ? 2 : 0);
+    POS_TEST_CHECK_BYTES(batched[packet], single[packet], numBytes);
+  }
+  srtp_freeContext(&srtp, NULL);
+}
+
+// A context set up again with new keys, as a restarted stream does, protects exactly
+// like a fresh one, and a freed context is empty
+static void test_setup_again(void)
+{
+  uint8_t oldKey[16];
+  uint8_t newKey[16];
+  uint8_t salt[14];
+  uint8_t payload[100];
+  uint8_t fresh[12 + 100 + 10];
+  uint8_t reused[12 + 100 + 10];
+  srtp_ctx freshSrtp;
+  srtp_ctx freshSrtcp;
+  srtp_ctx srtp;
+  srtp_ctx srtcp;
+
+  memset(oldKey, 0x11, sizeof(oldKey));
+  memset(newKey, 0x22, sizeof(newKey));
+  memset(salt, 0x33, sizeof(salt));
+  memset(payload, 0x44, sizeof(payload));
+  memset(&freshSrtp, 0, sizeof(freshSrtp));
+  memset(&freshSrtcp, 0, sizeof(freshSrtcp));
+  memset(&srtp, 0, sizeof(srtp));
+  memset(&srtcp, 0, sizeof(srtcp));
+
+  srtp_setupContext(&freshSrtp, &freshSrtcp, (const char *)newKey, 16, (const char *)salt, 10, 0xcafe);
+  srtp_setupContext(&srtp, &srtcp, (const char *)oldKey, 16, (const char *)salt, 10, 0xbeef);
+  srtp_setupContext(&srtp, &srtcp, (const char *)newKey, 16, (const char *)salt, 10, 0xcafe);
+
+  pos_test_hex(fresh, 12, "806000010000000000000000");
+  memcpy(reused, fresh, 12);
+  srtp_encrypt(&freshSrtp, fresh + 12, payload, 0, sizeof(payload), 1);
+  srtp_authenticate(&freshSrtp, fresh + 112, fresh, 112, 0);
+  srtp_encrypt(&srtp, reused + 12, payload, 0, sizeof(payload), 1);
+  srtp_authenticate(&srtp, reused + 112, reused, 112, 0);
+  POS_TEST_CHECK_BYTES(reused, fresh, sizeof(fresh));
+
+  srtp_encrypt(&freshSrtcp, fresh + 8, payload, 0, sizeof(payload), 5);
+  srtp_authenticate(&freshSrtcp, fresh + 108, fresh, 108, 0x80000005);
+  srtp_encrypt(&srtcp, reused + 8, payload, 0, sizeof(payload), 5);
+  srtp_authenticate(&srtcp, reused + 108, reused, 108, 0x80000005);
+  POS_TEST_CHECK_BYTES(reused, fresh, sizeof(fresh));
+
+  srtp_freeContext(&srtp, &srtcp);
+  POS_TEST_CHECK(srtp.key_size == 0 && srtcp.key_size == 0);
+  memset(fresh, 0, sizeof(fresh));
+  POS_TEST_CHECK_BYTES(srtp.encr_key, fresh, sizeof(srtp.encr_key));
+  POS_TEST_CHECK_BYTES(srtcp.auth_key, fresh, sizeof(srtcp.auth_key));
+  // freeing twice does nothing
+  srtp_freeContext(&srtp, &srtcp);
+  srtp_freeContext(&freshSrtp, &freshSrtcp);
+}
+
+static void start_video_stream(POSRTPStreamRef *stream)
+{
+  POSRTPParameters rtpParameters = {.type = 99, .ssrc = 0x11223344, .maxBitRate = 2000, .RTCPInterval = 0.5f,
+                                    .maximumMTU = 1378};
+  POSSRTPParameters srtpParameters;
+
+  memset(&srtpParameters, 0, sizeof(srtpParameters));
+  srtpParameters.cryptoType = CRYPTOTYPE_AES_CM_128_HMAC_SHA1_80;
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.key, 0x42, 16);
+  memset(srtpParameters.Key_Union.AES_CM_128_HMAC_SHA1_80.salt, 0x24, 14);
+  POSRTPStreamStart(stream, &rtpParameters, RTPType_H264, 90000, 0x55667788, 0, "positron-test", &srtpParameters,
+                    &srtpParameters);
+}
+
+static void push_access_unit(POSRTPStreamRef *stream, uint8_t *sps, size_t numSPSBytes, uint8_t *pps,
+                             size_t numPPSBytes, uint8_t *sei, size_t numSEIBytes, uint8_t *idr, size_t numIDRBytes)
+{
+  size_t numPayloadBytes;
+
+  POSRTPStreamPushPayload(stream, sps, numSPSBytes, &numPayloadBytes, 0, 0);
+  POSRTPStreamPushPayload(stream, pps, numPPSBytes, &numPayloadBytes, 0, 0);
+  POSRTPStreamPushPayload(stream, sei, numSEIBytes, &numPayloadBytes, 0, 0);
+  POSRTPStreamPushPayload(stream, idr, numIDRBytes, &numPayloadBytes, 0, 0);
+  POS_TEST_CHECK(numPayloadBytes == numIDRBytes);
+}
+
+// POSRTPStreamPollPackets builds a batch first and encrypts it with srtp_encrypt_many,
+// POSRTPStreamPollPacket encrypts each packet as it builds it.  The packets must match.
+static void test_poll_packets_batch(void)
+{
+  static POSRTPStreamRef batchedStream;
+  static POSRTPStreamRef singleStream;
+  static POSRTPPacketHistory history;
+  static uint8_t sps[] = {0x67, 0x64, 0x00, 0x1f, 0xac, 0x2b, 0x40, 0x28, 0x02, 0xdd, 0x08};
+  static uint8_t pps[] = {0x68, 0xee, 0x3c, 0xb0};
+  static uint8_t sei[40];
+  static uint8_t idr[5000];
+  static uint8_t pool[64][1500];
+  static uint8_t packet[1500];
+  size_t packetLens[64];
+  size_t numPackets = 0;
+  size_t numPacketBytes;
+
+  sei[0] = 0x06;
+  for (size_t idx = 1; idx < sizeof(sei); idx++)
+    sei[idx] = (uint8_t)idx;
+  idr[0] = 0x65;
+  for (size_t idx = 1; idx < sizeof(idr); idx++)
+    idr[idx] = (uint8_t)(idx * 7);
+
+  start_video_stream(&batchedStream);
+  start_video_stream(&singleStream);
+  singleStream.outTimeStampBase = batchedStream.outTimeStampBase;
+  singleStream.randomOutputSequenceNrBase = batchedStream.randomOutputSequenceNrBase;
+  POSRTPStreamSetHistory(&batchedStream, &history);
+
+  push_access_unit(&batchedStream, sps, sizeof(sps), pps, sizeof(pps), sei, sizeof(sei), idr, sizeof(idr));
+  push_access_unit(&singleStream, sps, sizeof(sps), pps, sizeof(pps), sei, sizeof(sei), idr, sizeof(idr));
+
+  // a pool smaller than the frame, so both a full and a partial run are encrypted
+  POSRTPStreamPollPackets(&batchedStream, pool, sizeof(pool[0]), 3, packetLens, &numPackets);
+  POS_TEST_CHECK(numPackets == 3);
+  POSRTPStreamPollPackets(&batchedStream, pool[3], sizeof(pool[0]), 61, &packetLens[3], &numPackets);
+  numPackets = numPackets + 3;
+  // SEI, SPS and PPS, then the IDR in FU-A fragments
+  POS_TEST_CHECK(numPackets >= 6);
+
+  for (size_t idx = 0; idx < numPackets; idx++)
+  {
+    POSRTPStreamPollPacket(&singleStream, packet, sizeof(packet), &numPacketBytes);
+    POS_TEST_CHECK(numPacketBytes == packetLens[idx]);
+    POS_TEST_CHECK_BYTES(pool[idx], packet, numPacketBytes);
+
+    // the NACK history holds the encrypted packet
+    uint16_t seq = (uint16_t)(pool[idx][2] << 8 | pool[idx][3]);
+    POSRTPHistorySlot *slot = &history.slots[seq & (POS_RTP_HISTORY_PACKETS - 1)];
+    POS_TEST_CHECK(slot->seq == seq);
+    POS_TEST_CHECK(slot->numBytes == numPacketBytes);
+    POS_TEST_CHECK_BYTES(slot->bytes, packet, numPacketBytes);
+  }
+  POSRTPStreamPollPacket(&singleStream, packet, sizeof(packet), &numPacketBytes);
+  POS_TEST_CHECK(numPacketBytes == 0);
+}
+
+int main(void)
+{
+  test_aes_cm_keystream();
+  test_key_derivation();
+  test_hmac_sha1();
+  test_protect_packet();
+  test_encrypt_many();
+  test_setup_again();
+  test_poll_packets_batch();
+  printf("srtp crypto tests passed\n");
+  return 0;
+}
@@ -0,0 +1,300 @@
+/* 
+ * This file is part of the positron distribution (https://github.com/radredgreen/positron).
+ * Copyright (c) 2024 RadRedGreen.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Sends frames with POSUDPSendBatch to a loopback receiver on each of its three paths,
+// UDP_SEGMENT, sendmmsg and one send() per packet, and checks every datagram arrives
+// once, in order and with its own boundaries.  The socket calls are wrapped to make
+// the kernel refuse UDP_SEGMENT, take part of a sendmmsg batch or lack sendmmsg, the
+// way older kernels and full socket buffers do.  Prints the socket calls per frame and
+// the send thread's CPU time on each path.
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "POSUDPSender.h"
+
+#include "pos_test.h"
+
+#define PACKET_BYTES 1200
+#define FRAME_PACKETS 40
+#define NUM_FRAMES 200
+
+// What the wrapped socket calls do
+static int gsoErrno;          // a UDP_SEGMENT sendmsg fails with this
+static unsigned int mmsgCap;  // a sendmmsg takes at most this many packets, 0 for all
+static int mmsgErrno;         // a sendmmsg fails with this
+static int mmsgEintrOnce;     // the next sendmmsg is interrupted before sending anything
+static int numGso, numSendmsg, numSendmmsg, numSend;
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+  static ssize_t (*realSendmsg)(int, const struct msghdr *, int);
+  if (!realSendmsg)
+    realSendmsg = (ssize_t(*)(int, const struct msghdr *, int))dlsym(RTLD_NEXT, "sendmsg");
+
+  numSendmsg++;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR((struct msghdr *)msg);
+  if (cmsg && cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_SEGMENT)
+  {
+    numGso++;
+    if (gsoErrno)
+    {
+      errno = gsoErrno;
+      return -1;
+    }
+  }
+  return realSendmsg(fd, msg, flags);
+}
+
+int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+  static int (*realSendmmsg)(int, struct mmsghdr *, unsigned int, int);
+  if (!realSendmmsg)
+    realSendmmsg = (int (*)(int, struct mmsghdr *, unsigned int, int))dlsym(RTLD_NEXT, "sendmmsg");
+
+  numSendmmsg++;
+  if (mmsgErrno)
+  {
+    errno = mmsgErrno;
+    return -1;
+  }
+  if (mmsgEintrOnce)
+  {
+    mmsgEintrOnce = 0;
+    errno = EINTR;
+    return -1;
+  }
+  if (mmsgCap && vlen > mmsgCap)
+    vlen = mmsgCap;
+  return realSendmmsg(fd, msgs, vlen, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+  static ssize_t (*realSend)(int, const void *, size_t, int);
+  if (!realSend)
+    realSend = (ssize_t(*)(int, const void *, size_t, int))dlsym(RTLD_NEXT, "send");
+
+  numSend++;
+  return realSend(fd, buf, len, flags);
+}
+
+static int sendSock, recvSock;
+static uint8_t pool[FRAME_PACKETS][2048];
+static size_t packetLens[FRAME_PACKETS];
+static uint32_t frameNumber;
+
+static void OpenLink(void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  int bufferBytes = 4 << 20;
+
+  recvSock = socket(AF_INET, SOCK_DGRAM, 0);
+  POS_TEST_CHECK(recvSock >= 0);
+  setsockopt(recvSock, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  POS_TEST_CHECK(bind(recvSock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  POS_TEST_CHECK(getsockname(recvSock, (struct sockaddr *)&addr, &addrLen) == 0);
+  sendSock = socket(AF_INET, SOCK_DGRAM, 0);
+  POS_TEST_CHECK(sendSock >= 0);
+  POS_TEST_CHECK(connect(sendSock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+}
+
+// Full packets and a shorter last one, like a frame out of the packetizer.  Each packet
+// carries its frame and packet number and is filled with a pattern that depends on both.
+static void MakeFrame(size_t numPackets, size_t lastBytes)
+{
+  frameNumber++;
+  for (size_t n = 0; n < numPackets; n++)
+  {
+    packetLens[n] = n == numPackets - 1 ? lastBytes : PACKET_BYTES;
+    memcpy(pool[n], &frameNumber, 4);
+    pool[n][4] = (uint8_t)n;
+    for (size_t idx = 5; idx < packetLens[n]; idx++)
+      pool[n][idx] = (uint8_t)(frameNumber * 31 + n * 7 + idx);
+  }
+}
+
+// Every packet of the frame has to come out as its own datagram, in order, and nothing more
+static void ReceiveFrame(size_t numPackets)
+{
+  uint8_t bytes[65536];
+
+  for (size_t n = 0; n < numPackets; n++)
+  {
+    ssize_t numBytes = recv(recvSock, bytes, sizeof(bytes), 0);
+    POS_TEST_CHECK(numBytes == (ssize_t)packetLens[n]);
+    POS_TEST_CHECK_BYTES(bytes, pool[n], packetLens[n]);
+  }
+  POS_TEST_CHECK(recv(recvSock, bytes, sizeof(bytes), MSG_DONTWAIT) < 0 && errno == EAGAIN);
+}
+
+static int64_t ThreadCpuNs(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Sends NUM_FRAMES frames and prints what they cost on the path in use
+static void MeasureFrames(const char *path)
+{
+  uint32_t numSyscalls = 0;
+  int64_t cpuNs = 0;
+
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    MakeFrame(FRAME_PACKETS, 1 + frame % PACKET_BYTES);
+    int64_t startNs = ThreadCpuNs();
+    int numSent = POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, &numSyscalls);
+    cpuNs += ThreadCpuNs() - startNs;
+    POS_TEST_CHECK(numSent == FRAME_PACKETS);
+    ReceiveFrame(FRAME_PACKETS);
+  }
+  printf("%-10s %5.2f socket calls per frame of %d packets, %6.1f us send thread cpu per frame\n", path,
+         (double)numSyscalls / NUM_FRAMES, FRAME_PACKETS, cpuNs / 1000.0 / NUM_FRAMES);
+}
+
+// Equal sized packets with a short tail go out as one UDP_SEGMENT datagram, which the
+// kernel splits back at the segment size
+static bool test_segmented(void)
+{
+  uint32_t numSyscalls = 0;
+
+  MakeFrame(FRAME_PACKETS, 300);
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, &numSyscalls) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  if (numSendmmsg != 0)
+  {
+    printf("this kernel has no UDP_SEGMENT, only the fallbacks are checked\n");
+    return false;
+  }
+  POS_TEST_CHECK(numGso == 1 && numSyscalls == 1);
+
+  // a packet longer than the one before ends the run, it starts the next one
+  MakeFrame(6, PACKET_BYTES);
+  packetLens[2] = 400;
+  numGso = 0;
+  numSyscalls = 0;
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, 6, &numSyscalls) == 6);
+  ReceiveFrame(6);
+  POS_TEST_CHECK(numGso == 2 && numSyscalls == 2);
+
+  MeasureFrames("gso");
+  return true;
+}
+
+// A kernel that can't segment this socket answers EIO or EINVAL, the batch still goes
+// out with sendmmsg and UDP_SEGMENT isn't tried again
+static void test_segment_rejected(bool haveSegment)
+{
+  uint32_t numSyscalls = 0;
+
+  gsoErrno = EIO;
+  numGso = 0;
+  numSendmmsg = 0;
+  MakeFrame(FRAME_PACKETS, 500);
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, &numSyscalls) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  if (haveSegment)
+    POS_TEST_CHECK(numGso == 1);
+  POS_TEST_CHECK(numSendmmsg == 1);
+
+  gsoErrno = EINVAL;
+  numGso = 0;
+  MakeFrame(FRAME_PACKETS, 500);
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, NULL) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  POS_TEST_CHECK(numGso == 0);
+  gsoErrno = 0;
+}
+
+// sendmmsg may take only part of a batch, or be interrupted, the rest follows in more calls
+static void test_partial_sendmmsg(void)
+{
+  uint32_t numSyscalls = 0;
+
+  MakeFrame(FRAME_PACKETS, 700);
+  mmsgCap = 7;
+  numSendmmsg = 0;
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, &numSyscalls) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  POS_TEST_CHECK(numSendmmsg == (FRAME_PACKETS + 6) / 7);
+  POS_TEST_CHECK(numSyscalls == (uint32_t)numSendmmsg);
+
+  mmsgCap = 0;
+  mmsgEintrOnce = 1;
+  numSendmmsg = 0;
+  MakeFrame(FRAME_PACKETS, 700);
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, NULL) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  POS_TEST_CHECK(numSendmmsg == 2);
+
+  MeasureFrames("sendmmsg");
+}
+
+// Without sendmmsg every packet takes its own send()
+static void test_send_fallback(void)
+{
+  uint32_t numSyscalls = 0;
+
+  mmsgErrno = ENOSYS;
+  numSendmmsg = 0;
+  numSend = 0;
+  MakeFrame(FRAME_PACKETS, 900);
+  POS_TEST_CHECK(POSUDPSendBatch(sendSock, pool[0], sizeof(pool[0]), packetLens, FRAME_PACKETS, &numSyscalls) ==
+                 FRAME_PACKETS);
+  ReceiveFrame(FRAME_PACKETS);
+  POS_TEST_CHECK(numSendmmsg == 1);
+  POS_TEST_CHECK(numSend == FRAME_PACKETS);
+  POS_TEST_CHECK(numSyscalls == 1 + FRAME_PACKETS);
+
+  numSendmmsg = 0;
+  MeasureFrames("send");
+  POS_TEST_CHECK(numSendmmsg == 0);
+}
+
+int main(void)
+{
+  OpenLink();
+  bool haveSegment = test_segmented();
+  test_segment_rejected(haveSegment);
+  test_partial_sendmmsg();
+  test_send_fallback();
+  close(sendSock);
+  close(recvSock);
+  printf("udp sender tests passed\n");
+  return 0;
+}